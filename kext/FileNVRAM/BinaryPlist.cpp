@@ -0,0 +1,665 @@
+/***
+ * BinaryPlist.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Binary property list (bplist00) writer and reader for the NVRAM store. Only
+ * the types the store can hold are supported: dict, array, string, data,
+ * integer and boolean. Objects are not uniqued, every value is written once.
+ */
+
+#include "FileNVRAM.h"
+
+#define BPLIST_MAGIC			"bplist00"
+#define BPLIST_MAGIC_LENGTH		8
+#define BPLIST_TRAILER_LENGTH	32
+#define BPLIST_MAX_DEPTH		16
+
+typedef struct
+{
+	const OSSymbol*	key;			// NULL for array elements, and in a header.
+	const OSObject*	value;
+	UInt32		objects;		// Objects value is written as, or in a header the members that follow.
+} BinaryPlistEntry;
+
+typedef struct
+{
+	NVRAMOutput*	out;
+	uint64_t*	offsets;		// File offset of every object, indexed by object number.
+	BinaryPlistEntry*	entries;	// Per collection, in the order they are written: a header, then its members.
+	UInt32		used;
+	UInt32		capacity;
+	UInt32		cursor;			// Header of the next collection to write.
+	UInt32		count;
+	UInt32		next;
+	UInt8		refSize;
+} BinaryPlistWriter;
+
+typedef struct
+{
+	const UInt8*	data;
+	size_t			length;
+	size_t			tableOffset;	// Objects live in [BPLIST_MAGIC_LENGTH, tableOffset).
+	uint64_t		count;
+	UInt8			offsetSize;
+	UInt8			refSize;
+} BinaryPlistReader;
+
+//==============================================================================
+
+static inline bool isBinaryPlist(const char* buffer, uint64_t length)
+{
+	return (length > BPLIST_MAGIC_LENGTH + BPLIST_TRAILER_LENGTH) && (strncmp(buffer, BPLIST_MAGIC, BPLIST_MAGIC_LENGTH) == 0);
+}
+
+//==============================================================================
+
+static inline UInt8 bplistIntSize(uint64_t value)
+{
+	return (value <= 0xFF) ? 1 : (value <= 0xFFFF) ? 2 : (value <= 0xFFFFFFFF) ? 4 : 8;
+}
+
+//==============================================================================
+
+static bool bplistAppendUInt(NVRAMOutput* out, uint64_t value, UInt8 size)
+{
+	UInt8 bytes[8];
+
+	for (int i = 0; i < size; i++)
+	{
+		bytes[i] = (UInt8)(value >> (8 * (size - 1 - i)));
+	}
+
+	return outputBytes(out, bytes, size);
+}
+
+//==============================================================================
+
+static bool bplistAppendInteger(NVRAMOutput* out, uint64_t value)
+{
+	UInt8 size = bplistIntSize(value);
+	UInt8 marker = 0x10 | ((size == 1) ? 0 : (size == 2) ? 1 : (size == 4) ? 2 : 3);
+
+	return outputBytes(out, &marker, 1) && bplistAppendUInt(out, value, size);
+}
+
+//==============================================================================
+
+static bool bplistAppendMarker(NVRAMOutput* out, UInt8 type, uint64_t length)
+{
+	UInt8 marker = type | (UInt8)MIN(length, (uint64_t)0xF);
+
+	if (!outputBytes(out, &marker, 1))
+	{
+		return false;
+	}
+
+	// Long lengths follow as an integer object.
+	return (length < 0xF) || bplistAppendInteger(out, length);
+}
+
+//==============================================================================
+
+static UInt32 bplistCollect(BinaryPlistWriter* w, const OSObject* object)
+{
+	const OSDictionary*	dict = OSDynamicCast(OSDictionary, object);
+	const OSArray*		array = dict ? NULL : OSDynamicCast(OSArray, object);
+	OSCollectionIterator* iter = NULL;
+	UInt32 size = dict ? dict->getCount() : array ? array->getCount() : 0;
+	UInt32 header = w->used;
+	UInt32 members = 0;
+	UInt32 count = 1;
+
+	if (!dict && !array)
+	{
+		return 1;
+	}
+
+	// The whole block is taken before the members add theirs after it.
+	if (w->used + 1 + size > w->capacity)
+	{
+		UInt32 capacity = MAX(2 * w->capacity, w->used + 1 + size);
+		BinaryPlistEntry* entries = (BinaryPlistEntry*)IOMalloc(capacity * sizeof(BinaryPlistEntry));
+
+		if (!entries)
+		{
+			return 0;
+		}
+
+		if (w->entries)
+		{
+			memcpy(entries, w->entries, w->used * sizeof(BinaryPlistEntry));
+			IOFree(w->entries, w->capacity * sizeof(BinaryPlistEntry));
+		}
+
+		w->entries = entries;
+		w->capacity = capacity;
+	}
+
+	w->used += 1 + size;
+
+	if (dict && !(iter = OSCollectionIterator::withCollection(dict)))
+	{
+		return 0;
+	}
+
+	for (UInt32 i = 0; i < size; i++)
+	{
+		const OSSymbol* key = iter ? OSDynamicCast(OSSymbol, iter->getNextObject()) : NULL;
+		const OSObject* value = iter ? (key ? dict->getObject(key) : NULL) : array->getObject(i);
+		UInt32 objects;
+
+		if (!canSerialize(value))
+		{
+			continue;
+		}
+
+		if (!(objects = bplistCollect(w, value)))
+		{
+			OSSafeReleaseNULL(iter);
+			return 0;
+		}
+
+		BinaryPlistEntry* entry = &w->entries[header + 1 + members++];
+
+		entry->key		= key;
+		entry->value	= value;
+		entry->objects	= objects;
+		count += (key ? 1 : 0) + objects;
+	}
+
+	OSSafeReleaseNULL(iter);
+
+	w->entries[header].key		= NULL;
+	w->entries[header].value	= object;
+	w->entries[header].objects	= members;
+
+	return count;
+}
+
+//==============================================================================
+
+static bool bplistWriteString(BinaryPlistWriter* w, const char* str, size_t length)
+{
+	const UInt8* bytes = (const UInt8*)str;
+	size_t units = 0;
+	bool ascii = true;
+
+	w->offsets[w->next++] = outputOffset(w->out);
+
+	for (size_t i = 0; i < length; i++)
+	{
+		if (bytes[i] & 0x80)
+		{
+			ascii = false;
+			break;
+		}
+	}
+
+	if (ascii)
+	{
+		return bplistAppendMarker(w->out, 0x50, length) && outputBytes(w->out, str, (unsigned int)length);
+	}
+
+	// Anything else is stored as big endian UTF-16, decode the UTF-8 twice: count, then write.
+	for (int pass = 0; pass < 2; pass++)
+	{
+		size_t i = 0;
+
+		if (pass == 1 && !bplistAppendMarker(w->out, 0x60, units))
+		{
+			return false;
+		}
+
+		while (i < length)
+		{
+			UInt32 c = bytes[i];
+			int extra = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+
+			c &= (extra == 3) ? 0x07 : (extra == 2) ? 0x0F : (extra == 1) ? 0x1F : 0x7F;
+			i++;
+
+			for (int k = 0; k < extra && i < length; k++, i++)
+			{
+				c = (c << 6) | (bytes[i] & 0x3F);
+			}
+
+			if (c > 0x10FFFF)
+			{
+				c = 0xFFFD;
+			}
+
+			if (pass == 0)
+			{
+				units += (c > 0xFFFF) ? 2 : 1;
+			}
+			else if (c > 0xFFFF)
+			{
+				c -= 0x10000;
+
+				if (!bplistAppendUInt(w->out, 0xD800 | (c >> 10), 2) || !bplistAppendUInt(w->out, 0xDC00 | (c & 0x3FF), 2))
+				{
+					return false;
+				}
+			}
+			else if (!bplistAppendUInt(w->out, c, 2))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+//==============================================================================
+
+static bool bplistWriteObject(BinaryPlistWriter* w, const OSObject* object)
+{
+	OSString*		string;
+	OSData*			data;
+	OSNumber*		number;
+	OSBoolean*		boolean;
+	OSDictionary*	dict;
+	OSArray*		array;
+
+	if ((string = OSDynamicCast(OSString, object)))
+	{
+		return bplistWriteString(w, string->getCStringNoCopy(), string->getLength());
+	}
+
+	w->offsets[w->next++] = outputOffset(w->out);
+
+	if ((data = OSDynamicCast(OSData, object)))
+	{
+		return bplistAppendMarker(w->out, 0x40, data->getLength()) && outputBytes(w->out, data->getBytesNoCopy(), data->getLength());
+	}
+
+	if ((number = OSDynamicCast(OSNumber, object)))
+	{
+		return bplistAppendInteger(w->out, number->unsigned64BitValue());
+	}
+
+	if ((boolean = OSDynamicCast(OSBoolean, object)))
+	{
+		UInt8 marker = boolean->isTrue() ? 0x09 : 0x08;
+
+		return outputBytes(w->out, &marker, 1);
+	}
+
+	dict = OSDynamicCast(OSDictionary, object);
+	array = dict ? NULL : OSDynamicCast(OSArray, object);
+
+	if (dict || array)
+	{
+		// Members were looked up once, by bplistCollect(), and are written in that order.
+		const BinaryPlistEntry* header = &w->entries[w->cursor];
+		const BinaryPlistEntry* members = header + 1;
+		UInt32 count = header->objects;
+		bool result = (w->cursor < w->used) && (header->value == object);
+
+		w->cursor += 1 + (dict ? dict->getCount() : array->getCount());
+		result = result && bplistAppendMarker(w->out, dict ? 0xD0 : 0xA0, count);
+
+		// Dicts have key references, then value references; each key is followed by its value's objects.
+		for (int pass = dict ? 0 : 1; result && pass < 2; pass++)
+		{
+			UInt32 next = w->next;
+
+			for (UInt32 i = 0; result && i < count; i++)
+			{
+				result = bplistAppendUInt(w->out, (pass == 0 || !dict) ? next : next + 1, w->refSize);
+				next += (dict ? 1 : 0) + members[i].objects;
+			}
+		}
+
+		for (UInt32 i = 0; result && i < count; i++)
+		{
+			const OSSymbol* key = members[i].key;
+
+			result = (!key || bplistWriteString(w, key->getCStringNoCopy(), key->getLength())) && bplistWriteObject(w, members[i].value);
+		}
+
+		return result;
+	}
+
+	return false;
+}
+
+//==============================================================================
+
+static bool serializeBinaryPlist(NVRAMOutput* out, const OSDictionary* root)
+{
+	BinaryPlistWriter w;
+	bool result;
+
+	bzero(&w, sizeof(w));
+	w.out		= out;
+	w.count		= bplistCollect(&w, root);
+	w.refSize	= bplistIntSize(w.count);
+	w.offsets	= w.count ? (uint64_t*)IOMalloc(w.count * sizeof(uint64_t)) : NULL;
+
+	if (!w.offsets)
+	{
+		if (w.entries)
+		{
+			IOFree(w.entries, w.capacity * sizeof(BinaryPlistEntry));
+		}
+
+		return false;
+	}
+
+	result = outputBytes(out, BPLIST_MAGIC, BPLIST_MAGIC_LENGTH) && bplistWriteObject(&w, root) && (w.next == w.count);
+
+	if (result)
+	{
+		uint64_t tableOffset = outputOffset(out);
+		UInt8 offsetSize = bplistIntSize(tableOffset);
+		UInt8 trailer[BPLIST_TRAILER_LENGTH - 24] = { 0, 0, 0, 0, 0, 0, offsetSize, w.refSize };
+
+		for (UInt32 i = 0; result && i < w.count; i++)
+		{
+			result = bplistAppendUInt(out, w.offsets[i], offsetSize);
+		}
+
+		result = result &&
+				 outputBytes(out, trailer, sizeof(trailer)) &&
+				 bplistAppendUInt(out, w.count, 8) &&		// Number of objects.
+				 bplistAppendUInt(out, 0, 8) &&				// Top object.
+				 bplistAppendUInt(out, tableOffset, 8);		// Offset table offset.
+	}
+
+	IOFree(w.offsets, w.count * sizeof(uint64_t));
+	IOFree(w.entries, w.capacity * sizeof(BinaryPlistEntry));
+
+	return result;
+}
+
+//==============================================================================
+
+static inline bool bplistReadUInt(const BinaryPlistReader* r, size_t offset, UInt8 size, uint64_t* value)
+{
+	if (size == 0 || size > 8 || offset + size > r->length)
+	{
+		return false;
+	}
+
+	*value = 0;
+
+	for (int i = 0; i < size; i++)
+	{
+		*value = (*value << 8) | r->data[offset + i];
+	}
+
+	return true;
+}
+
+//==============================================================================
+// Returns the payload offset and element count of the object at offset.
+
+static bool bplistReadLength(const BinaryPlistReader* r, size_t offset, size_t* payload, uint64_t* length)
+{
+	UInt8 info = r->data[offset] & 0x0F;
+
+	if (info != 0x0F)
+	{
+		*payload = offset + 1;
+		*length = info;
+		return true;
+	}
+
+	if (offset + 2 > r->tableOffset || (r->data[offset + 1] & 0xF0) != 0x10)
+	{
+		return false;
+	}
+
+	UInt8 size = 1 << (r->data[offset + 1] & 0x0F);
+
+	*payload = offset + 2 + size;
+
+	return bplistReadUInt(r, offset + 2, size, length);
+}
+
+//==============================================================================
+
+static OSObject* bplistReadObject(const BinaryPlistReader* r, uint64_t ref, int depth)
+{
+	uint64_t offset, length;
+	size_t payload;
+
+	if (ref >= r->count || depth > BPLIST_MAX_DEPTH ||
+		!bplistReadUInt(r, r->tableOffset + (size_t)ref * r->offsetSize, r->offsetSize, &offset) ||
+		offset < BPLIST_MAGIC_LENGTH || offset >= r->tableOffset)
+	{
+		return NULL;
+	}
+
+	UInt8 marker = r->data[offset];
+
+	switch (marker >> 4)
+	{
+		case 0x0:
+			if (marker == 0x08 || marker == 0x09)
+			{
+				OSBoolean* boolean = (marker == 0x09) ? kOSBooleanTrue : kOSBooleanFalse;
+				boolean->retain();
+
+				return boolean;
+			}
+
+			return NULL;
+
+		case 0x1:
+		{
+			UInt8 size = 1 << (marker & 0x0F);
+			uint64_t value;
+
+			if (!bplistReadUInt(r, (size_t)offset + 1, size, &value))
+			{
+				return NULL;
+			}
+
+			return OSNumber::withNumber(value, size * 8);
+		}
+
+		case 0x4:
+		case 0x5:
+		case 0x6:
+		{
+			if (!bplistReadLength(r, (size_t)offset, &payload, &length))
+			{
+				return NULL;
+			}
+
+			uint64_t bytes = ((marker >> 4) == 0x6) ? length * 2 : length;
+
+			if (bytes > r->tableOffset || payload > r->tableOffset - bytes)
+			{
+				return NULL;
+			}
+
+			if ((marker >> 4) == 0x4)
+			{
+				return OSData::withBytes(&r->data[payload], (unsigned int)length);
+			}
+
+			if ((marker >> 4) == 0x5)
+			{
+				char* str = (char*)IOMalloc((size_t)length + 1);
+				OSString* string = NULL;
+
+				if (str)
+				{
+					memcpy(str, &r->data[payload], (size_t)length);
+					str[length] = 0;
+					string = OSString::withCString(str);
+					IOFree(str, (size_t)length + 1);
+				}
+
+				return string;
+			}
+
+			// UTF-16 to UTF-8, at most 3 bytes per code unit.
+			size_t size = (size_t)length * 3 + 1;
+			char* str = (char*)IOMalloc(size);
+			OSString* string = NULL;
+			size_t used = 0;
+
+			if (!str)
+			{
+				return NULL;
+			}
+
+			for (uint64_t i = 0; i < length; i++)
+			{
+				UInt32 c = (r->data[payload + i * 2] << 8) | r->data[payload + i * 2 + 1];
+
+				if (c >= 0xD800 && c <= 0xDBFF && i + 1 < length)
+				{
+					UInt32 low = (r->data[payload + i * 2 + 2] << 8) | r->data[payload + i * 2 + 3];
+
+					if (low >= 0xDC00 && low <= 0xDFFF)
+					{
+						c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+						i++;
+					}
+				}
+
+				// Surrogate pairs produce 4 bytes from 2 units, so we stay within size.
+				if (c < 0x80)
+				{
+					str[used++] = (char)c;
+				}
+				else if (c < 0x800)
+				{
+					str[used++] = (char)(0xC0 | (c >> 6));
+					str[used++] = (char)(0x80 | (c & 0x3F));
+				}
+				else if (c < 0x10000)
+				{
+					str[used++] = (char)(0xE0 | (c >> 12));
+					str[used++] = (char)(0x80 | ((c >> 6) & 0x3F));
+					str[used++] = (char)(0x80 | (c & 0x3F));
+				}
+				else
+				{
+					str[used++] = (char)(0xF0 | (c >> 18));
+					str[used++] = (char)(0x80 | ((c >> 12) & 0x3F));
+					str[used++] = (char)(0x80 | ((c >> 6) & 0x3F));
+					str[used++] = (char)(0x80 | (c & 0x3F));
+				}
+			}
+
+			str[used] = 0;
+			string = OSString::withCString(str);
+			IOFree(str, size);
+
+			return string;
+		}
+
+		case 0xA:
+		case 0xD:
+		{
+			bool isDict = ((marker >> 4) == 0xD);
+
+			if (!bplistReadLength(r, (size_t)offset, &payload, &length) ||
+				length > r->count || payload + (isDict ? 2 : 1) * length * r->refSize > r->tableOffset)
+			{
+				return NULL;
+			}
+
+			OSDictionary* dict = isDict ? OSDictionary::withCapacity((unsigned int)length) : NULL;
+			OSArray* array = isDict ? NULL : OSArray::withCapacity((unsigned int)length);
+			OSObject* result = isDict ? (OSObject*)dict : (OSObject*)array;
+
+			for (uint64_t i = 0; result && i < length; i++)
+			{
+				uint64_t keyRef, valueRef;
+
+				if (!bplistReadUInt(r, payload + (size_t)(i + (isDict ? length : 0)) * r->refSize, r->refSize, &valueRef))
+				{
+					break;
+				}
+
+				OSObject* value = bplistReadObject(r, valueRef, depth + 1);
+
+				// Values we can't represent are skipped, like the XML loader does.
+				if (value)
+				{
+					if (!isDict)
+					{
+						array->setObject(value);
+					}
+					else if (bplistReadUInt(r, payload + (size_t)i * r->refSize, r->refSize, &keyRef))
+					{
+						OSObject* key = bplistReadObject(r, keyRef, depth + 1);
+						OSString* name = OSDynamicCast(OSString, key);
+
+						if (name)
+						{
+							dict->setObject(name->getCStringNoCopy(), value);
+						}
+
+						OSSafeReleaseNULL(key);
+					}
+
+					value->release();
+				}
+			}
+
+			return result;
+		}
+
+		default:
+			return NULL;
+	}
+}
+
+//==============================================================================
+
+static OSDictionary* unserializeBinaryPlist(const char* buffer, uint64_t length)
+{
+	BinaryPlistReader r;
+	uint64_t top, tableOffset;
+
+	if (!isBinaryPlist(buffer, length))
+	{
+		return NULL;
+	}
+
+	r.data			= (const UInt8*)buffer;
+	r.length		= (size_t)length;
+	r.tableOffset	= r.length;		// Until we know better, for the bounds checks below.
+
+	const UInt8* trailer = r.data + r.length - BPLIST_TRAILER_LENGTH;
+
+	r.offsetSize	= trailer[6];
+	r.refSize		= trailer[7];
+
+	if (!bplistReadUInt(&r, r.length - 24, 8, &r.count) ||
+		!bplistReadUInt(&r, r.length - 16, 8, &top) ||
+		!bplistReadUInt(&r, r.length - 8, 8, &tableOffset) ||
+		r.offsetSize == 0 || r.offsetSize > 8 || r.refSize == 0 || r.refSize > 8 ||
+		tableOffset < BPLIST_MAGIC_LENGTH || tableOffset > r.length - BPLIST_TRAILER_LENGTH ||
+		r.count > (r.length - BPLIST_TRAILER_LENGTH - tableOffset) / r.offsetSize)
+	{
+		return NULL;
+	}
+
+	r.tableOffset = (size_t)tableOffset;
+
+	OSObject* object = bplistReadObject(&r, top, 0);
+	OSDictionary* dict = OSDynamicCast(OSDictionary, object);
+
+	if (!dict)
+	{
+		OSSafeReleaseNULL(object);
+	}
+
+	return dict;
+}
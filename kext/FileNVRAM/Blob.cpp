@@ -0,0 +1,93 @@
+/***
+ * Blob.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * With BlobThreshold set, data values of at least that many bytes are kept in
+ * their own file, named after the SHA-1 of its contents, and the snapshot only
+ * holds a reference to it: a dict with the hash under NVRAM_BLOB_KEY. A blob is
+ * written once and never again while a value with the same contents exists.
+ */
+
+#include "FileNVRAM.h"
+#include <libkern/crypto/sha1.h>
+
+#define NVRAM_BLOB_HASH_LENGTH	(2 * SHA_DIGEST_LENGTH)
+#define NVRAM_BLOB_PATH_MAX		(sizeof(FILE_NVRAM_BLOB_FORMAT) + NVRAM_BLOB_HASH_LENGTH)
+
+//==============================================================================
+// Hex SHA-1 of length bytes, hash takes NVRAM_BLOB_HASH_LENGTH + 1.
+
+static void blobHash(const void* bytes, size_t length, char* hash)
+{
+	static const char digits[] = "0123456789abcdef";
+	UInt8 digest[SHA_DIGEST_LENGTH];
+	SHA1_CTX context;
+
+	SHA1Init(&context);
+	SHA1Update(&context, bytes, length);
+	SHA1Final(digest, &context);
+
+	for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
+	{
+		hash[2 * i] = digits[digest[i] >> 4];
+		hash[2 * i + 1] = digits[digest[i] & 0x0F];
+	}
+
+	hash[NVRAM_BLOB_HASH_LENGTH] = 0;
+}
+
+//==============================================================================
+
+static inline void blobPath(char* path, size_t size, const char* hash)
+{
+	snprintf(path, size, FILE_NVRAM_BLOB_FORMAT, hash);
+}
+
+//==============================================================================
+// The hash a value refers to, or NULL when it is an ordinary value.
+
+static const OSString* blobReferenceHash(const OSObject* value)
+{
+	const OSDictionary* dict = OSDynamicCast(OSDictionary, value);
+	const OSString* hash = dict && dict->getCount() == 1 ? OSDynamicCast(OSString, dict->getObject(NVRAM_BLOB_KEY)) : NULL;
+
+	if (!hash || hash->getLength() != NVRAM_BLOB_HASH_LENGTH)
+	{
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < NVRAM_BLOB_HASH_LENGTH; i++)
+	{
+		char c = hash->getChar(i);
+
+		if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+		{
+			return NULL;
+		}
+	}
+
+	return hash;
+}
+
+//==============================================================================
+
+static OSDictionary* blobCopyReference(const char* hash)
+{
+	OSDictionary* dict = OSDictionary::withCapacity(1);
+	OSString* string = OSString::withCString(hash);
+
+	if (!dict || !string || !dict->setObject(NVRAM_BLOB_KEY, string))
+	{
+		OSSafeReleaseNULL(dict);
+	}
+
+	OSSafeReleaseNULL(string);
+
+	return dict;
+}
@@ -0,0 +1,154 @@
+/***
+ * Epoch.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Lets getProperty() read the store without taking mStoreLock. Readers only count
+ * themselves in, under the parity of the current epoch. Writers still take the
+ * write lock, and instead of freeing what they unlink (replaced values, removed
+ * names, arrays that were grown) they retire it: it is freed once every reader of
+ * the epoch it was unlinked in has left. The version is odd while a writer holds
+ * the lock, a reader that saw it change throws away what it read.
+ */
+
+#include "FileNVRAM.h"
+
+#define NVRAM_READ_RETRIES	4	// Tries without the lock before a reader takes it.
+
+static void storeFreeEntries(NVRAMStoreEntry* entries, UInt32 capacity);	// Store.cpp
+
+//==============================================================================
+
+static void epochDispose(UInt8 kind, void* pointer, size_t size)
+{
+	switch (kind)
+	{
+		case kNVRAMRetireObject:
+			((const OSObject *)pointer)->release();
+			break;
+
+		case kNVRAMRetireMemory:
+			IOFree(pointer, size);
+			break;
+
+		case kNVRAMRetireEntries:
+			storeFreeEntries((NVRAMStoreEntry *)pointer, (UInt32)size);
+			break;
+	}
+}
+
+//==============================================================================
+
+static void epochFree(NVRAMRetired* list)
+{
+	while (list)
+	{
+		NVRAMRetired* next = list->next;
+
+		epochDispose(list->kind, list->pointer, list->size);
+		IOFree(list, sizeof(NVRAMRetired));
+		list = next;
+	}
+}
+
+//==============================================================================
+// Returns the epoch to pass to epochExit().
+
+static inline UInt32 epochEnter(NVRAMEpoch* epoch)
+{
+	for (;;)
+	{
+		UInt32 current = epoch->epoch;
+
+		OSIncrementAtomic(&epoch->readers[current & 1]);
+
+		// Counted under the epoch that is still current, not one a writer just moved past.
+		if (epoch->epoch == current)
+		{
+			return current;
+		}
+
+		OSDecrementAtomic(&epoch->readers[current & 1]);
+	}
+}
+
+//==============================================================================
+
+static inline void epochExit(NVRAMEpoch* epoch, UInt32 current)
+{
+	OSDecrementAtomic(&epoch->readers[current & 1]);
+}
+
+//==============================================================================
+// Called with the write lock held. Without an epoch there is no reader to wait
+// for, and without memory for the record we wait for them right here.
+
+static void epochSynchronize(NVRAMEpoch* epoch);
+
+static void epochRetire(NVRAMEpoch* epoch, UInt8 kind, void* pointer, size_t size)
+{
+	NVRAMRetired* retired;
+
+	if (!epoch)
+	{
+		epochDispose(kind, pointer, size);
+		return;
+	}
+
+	if (!(retired = (NVRAMRetired*)IOMalloc(sizeof(NVRAMRetired))))
+	{
+		// It is already unlinked, so only readers that are in now can still see it.
+		epochSynchronize(epoch);
+		epochDispose(kind, pointer, size);
+		return;
+	}
+
+	retired->next		= epoch->retired;
+	retired->kind		= kind;
+	retired->pointer	= pointer;
+	retired->size		= size;
+	epoch->retired		= retired;
+}
+
+//==============================================================================
+// Called with the write lock held. Once the readers of the previous epoch are gone
+// what was retired before it is freed, and a new epoch starts for what was retired
+// in this one. With wait set it sleeps until they are, otherwise it tries again
+// after the next write.
+
+static void epochReclaim(NVRAMEpoch* epoch, bool wait)
+{
+	while (epoch->readers[(epoch->epoch - 1) & 1])
+	{
+		if (!wait)
+		{
+			return;
+		}
+
+		IOSleep(1);
+	}
+
+	epochFree(epoch->retiring);
+	epoch->retiring = epoch->retired;
+	epoch->retired = NULL;
+
+	if (epoch->retiring || wait)
+	{
+		OSIncrementAtomic((volatile SInt32 *)&epoch->epoch);
+	}
+}
+
+//==============================================================================
+// Called with the write lock held, returns once every reader that was already
+// in has left.
+
+static void epochSynchronize(NVRAMEpoch* epoch)
+{
+	epochReclaim(epoch, true);
+	epochReclaim(epoch, true);
+}
@@ -0,0 +1,219 @@
+/***
+ * FileIO.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Every vnode call the kext makes goes through the few routines in here: open,
+ * close, setting the size, syncing, removing, and reads and writes at an offset. They go through
+ * the unified buffer cache, and are split so a single vn_rdwr() never sees more
+ * than an int of data. A user space build can replace this file with one on top
+ * of open/pread/pwrite/ftruncate/unlink.
+ */
+
+#include "FileNVRAM.h"
+
+#define NVRAM_IO_MAX		(1U << 30)	// Largest single vn_rdwr(), its length is an int.
+
+//==============================================================================
+
+static inline size_t fileRound(size_t length)
+{
+	return (length + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+}
+
+//==============================================================================
+// Page aligned buffer for file data, released with fileFree() and the same length.
+
+static inline char* fileAlloc(size_t length)
+{
+	return length ? (char *)IOMallocAligned(fileRound(length), PAGE_SIZE) : NULL;
+}
+
+//==============================================================================
+
+static inline void fileFree(char* buffer, size_t length)
+{
+	if (buffer)
+	{
+		IOFreeAligned(buffer, fileRound(length));
+	}
+}
+
+//==============================================================================
+// Opens a regular file, and returns its size when size is set.
+
+static int fileOpen(const char* path, int flags, vnode_t* vp, off_t* size, vfs_context_t ctx)
+{
+	struct vnode_attr va;
+	int error;
+
+	if ((error = vnode_open(path, flags | O_NOFOLLOW, S_IRUSR | S_IWUSR, VNODE_LOOKUP_NOFOLLOW, vp, ctx)))
+	{
+		printf("FileNVRAM.kext: Error, vnode_open(%s) failed with error %d!\n", path, error);
+
+		return error;
+	}
+
+	if ((error = vnode_isreg(*vp)) != VREG)
+	{
+		printf("FileNVRAM.kext: Error, vnode_isreg(%s) failed with error %d!\n", path, error);
+		error = EINVAL;
+	}
+	else if (!size)
+	{
+		error = 0;
+	}
+	else
+	{
+		VATTR_INIT(&va);
+		VATTR_WANTED(&va, va_data_size);
+
+		if ((error = vnode_getattr(*vp, &va, ctx)))
+		{
+			printf("FileNVRAM.kext: Error, failed to determine file size of %s, errno %d.\n", path, error);
+		}
+		else
+		{
+			*size = va.va_data_size;
+		}
+	}
+
+	if (error)
+	{
+		vnode_close(*vp, 0, ctx);
+		*vp = NULL;
+	}
+
+	return error;
+}
+
+//==============================================================================
+
+static inline int fileClose(vnode_t vp, bool written, vfs_context_t ctx)
+{
+	int error = vnode_close(vp, written ? FWASWRITTEN : 0, ctx);
+
+	if (error)
+	{
+		printf("FileNVRAM.kext: Error, vnode_close() failed with error %d!\n", error);
+	}
+
+	return error;
+}
+
+//==============================================================================
+// Sets the file size, anything after size is dropped.
+
+static inline int fileSetSize(vnode_t vp, vfs_context_t ctx, off_t size)
+{
+	return vnode_setsize(vp, size, 0, ctx);
+}
+
+//==============================================================================
+// Returns once everything written to vp is on disk.
+
+static inline int fileSync(vnode_t vp, vfs_context_t ctx)
+{
+	return VNOP_FSYNC(vp, MNT_WAIT, ctx);
+}
+
+//==============================================================================
+// Reads or writes exactly length bytes at offset. Running into the end of the
+// file on a read, or a write that makes no progress, is an EIO.
+
+static int fileTransfer(enum uio_rw rw, vnode_t vp, vfs_context_t ctx, char* buffer, size_t length, off_t offset)
+{
+	int error = 0;
+
+	while (length && !error)
+	{
+		int count = (int)MIN(length, (size_t)NVRAM_IO_MAX);
+		int resid = 0;
+
+		error = vn_rdwr(rw, vp, buffer, count, offset, UIO_SYSSPACE, IO_NODELOCKED | IO_UNIT, vfs_context_ucred(ctx), &resid, vfs_context_proc(ctx));
+
+		if (!error && resid == count)
+		{
+			error = EIO;
+		}
+
+		count -= resid;
+		buffer += count;
+		offset += count;
+		length -= count;
+	}
+
+	return error;
+}
+
+//==============================================================================
+
+static inline int fileRead(vnode_t vp, vfs_context_t ctx, void* buffer, size_t length, off_t offset)
+{
+	return fileTransfer(UIO_READ, vp, ctx, (char *)buffer, length, offset);
+}
+
+//==============================================================================
+
+static inline int fileWrite(vnode_t vp, vfs_context_t ctx, const void* buffer, size_t length, off_t offset)
+{
+	return fileTransfer(UIO_WRITE, vp, ctx, (char *)buffer, length, offset);
+}
+
+//==============================================================================
+// Removes a file. No KPI takes a path for that, so the file and its directory are
+// looked up and the file system is asked directly.
+
+static int fileRemove(const char* path, vfs_context_t ctx)
+{
+	const char* name = NULL;
+	char directory[128];
+	struct componentname cn;
+	vnode_t dvp = NULL;
+	vnode_t vp = NULL;
+	int error;
+
+	for (const char* c = path; *c; c++)
+	{
+		if (*c == '/')
+		{
+			name = c;
+		}
+	}
+
+	if (!name || name == path || (size_t)(name - path) >= sizeof(directory))
+	{
+		return EINVAL;
+	}
+
+	strlcpy(directory, path, name - path + 1);
+
+	if (!(error = vnode_lookup(directory, 0, &dvp, ctx)) &&
+		!(error = vnode_lookup(path, VNODE_LOOKUP_NOFOLLOW, &vp, ctx)))
+	{
+		bzero(&cn, sizeof(cn));
+		cn.cn_nameiop = DELETE;
+		cn.cn_flags = ISLASTCN;
+		cn.cn_nameptr = (char *)name + 1;
+		cn.cn_namelen = (int)strlen(name + 1);
+
+		error = VNOP_REMOVE(dvp, vp, &cn, 0, ctx);
+	}
+
+	if (vp)
+	{
+		vnode_put(vp);
+	}
+
+	if (dvp)
+	{
+		vnode_put(dvp);
+	}
+
+	return error;
+}
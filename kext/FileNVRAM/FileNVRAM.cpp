@@ -26,7 +26,19 @@
 #include <libkern/c++/OSUnserialize.h>
 
 /** The cpp file is included here to hide symbol names. **/
+#include "FileIO.cpp"
 #include "Support.cpp"
+#include "Slot.cpp"
+#include "Shard.cpp"
+#include "Blob.cpp"
+#include "Serializer.cpp"
+#include "BinaryPlist.cpp"
+#include "Loader.cpp"
+#include "Trace.cpp"
+#include "Stats.cpp"
+#include "Policy.cpp"
+#include "Epoch.cpp"
+#include "Store.cpp"
 
 /** Private Macros **/
 
@@ -68,9 +80,36 @@ bool FileNVRAM::start(IOService *provider)
 	LOG(NOTICE, "start() called (%d)\n", mInitComplete);
 
 	// mFilePath		= NULL;			// no know file
-	mLoggingLevel   = NOTICE;		// start with logging disabled, can be update for debug
+	mLoggingLevel   = ERROR;		// only errors by default, EnableLogging raises it for debug
 	mInitComplete   = false;		// Don't resync anything that's already in the file system.
 	mSafeToSync     = false;		// Don't sync untill later
+	mDirty          = false;		// Nothing pending yet.
+	mSyncRetries    = 0;
+	mSyncDelay      = NVRAM_SYNC_DELAY_MS;
+	mSyncDeadline   = NVRAM_SYNC_DEADLINE_MS;
+	mSleepBudget    = NVRAM_SLEEP_BUDGET_MS;
+	mJournalMode    = false;		// Plain nvram.plist rewrites unless JournalMode is set.
+	mJournalLimit   = NVRAM_JOURNAL_LIMIT_BYTES;
+	mJournalSize    = 0;
+	mJournalCompact = false;
+	mJournalGeneration = 0;
+	mSnapshotLoaded = false;
+	mSlotGeneration = 0;
+	mSnapshotCRC    = 0;
+	mSnapshotLength = 0;			// Nothing written yet.
+	mShardMode      = false;		// Everything in nvram.plist unless ShardMode is set.
+	mShardsStale    = false;
+	mBlobThreshold  = 0;			// Everything inline unless BlobThreshold is set.
+	mPolicyChanged  = false;
+	mLazyLoad       = false;
+	mFileFormat     = kNVRAMFormatXML;	// The bootloader only reads XML.
+
+	UInt32 lazy = 0;
+
+	if (PE_parse_boot_argn(NVRAM_LAZY_BOOT_ARG, &lazy, sizeof(lazy)))
+	{
+		mLazyLoad = (lazy != 0);
+	}
 
 	// We should be root right now... cache this for later.
 	mCtx            = vfs_context_current();
@@ -87,11 +126,76 @@ bool FileNVRAM::start(IOService *provider)
 	mCommandGate = IOCommandGate::commandGate( this, dispatchCommand);
 	getWorkLoop()->addEventSource( mCommandGate );
 
+	// Create the write-behind timer, changes are flushed once they have settled.
+	mSyncLock = IOLockAlloc();
+	mFragments = OSDictionary::withCapacity(4);
+	mFragmentCRCs = OSDictionary::withCapacity(4);
+	mDirtyNamespaces = NULL;
+	mJournalPending = NULL;
+	mShardGenerations = OSDictionary::withCapacity(4);
+	mBlobs = OSSet::withCapacity(4);
+	mBlobRefs = OSDictionary::withCapacity(4);
+	mBlobRefsPrevious = OSDictionary::withCapacity(4);
+	mVolatileKeys = NULL;			// Every variable is written unless VolatileKeys is set.
+	mImmediateKeys = NULL;
+
+	OSString* immediate = OSString::withCString(NVRAM_IMMEDIATE_DEFAULT);
+
+	mImmediateKeys = policyParse(immediate);
+	OSSafeReleaseNULL(immediate);
+	mChunk = fileAlloc(NVRAM_CHUNK_SIZE);
+	mStats = (NVRAMStats *)IOMalloc(sizeof(NVRAMStats));
+	mStatsKey = OSSymbol::withCString(FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_STATS);
+	mLoadPending = false;
+	mRootListener = NULL;
+	mRootCallbacks = 0;
+	mRootSeen = 0;
+	mLoadCall = NULL;
+	mEarlyWrites = NULL;
+	mEarlyRemoves = NULL;
+	mBSDNotifier = NULL;
+
+	if (mStats)
+	{
+		bzero(mStats, sizeof(NVRAMStats));
+	}
+
+	statsMark(mStats, kNVRAMBootStart);
+	mStore = storeCreate();
+	mStoreLock = IORWLockAlloc();
+	mEpoch = (NVRAMEpoch *)IOMalloc(sizeof(NVRAMEpoch));
+	bzero(mSymbols, sizeof(mSymbols));
+
+	if (mEpoch)
+	{
+		bzero(mEpoch, sizeof(NVRAMEpoch));
+	}
+
+	if (mStore)
+	{
+		mStore->epoch = mEpoch;
+	}
+
+	traceStart();
+	mSyncTimer = IOTimerEventSource::timerEventSource(this, syncTimeoutOccurred);
+
+	if (mSyncTimer)
+	{
+		getWorkLoop()->addEventSource(mSyncTimer);
+	}
+
+	// Flushes are written from here, callers only ask for one.
+	mFlushRequested = 0;
+	mFlushCompleted = 0;
+	mFlushFailed = 0;
+	mFlushCall = thread_call_allocate(flushOccurred, this);
+
 	// Replace the IOService dicionary with an empty one, clean out variables we don't want.
 	OSDictionary* dict = OSDictionary::withCapacity(1);
 
-	if (!dict)
+	if (!dict || !mStore || !mStoreLock)
 	{
+		OSSafeReleaseNULL(dict);
 		return false;
 	}
 
@@ -101,25 +205,21 @@ bool FileNVRAM::start(IOService *provider)
 	{
 		copyEntryProperties(NULL, bootnvram);
 		bootnvram->detachFromParent(root, gIODTPlane);
+		statsMark(mStats, kNVRAMBootLoaded);
+
+		// The bootloader only passes us nvram.plist, the other slot and the
+		// journal tail are looked at once the file system is available.
+		mSnapshotLoaded = true;
+		waitForFileSystem();
 	}
 	else
 	{
-		IOTimerEventSource* mTimer = IOTimerEventSource::timerEventSource(this, timeoutOccurred);
-
-		if (mTimer)
-		{
-			getWorkLoop()->addEventSource( mTimer);
-			mTimer->setTimeoutMS(50); // callback isn't being setup right, causes a panic
-			mSafeToSync = false;
-		}
-		else
-		{
-			earlyInit = true;
-		}
+		mSafeToSync = false;
+		earlyInit = !waitForFileSystem();
 	}
 
-	// We don't have initial NVRAM data from the bootloader, or we couldn't schedule a
-	// timer to read in /Extra/NVRAM/nvram.plist, so start up immediately.
+	// We don't have initial NVRAM data from the bootloader, or we couldn't wait
+	// for the file system to read in /Extra/NVRAM/nvram.plist, so start up immediately.
 	if (earlyInit == true)
 	{
 		mSafeToSync = true;
@@ -141,6 +241,7 @@ void FileNVRAM::registerNVRAM()
 	IORegistryEntry* root = IORegistryEntry::fromPath("/", gIODTPlane);
 	attachToParent(root, gIODTPlane);
 	registerService();
+	statsMark(mStats, kNVRAMBootRegistered);
 
 	// Register with the platform expert
 	const OSSymbol* funcSym = OSSymbol::withCString("RegisterNVRAM");
@@ -158,18 +259,107 @@ void FileNVRAM::stop(IOService *provider)
 {
 	// OSSafeReleaseNULL(mFilePath);
 
-	if (mTimer)
+	// Write out anything that is still waiting for the write-behind timer.
+	if (mDirty)
+	{
+		sync();
+	}
+
+	if (mSyncTimer)
+	{
+		mSyncTimer->cancelTimeout();
+		getWorkLoop()->removeEventSource(mSyncTimer);
+		OSSafeReleaseNULL(mSyncTimer);
+	}
+
+	if (mFlushCall)
+	{
+		// The timer may have asked for one more.
+		thread_call_cancel_wait(mFlushCall);
+		thread_call_free(mFlushCall);
+		mFlushCall = NULL;
+	}
+
+	if (mBSDNotifier)
+	{
+		mBSDNotifier->remove();
+		mBSDNotifier = NULL;
+	}
+
+	stopListening();
+
+	if (mLoadCall)
 	{
-		mTimer->cancelTimeout();
-		getWorkLoop()->removeEventSource(mTimer);
-		OSSafeReleaseNULL(mTimer);
+		thread_call_cancel_wait(mLoadCall);
+		thread_call_free(mLoadCall);
+		mLoadCall = NULL;
 	}
 
+	OSSafeReleaseNULL(mEarlyWrites);
+	OSSafeReleaseNULL(mEarlyRemoves);
+
 	if (mCommandGate)
 	{
 		getWorkLoop()->removeEventSource(mCommandGate);
 	}
 
+	if (mSyncLock)
+	{
+		IOLockFree(mSyncLock);
+		mSyncLock = NULL;
+	}
+
+	OSSafeReleaseNULL(mFragments);
+	OSSafeReleaseNULL(mFragmentCRCs);
+	OSSafeReleaseNULL(mDirtyNamespaces);
+	OSSafeReleaseNULL(mJournalPending);
+	OSSafeReleaseNULL(mShardGenerations);
+	OSSafeReleaseNULL(mBlobs);
+	OSSafeReleaseNULL(mBlobRefs);
+	OSSafeReleaseNULL(mBlobRefsPrevious);
+	OSSafeReleaseNULL(mImmediateKeys);
+	OSSafeReleaseNULL(mVolatileKeys);
+
+	if (mChunk)
+	{
+		fileFree(mChunk, NVRAM_CHUNK_SIZE);
+		mChunk = NULL;
+	}
+
+	if (mStats)
+	{
+		IOFree(mStats, sizeof(NVRAMStats));
+		mStats = NULL;
+	}
+
+	OSSafeReleaseNULL(mStatsKey);
+	traceStop();
+
+	for (int i = 0; i < NVRAM_SYMBOL_CACHE; i++)
+	{
+		OSSafeReleaseNULL(mSymbols[i]);
+	}
+
+	if (mStore)
+	{
+		storeDestroy(mStore);
+		mStore = NULL;
+	}
+
+	if (mEpoch)
+	{
+		epochFree(mEpoch->retiring);
+		epochFree(mEpoch->retired);
+		IOFree(mEpoch, sizeof(NVRAMEpoch));
+		mEpoch = NULL;
+	}
+
+	if (mStoreLock)
+	{
+		IORWLockFree(mStoreLock);
+		mStoreLock = NULL;
+	}
+
 	PMstop();
 	LOG(NOTICE, "Stop called, attempting to detachFromParent\n");
 
@@ -215,12 +405,21 @@ void FileNVRAM::copyUnserialzedData(const char* prefix, OSDictionary* dict)
 			{
 				size_t size = strlen(prefix) + sizeof(NVRAM_SEPERATOR) + strlen(key->getCStringNoCopy());
 				char* newKey = (char*)IOMalloc(size);
+				const OSSymbol* symbol = NULL;
 
-				snprintf(newKey, size, "%s%s%s", prefix, NVRAM_SEPERATOR, key->getCStringNoCopy());
+				if (newKey)
+				{
+					snprintf(newKey, size, "%s%s%s", prefix, NVRAM_SEPERATOR, key->getCStringNoCopy());
+					symbol = OSSymbol::withCString(newKey);
+					IOFree(newKey, size);
+				}
 
-				setProperty(OSSymbol::withCString(newKey), object);
+				if (!symbol || !loadProperty(symbol, object))
+				{
+					LOG(ERROR, "Unable to load %s%s%s\n", prefix, NVRAM_SEPERATOR, name);
+				}
 
-				IOFree(newKey, size);
+				OSSafeReleaseNULL(symbol);
 			}
 			else
 			{
@@ -231,9 +430,9 @@ void FileNVRAM::copyUnserialzedData(const char* prefix, OSDictionary* dict)
 					// Guid
 					copyUnserialzedData(name, subdict);
 				}
-				else
+				else if (!loadProperty(key, object))
 				{
-					setProperty(key, object);
+					LOG(ERROR, "Unable to load %s\n", name);
 				}
 			}
 		}
@@ -251,95 +450,148 @@ void FileNVRAM::copyUnserialzedData(const char* prefix, OSDictionary* dict)
 
 void FileNVRAM::copyEntryProperties(const char* prefix, IORegistryEntry* entry)
 {
-	IORegistryEntry* child;
-	OSDictionary* properties;
-	OSCollectionIterator *iter;
+	// Children are walked depth first, each level only remembers where its path ends.
+	OSIterator* children[NVRAM_IMPORT_DEPTH];
+	size_t ends[NVRAM_IMPORT_DEPTH];
+	char path[2 * NVRAM_NAME_MAX];
+	UInt32 count = 0;
+	int depth = 0;
+
+	if (!entry || !mStore)
+	{
+		return;
+	}
 
-	if (entry)
+	if (strlcpy(path, prefix ? prefix : "", sizeof(path)) >= sizeof(path))
 	{
-		// Parse all IORegistery Children
-		OSIterator * iterator = entry->getChildIterator(gIODTPlane);
+		return;
+	}
 
-		if (iterator)
-		{
-			while((child = OSDynamicCast(IORegistryEntry, iterator->getNextObject())) != NULL)
-			{
-				const char* name = child->getName();
+	uint64_t start = statsBegin();
 
-				if (prefix)
-				{
-					size_t size = strlen(prefix) + sizeof(NVRAM_SEPERATOR) + strlen(name);
-					char* newPrefix = (char*)IOMalloc(size);
+	lockStoreWrite();
 
-					snprintf(newPrefix, size, "%s%s%s", prefix, NVRAM_SEPERATOR, name);
-					copyEntryProperties(newPrefix, child);
+	ends[0] = strlen(path);
+	children[0] = entry->getChildIterator(gIODTPlane);
+	count += copyEntryValues(entry, path, sizeof(path), ends[0]);
 
-					IOFree(newPrefix, size);
-				}
-				else
-				{
-					copyEntryProperties(name, child);
-				}
-			}
+	while (depth >= 0)
+	{
+		IORegistryEntry* child = children[depth] ? OSDynamicCast(IORegistryEntry, children[depth]->getNextObject()) : NULL;
 
-			iterator->release();
+		if (!child)
+		{
+			OSSafeReleaseNULL(children[depth]);
+			depth--;
+			continue;
 		}
 
-		// Parse entry properties and add them to our self
-		properties = entry->dictionaryWithProperties();
+		size_t end = ends[depth];
+		size_t length = snprintf(&path[end], sizeof(path) - end, "%s%s", end ? NVRAM_SEPERATOR : "", child->getName());
 
-		bool                 result = true;
-		OSObject             *object;
-		const OSSymbol       *key;
+		if (end + length >= sizeof(path))
+		{
+			LOG(ERROR, "copyEntryProperties: %s is too long, skipped\n", child->getName());
+			continue;
+		}
 
-		iter = OSCollectionIterator::withCollection(properties);
+		end += length;
+		count += copyEntryValues(child, path, sizeof(path), end);
 
-		if (iter == 0)
+		if (depth + 1 < NVRAM_IMPORT_DEPTH)
 		{
-			return;
+			depth++;
+			ends[depth] = end;
+			children[depth] = child->getChildIterator(gIODTPlane);
 		}
-	
-		while (result)
+		else
 		{
+			LOG(ERROR, "copyEntryProperties: children of %s are nested too deep, skipped\n", path);
+		}
+	}
 
-			key = OSDynamicCast(OSSymbol, iter->getNextObject());
+	unlockStoreWrite();
 
-			if (key == 0)
-			{
-				break;
-			}
-			
-			if (key->isEqualTo("name"))
-			{
-				continue; // Special property in IORegistery, ignore
-			}
-			
-			object = properties->getObject(key);
+	// Our own settings take effect once everything is in.
+	applyStoredSettings();
 
-			if (object == 0)
-			{
-				continue;
-			}
-			
-			if (prefix)
-			{
-				size_t size = strlen(prefix) + sizeof(NVRAM_SEPERATOR) + strlen(key->getCStringNoCopy());
-				char* newKey = (char*)IOMalloc(size);
+	statsEnd(mStats, kNVRAMStatLoad, start);
+	LOG(NOTICE, "copyEntryProperties: imported %u variables\n", (unsigned int)count);
+}
 
-				snprintf(newKey, size, "%s%s%s", prefix, NVRAM_SEPERATOR, key->getCStringNoCopy());
+//==============================================================================
+// Hands every FILE_NVRAM_GUID variable to handleSetting(), for loads that bypass setProperty().
 
-				setProperty(OSSymbol::withCString(newKey), object);
+void FileNVRAM::applyStoredSettings(void)
+{
+	IORWLockRead(mStoreLock);
+	NVRAMPartition* partition = storePartition(mStore, FILE_NVRAM_GUID, strlen(FILE_NVRAM_GUID), false);
+	OSDictionary* settings = partition ? storeCopyPartition(mStore, partition, NULL) : NULL;
+	IORWLockUnlock(mStoreLock);
 
-				IOFree(newKey, size);
-			}
-			else
-			{
-				setProperty(key, object);
-			}
+	OSCollectionIterator* iter = OSCollectionIterator::withCollection(settings);
+	const OSSymbol* name;
+
+	while (iter && (name = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		handleSetting(name, settings->getObject(name), this);
+	}
+
+	OSSafeReleaseNULL(iter);
+	OSSafeReleaseNULL(settings);
+}
+
+//==============================================================================
+// Stores the properties of one device tree entry under path (GUID, or "" at the top),
+// caller holds mStoreLock. path is restored before returning.
+
+UInt32 FileNVRAM::copyEntryValues(IORegistryEntry* entry, char* path, size_t size, size_t end)
+{
+	OSDictionary* properties = entry->dictionaryWithProperties();
+	OSCollectionIterator* iter = OSCollectionIterator::withCollection(properties);
+	const OSSymbol* key;
+	UInt32 count = 0;
+
+	while (iter && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		OSObject* object = properties->getObject(key);
+
+		if (!object || key->isEqualTo("name"))
+		{
+			continue; // Special property in IORegistery, ignore
+		}
+
+		if (end && (end + strlen(NVRAM_SEPERATOR) + key->getLength() >= size))
+		{
+			LOG(ERROR, "copyEntryProperties: %s%s%s is too long, skipped\n", path, NVRAM_SEPERATOR, key->getCStringNoCopy());
+			continue;
 		}
 
-		iter->release();
+		if (end)
+		{
+			snprintf(&path[end], size - end, "%s%s", NVRAM_SEPERATOR, key->getCStringNoCopy());
+		}
+
+		// Legacy keys only exist at the top level.
+		OSObject* value = end ? object : cast(key, object);
+
+		if (storeInsert(mStore, end ? path : key->getCStringNoCopy(), value, NULL))
+		{
+			count++;
+		}
+
+		if (value != object)
+		{
+			value->release();
+		}
 	}
+
+	path[end] = 0;
+
+	OSSafeReleaseNULL(iter);
+	OSSafeReleaseNULL(properties);
+
+	return count;
 }
 
 //==============================================================================
@@ -388,776 +640,3426 @@ void FileNVRAM::registerNVRAMController(IONVRAMController *nvram)
 
 //==============================================================================
 
+// Returns once everything set before the call is on disk, or a sync failed.
+
 void FileNVRAM::sync(void)
 {
 	LOG(NOTICE, "sync() called\n");
 
-	mCommandGate->runCommand( ( void * ) kNVRAMSyncCommand, NULL, NULL, NULL );
+	requestFlush(true, 0);
 }
 
 //==============================================================================
+// Hands a sync to the flush thread. With aWait set it is a barrier: it returns
+// true once a sync that started after the call got everything on disk, false when
+// that sync failed or took longer than aBudget ms (0 for no limit). A sync that
+// is still running completes later.
 
-void FileNVRAM::doSync(void)
+bool FileNVRAM::requestFlush(bool aWait, UInt32 aBudget)
 {
-	LOG(NOTICE, "doSync() called\n");
-
-	/* if (!mFilePath)
-	{
-		return;
-	} */
+	bool result = true;
+	UInt32 ticket;
 
-	if (!mSafeToSync)
+	// No flush thread, or called from inside the gate, where the flush thread
+	// would wait for us to leave it: write it from here.
+	if (!mFlushCall || !mSyncLock || (aWait && getWorkLoop()->inGate()))
 	{
-		return;
+		return (mCommandGate->runCommand( ( void * ) kNVRAMSyncCommand, NULL, NULL, NULL ) == kIOReturnSuccess);
 	}
-	
-	LOG(NOTICE, "doSync() running\n");
-
-	//create the output Dictionary
-	OSDictionary * outputDict = OSDictionary::withCapacity(1);
-
-	//going to have to spin over ourselves..
-	OSDictionary * inputDict = dictionaryWithProperties();
-	OSCollectionIterator *iter = OSCollectionIterator::withCollection(inputDict);
 
-	if (iter == 0)
-	{
-		LOG(ERROR, "FAILURE!. No iterator on input dictionary (myself)\n");
-		return;
-	}
+	IOLockLock(mSyncLock);
+	ticket = ++mFlushRequested;
+	IOLockUnlock(mSyncLock);
 
-	OSSymbol * key = NULL;
-	OSObject * value = NULL;
+	// Requests made before a pending call starts are all covered by it.
+	thread_call_enter(mFlushCall);
 
-	while ((key = OSDynamicCast(OSSymbol,iter->getNextObject())))
+	if (aWait)
 	{
-		//just get the value now anyway
-		value = inputDict->getObject(key);
+		uint64_t deadline = 0;
 
-		//if the key conmektains :, look to see if it's in the map already, cause we'll add a child pair to it
-		//otherwise we just slam the key/val pair in
+		if (aBudget)
+		{
+			clock_interval_to_deadline(aBudget, kMillisecondScale, &deadline);
+		}
 
-		const char * keyChar = key->getCStringNoCopy();
-		const char * guidValueStr = NULL;
+		IOLockLock(mSyncLock);
 
-		if (( guidValueStr = strstr(keyChar , NVRAM_SEPERATOR)) != NULL)
+		while (result && (SInt32)(ticket - mFlushCompleted) > 0)
 		{
-			//we have a GUID child to deal with
-			//now substring out the GUID cause thats going to be a DICT itself on the new outputDict
-			//guidValueStr points to the :
-			size_t guidCutOff = guidValueStr - keyChar;
+			if ((SInt32)(mFlushFailed - ticket) >= 0)
+			{
+				// A sync that started after our request didn't make it.
+				result = false;
+			}
+			else if (!aBudget)
+			{
+				IOLockSleep(mSyncLock, &mFlushCompleted, THREAD_UNINT);
+			}
+			else if (IOLockSleepDeadline(mSyncLock, &mFlushCompleted, (AbsoluteTime)deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+			{
+				result = ((SInt32)(ticket - mFlushCompleted) <= 0);
+			}
+		}
 
-			//allocate buffer
-			//we ar ereally accounting for + sizeof('\0')
-			//thats always 1. so 1.
-			char guidStr[guidCutOff+1];
-			strlcpy(guidStr, keyChar, guidCutOff+1);
+		IOLockUnlock(mSyncLock);
+	}
 
-			//in theory we have a guid and a value
-			//LOG("sync() -> Located GUIDStr as %s\n",guidStr);
+	return result;
+}
 
-			//check for ?OSDictionary? from the dictionary
-			OSDictionary * guidDict = OSDynamicCast(OSDictionary, outputDict->getObject(guidStr));
+//==============================================================================
 
-			if (!guidDict)
-			{
-				guidDict = OSDictionary::withCapacity(1);
-				outputDict->setObject(guidStr,guidDict);
-			}
+void FileNVRAM::flushOccurred(thread_call_param_t owner, thread_call_param_t unused)
+{
+	FileNVRAM* self = (FileNVRAM *)owner;
+	UInt32 ticket;
 
-			//now we have a dict for the guid no matter what (mapping GUID | DICT)
-			guidDict->setObject(OSString::withCString(guidValueStr+strlen(NVRAM_SEPERATOR)), value);
-		}
-		else
-		{
-			//we are boring.
-			outputDict->setObject(key,value);
-		}
-	}//end while
+	IOLockLock(self->mSyncLock);
+	ticket = self->mFlushRequested;
+	IOLockUnlock(self->mSyncLock);
 
-	//serialize and write this out
-	OSSerialize *s = OSSerialize::withCapacity(10000);
-	s->addString(NVRAM_FILE_HEADER);
-	outputDict->serialize(s);
-	s->addString(NVRAM_FILE_FOOTER);
+	// Everything asked for up to ticket was set before this sync takes its snapshot.
+	IOReturn result = self->mCommandGate->runCommand( ( void * ) kNVRAMSyncCommand, NULL, NULL, NULL );
 
-	int error = write_buffer(s->text(), mCtx);
+	IOLockLock(self->mSyncLock);
 
-	if (error)
+	// Calls can overlap, one that took an older ticket may finish last.
+	if (result != kIOReturnSuccess)
+	{
+		if ((SInt32)(ticket - self->mFlushFailed) > 0)
+		{
+			self->mFlushFailed = ticket;
+		}
+	}
+	else if ((SInt32)(ticket - self->mFlushCompleted) > 0)
 	{
-		LOG(ERROR, "Unable to write to %s, errno %d\n", mFilePath->getCStringNoCopy(), error);
+		self->mFlushCompleted = ticket;
 	}
 
-	//now free the dictionaries && iter
-	iter->release();
-	outputDict->release();
-	s->release();
-
+	IOLockWakeup(self->mSyncLock, &self->mFlushCompleted, false);
+	IOLockUnlock(self->mSyncLock);
 }
 
 //==============================================================================
 
-bool FileNVRAM::serializeProperties(OSSerialize *s) const
+void FileNVRAM::scheduleSync(void)
 {
-	bool result = IOService::serializeProperties(s);
-	LOG(NOTICE, "serializeProperties(%p) = %s\n", s, s->text());
+	uint64_t now, elapsed;
+	bool retrying;
 
-	return result;
-}
+	if (!mInitComplete)
+	{
+		return;
+	}
 
-//==============================================================================
+	if (!mSyncLock)
+	{
+		sync();
+		return;
+	}
 
-OSObject * FileNVRAM::getProperty(const OSSymbol *aKey) const
-{
-	OSObject* value = IOService::getProperty(aKey);
+	clock_get_uptime(&now);
 
-	if (value)
+	IOLockLock(mSyncLock);
+
+	if (!mDirty)
 	{
-		OSSerialize *s = OSSerialize::withCapacity(1000);
+		mDirty = true;
+		mDirtySince = now;
+	}
 
-		if (value->serialize(s))
-		{
-			LOG(INFO, "getProperty(%s) = %s called\n", aKey->getCStringNoCopy(), s->text());
-		}
-		else
-		{
-			LOG(INFO, "getProperty(%s) = %p called\n", aKey->getCStringNoCopy(), value);
-		}
+	absolutetime_to_nanoseconds(now - mDirtySince, &elapsed);
+	elapsed /= NSEC_PER_MSEC;
+	retrying = mSyncRetries != 0 && mSyncTimer;
 
-		s->release();
+	IOLockUnlock(mSyncLock);
+
+	// After a failed sync the retry timer is armed, this change goes with it.
+	if (retrying)
+	{
+		return;
+	}
+
+	// Write-behind disabled (SyncDelay set to 0), or no timer: flush right away.
+	// Either way mDirty stays set until a sync has it on disk.
+	UInt32 wait = mSyncTimer ? syncWait(elapsed, mSyncDelay, mSyncDeadline) : 0;
+
+	if (wait)
+	{
+		mSyncTimer->setTimeoutMS(wait);
 	}
 	else
 	{
-
-		// Ignore BSD Name for now in logs, it pollutes
-		if (!aKey->isEqualTo("BSD Name"))
+		if (mSyncDelay && mSyncTimer)
 		{
-			LOG(INFO, "getProperty(%s) = %p called\n", aKey->getCStringNoCopy(), (void*)NULL);
+			// Changes kept coming for too long, don't wait for a quiet window.
+			LOG(NOTICE, "scheduleSync() deadline passed after %llu ms\n", elapsed);
 		}
-	}
 
-	return value;
+		requestFlush(false, 0);
+	}
 }
 
 //==============================================================================
+// Volatile wins when a key is in both lists. Our own settings are always deferred
+// (policyMatch() never matches them).
 
-OSObject * FileNVRAM::getProperty(const char *aKey) const
+UInt8 FileNVRAM::persistenceOf(const OSSymbol *aKey)
 {
-	const OSSymbol *keySymbol;
-	OSObject *theObject = 0;
+	UInt8 persistence = kNVRAMPersistDeferred;
+
+	if (!aKey || !mSyncLock)
+	{
+		return persistence;
+	}
 
-	keySymbol = OSSymbol::withCStringNoCopy(aKey);
+	IOLockLock(mSyncLock);
 
-	if (keySymbol != 0)
+	if (policyMatch(mVolatileKeys, aKey->getCStringNoCopy()))
+	{
+		persistence = kNVRAMPersistVolatile;
+	}
+	else if (policyMatch(mImmediateKeys, aKey->getCStringNoCopy()))
 	{
-		theObject = getProperty(keySymbol);
-		keySymbol->release();
+		persistence = kNVRAMPersistImmediate;
 	}
 
-	return theObject;
+	IOLockUnlock(mSyncLock);
+
+	return persistence;
 }
 
 //==============================================================================
+// Replaces the ImmediateKeys or VolatileKeys list, values that aren't text are ignored.
 
-OSObject * FileNVRAM::copyProperty(const OSSymbol *aKey) const
+void FileNVRAM::setPersistence(UInt8 aClass, const OSObject *aValue)
 {
-	OSObject* prop = getProperty(aKey);
+	OSArray* patterns = policyParse(aValue);
+
+	if (!patterns || !mSyncLock)
+	{
+		OSSafeReleaseNULL(patterns);
+		return;
+	}
+
+	IOLockLock(mSyncLock);
 
-	if (prop)
+	if (aClass == kNVRAMPersistVolatile)
+	{
+		// What is in the files no longer matches, whichever way a variable moved.
+		OSSafeReleaseNULL(mVolatileKeys);
+		mVolatileKeys = patterns;
+		mPolicyChanged = true;
+	}
+	else
 	{
-		prop->retain();
+		OSSafeReleaseNULL(mImmediateKeys);
+		mImmediateKeys = patterns;
 	}
 
-	return prop;
+	IOLockUnlock(mSyncLock);
 }
 
 //==============================================================================
+// For a sync to leave the volatile variables out, NULL when there are none.
 
-OSObject * FileNVRAM::copyProperty(const char *aKey) const
+OSArray* FileNVRAM::copyVolatileKeys(void)
 {
-	OSObject* prop = getProperty(aKey);
+	OSArray* patterns = NULL;
 
-	if (prop)
+	if (mSyncLock)
 	{
-		prop->retain();
+		IOLockLock(mSyncLock);
+		patterns = mVolatileKeys;
+
+		if (patterns)
+		{
+			patterns->retain();
+		}
+
+		IOLockUnlock(mSyncLock);
 	}
 
-	return prop;
+	return patterns;
 }
 
 //==============================================================================
 
-bool FileNVRAM::setProperty(const OSSymbol *aKey, OSObject *anObject)
+void FileNVRAM::markDirty(const OSSymbol *aGuid)
 {
-	// Verify permissions.
-	if (IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+	if (!aGuid || !mSyncLock)
 	{
-		// Not priveleged!
-		return false;
+		return;
 	}
-	
-	// Check for SIP configuration variables.
-	if ((strncmp("csr-data", aKey->getCStringNoCopy(), 8) == 0) || (strncmp("csr-active-config", aKey->getCStringNoCopy(), 17) == 0))
+
+	IOLockLock(mSyncLock);
+
+	if (!mDirtyNamespaces)
 	{
-		// We have a match so first verify the entitlements.
-		if (IOUserClient::copyClientEntitlement(current_task(), "com.apple.private.iokit.nvram-csr") == NULL)
-		{
-			LOG(INFO, "setProperty(%s, (%s) %p) failed (not entitled)\n", aKey->getCStringNoCopy(), anObject->getMetaClass()->getClassName(), anObject);
-			// Not entitled!
-			return false;
-		}
+		mDirtyNamespaces = OSSet::withCapacity(4);
 	}
-	
-	OSSerialize *s = OSSerialize::withCapacity(1000);
-	
-	if (anObject->serialize(s))
+
+	if (mDirtyNamespaces)
+	{
+		mDirtyNamespaces->setObject(aGuid);
+	}
+
+	IOLockUnlock(mSyncLock);
+}
+
+//==============================================================================
+
+void FileNVRAM::journalRecord(UInt8 op, const OSSymbol *aKey, OSObject *anObject)
+{
+	if (!mJournalMode || !mSyncLock)
+	{
+		return;
+	}
+
+	// The bootloader never sees the journal, these go to nvram.plist with the next sync.
+	bool compact = bootVariable(aKey->getCStringNoCopy()) || persistenceOf(aKey) == kNVRAMPersistImmediate;
+
+	OSData* payload = OSData::withCapacity(64);
+	NVRAMOutput output = { payload };
+	bool result = payload &&
+				  payload->appendByte(op, 1) &&
+				  payload->appendBytes(aKey->getCStringNoCopy(), aKey->getLength() + 1);
+
+	if (result && anObject)
+	{
+		result = canSerialize(anObject) && serializeObject(&output, anObject, 0) && payload->appendByte(0x00, 1);
+	}
+
+	if (result)
+	{
+		NVRAMJournalRecord record;
+
+		record.magic	= NVRAM_RECORD_MAGIC;
+		record.length	= payload->getLength();
+		record.checksum	= nvram_crc32(0, payload->getBytesNoCopy(), payload->getLength());
+
+		statsCount(mStats, kNVRAMStatSerialized, payload->getLength());
+
+		IOLockLock(mSyncLock);
+
+		if (!mJournalPending)
+		{
+			mJournalPending = OSData::withCapacity(1024);
+		}
+
+		if (!mJournalPending || !mJournalPending->appendBytes(&record, sizeof(record)) || !mJournalPending->appendBytes(payload))
+		{
+			// Can't journal it, make the next sync write a full snapshot instead.
+			mJournalSize = 0;
+		}
+
+		mJournalCompact = mJournalCompact || compact;
+
+		IOLockUnlock(mSyncLock);
+	}
+	else
+	{
+		LOG(ERROR, "Unable to journal %s\n", aKey->getCStringNoCopy());
+	}
+
+	OSSafeReleaseNULL(payload);
+}
+
+//==============================================================================
+// Applies the journal straight to the store, nothing is journaled or synced again.
+// Returns the number of records applied, the caller writes them out in one snapshot.
+
+int FileNVRAM::replayJournal(void)
+{
+	char* buffer;
+	uint64_t len;
+	NVRAMJournalHeader header;
+
+	mJournalSize = 0;
+
+	if (read_buffer(FILE_NVRAM_JOURNAL_PATH, &buffer, &len, mCtx))
+	{
+		LOG(NOTICE, "No journal at %s\n", FILE_NVRAM_JOURNAL_PATH);
+		return 0;
+	}
+
+	if (len < sizeof(header))
+	{
+		fileFree(buffer, (size_t)len);
+		return 0;
+	}
+
+	memcpy(&header, buffer, sizeof(header));
+
+	// A journal from before the last compaction is already part of nvram.plist.
+	if (header.magic != NVRAM_JOURNAL_MAGIC || header.generation != mJournalGeneration)
+	{
+		LOG(NOTICE, "Ignoring stale journal (generation %u, expected %u)\n", header.generation, mJournalGeneration);
+		fileFree(buffer, (size_t)len);
+		return 0;
+	}
+
+	uint64_t offset = sizeof(header);
+	int count = 0;
+
+	LOG(INFO, "Replaying nvram journal.\n");
+
+	while (offset + sizeof(NVRAMJournalRecord) <= len)
+	{
+		NVRAMJournalRecord record;
+		memcpy(&record, buffer + offset, sizeof(record));
+
+		const char* payload = buffer + offset + sizeof(record);
+
+		// Anything that doesn't check out is a torn write, drop it and everything after it.
+		if (record.magic != NVRAM_RECORD_MAGIC ||
+			record.length < 3 ||
+			record.length > len - offset - sizeof(record) ||
+			payload[record.length - 1] != 0 ||
+			nvram_crc32(0, payload, record.length) != record.checksum)
+		{
+			LOG(ERROR, "Dropping torn journal tail at offset %llu\n", offset);
+			break;
+		}
+
+		const char* key = payload + 1;
+		const char* xml = key + strlen(key) + 1;
+		const OSSymbol* symbol = OSSymbol::withCString(key);
+		const OSSymbol* guid = NULL;
+
+		if (symbol)
+		{
+			// Recorded after cast(), so stored as is.
+			if (payload[0] == kNVRAMJournalRemove)
+			{
+				unstoreProperty(symbol, &guid);
+			}
+			else if (payload[0] == kNVRAMJournalSet && xml < payload + record.length)
+			{
+				OSObject* value = OSUnserializeXML(xml);
+
+				if (!value || !storeProperty(symbol, value, &guid))
+				{
+					LOG(ERROR, "Unable to replay %s\n", key);
+				}
+
+				OSSafeReleaseNULL(value);
+			}
+
+			// The snapshot that replaces the journal serializes it again.
+			markDirty(guid);
+			symbol->release();
+		}
+
+		offset += sizeof(record) + record.length;
+		count++;
+	}
+
+	// Folded into the next snapshot, which starts a new journal. Nothing was, so
+	// new records go after the last good one, overwriting any torn tail.
+	mJournalSize = count ? 0 : offset;
+
+	LOG(INFO, "Replayed %d journal records.\n", count);
+
+	fileFree(buffer, (size_t)len);
+
+	if (count)
+	{
+		applyStoredSettings();
+	}
+
+	return count;
+}
+
+//==============================================================================
+
+void FileNVRAM::syncTimeoutOccurred(OSObject *target, IOTimerEventSource* timer)
+{
+	FileNVRAM* self = OSDynamicCast(FileNVRAM, target);
+
+	// Keep the work loop free, the flush thread does the writing.
+	if (self && self->mDirty)
+	{
+		self->requestFlush(false, 0);
+	}
+}
+
+//==============================================================================
+
+// Returns true when everything that was pending is on disk, or nothing was.
+
+bool FileNVRAM::doSync(void)
+{
+	LOG(NOTICE, "doSync() called\n");
+
+	/* if (!mFilePath)
+	{
+		return;
+	} */
+
+	// Until the file system is there we don't know which slot is the older one.
+	// Asleep, or not mounted yet: setPowerState() and loadFileSystem() try again.
+	if (!mSafeToSync || mLoadPending)
+	{
+		return !mDirty;
+	}
+
+	bool result = flushStore();
+
+	if (!result)
+	{
+		syncFailed();
+	}
+	else if (mSyncLock)
+	{
+		IOLockLock(mSyncLock);
+		mSyncRetries = 0;
+		IOLockUnlock(mSyncLock);
+	}
+
+	// Only once everything that refers to a blob is on disk.
+	if (result)
+	{
+		removeBlobs();
+	}
+
+	return result;
+}
+
+//==============================================================================
+// A sync that didn't get everything on disk leaves the store dirty and tries again,
+// waiting twice as long after every failure in a row.
+
+void FileNVRAM::syncFailed(void)
+{
+	uint64_t now;
+	UInt32 delay;
+
+	if (!mSyncLock)
+	{
+		return;
+	}
+
+	clock_get_uptime(&now);
+
+	IOLockLock(mSyncLock);
+
+	// The deadline counts from here, or every change would be another retry right away.
+	mDirty = true;
+	mDirtySince = now;
+	delay = MIN(NVRAM_RETRY_MIN_MS << MIN(mSyncRetries, 16), NVRAM_RETRY_MAX_MS);
+	mSyncRetries++;
+
+	IOLockUnlock(mSyncLock);
+
+	LOG(ERROR, "Sync failed, trying again in %u ms\n", delay);
+
+	if (mSyncTimer)
+	{
+		mSyncTimer->setTimeoutMS(delay);
+	}
+}
+
+//==============================================================================
+// Writes what is pending, the journal records or a snapshot. Returns true when
+// all of it is on disk, doSync() takes care of trying again when it isn't.
+
+bool FileNVRAM::flushStore(void)
+{
+	LOG(NOTICE, "doSync() running\n");
+	traceEvent(kNVRAMTraceSyncBegin, NULL, 0);
+
+	uint64_t start = statsBegin();
+
+	// Take the pending namespaces before we take our copy, so that changes made
+	// while we are writing mark us dirty again and get picked up by the next sync.
+	OSSet* dirty = NULL;
+	OSData* records = NULL;
+	bool journal = false;
+	bool policy = false;
+	bool complete = true;
+
+	if (mSyncLock)
+	{
+		IOLockLock(mSyncLock);
+		mDirty = false;
+
+		if (mJournalMode && mJournalSize && !mPolicyChanged && !mJournalCompact &&
+			(!mJournalPending || (mJournalSize + mJournalPending->getLength() <= mJournalLimit)))
+		{
+			// Append only, the namespaces stay dirty until the next snapshot.
+			journal = true;
+			records = mJournalPending;
+			mJournalPending = NULL;
+		}
+		else
+		{
+			// A full snapshot includes everything that is still pending.
+			dirty = mDirtyNamespaces;
+			mDirtyNamespaces = NULL;
+			OSSafeReleaseNULL(mJournalPending);
+			policy = mPolicyChanged;
+			mPolicyChanged = false;
+			mJournalCompact = false;
+		}
+
+		IOLockUnlock(mSyncLock);
+	}
+
+	if (journal)
+	{
+		if (!records)
+		{
+			// Everything is in the journal already.
+			return true;
+		}
+
+		int error = write_buffer(FILE_NVRAM_JOURNAL_PATH, (const char *)records->getBytesNoCopy(), records->getLength(), mJournalSize, false, mCtx);
+
+		if (error)
+		{
+			// Don't trust the journal anymore, compact on the next sync.
+			LOG(ERROR, "Unable to append to %s, errno %d\n", FILE_NVRAM_JOURNAL_PATH, error);
+			mJournalSize = 0;
+			complete = false;
+		}
+		else
+		{
+			mJournalSize += records->getLength();
+			traceEvent(kNVRAMTraceSyncEnd, FILE_NVRAM_JOURNAL_PATH, records->getLength());
+		}
+
+		records->release();
+		statsEnd(mStats, kNVRAMStatSync, start);
+		return complete;
+	}
+
+	if (!mFragments)
+	{
+		OSSafeReleaseNULL(dirty);
+		LOG(ERROR, "FAILURE!. No fragment cache\n");
+		return false;
+	}
+
+	if (dirty)
+	{
+		OSCollectionIterator *dirtyIter = OSCollectionIterator::withCollection(dirty);
+		const OSSymbol* guid;
+
+		while (dirtyIter && (guid = OSDynamicCast(OSSymbol, dirtyIter->getNextObject())))
+		{
+			mFragments->removeObject(guid);
+		}
+
+		OSSafeReleaseNULL(dirtyIter);
+	}
+
+	// Variables became volatile or stopped being it, in any namespace.
+	if (policy)
+	{
+		mFragments->flushCollection();
+		mShardsStale = mShardMode;
+	}
+
+	// Compacting: the snapshot gets a new generation, which invalidates the old journal.
+	if (mJournalMode)
+	{
+		const OSSymbol* genKey = OSSymbol::withCString(FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_JOURNAL_GENERATION);
+		OSNumber* gen = OSNumber::withNumber(++mJournalGeneration, 32);
+
+		if (genKey && gen)
+		{
+			storeProperty(genKey, gen, NULL);
+		}
+
+		mFragments->removeObject(FILE_NVRAM_GUID);
+
+		OSSafeReleaseNULL(genKey);
+		OSSafeReleaseNULL(gen);
+	}
+
+	// Sharded: namespaces go to their own files, nvram.plist is only written when its part changed.
+	bool whole = !mShardMode || writeShards(dirty, &complete);
+
+	OSSafeReleaseNULL(dirty);
+
+	if (!whole)
+	{
+		statsEnd(mStats, kNVRAMStatSync, start);
+		return complete;
+	}
+
+	// Build everything that can fail before a slot is overwritten.
+	OSDictionary * binaryDict = NULL;
+	const char * path = FILE_NVRAM_SLOT_PATH;
+
+	if ((mFileFormat == kNVRAMFormatBinary && !mShardMode) ? !(binaryDict = copyBinarySnapshot()) : !updateFragments())
+	{
+		LOG(ERROR, "FAILURE!. Unable to build %s\n", path);
+		return false;
+	}
+
+	// An XML snapshot made of the same fragments as the last one isn't written. Binary
+	// ones are always written, telling would take serializing them twice.
+	NVRAMOutput output;
+	UInt32 digest = 0;
+	uint64_t length = 0;
+	bool digested = !binaryDict && snapshotDigest(&digest, &length);
+
+	if (digested && mSnapshotLength && length == mSnapshotLength && digest == mSnapshotCRC)
+	{
+		statsCount(mStats, kNVRAMStatSyncSkipped, 1);
+		statsEnd(mStats, kNVRAMStatSync, start);
+		return complete;
+	}
+
+	// nvram.plist keeps the last snapshot until this one is on disk in nvram.1.plist.
+	int error = open_stream(&output, path, 0, false, mCtx);
+	UInt32 written = 0;
+
+	if (!error)
+	{
+		bool result = binaryDict ? serializeBinaryPlist(&output, binaryDict) : writeXMLSnapshot(&output);
+
+		written = (UInt32)outputOffset(&output);
+		result = result && slotFinish(&output, mSlotGeneration + 1);
+
+		error = close_stream(&output);
+
+		if (!error && !result)
+		{
+			error = EIO;
+		}
+
+		if (!error)
+		{
+			traceEvent(kNVRAMTraceSyncEnd, path, written);
+		}
+
+		if (binaryDict)
+		{
+			statsCount(mStats, kNVRAMStatSerialized, written);
+		}
+	}
+
+	OSSafeReleaseNULL(binaryDict);
+
+	if (error)
+	{
+		// nvram.plist is still good, nvram.1.plist is written again next time.
+		LOG(ERROR, "Unable to write to %s, errno %d\n", path, error);
+		mJournalSize = 0;
+		mSnapshotLength = 0;
+		complete = false;
+	}
+	else
+	{
+		mSlotGeneration++;
+
+		// Now the bootloader gets it too. Cut short, nvram.1.plist is loaded instead.
+		int copyError = slotCopy(path, FILE_NVRAM_PATH, mChunk, mCtx);
+
+		if (copyError)
+		{
+			// The snapshot is safe, but nvram.plist is out of date until the next sync,
+			// which mustn't be a journal append.
+			LOG(ERROR, "Unable to copy %s to %s, errno %d\n", path, FILE_NVRAM_PATH, copyError);
+			mSnapshotLength = 0;
+			complete = false;
+
+			if (mSyncLock)
+			{
+				IOLockLock(mSyncLock);
+				mJournalCompact = true;
+				IOLockUnlock(mSyncLock);
+			}
+		}
+		else
+		{
+			statsCount(mStats, kNVRAMStatWritten, written + NVRAM_SLOT_RECORD_SIZE);
+			mSnapshotCRC = digest;
+			mSnapshotLength = digested ? length : 0;
+		}
+	}
+
+	if (!error && mJournalMode)
+	{
+		// Start a fresh journal for this generation.
+		NVRAMJournalHeader header = { NVRAM_JOURNAL_MAGIC, mJournalGeneration };
+
+		error = write_buffer(FILE_NVRAM_JOURNAL_PATH, (const char *)&header, sizeof(header), 0, true, mCtx);
+		mJournalSize = error ? 0 : sizeof(header);
+	}
+
+	statsEnd(mStats, kNVRAMStatSync, start);
+
+	return complete;
+}
+
+//==============================================================================
+// Re-serializes the namespaces that have no cached XML fragment, straight from the store.
+
+bool FileNVRAM::updateFragments(void)
+{
+	NVRAMStore * snapshot = copyStoreSnapshot(false);
+	OSArray * volatileKeys = copyVolatileKeys();
+	bool complete = true;
+
+	if (!snapshot)
+	{
+		LOG(ERROR, "Unable to take a snapshot of the store\n");
+		OSSafeReleaseNULL(volatileKeys);
+		return false;
+	}
+
+	// No lock from here on, variables set meanwhile go to copies of their partitions.
+	for (UInt32 i = 0; i < snapshot->capacity; i++)
+	{
+		NVRAMPartition * partition = snapshot->partitions[i];
+		const OSSymbol * key = partition ? partition->guid : NULL;
+
+		// Namespaces that didn't change are written from the cache.
+		if (!partition || !partition->count || mFragments->getObject(key))
+		{
+			continue;
+		}
+
+		OSData * fragment = OSData::withCapacity(1024);
+		OSSet * refs = mBlobThreshold ? OSSet::withCapacity(2) : NULL;
+		NVRAMOutput output = { fragment };
+		bool result = (fragment != NULL);
+		int depth = key->getLength() ? 2 : 1;
+
+		// Plain keys live at the top level, everything else in a dictionary per GUID.
+		if (result && key->getLength())
+		{
+			result = appendString(&output, "\t<key>") &&
+					 appendEscaped(&output, key->getCStringNoCopy(), key->getLength()) &&
+					 appendString(&output, "</key>\n\t<dict>\n");
+		}
+
+		for (UInt32 j = 0; result && j < partition->capacity; j++)
+		{
+			NVRAMStoreEntry * entry = &partition->entries[j];
+			OSObject * value = entry->value;
+
+			if (!entry->name || policyMatchEntry(volatileKeys, key, entry->name))
+			{
+				continue;
+			}
+
+			if (value)
+			{
+				OSObject * reference = copyBlobReference(key, value, refs);
+
+				result = serializeEntry(&output, entry->name->getCStringNoCopy(), reference ? reference : value, depth);
+				OSSafeReleaseNULL(reference);
+			}
+			else
+			{
+				// Never read, so unchanged: copied through as it was in the file.
+				result = appendIndent(&output, depth) &&
+						 appendString(&output, "<key>") &&
+						 appendEscaped(&output, entry->name->getCStringNoCopy(), entry->name->getLength()) &&
+						 appendString(&output, "</key>\n") &&
+						 appendIndent(&output, depth) &&
+						 outputBytes(&output, snapshot->image + entry->offset, entry->length) &&
+						 appendString(&output, "\n");
+			}
+		}
+
+		if (result && key->getLength())
+		{
+			result = appendString(&output, "\t</dict>\n");
+		}
+
+		if (result)
+		{
+			OSNumber * crc = OSNumber::withNumber(nvram_crc32(0, fragment->getBytesNoCopy(), fragment->getLength()), 32);
+
+			// Without its CRC the next snapshot just isn't compared, see snapshotDigest().
+			if (mFragmentCRCs && !(crc && mFragmentCRCs->setObject(key, crc)))
+			{
+				mFragmentCRCs->removeObject(key);
+			}
+
+			mFragments->setObject(key, fragment);
+			updateBlobRefs(key, refs);
+			statsCount(mStats, kNVRAMStatSerialized, fragment->getLength());
+			OSSafeReleaseNULL(crc);
+		}
+		else
+		{
+			// Not cached, so it is rebuilt next time. Don't write a file without it.
+			LOG(ERROR, "Unable to serialize namespace %s\n", key->getCStringNoCopy());
+			complete = false;
+		}
+
+		OSSafeReleaseNULL(fragment);
+		OSSafeReleaseNULL(refs);
+	}
+
+	releaseStoreSnapshot(snapshot);
+	OSSafeReleaseNULL(volatileKeys);
+
+	return complete;
+}
+
+//==============================================================================
+// Joins the cached fragments, call updateFragments() first. In ShardMode only the ones without a shard.
+
+bool FileNVRAM::writeXMLSnapshot(NVRAMOutput *output)
+{
+	OSData * fragment = OSDynamicCast(OSData, mFragments->getObject(""));
+	OSCollectionIterator * iter = OSCollectionIterator::withCollection(mFragments);
+	bool result = iter && appendString(output, NVRAM_FILE_HEADER "<dict>\n");
+	const OSSymbol * key;
+
+	if (result && fragment)
+	{
+		result = outputBytes(output, fragment->getBytesNoCopy(), fragment->getLength());
+	}
+
+	while (result && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		// Written to its own shard.
+		if (mShardMode && shardable(key))
+		{
+			continue;
+		}
+
+		if (key->getLength() && (fragment = OSDynamicCast(OSData, mFragments->getObject(key))))
+		{
+			result = outputBytes(output, fragment->getBytesNoCopy(), fragment->getLength());
+		}
+	}
+
+	OSSafeReleaseNULL(iter);
+
+	return result && appendString(output, "</dict>\n" NVRAM_FILE_FOOTER);
+}
+
+//==============================================================================
+// What writeXMLSnapshot() would write, summed up from the fragment CRCs: a digest
+// of the fragments in the order they are written, and the file length. False when
+// a fragment has no CRC, the snapshot is written without comparing it then.
+
+bool FileNVRAM::snapshotDigest(UInt32 *aDigest, uint64_t *aLength)
+{
+	OSCollectionIterator * iter = OSCollectionIterator::withCollection(mFragments);
+	uint64_t length = strlen(NVRAM_FILE_HEADER "<dict>\n" "</dict>\n" NVRAM_FILE_FOOTER);
+	UInt32 digest = 0;
+	bool result = (iter && mFragmentCRCs);
+	const OSSymbol * key;
+
+	while (result && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		OSData * fragment = OSDynamicCast(OSData, mFragments->getObject(key));
+		OSNumber * crc = OSDynamicCast(OSNumber, mFragmentCRCs->getObject(key));
+
+		if (!fragment || (mShardMode && key->getLength() && shardable(key)))
+		{
+			continue;
+		}
+
+		if (!crc)
+		{
+			result = false;
+			break;
+		}
+
+		UInt32 value = crc->unsigned32BitValue();
+		UInt32 size = fragment->getLength();
+
+		digest = nvram_crc32(digest, key->getCStringNoCopy(), key->getLength() + 1);
+		digest = nvram_crc32(digest, &value, sizeof(value));
+		digest = nvram_crc32(digest, &size, sizeof(size));
+		length += size;
+	}
+
+	OSSafeReleaseNULL(iter);
+
+	*aDigest = digest;
+	*aLength = length;
+
+	return result;
+}
+
+//==============================================================================
+
+OSDictionary * FileNVRAM::copyBinarySnapshot(void)
+{
+	NVRAMStore * snapshot = copyStoreSnapshot(true);
+	OSArray * volatileKeys = copyVolatileKeys();
+
+	// Plain keys go to the top level, like they do in the XML file.
+	OSDictionary * outputDict = snapshot ? storeCopyRoot(snapshot, volatileKeys) : NULL;
+
+	if (snapshot)
+	{
+		releaseStoreSnapshot(snapshot);
+	}
+
+	OSSafeReleaseNULL(volatileKeys);
+
+	if (outputDict)
+	{
+		referenceBlobs(outputDict, NULL);
+	}
+
+	return outputDict;
+}
+
+//==============================================================================
+// Writes the shards of the namespaces in dirty (all of them while mShardsStale) and keeps
+// FILE_NVRAM_GUID:Shards up to date. Returns true when nvram.plist has to be written too,
+// and clears aComplete when a shard couldn't be written.
+
+bool FileNVRAM::writeShards(OSSet* dirty, bool* aComplete)
+{
+	OSCollectionIterator * iter = dirty ? OSCollectionIterator::withCollection(dirty) : NULL;
+	OSArray * shards = copyShardList();
+	const OSSymbol * guid;
+	bool whole = mJournalMode;	// Compacting changed JournalGeneration.
+
+	while (iter && (guid = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		whole = whole || !shardable(guid);
+	}
+
+	OSSafeReleaseNULL(iter);
+
+	if (!shards)
+	{
+		return true;
+	}
+
+	// Namespaces that fail to serialize have no fragment, and are handled like a failed write.
+	updateFragments();
+
+	for (unsigned int i = 0; i < shards->getCount(); i++)
+	{
+		guid = OSDynamicCast(OSSymbol, shards->getObject(i));
+
+		if (!guid || !(mShardsStale || (dirty && dirty->containsObject(guid))))
+		{
+			continue;
+		}
+
+		OSData * fragment = OSDynamicCast(OSData, mFragments->getObject(guid));
+
+		if (!fragment || writeShard(guid, fragment))
+		{
+			// Tried again on the next sync.
+			markDirty(guid);
+			*aComplete = false;
+		}
+	}
+
+	mShardsStale = false;
+
+	// Written after the shards, so it never lists one that isn't there.
+	IORWLockRead(mStoreLock);
+	bool same = shardListEqual(shards, OSDynamicCast(OSArray, storeLookup(mStore, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_SHARDS)));
+	IORWLockUnlock(mStoreLock);
+
+	if (!same)
+	{
+		const OSSymbol * key = OSSymbol::withCString(FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_SHARDS);
+
+		if (key)
+		{
+			storeProperty(key, shards, NULL);
+			key->release();
+		}
+
+		mFragments->removeObject(FILE_NVRAM_GUID);
+		whole = true;
+	}
+
+	shards->release();
+
+	return whole;
+}
+
+//==============================================================================
+// Writes one namespace to the slot of its shard that doesn't hold the newest generation.
+
+int FileNVRAM::writeShard(const OSSymbol* aGuid, OSData* aFragment)
+{
+	char path[NVRAM_SHARD_PATH_MAX];
+	OSNumber * known = mShardGenerations ? OSDynamicCast(OSNumber, mShardGenerations->getObject(aGuid)) : NULL;
+	UInt32 generation = (known ? known->unsigned32BitValue() : shardCheck(aGuid, mChunk, mCtx)) + 1;
+
+	shardPath(path, sizeof(path), aGuid, generation);
+
+	NVRAMOutput output;
+	int error = open_stream(&output, path, 0, false, mCtx);
+
+	if (!error)
+	{
+		bool result = appendString(&output, NVRAM_FILE_HEADER "<dict>\n") &&
+					  outputBytes(&output, aFragment->getBytesNoCopy(), aFragment->getLength()) &&
+					  appendString(&output, "</dict>\n" NVRAM_FILE_FOOTER);
+		UInt32 written = (UInt32)outputOffset(&output);
+
+		result = result && slotFinish(&output, generation);
+
+		error = close_stream(&output);
+
+		if (!error && !result)
+		{
+			error = EIO;
+		}
+
+		if (!error)
+		{
+			traceEvent(kNVRAMTraceSyncEnd, path, written);
+		}
+	}
+
+	if (error)
+	{
+		LOG(ERROR, "Unable to write to %s, errno %d\n", path, error);
+		return error;
+	}
+
+	OSNumber * number = OSNumber::withNumber(generation, 32);
+
+	if (number && mShardGenerations)
+	{
+		mShardGenerations->setObject(aGuid, number);
+	}
+
+	OSSafeReleaseNULL(number);
+
+	return 0;
+}
+
+//==============================================================================
+// For data of at least BlobThreshold bytes: makes sure its blob is on disk, and returns
+// a reference to it (retained), its hash goes in aRefs. NULL means the value is written
+// as it is, which is always the case in the namespaces the bootloader reads.
+
+OSObject * FileNVRAM::copyBlobReference(const OSSymbol* aGuid, const OSObject* aValue, OSSet* aRefs)
+{
+	const OSData * data = OSDynamicCast(OSData, aValue);
+	char hash[NVRAM_BLOB_HASH_LENGTH + 1];
+	char path[NVRAM_BLOB_PATH_MAX];
+
+	if (!mBlobThreshold || !mBlobs || !data || data->getLength() < mBlobThreshold ||
+		bootNamespace(aGuid->getCStringNoCopy(), aGuid->getLength()))
+	{
+		return NULL;
+	}
+
+	blobHash(data->getBytesNoCopy(), data->getLength(), hash);
+
+	const OSSymbol * symbol = OSSymbol::withCString(hash);
+
+	if (!symbol)
+	{
+		return NULL;
+	}
+
+	// Same contents, same file: only new blobs are written.
+	if (!mBlobs->containsObject(symbol))
+	{
+		blobPath(path, sizeof(path), hash);
+
+		int error = write_buffer(path, (const char *)data->getBytesNoCopy(), data->getLength(), 0, true, mCtx);
+
+		if (error)
+		{
+			LOG(ERROR, "Unable to write to %s, errno %d\n", path, error);
+			symbol->release();
+			return NULL;
+		}
+
+		mBlobs->setObject(symbol);
+	}
+
+	if (aRefs)
+	{
+		aRefs->setObject(symbol);
+	}
+
+	symbol->release();
+
+	return blobCopyReference(hash);
+}
+
+//==============================================================================
+// Replaces the large values in a binary snapshot by blob references. At the top
+// level (aGuid NULL) only the GUID dicts are looked into, they are copies and are
+// changed in place.
+
+void FileNVRAM::referenceBlobs(OSDictionary* aDict, const OSSymbol* aGuid)
+{
+	OSCollectionIterator * iter = OSCollectionIterator::withCollection(aDict);
+	OSArray * keys = OSArray::withCapacity(MAX(aDict->getCount(), 1));
+	OSSet * refs = (aGuid && mBlobThreshold) ? OSSet::withCapacity(2) : NULL;
+	const OSSymbol * key;
+
+	// Setting an object invalidates the iterator.
+	while (iter && keys && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		keys->setObject(key);
+	}
+
+	OSSafeReleaseNULL(iter);
+
+	for (unsigned int i = 0; keys && i < keys->getCount(); i++)
+	{
+		key = (const OSSymbol *)keys->getObject(i);
+		OSObject * value = aDict->getObject(key);
+
+		if (!aGuid)
+		{
+			// Plain keys are read by the bootloader, they stay as they are.
+			IORWLockRead(mStoreLock);
+			OSDictionary * guid = (key->getLength() && storePartition(mStore, key->getCStringNoCopy(), key->getLength(), false)) ? OSDynamicCast(OSDictionary, value) : NULL;
+			IORWLockUnlock(mStoreLock);
+
+			if (guid)
+			{
+				referenceBlobs(guid, key);
+			}
+
+			continue;
+		}
+
+		OSObject * reference = copyBlobReference(aGuid, value, refs);
+
+		if (reference)
+		{
+			aDict->setObject(key, reference);
+			reference->release();
+		}
+	}
+
+	if (aGuid)
+	{
+		updateBlobRefs(aGuid, refs);
+	}
+
+	OSSafeReleaseNULL(refs);
+	OSSafeReleaseNULL(keys);
+}
+
+//==============================================================================
+// A namespace was serialized again, referring to aRefs (NULL for no blobs). What
+// it referred to before is kept one more round: until the new form is on disk,
+// and in the other slot of its shard.
+
+void FileNVRAM::updateBlobRefs(const OSSymbol* aGuid, OSSet* aRefs)
+{
+	OSObject * current = mBlobRefs ? mBlobRefs->getObject(aGuid) : NULL;
+
+	if (!mBlobRefs || !mBlobRefsPrevious)
+	{
+		return;
+	}
+
+	if (current)
+	{
+		mBlobRefsPrevious->setObject(aGuid, current);
+	}
+	else
+	{
+		mBlobRefsPrevious->removeObject(aGuid);
+	}
+
+	if (aRefs && aRefs->getCount())
+	{
+		mBlobRefs->setObject(aGuid, aRefs);
+	}
+	else
+	{
+		mBlobRefs->removeObject(aGuid);
+	}
+}
+
+//==============================================================================
+// After a sync got everything on disk: removes the blobs no namespace refers to
+// any more. A namespace without variables isn't serialized again, so it drops
+// its references here, over two syncs like the others. Blobs this driver doesn't
+// know of, because nothing it loaded referred to them, are left alone.
+
+void FileNVRAM::removeBlobs(void)
+{
+	char path[NVRAM_BLOB_PATH_MAX];
+	OSSet * empty = OSSet::withCapacity(2);
+	OSSet * used = OSSet::withCapacity(8);
+	OSArray * gone = OSArray::withCapacity(2);
+	const OSSymbol * key;
+
+	if (!empty || !used || !gone || !mBlobs || !mBlobs->getCount() || !mBlobRefs || !mBlobRefsPrevious)
+	{
+		OSSafeReleaseNULL(empty);
+		OSSafeReleaseNULL(used);
+		OSSafeReleaseNULL(gone);
+		return;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		OSDictionary * refs = i ? mBlobRefsPrevious : mBlobRefs;
+		OSCollectionIterator * iter = OSCollectionIterator::withCollection(refs);
+
+		while (iter && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+		{
+			IORWLockRead(mStoreLock);
+			NVRAMPartition * partition = storePartition(mStore, key->getCStringNoCopy(), key->getLength(), false);
+			bool vacant = !partition || !partition->count;
+			IORWLockUnlock(mStoreLock);
+
+			if (vacant)
+			{
+				empty->setObject(key);
+			}
+		}
+
+		OSSafeReleaseNULL(iter);
+	}
+
+	// Changing the dictionaries invalidates their iterators.
+	OSCollectionIterator * iter = OSCollectionIterator::withCollection(empty);
+
+	while (iter && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		updateBlobRefs(key, NULL);
+	}
+
+	OSSafeReleaseNULL(iter);
+
+	for (int i = 0; i < 2; i++)
+	{
+		OSDictionary * refs = i ? mBlobRefsPrevious : mBlobRefs;
+
+		iter = OSCollectionIterator::withCollection(refs);
+
+		while (iter && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+		{
+			OSSet * hashes = OSDynamicCast(OSSet, refs->getObject(key));
+
+			if (hashes)
+			{
+				used->merge(hashes);
+			}
+		}
+
+		OSSafeReleaseNULL(iter);
+	}
+
+	iter = OSCollectionIterator::withCollection(mBlobs);
+
+	while (iter && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		if (!used->containsObject(key))
+		{
+			gone->setObject(key);
+		}
+	}
+
+	OSSafeReleaseNULL(iter);
+
+	for (unsigned int i = 0; i < gone->getCount(); i++)
+	{
+		key = (const OSSymbol *)gone->getObject(i);
+		blobPath(path, sizeof(path), key->getCStringNoCopy());
+
+		int error = fileRemove(path, mCtx);
+
+		if (error && error != ENOENT)
+		{
+			// Tried again after the next sync.
+			LOG(ERROR, "Unable to remove %s, errno %d\n", path, error);
+			continue;
+		}
+
+		LOG(INFO, "Removed %s\n", path);
+		mBlobs->removeObject(key);
+	}
+
+	OSSafeReleaseNULL(empty);
+	OSSafeReleaseNULL(used);
+	OSSafeReleaseNULL(gone);
+}
+
+//==============================================================================
+// The namespaces that currently have variables and a shard.
+
+OSArray * FileNVRAM::copyShardList(void)
+{
+	OSArray * shards = OSArray::withCapacity(4);
+
+	IORWLockRead(mStoreLock);
+
+	for (UInt32 i = 0; shards && i < mStore->capacity; i++)
+	{
+		NVRAMPartition * partition = mStore->partitions[i];
+
+		if (partition && partition->count && shardable(partition->guid))
+		{
+			shards->setObject(partition->guid);
+		}
+	}
+
+	IORWLockUnlock(mStoreLock);
+
+	return shards;
+}
+
+//==============================================================================
+
+bool FileNVRAM::serializeProperties(OSSerialize *s) const
+{
+	// The registry table only has what IOKit set before start(), Stats is made here.
+	OSDictionary* dict = NULL;
+	OSDictionary* table = dictionaryWithProperties();
+	OSDictionary* stats = (mStats && mStatsKey) ? copyStats(mStats) : NULL;
+
+	if (table && stats)
+	{
+		table->setObject(mStatsKey, stats);
+	}
+
+	OSSafeReleaseNULL(stats);
+
+	if (mStore)
+	{
+		IORWLockRead(mStoreLock);
+		dict = storeCopyFlat(mStore);
+		IORWLockUnlock(mStoreLock);
+	}
+
+	if (dict && table)
+	{
+		dict->merge(table);
+	}
+
+	bool result = dict ? dict->serialize(s) : (table && table->serialize(s));
+
+	OSSafeReleaseNULL(dict);
+	OSSafeReleaseNULL(table);
+
+	LOG(NOTICE, "serializeProperties(%p) = %s\n", s, s->text());
+
+	return result;
+}
+
+//==============================================================================
+// getProperty() and copyProperty(): the store first, then the registry table. aSymbol
+// is aKey as a symbol, when the caller has one.
+
+OSObject * FileNVRAM::readProperty(const char* aKey, const OSSymbol* aSymbol, bool aRetain) const
+{
+	uint64_t start = statsBegin();
+
+	statsMark(mStats, kNVRAMBootFirstGet);
+
+	// Stats is made for each copyProperty(), getProperty() has no reference to hand
+	// out and nothing it returned could be freed under the caller.
+	if (aSymbol ? (aSymbol == mStatsKey) : (mStatsKey && mStatsKey->isEqualTo(aKey)))
+	{
+		OSDictionary* stats = (aRetain && mStats) ? copyStats(mStats) : NULL;
+
+		statsEnd(mStats, kNVRAMStatGet, start);
+		return stats;
+	}
+
+	OSObject* value = lookupProperty(aKey, aRetain);
+
+	if (!value)
+	{
+		const OSSymbol* symbol = aSymbol ? aSymbol : copySymbol(aKey);
+
+		if (symbol)
+		{
+			value = aRetain ? IOService::copyProperty(symbol) : IOService::getProperty(symbol);
+		}
+
+		if (symbol != aSymbol)
+		{
+			OSSafeReleaseNULL(symbol);
+		}
+	}
+
+	if (!LOG_ENABLED(INFO))
+	{
+		statsEnd(mStats, kNVRAMStatGet, start);
+		return value;
+	}
+
+	if (value)
+	{
+		OSSerialize *s = OSSerialize::withCapacity(1000);
+
+		if (value->serialize(s))
+		{
+			LOG(INFO, "getProperty(%s) = %s called\n", aKey, s->text());
+		}
+		else
+		{
+			LOG(INFO, "getProperty(%s) = %p called\n", aKey, value);
+		}
+
+		s->release();
+	}
+	else
+	{
+
+		// Ignore BSD Name for now in logs, it pollutes
+		if (strcmp(aKey, "BSD Name") != 0)
+		{
+			LOG(INFO, "getProperty(%s) = %p called\n", aKey, (void*)NULL);
+		}
+	}
+
+	statsEnd(mStats, kNVRAMStatGet, start);
+
+	return value;
+}
+
+//==============================================================================
+// OSSymbol::withCString() takes the global symbol lock, and the same few registry
+// keys are looked up by name over and over. The first symbol made for a slot stays
+// there, so a reader never sees one released under it. Returns a reference.
+
+const OSSymbol * FileNVRAM::copySymbol(const char* aKey) const
+{
+	const OSSymbol* volatile* slot = (const OSSymbol* volatile *)&mSymbols[nvram_hash(aKey, strlen(aKey)) & (NVRAM_SYMBOL_CACHE - 1)];
+	const OSSymbol* symbol = *slot;
+
+	if (symbol && strcmp(symbol->getCStringNoCopy(), aKey) == 0)
+	{
+		symbol->retain();
+		return symbol;
+	}
+
+	if (!(symbol = OSSymbol::withCString(aKey)))
+	{
+		return NULL;
+	}
+
+	if (!*slot && OSCompareAndSwapPtr(NULL, (void *)symbol, (void * volatile *)slot))
+	{
+		// The slot holds its own reference.
+		symbol->retain();
+	}
+
+	return symbol;
+}
+
+//==============================================================================
+
+OSObject * FileNVRAM::getProperty(const OSSymbol *aKey) const
+{
+	return readProperty(aKey->getCStringNoCopy(), aKey, false);
+}
+
+//==============================================================================
+
+OSObject * FileNVRAM::getProperty(const char *aKey) const
+{
+	// No symbol unless the registry table has to be searched.
+	return readProperty(aKey, NULL, false);
+}
+
+//==============================================================================
+
+OSObject * FileNVRAM::copyProperty(const OSSymbol *aKey) const
+{
+	return readProperty(aKey->getCStringNoCopy(), aKey, true);
+}
+
+//==============================================================================
+
+OSObject * FileNVRAM::copyProperty(const char *aKey) const
+{
+	return readProperty(aKey, NULL, true);
+}
+
+//==============================================================================
+
+bool FileNVRAM::setProperty(const OSSymbol *aKey, OSObject *anObject)
+{
+	uint64_t start = statsBegin();
+
+	// Verify permissions.
+	if (IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+	{
+		// Not priveleged!
+		statsCount(mStats, kNVRAMStatRejected, 1);
+		return false;
+	}
+	
+	// Check for SIP configuration variables.
+	if (!entitledToSet(aKey))
+	{
+		LOG(INFO, "setProperty(%s, (%s) %p) failed (not entitled)\n", aKey->getCStringNoCopy(), anObject->getMetaClass()->getClassName(), anObject);
+		// Not entitled!
+		statsCount(mStats, kNVRAMStatRejected, 1);
+		return false;
+	}
+	
+	if (LOG_ENABLED(INFO))
+	{
+		OSSerialize *s = OSSerialize::withCapacity(1000);
+
+		if (s && anObject->serialize(s))
+		{
+			LOG(INFO, "setProperty(%s, (%s) %s) called\n", aKey->getCStringNoCopy(), anObject->getMetaClass()->getClassName(), s->text());
+		}
+		else
+		{
+			LOG(INFO, "setProperty(%s, (%s) %p) called\n", aKey->getCStringNoCopy(), anObject->getMetaClass()->getClassName(), anObject);
+		}
+
+		OSSafeReleaseNULL(s);
+	}
+	
+	// Check for special FileNVRAM properties:
+	applySetting(aKey, anObject);
+
+	// Generated when read, writing it only resets the counters.
+	if (aKey == mStatsKey)
+	{
+		return true;
+	}
+
+	OSObject* value = cast(aKey, anObject);
+	const OSSymbol* guid = NULL;
+	bool changed = true;
+
+	rememberEarlyWrite(aKey, value);
+
+	bool stat = updateProperty(aKey, value, &guid, &changed);
+
+	traceEvent(kNVRAMTraceSet, aKey->getCStringNoCopy(), traceLength(value));
+
+	UInt8 persistence = (stat && changed) ? persistenceOf(aKey) : kNVRAMPersistDeferred;
+
+	// A value that wasn't stored is neither journaled nor synced. Setting the value
+	// it already has doesn't need a sync, a volatile variable never does.
+	if (!stat)
+	{
+		LOG(ERROR, "setProperty(%s) failed, unable to store it\n", aKey->getCStringNoCopy());
+	}
+	else if (!changed)
+	{
+		statsCount(mStats, kNVRAMStatUnchanged, 1);
+	}
+	else if (persistence == kNVRAMPersistVolatile)
+	{
+		statsCount(mStats, kNVRAMStatVolatile, 1);
+	}
+	else
+	{
+		journalRecord(kNVRAMJournalSet, aKey, value);
+		markDirty(guid);
+		scheduleSync();
+
+		// Scheduled as well, so it stays dirty if the sync can't happen now.
+		if (persistence == kNVRAMPersistImmediate && !requestFlush(true, 0))
+		{
+			LOG(ERROR, "setProperty(%s) is set, but not on disk yet\n", aKey->getCStringNoCopy());
+			stat = false;
+		}
+	}
+
+	if (value != anObject)
+	{
+		value->release();
+	}
+
+	statsEnd(mStats, kNVRAMStatSet, start);
+
+	return stat;
+}
+
+//==============================================================================
+
+void FileNVRAM::removeProperty(const OSSymbol *aKey)
+{
+	// Verify permissions.
+	IOReturn result = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+
+	if (result != kIOReturnSuccess)
+	{
+		statsCount(mStats, kNVRAMStatRejected, 1);
+		return;
+	}
+	
+	LOG(NOTICE, "removeProperty() called\n");
+
+	const OSSymbol* guid = NULL;
+
+	rememberEarlyWrite(aKey, NULL);
+
+	if (!unstoreProperty(aKey, &guid))
+	{
+		IOService::removeProperty(aKey);
+	}
+
+	traceEvent(kNVRAMTraceRemove, aKey->getCStringNoCopy(), 0);
+
+	// Never written, so there is nothing to remove from the files.
+	UInt8 persistence = persistenceOf(aKey);
+
+	if (persistence == kNVRAMPersistVolatile)
+	{
+		return;
+	}
+
+	journalRecord(kNVRAMJournalRemove, aKey, NULL);
+	markDirty(guid);
+	scheduleSync();
+
+	if (persistence == kNVRAMPersistImmediate && !requestFlush(true, 0))
+	{
+		LOG(ERROR, "removeProperty(%s) is done, but not on disk yet\n", aKey->getCStringNoCopy());
+	}
+}
+
+//==============================================================================
+
+IOReturn FileNVRAM::setProperties(OSObject *properties)
+{
+	uint64_t				start = statsBegin();
+	IOReturn				result = kIOReturnSuccess;
+	OSObject				*object;
+	const OSSymbol			*key;
+	const OSString			*tmpStr;
+	const OSSymbol			*deleteKey = NULL;
+	const OSSymbol			*deleteGuid = NULL;
+	bool					deleted = false;
+	bool					syncNow = false;
+	bool					changed = false;
+	bool					immediate = false;
+	OSDictionary			*dict;
+	OSCollectionIterator	*iter;
+	NVRAMChange				*changes;
+	UInt32					count = 0;
+	UInt32					applied = 0;
+
+	dict = OSDynamicCast(OSDictionary, properties);
+
+	if (!dict || !mStore)
+	{
+		return kIOReturnBadArgument;
+	}
+
+	// One privilege check for the whole batch.
+	if (IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess)
+	{
+		statsCount(mStats, kNVRAMStatRejected, 1);
+		return kIOReturnNotPrivileged;
+	}
+
+	iter = OSCollectionIterator::withCollection(dict);
+	changes = (NVRAMChange *)IOMalloc(MAX(dict->getCount(), 1) * sizeof(NVRAMChange));
+
+	if (!iter || !changes)
+	{
+		OSSafeReleaseNULL(iter);
+
+		if (changes)
+		{
+			IOFree(changes, MAX(dict->getCount(), 1) * sizeof(NVRAMChange));
+		}
+
+		return kIOReturnNoMemory;
+	}
+
+	LOG(INFO, "setProperties(%u variables) called\n", dict->getCount());
+
+	// Check everything before anything is changed.
+	while (result == kIOReturnSuccess && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		object = dict->getObject(key);
+
+		if (!object)
+		{
+			continue;
+		}
+
+		if (key->isEqualTo(kIONVRAMDeletePropertyKey) || key->isEqualTo(kIONVRAMSyncNowPropertyKey))
+		{
+			tmpStr = OSDynamicCast(OSString, object);
+
+			if (!tmpStr)
+			{
+				result = kIOReturnBadArgument;
+			}
+			else if (key->isEqualTo(kIONVRAMSyncNowPropertyKey))
+			{
+				syncNow = true; // We are not going to gaurantee sync, this is best effort
+			}
+			else if (!(deleteKey = OSSymbol::withString(tmpStr)))
+			{
+				result = kIOReturnNoMemory;
+			}
+		}
+		else if (!entitledToSet(key))
+		{
+			LOG(INFO, "setProperties(%s) failed (not entitled)\n", key->getCStringNoCopy());
+			statsCount(mStats, kNVRAMStatRejected, 1);
+			result = kIOReturnNotPrivileged;
+		}
+		else
+		{
+			changes[count].key		= key;
+			changes[count].value	= cast(key, object);
+			changes[count].previous	= NULL;
+			changes[count].guid		= NULL;
+			changes[count].digest	= storeDigest(changes[count].value);
+			changes[count].changed	= true;
+			changes[count].kept		= false;
+
+			// cast() hands back either a new object or the one passed in.
+			if (changes[count].value == object)
+			{
+				object->retain();
+			}
+
+			count++;
+		}
+	}
+
+	iter->release();
+
+	// Apply every change under one lock, undoing them all if one fails.
+	lockStoreWrite();
+
+	UInt32 fresh = 0;
+
+	// Keep what is there now, a value that can't be decoded fails the batch up
+	// front rather than being mistaken for a new variable when undoing it.
+	for (UInt32 i = 0; result == kIOReturnSuccess && i < count; i++)
+	{
+		NVRAMChange* change = &changes[i];
+
+		if (change->key == mStatsKey)
+		{
+			continue;
+		}
+
+		if ((change->previous = storeLookup(mStore, change->key->getCStringNoCopy())))
+		{
+			change->previous->retain();
+		}
+		else if (storeFind(mStore, change->key->getCStringNoCopy(), NULL))
+		{
+			result = kIOReturnNoMemory;
+		}
+		else
+		{
+			fresh++;
+		}
+	}
+
+	// Unshared and large enough, undoing changes (and the delete) can't fail anymore.
+	for (UInt32 i = 0; result == kIOReturnSuccess && i < count; i++)
+	{
+		if (changes[i].key != mStatsKey && !storeReserve(mStore, changes[i].key->getCStringNoCopy(), fresh))
+		{
+			result = kIOReturnNoMemory;
+		}
+	}
+
+	if (result == kIOReturnSuccess && deleteKey && !storeReserve(mStore, deleteKey->getCStringNoCopy(), 0))
+	{
+		result = kIOReturnNoMemory;
+	}
+
+	for (; result == kIOReturnSuccess && applied < count; applied++)
+	{
+		NVRAMChange* change = &changes[applied];
+
+		if (change->key == mStatsKey)
+		{
+			continue;
+		}
+
+		if (!storeUpdate(mStore, change->key->getCStringNoCopy(), change->value, change->digest, &change->guid, &change->changed))
+		{
+			result = kIOReturnNoMemory;
+			break;
+		}
+	}
+
+	if (result != kIOReturnSuccess)
+	{
+		while (applied--)
+		{
+			NVRAMChange* change = &changes[applied];
+			bool undone;
+
+			if (change->key == mStatsKey || !change->changed)
+			{
+				continue;
+			}
+
+			if (change->previous)
+			{
+				undone = storeInsert(mStore, change->key->getCStringNoCopy(), change->previous, NULL);
+			}
+			else
+			{
+				undone = storeDelete(mStore, change->key->getCStringNoCopy(), NULL);
+			}
+
+			// storeReserve() should have made sure of it. If not the store has to be written as it is.
+			if (!undone)
+			{
+				LOG(ERROR, "setProperties() unable to undo %s\n", change->key->getCStringNoCopy());
+				change->kept = true;
+			}
+		}
+	}
+	else if (deleteKey)
+	{
+		deleted = storeDelete(mStore, deleteKey->getCStringNoCopy(), &deleteGuid);
+	}
+
+	for (UInt32 i = 0; result == kIOReturnSuccess && i <= count; i++)
+	{
+		const OSSymbol* symbol = (i < count) ? changes[i].key : deleteKey;
+
+		if (symbol && symbol != mStatsKey)
+		{
+			rememberEarlyWrite(symbol, (i < count) ? changes[i].value : NULL);
+		}
+	}
+
+	unlockStoreWrite();
+
+	// Committed: settings, trace, journal and dirty tracking, as setProperty() does.
+	for (UInt32 i = 0; i < count; i++)
+	{
+		NVRAMChange* change = &changes[i];
+
+		if (result == kIOReturnSuccess)
+		{
+			applySetting(change->key, change->value);
+
+			if (change->key != mStatsKey)
+			{
+				traceEvent(kNVRAMTraceSet, change->key->getCStringNoCopy(), traceLength(change->value));
+
+				UInt8 persistence = change->changed ? persistenceOf(change->key) : kNVRAMPersistDeferred;
+
+				if (!change->changed)
+				{
+					statsCount(mStats, kNVRAMStatUnchanged, 1);
+				}
+				else if (persistence == kNVRAMPersistVolatile)
+				{
+					statsCount(mStats, kNVRAMStatVolatile, 1);
+				}
+				else
+				{
+					journalRecord(kNVRAMJournalSet, change->key, change->value);
+					markDirty(change->guid);
+					changed = true;
+					immediate = immediate || (persistence == kNVRAMPersistImmediate);
+				}
+			}
+		}
+		else if (change->kept)
+		{
+			journalRecord(kNVRAMJournalSet, change->key, change->value);
+			markDirty(change->guid);
+			scheduleSync();
+		}
+
+		OSSafeReleaseNULL(change->previous);
+		change->value->release();
+	}
+
+	IOFree(changes, MAX(dict->getCount(), 1) * sizeof(NVRAMChange));
+
+	if (result == kIOReturnSuccess && deleteKey)
+	{
+		if (!deleted)
+		{
+			IOService::removeProperty(deleteKey);
+		}
+
+		traceEvent(kNVRAMTraceRemove, deleteKey->getCStringNoCopy(), 0);
+
+		UInt8 persistence = persistenceOf(deleteKey);
+
+		if (persistence != kNVRAMPersistVolatile)
+		{
+			journalRecord(kNVRAMJournalRemove, deleteKey, NULL);
+			markDirty(deleteGuid);
+			changed = true;
+			immediate = immediate || (persistence == kNVRAMPersistImmediate);
+		}
+	}
+
+	OSSafeReleaseNULL(deleteKey);
+
+	if (result != kIOReturnSuccess)
+	{
+		LOG(ERROR, "setProperties() failed with 0x%x, nothing was changed\n", result);
+		return result;
+	}
+
+	// One sync for the whole batch, none when it changed nothing. An immediate
+	// variable makes it synchronous, and stays dirty until it is written.
+	if (immediate)
+	{
+		scheduleSync();
+
+		if (!requestFlush(true, 0))
+		{
+			LOG(ERROR, "setProperties() changes are set, but not on disk yet\n");
+			result = kIOReturnIOError;
+		}
+	}
+	else if (syncNow && safeToSync())
+	{
+		// Scheduled as well, so it stays dirty if the sync can't happen now.
+		if (changed)
+		{
+			scheduleSync();
+		}
+
+		if (!requestFlush(true, 0))
+		{
+			LOG(ERROR, "setProperties() changes are set, but not on disk yet\n");
+			result = kIOReturnIOError;
+		}
+	}
+	else if (changed)
+	{
+		scheduleSync();
+	}
+
+	statsEnd(mStats, kNVRAMStatSet, start);
+
+	return result;
+}
+
+//==============================================================================
+
+IOReturn FileNVRAM::readXPRAM(IOByteCount offset, UInt8 *buffer, IOByteCount length)
+{
+	LOG(NOTICE, "readXPRAM(%zu, %p, %zu) called\n", (size_t)offset, buffer, (size_t)length);
+
+	return kIOReturnUnsupported;
+}
+
+//==============================================================================
+
+IOReturn FileNVRAM::writeXPRAM(IOByteCount offset, UInt8 *buffer, IOByteCount length)
+{
+	LOG(NOTICE, "writeXPRAM(%zu, %p, %zu) called\n", (size_t)offset, buffer, (size_t)length);
+
+	return kIOReturnUnsupported;
+}
+
+//==============================================================================
+
+IOReturn FileNVRAM::readNVRAMProperty(IORegistryEntry *entry, const OSSymbol **name, OSData **value)
+{
+	LOG(NOTICE, "readNVRAMProperty(%s, %p, %p) called\n", entry->getName(), name, value);
+
+	return kIOReturnUnsupported;
+}
+
+//==============================================================================
+
+IOReturn FileNVRAM::writeNVRAMProperty(IORegistryEntry *entry, const OSSymbol *name, OSData *value)
+{
+	LOG(NOTICE, "writeNVRAMProperty(%s, %s, %p) called\n", entry->getName(), name->getCStringNoCopy(), value);
+
+	return kIOReturnUnsupported;
+}
+
+//==============================================================================
+
+OSDictionary * FileNVRAM::getNVRAMPartitions(void)
+{
+	LOG(NOTICE, "getNVRAMPartitions() called\n");
+
+	return 0;
+}
+
+//==============================================================================
+
+IOReturn FileNVRAM::readNVRAMPartition(const OSSymbol *partitionID, IOByteCount offset, UInt8 *buffer, IOByteCount length)
+{
+	LOG(NOTICE, "readNVRAMPartition(%s, %zu, %p, %zu) called\n", partitionID->getCStringNoCopy(), (size_t)offset, buffer, (size_t)length);
+
+	return kIOReturnNotFound;
+}
+
+//==============================================================================
+
+IOReturn FileNVRAM::writeNVRAMPartition(const OSSymbol *partitionID, IOByteCount offset, UInt8 *buffer, IOByteCount length)
+{
+	LOG(NOTICE, "writeNVRAMPartition(%s, %zu, %p, %zu) called\n", partitionID->getCStringNoCopy(), (size_t)offset, buffer, (size_t)length);
+
+	return kIOReturnSuccess;
+}
+
+//==============================================================================
+
+IOByteCount FileNVRAM::savePanicInfo(UInt8 *buffer, IOByteCount length)
+{
+	// NOTE: In the event of a panic, we *cannot* use printf's.
+	// Also, we double panic when we call the next line, investigate.
+	//setProperty(OSSymbol::withCString("PANIC"), OSString::withCString("test"));
+
+	return length;
+}
+
+//==============================================================================
+
+bool FileNVRAM::safeToSync(void)
+{
+	static int count;
+	LOG(NOTICE, "safeToSync() called\n");
+
+	// Don't sync every time... we already do it so it shouldn't be needed, but just in case.
+	count++;
+
+	if (count % 4)
+	{
+		return true;
+	}
+
+	return false;
+}
+
+//==============================================================================
+
+IOReturn FileNVRAM::dispatchCommand(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+	FileNVRAM* self = OSDynamicCast(FileNVRAM, owner);
+
+	if (!self)
+	{
+		return kIOReturnBadArgument;
+	}
+	
+	size_t command = (size_t) arg0;
+
+	switch (command)
+	{
+		case kNVRAMSyncCommand:
+			return self->doSync() ? kIOReturnSuccess : kIOReturnIOError;
+
+		case kNVRAMLoadCommand:
+			self->loadFileSystem();
+			break;
+
+		default:
+			break;
+	}
+
+	return kIOReturnSuccess;
+}
+
+//==============================================================================
+// Runs on its own thread, for rootFileOp() (which mustn't block) or the retry in loadFileSystem().
+
+void FileNVRAM::loadOccurred(thread_call_param_t owner, thread_call_param_t unused)
+{
+	FileNVRAM* self = OSDynamicCast(FileNVRAM, (OSObject *)owner);
+
+	if (self && self->mCommandGate)
+	{
+		self->mCommandGate->runCommand((void *) kNVRAMLoadCommand, NULL, NULL, NULL);
+	}
+}
+
+//==============================================================================
+// KAUTH_SCOPE_FILEOP listener, called on any thread for every file operation. There
+// are none before / is mounted, so the first one starts the load. The listener is
+// removed by the load, stopListening() waits for calls still in here.
+
+int FileNVRAM::rootFileOp(kauth_cred_t credential, void *idata, kauth_action_t action, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3)
+{
+	FileNVRAM* self = (FileNVRAM *)idata;
+
+	OSIncrementAtomic(&self->mRootCallbacks);
+
+	if (OSCompareAndSwap(0, 1, &self->mRootSeen))
+	{
+		thread_call_enter(self->mLoadCall);
+	}
+
+	OSDecrementAtomic(&self->mRootCallbacks);
+
+	return KAUTH_RESULT_DEFER;
+}
+
+//==============================================================================
+// Removes the file operation listener, on the workloop.
+
+void FileNVRAM::stopListening(void)
+{
+	if (!mRootListener)
+	{
+		return;
+	}
+
+	kauth_unlisten_scope(mRootListener);
+	mRootListener = NULL;
+
+	// No new calls after the unlisten, the ones that got in are a few instructions from done.
+	while (mRootCallbacks)
+	{
+		IOSleep(1);
+	}
+}
+
+//==============================================================================
+// Called once IOBSD is published (right away when it already is), on the notification thread.
+
+bool FileNVRAM::bsdPublished(void *target, void *refCon, IOService *newService, IONotifier *notifier)
+{
+	FileNVRAM* self = OSDynamicCast(FileNVRAM, (OSObject *)target);
+
+	if (self)
+	{
+		statsMark(self->mStats, kNVRAMBootBSD);
+		self->mCommandGate->runCommand((void *) kNVRAMLoadCommand, NULL, NULL, NULL);
+	}
+
+	return true;
+}
+
+//==============================================================================
+// Reads nvram.plist once, as soon as it can be reached, instead of polling for it.
+
+bool FileNVRAM::waitForFileSystem(void)
+{
+	OSDictionary* matching = IOService::resourceMatching("IOBSD");
+
+	mLoadCall = thread_call_allocate(loadOccurred, this);
+
+	if (!matching || !mLoadCall)
+	{
+		OSSafeReleaseNULL(matching);
+		return false;
+	}
+
+	// Set first, bsdPublished() may run before addMatchingNotification() returns.
+	mLoadPending = true;
+	mBSDNotifier = addMatchingNotification(gIOFirstPublishNotification, matching, bsdPublished, this);
+	matching->release();
+
+	if (!mBSDNotifier)
+	{
+		mLoadPending = false;
+		return false;
+	}
+
+	return true;
+}
+
+//==============================================================================
+// Runs on the workloop, when IOBSD is published and again on the first file
+// operation after that. The file is read once.
+
+void FileNVRAM::loadFileSystem(void)
+{
+	vnode_t rootvp;
+
+	if (!mLoadPending)
+	{
+		// Already done.
+		return;
+	}
+
+	// IOBSD comes up before the root file system, the first file operation tells us it is mounted.
+	if (!(rootvp = vfs_rootvnode()) && !mRootListener)
+	{
+		mRootListener = kauth_listen_scope(KAUTH_SCOPE_FILEOP, rootFileOp, this);
+
+		// Mounted meanwhile, there may not be another file operation for a while.
+		rootvp = vfs_rootvnode();
+	}
+
+	if (!rootvp)
+	{
+		if (mRootListener)
+		{
+			// Not that file operation then, the next one.
+			mRootSeen = 0;
+		}
+		else
+		{
+			uint64_t deadline;
+
+			LOG(ERROR, "Unable to listen for file operations, looking for / again in %u ms\n", NVRAM_ROOT_RETRY_MS);
+			clock_interval_to_deadline(NVRAM_ROOT_RETRY_MS, kMillisecondScale, &deadline);
+			thread_call_enter_delayed(mLoadCall, deadline);
+		}
+
+		return;
+	}
+
+	vnode_put(rootvp);
+	statsMark(mStats, kNVRAMBootRoot);
+	stopListening();
+
+	LOG(NOTICE, "Root file system mounted, loading\n");
+
+	uint64_t start = statsBegin();
+	int slot = selectSlot();
+	bool loaded = !mSnapshotLoaded || slot > 0;
+	bool rewrite = false;
+	IOReturn error = 0;
+	int replayed = 0;
+
+	if (slot < 0)
+	{
+		// Nothing on disk checks out. Start out empty, or write what the bootloader passed.
+		LOG(ERROR, "Neither %s nor %s can be used\n", FILE_NVRAM_PATH, FILE_NVRAM_SLOT_PATH);
+		rewrite = mSnapshotLoaded;
+		error = ENOENT;
+	}
+	else if (!mSnapshotLoaded)
+	{
+		error = loadSlot(sSlotPaths[slot]);
+	}
+	else if (slot != 0)
+	{
+		// The bootloader only reads nvram.plist, what it passed us is out of date.
+		LOG(NOTICE, "%s is newer than %s, reloading\n", sSlotPaths[slot], FILE_NVRAM_PATH);
+		error = resetStore() ? loadSlot(sSlotPaths[slot]) : ENOMEM;
+	}
+
+	if (error && slot >= 0)
+	{
+		// / is mounted, so the file isn't going to show up: start out empty.
+		LOG(ERROR, "Unable to read in nvram data at %s, errno %d\n", sSlotPaths[slot], error);
+	}
+	else if (!error)
+	{
+		// A sync was cut short after nvram.1.plist was written, finish it for the bootloader.
+		int copyError = (slot > 0) ? slotCopy(sSlotPaths[slot], FILE_NVRAM_PATH, mChunk, mCtx) : 0;
+
+		if (copyError)
+		{
+			LOG(ERROR, "Unable to copy %s to %s, errno %d\n", sSlotPaths[slot], FILE_NVRAM_PATH, copyError);
+			rewrite = true;
+		}
+
+		// Known once nvram.plist is in, it has the settings.
+		if (mShardMode)
+		{
+			rewrite = loadShards() || rewrite;
+			loaded = true;
+		}
+
+		// Blobs are only looked at once every file that can refer to one is in.
+		resolveBlobs();
+
+		if (loaded && mSyncLock)
+		{
+			// Nothing that was just loaded has to be written back, only the journal can change that.
+			IOLockLock(mSyncLock);
+			OSSafeReleaseNULL(mDirtyNamespaces);
+			IOLockUnlock(mSyncLock);
+		}
+
+		if (mJournalMode)
+		{
+			replayed = replayJournal();
+		}
+
+		statsEnd(mStats, kNVRAMStatLoad, start);
+		statsMark(mStats, kNVRAMBootLoaded);
+	}
+
+	// Whatever was set or removed before the load goes over what it read.
+	bool merged = mergeEarlyWrites();
+
+	mSafeToSync = true;
+
+	if (replayed || merged || rewrite)
+	{
+		// One sync for everything the journal had, and everything changed meanwhile.
+		IOLockLock(mSyncLock);
+		mDirty = true;
+		IOLockUnlock(mSyncLock);
+
+		doSync();
+	}
+	else if (loaded || mJournalMode)
+	{
+		// What we just restored is already on disk.
+		IOLockLock(mSyncLock);
+		mDirty = false;
+		IOLockUnlock(mSyncLock);
+		OSSafeReleaseNULL(mJournalPending);
+	}
+	else if (mDirty)
+	{
+		// Changes made while we couldn't tell which slot to write yet.
+		doSync();
+	}
+
+	if (!mSnapshotLoaded)
+	{
+		registerNVRAM();
+	}
+}
+
+//==============================================================================
+// Called by setProperty() and removeProperty() before the change is stored, and by
+// setProperties() with the write lock still held (anObject NULL for a removal). Until
+// nvram.plist is loaded the load could replace the store, mergeEarlyWrites() applies
+// the change again after it.
+
+void FileNVRAM::rememberEarlyWrite(const OSSymbol* aKey, OSObject* anObject)
+{
+	if (!mSyncLock)
+	{
+		return;
+	}
+
+	IOLockLock(mSyncLock);
+
+	if (mLoadPending)
+	{
+		if (!mEarlyWrites)
+		{
+			mEarlyWrites = OSDictionary::withCapacity(4);
+		}
+
+		if (!mEarlyRemoves)
+		{
+			mEarlyRemoves = OSSet::withCapacity(4);
+		}
+
+		// The last change to a variable is the one that counts.
+		if (mEarlyWrites && mEarlyRemoves)
+		{
+			if (anObject)
+			{
+				mEarlyRemoves->removeObject(aKey);
+				mEarlyWrites->setObject(aKey, anObject);
+			}
+			else
+			{
+				mEarlyWrites->removeObject(aKey);
+				mEarlyRemoves->setObject(aKey);
+			}
+		}
+	}
+
+	IOLockUnlock(mSyncLock);
+}
+
+//==============================================================================
+// Ends the load: applies what rememberEarlyWrite() kept over what was loaded. Done
+// under the write lock, so a change that comes after it isn't overwritten by an
+// older one. Returns true when there was anything to apply.
+
+bool FileNVRAM::mergeEarlyWrites(void)
+{
+	OSDictionary* writes = NULL;
+	OSSet* removes = NULL;
+	UInt32 count = 0;
+
+	lockStoreWrite();
+
+	if (mSyncLock)
+	{
+		IOLockLock(mSyncLock);
+	}
+
+	mLoadPending = false;
+	writes = mEarlyWrites;
+	removes = mEarlyRemoves;
+	mEarlyWrites = NULL;
+	mEarlyRemoves = NULL;
+
+	if (mSyncLock)
+	{
+		IOLockUnlock(mSyncLock);
+	}
+
+	OSCollectionIterator* iter = OSCollectionIterator::withCollection(removes);
+	const OSSymbol* key;
+	const OSSymbol* guid;
+
+	while (iter && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		guid = NULL;
+
+		if (storeDelete(mStore, key->getCStringNoCopy(), &guid))
+		{
+			markDirty(guid);
+			count++;
+		}
+	}
+
+	OSSafeReleaseNULL(iter);
+	iter = OSCollectionIterator::withCollection(writes);
+
+	while (iter && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+	{
+		guid = NULL;
+
+		if (!storeInsert(mStore, key->getCStringNoCopy(), writes->getObject(key), &guid))
+		{
+			LOG(ERROR, "Unable to keep %s, set before nvram.plist was loaded\n", key->getCStringNoCopy());
+			continue;
+		}
+
+		markDirty(guid);
+		count++;
+	}
+
+	OSSafeReleaseNULL(iter);
+
+	unlockStoreWrite();
+
+	if (count)
+	{
+		LOG(NOTICE, "Merged %u changes made before nvram.plist was loaded\n", (unsigned int)count);
+
+		// The loaded settings may have replaced ones set meanwhile.
+		applyStoredSettings();
+	}
+
+	OSSafeReleaseNULL(writes);
+	OSSafeReleaseNULL(removes);
+
+	return count != 0;
+}
+
+//==============================================================================
+// slotSelect(), and says why the other slot was passed over.
+
+int FileNVRAM::selectSlot(void)
+{
+	int errors[NVRAM_SLOTS];
+	int newest = slotSelect(mChunk, mCtx, &mSlotGeneration, errors);
+
+	for (int i = 0; i < NVRAM_SLOTS; i++)
+	{
+		if (errors[i])
+		{
+			LOG(NOTICE, "Skipping %s, errno %d\n", sSlotPaths[i], errors[i]);
+		}
+	}
+
+	if (newest >= 0)
+	{
+		LOG(INFO, "Using %s%s, generation %u\n", sSlotPaths[newest], (errors[newest] == EBADMSG) ? " edited by hand" : errors[newest] ? " without a record" : "", mSlotGeneration);
+	}
+
+	return newest;
+}
+
+//==============================================================================
+// Loads the shards listed in FILE_NVRAM_GUID:Shards, after nvram.plist. True when
+// one of them belongs in nvram.plist now (a boot namespace sharded by an older
+// version), nvram.plist has to be written again then.
+
+bool FileNVRAM::loadShards(void)
+{
+	char path[NVRAM_SHARD_PATH_MAX];
+	bool moved = false;
+
+	IORWLockRead(mStoreLock);
+	OSArray* shards = OSDynamicCast(OSArray, storeLookup(mStore, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_SHARDS));
+
+	if (shards)
+	{
+		shards->retain();
+	}
+
+	IORWLockUnlock(mStoreLock);
+
+	for (unsigned int i = 0; shards && i < shards->getCount(); i++)
+	{
+		OSString* guid = OSDynamicCast(OSString, shards->getObject(i));
+		UInt32 generation = (guid && shardName(guid)) ? shardCheck(guid, mChunk, mCtx) : 0;
+
+		if (!generation)
+		{
+			LOG(ERROR, "No valid shard for %s\n", guid ? guid->getCStringNoCopy() : "?");
+			continue;
+		}
+
+		shardPath(path, sizeof(path), guid, generation);
+
+		IOReturn error = loadSlot(path);
+
+		if (error)
+		{
+			LOG(ERROR, "Unable to read in nvram data at %s, errno %d\n", path, error);
+		}
+		else if (!shardable(guid))
+		{
+			LOG(NOTICE, "Moving %s back to %s\n", guid->getCStringNoCopy(), FILE_NVRAM_PATH);
+			moved = true;
+		}
+
+		// Even when it didn't load, the next write must not overwrite it.
+		const OSSymbol* symbol = OSSymbol::withString(guid);
+		OSNumber* number = OSNumber::withNumber(generation, 32);
+
+		if (symbol && number && mShardGenerations)
+		{
+			mShardGenerations->setObject(symbol, number);
+		}
+
+		OSSafeReleaseNULL(symbol);
+		OSSafeReleaseNULL(number);
+	}
+
+	OSSafeReleaseNULL(shards);
+
+	// What is on disk is what we have now.
+	mShardsStale = false;
+
+	return moved;
+}
+
+//==============================================================================
+// Reads a blob back, NULL when it is missing or doesn't match its hash.
+
+OSData* FileNVRAM::copyBlob(const OSString* aHash)
+{
+	char path[NVRAM_BLOB_PATH_MAX];
+	char hash[NVRAM_BLOB_HASH_LENGTH + 1];
+	OSData* data = NULL;
+	char* buffer;
+	uint64_t len;
+
+	blobPath(path, sizeof(path), aHash->getCStringNoCopy());
+
+	if (read_buffer(path, &buffer, &len, mCtx))
+	{
+		return NULL;
+	}
+
+	blobHash(buffer, (size_t)len, hash);
+
+	if (aHash->isEqualTo(hash))
 	{
-		
-		LOG(INFO, "setProperty(%s, (%s) %s) called\n", aKey->getCStringNoCopy(), anObject->getMetaClass()->getClassName(), s->text());
+		data = OSData::withBytes(buffer, (unsigned int)len);
 	}
 	else
 	{
-		LOG(INFO, "setProperty(%s, (%s) %p) called\n", aKey->getCStringNoCopy(), anObject->getMetaClass()->getClassName(), anObject);
+		LOG(ERROR, "%s doesn't match its hash\n", path);
 	}
-	
-	s->release();
-	
-	// Check for special FileNVRAM properties:
-	if (strncmp(FILE_NVRAM_GUID ":", aKey->getCStringNoCopy(), MIN(aKey->getLength(), strlen(FILE_NVRAM_GUID ":"))) == 0)
+
+	fileFree(buffer, (size_t)len);
+
+	return data;
+}
+
+//==============================================================================
+// Swaps the blob references that were loaded for the values they refer to. One
+// that can't be read stays, so it is written back as it was.
+
+void FileNVRAM::resolveBlobs(void)
+{
+	OSDictionary* references = OSDictionary::withCapacity(4);
+	OSCollectionIterator* iter;
+	const OSSymbol* key;
+
+	IORWLockRead(mStoreLock);
+
+	for (UInt32 i = 0; references && i < mStore->capacity; i++)
 	{
-		unsigned long bytes = aKey->getLength() - strlen(FILE_NVRAM_GUID ":") + 1;
-		// Found GUID
-		char* newKey = (char*)IOMalloc(bytes);
-		snprintf(newKey, bytes+1, "%s", &(aKey->getCStringNoCopy()[strlen(FILE_NVRAM_GUID ":")]));
-		
-		// Send d
-		OSString* str = OSString::withCString(newKey);
-		handleSetting(str, anObject, this);
-		str->release();
-		IOFree(newKey, bytes);
+		NVRAMPartition* partition = mStore->partitions[i];
+
+		for (UInt32 j = 0; partition && j < partition->capacity; j++)
+		{
+			NVRAMStoreEntry* entry = &partition->entries[j];
+
+			// Lazily loaded values are only decoded when they are dicts.
+			if (!entry->name || (!entry->value && (!mStore->image || strncmp(mStore->image + entry->offset, "<dict", 5) != 0)))
+			{
+				continue;
+			}
+
+			const OSString* hash = blobReferenceHash(storeValue(mStore, entry));
+
+			if (!hash)
+			{
+				continue;
+			}
+
+			// Not on the stack, names are as long as whoever set them liked.
+			size_t length = partition->guid->getLength();
+			size_t size = length + entry->name->getLength() + 2;
+			char* name = (char *)IOMalloc(size);
+
+			if (!name)
+			{
+				continue;
+			}
+
+			snprintf(name, size, "%s%s%s", partition->guid->getCStringNoCopy(), length ? NVRAM_SEPERATOR : "", entry->name->getCStringNoCopy());
+
+			if ((key = OSSymbol::withCString(name)))
+			{
+				references->setObject(key, hash);
+				key->release();
+			}
+
+			IOFree(name, size);
+		}
 	}
-	
-	bool stat = IOService::setProperty(aKey, cast(aKey, anObject));
-	
-	if (mInitComplete)
+
+	IORWLockUnlock(mStoreLock);
+
+	iter = OSCollectionIterator::withCollection(references);
+
+	while (iter && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
 	{
-		sync();
+		const OSString* hash = OSDynamicCast(OSString, references->getObject(key));
+		OSData* data = copyBlob(hash);
+
+		if (!data)
+		{
+			LOG(ERROR, "Missing blob %s for %s\n", hash->getCStringNoCopy(), key->getCStringNoCopy());
+			continue;
+		}
+
+		storeProperty(key, data, NULL);
+		data->release();
+
+		const OSSymbol* symbol = OSSymbol::withString(hash);
+
+		if (symbol && mBlobs)
+		{
+			mBlobs->setObject(symbol);
+		}
+
+		OSSafeReleaseNULL(symbol);
 	}
-	
-	return stat;
+
+	OSSafeReleaseNULL(iter);
+	OSSafeReleaseNULL(references);
 }
 
 //==============================================================================
+// Reads a snapshot into the store with the cheapest loader that handles it.
 
-void FileNVRAM::removeProperty(const OSSymbol *aKey)
+IOReturn FileNVRAM::loadSlot(const char* aPath)
 {
-	// Verify permissions.
-	IOReturn result = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+	// The store keeps a single file image, later files are loaded eagerly.
+	IOReturn error = (mLazyLoad && !mStore->image) ? load_image(aPath, mCtx) : EFTYPE;
 
-	if (result != kIOReturnSuccess)
+	if (error == EFTYPE)
 	{
-		return;
+		error = load_file(aPath, mCtx);
 	}
-	
-	LOG(NOTICE, "removeProperty() called\n");
 
-	IOService::removeProperty(aKey);
+	if (error == EFTYPE)
+	{
+		// Binary, or XML the streaming loader doesn't handle: parse it in one piece.
+		error = load_buffer(aPath, mCtx);
+	}
 
-	if (mInitComplete)
+	// The loaders store around handleSetting(), our own settings take effect once everything is in.
+	if (!error)
 	{
-		sync();
+		applyStoredSettings();
 	}
+
+	return error;
 }
 
 //==============================================================================
+// Drops every variable, before a snapshot is loaded over what the bootloader passed.
 
-IOReturn FileNVRAM::setProperties(OSObject *properties)
+bool FileNVRAM::resetStore(void)
 {
-	bool                 result = true;
-	OSObject             *object;
-	const OSSymbol       *key;
-	const OSString       *tmpStr;
-	OSDictionary         *dict;
-	OSCollectionIterator *iter;
-
-	dict = OSDynamicCast(OSDictionary, properties);
+	NVRAMStore* store = storeCreate();
 
-	if (!dict)
+	if (!store)
 	{
-		return kIOReturnBadArgument;
+		return false;
 	}
 
-	iter = OSCollectionIterator::withCollection(dict);
+	store->epoch = mEpoch;
 
-	if (!iter)
+	lockStoreWrite();
+	NVRAMStore* previous = mStore;
+	mStore = store;
+
+	// Readers without the lock may still be in the previous one.
+	if (mEpoch)
 	{
-		return kIOReturnBadArgument;
+		epochSynchronize(mEpoch);
 	}
 
-	while (result)
+	unlockStoreWrite();
+
+	storeDestroy(previous);
+
+	if (mFragments)
 	{
-		key = OSDynamicCast(OSSymbol, iter->getNextObject());
+		mFragments->flushCollection();
+	}
 
-		if (!key)
-		{
-			break;
-		}
+	return true;
+}
 
-		object = dict->getObject(key);
+//==============================================================================
 
-		if (!object)
-		{
-			continue;
-		}
-		
-		if (key->isEqualTo(kIONVRAMDeletePropertyKey))
-		{
-			tmpStr = OSDynamicCast(OSString, object);
+IOReturn FileNVRAM::setPowerState ( unsigned long whichState, IOService * whatDevice )
+{
+	LOG(NOTICE, "setPowerState() state %lu\n",whichState);
+
+	switch (whichState)
+	{
+		case POWER_STATE_OFF:
+			LOG(NOTICE, "Entering sleep\n");
 
-			if (tmpStr)
+			// Flush pending changes while we still can, but don't hold up the
+			// power change for longer than SleepBudget. A sync that is already
+			// writing finishes on its own, one that starts after this leaves
+			// everything dirty for the flush on wake.
+			if ((mDirty || mFlushRequested != mFlushCompleted) && !requestFlush(true, mSleepBudget))
 			{
-				key = OSSymbol::withString(tmpStr);
-				removeProperty(key);
-				key->release();
-				result = true;
+				LOG(NOTICE, "Sleep flush still running after %u ms\n", mSleepBudget);
 			}
-			else
+
+			mSafeToSync = false;
+			// Going to sleep. Perform state-saving tasks here.
+			break;
+
+		default:
+		case POWER_STATE_ON:
+			LOG(NOTICE, "Wakeing\n");
+			// Waking up. Perform device initialization here.
+			mSafeToSync = true;
+
+			// Catch up on anything set while we were asleep, or that missed the sleep flush.
+			if (mDirty)
 			{
-				result = false;
+				requestFlush(false, 0);
 			}
-		}
-		else if(key->isEqualTo(kIONVRAMSyncNowPropertyKey))
-		{
-			tmpStr = OSDynamicCast(OSString, object);
+			break;
+	}
+
+	return kIOPMAckImplied;
+}
+
+//==============================================================================
+
+void FileNVRAM::systemWillShutdown(IOOptionBits specifier)
+{
+	LOG(NOTICE, "systemWillShutdown(%x) called\n", specifier);
+
+	// Don't lose changes that are still waiting for the write-behind timer.
+	if (mDirty)
+	{
+		sync();
+	}
+
+	super::systemWillShutdown(specifier);
+}
+
+//==============================================================================
+
+OSObject* FileNVRAM::cast(const OSSymbol* key, OSObject* obj)
+{
+	const char* legacy[] = {
+		"boot-args",
+		"boot-script",
+	};
 
-			if (tmpStr)
+	OSString* str = OSDynamicCast(OSString, key);
+
+	if (str)
+	{
+		for (int i = 0; i < sizeof(legacy)/sizeof(char*); i++)
+		{
+			if (str->isEqualTo(legacy[i]))
 			{
-				result = true; // We are not going to gaurantee sync, this is best effort
+				LOG(NOTICE, "Found legacy key %s\n", str->getCStringNoCopy());
 
-				if (safeToSync())
+				// add null char, convert to OSString
+				OSData* data = OSDynamicCast(OSData, obj);
+
+				if (data)
 				{
-					sync();
+					data->appendByte(0x00, 1);
+
+					return OSString::withCString((const char*)data->getBytesNoCopy());
 				}
 			}
-			else
+		}
+	}
+
+	return obj;
+}
+
+//==============================================================================
+// SIP configuration variables need an entitlement on top of administrator rights.
+
+bool FileNVRAM::entitledToSet(const OSSymbol* aKey)
+{
+	if ((strncmp("csr-data", aKey->getCStringNoCopy(), 8) != 0) && (strncmp("csr-active-config", aKey->getCStringNoCopy(), 17) != 0))
+	{
+		return true;
+	}
+
+	OSObject* entitlement = IOUserClient::copyClientEntitlement(current_task(), "com.apple.private.iokit.nvram-csr");
+	bool result = (entitlement != NULL);
+
+	OSSafeReleaseNULL(entitlement);
+
+	return result;
+}
+
+//==============================================================================
+// Passes FILE_NVRAM_GUID:<setting> on to handleSetting().
+
+void FileNVRAM::applySetting(const OSSymbol* aKey, OSObject* anObject)
+{
+	if (strncmp(FILE_NVRAM_GUID ":", aKey->getCStringNoCopy(), MIN(aKey->getLength(), strlen(FILE_NVRAM_GUID ":"))) == 0)
+	{
+		unsigned long bytes = aKey->getLength() - strlen(FILE_NVRAM_GUID ":") + 1;
+		// Found GUID
+		char* newKey = (char*)IOMalloc(bytes);
+		snprintf(newKey, bytes, "%s", &(aKey->getCStringNoCopy()[strlen(FILE_NVRAM_GUID ":")]));
+
+		// Send d
+		OSString* str = OSString::withCString(newKey);
+		handleSetting(str, anObject, this);
+		str->release();
+		IOFree(newKey, bytes);
+	}
+}
+
+//==============================================================================
+// Returns the stored value (retained with aRetain) or NULL, the registry table isn't
+// searched. Tried without the lock first, see Epoch.cpp, a value that still has to
+// be decoded or a writer getting in the way takes the read lock after all.
+
+OSObject* FileNVRAM::lookupProperty(const char* aKey, bool aRetain) const
+{
+	OSObject* value = NULL;
+	bool found = false;
+
+	if (!mStore)
+	{
+		return NULL;
+	}
+
+	if (mEpoch)
+	{
+		UInt32 epoch = epochEnter(mEpoch);
+
+		for (int i = 0; !found && i < NVRAM_READ_RETRIES; i++)
+		{
+			UInt32 version = mEpoch->version;
+			bool lazy;
+
+			if (version & 1)
 			{
-				result = false;
+				break;
+			}
+
+			OSMemoryBarrier();
+			value = storeRead(mStore, aKey, &lazy);
+			OSMemoryBarrier();
+
+			if (lazy)
+			{
+				break;
 			}
+
+			found = (mEpoch->version == version);
 		}
-		else
+
+		// Still in the epoch, so it can't have been freed yet.
+		if (found && value && aRetain)
 		{
-			result = setProperty(key, object);
+			value->retain();
 		}
 
+		epochExit(mEpoch, epoch);
+
+		if (found)
+		{
+			return value;
+		}
 	}
 
-	iter->release();
+	IORWLockRead(mStoreLock);
+	value = storeLookup(mStore, aKey);
 
-	if (result)
+	if (value && aRetain)
 	{
-		return kIOReturnSuccess;
+		value->retain();
 	}
 
-	return kIOReturnError;
+	IORWLockUnlock(mStoreLock);
+
+	return value;
 }
 
 //==============================================================================
+// Writers go through these two, they keep the version lock free readers check.
 
-IOReturn FileNVRAM::readXPRAM(IOByteCount offset, UInt8 *buffer, IOByteCount length)
+void FileNVRAM::lockStoreWrite(void)
 {
-	LOG(NOTICE, "readXPRAM(%zu, %p, %zu) called\n", (size_t)offset, buffer, (size_t)length);
+	IORWLockWrite(mStoreLock);
 
-	return kIOReturnUnsupported;
+	if (mEpoch)
+	{
+		mEpoch->version++;
+		OSMemoryBarrier();
+	}
 }
 
 //==============================================================================
 
-IOReturn FileNVRAM::writeXPRAM(IOByteCount offset, UInt8 *buffer, IOByteCount length)
+void FileNVRAM::unlockStoreWrite(void)
 {
-	LOG(NOTICE, "writeXPRAM(%zu, %p, %zu) called\n", (size_t)offset, buffer, (size_t)length);
+	if (mEpoch)
+	{
+		// Frees what no reader can see anymore.
+		epochReclaim(mEpoch, false);
 
-	return kIOReturnUnsupported;
+		OSMemoryBarrier();
+		mEpoch->version++;
+	}
+
+	IORWLockUnlock(mStoreLock);
 }
 
 //==============================================================================
+// Variables set before start() created the store stay in the registry table.
 
-IOReturn FileNVRAM::readNVRAMProperty(IORegistryEntry *entry, const OSSymbol **name, OSData **value)
+bool FileNVRAM::storeProperty(const OSSymbol* aKey, OSObject* anObject, const OSSymbol** aGuid)
 {
-	LOG(NOTICE, "readNVRAMProperty(%s, %p, %p) called\n", entry->getName(), name, value);
+	bool result;
 
-	return kIOReturnUnsupported;
+	if (!mStore)
+	{
+		return IOService::setProperty(aKey, anObject);
+	}
+
+	lockStoreWrite();
+	result = storeInsert(mStore, aKey->getCStringNoCopy(), anObject, aGuid);
+	unlockStoreWrite();
+
+	return result;
 }
 
 //==============================================================================
+// A variable read back from disk. Stored as setProperty() would, minus the
+// privilege check, stats, trace, journal and sync: it is on disk already.
 
-IOReturn FileNVRAM::writeNVRAMProperty(IORegistryEntry *entry, const OSSymbol *name, OSData *value)
+bool FileNVRAM::loadProperty(const OSSymbol* aKey, OSObject* anObject)
 {
-	LOG(NOTICE, "writeNVRAMProperty(%s, %s, %p) called\n", entry->getName(), name->getCStringNoCopy(), value);
+	OSObject* value = cast(aKey, anObject);
+	bool result = value && storeProperty(aKey, value, NULL);
 
-	return kIOReturnUnsupported;
+	if (value && value != anObject)
+	{
+		value->release();
+	}
+
+	return result;
 }
 
 //==============================================================================
+// The store as it is now, for a sync to serialize without holding the lock. With
+// aDecoded set nothing in it is lazy, so storeValue() can be used on it.
 
-OSDictionary * FileNVRAM::getNVRAMPartitions(void)
+NVRAMStore* FileNVRAM::copyStoreSnapshot(bool aDecoded)
 {
-	LOG(NOTICE, "getNVRAMPartitions() called\n");
+	NVRAMStore* snapshot;
 
-	return 0;
+	if (aDecoded)
+	{
+		IORWLockRead(mStoreLock);
+		storeDecodeAll(mStore);
+		IORWLockUnlock(mStoreLock);
+	}
+
+	lockStoreWrite();
+	snapshot = storeSnapshot(mStore);
+	unlockStoreWrite();
+
+	return snapshot;
 }
 
 //==============================================================================
 
-IOReturn FileNVRAM::readNVRAMPartition(const OSSymbol *partitionID, IOByteCount offset, UInt8 *buffer, IOByteCount length)
+void FileNVRAM::releaseStoreSnapshot(NVRAMStore* aSnapshot)
 {
-	LOG(NOTICE, "readNVRAMPartition(%s, %zu, %p, %zu) called\n", partitionID->getCStringNoCopy(), (size_t)offset, buffer, (size_t)length);
-
-	return kIOReturnNotFound;
+	lockStoreWrite();
+	storeRelease(mStore, aSnapshot);
+	unlockStoreWrite();
 }
 
 //==============================================================================
+// storeProperty() for sets from outside, aChanged is false when the variable already had that value.
 
-IOReturn FileNVRAM::writeNVRAMPartition(const OSSymbol *partitionID, IOByteCount offset, UInt8 *buffer, IOByteCount length)
+bool FileNVRAM::updateProperty(const OSSymbol* aKey, OSObject* anObject, const OSSymbol** aGuid, bool* aChanged)
 {
-	LOG(NOTICE, "writeNVRAMPartition(%s, %zu, %p, %zu) called\n", partitionID->getCStringNoCopy(), (size_t)offset, buffer, (size_t)length);
+	UInt32 digest = storeDigest(anObject);
+	bool result;
 
-	return kIOReturnSuccess;
+	*aChanged = true;
+
+	if (!mStore)
+	{
+		return IOService::setProperty(aKey, anObject);
+	}
+
+	lockStoreWrite();
+	result = storeUpdate(mStore, aKey->getCStringNoCopy(), anObject, digest, aGuid, aChanged);
+	unlockStoreWrite();
+
+	return result;
 }
 
 //==============================================================================
 
-IOByteCount FileNVRAM::savePanicInfo(UInt8 *buffer, IOByteCount length)
+bool FileNVRAM::unstoreProperty(const OSSymbol* aKey, const OSSymbol** aGuid)
 {
-	// NOTE: In the event of a panic, we *cannot* use printf's.
-	// Also, we double panic when we call the next line, investigate.
-	//setProperty(OSSymbol::withCString("PANIC"), OSString::withCString("test"));
+	bool result;
 
-	return length;
+	if (!mStore)
+	{
+		return false;
+	}
+
+	lockStoreWrite();
+	result = storeDelete(mStore, aKey->getCStringNoCopy(), aGuid);
+	unlockStoreWrite();
+
+	return result;
 }
 
 //==============================================================================
 
-bool FileNVRAM::safeToSync(void)
+IOReturn FileNVRAM::write_buffer(const char* aPath, const char* aBuffer, size_t aLength, off_t aOffset, bool aTruncate, vfs_context_t aCtx)
 {
-	static int count;
-	LOG(NOTICE, "safeToSync() called\n");
-
-	// Don't sync every time... we already do it so it shouldn't be needed, but just in case.
-	count++;
+	NVRAMOutput output;
+	IOReturn error = open_stream(&output, aPath, aOffset, aTruncate, aCtx);
 
-	if (count % 4)
+	if (!error)
 	{
-		return true;
+		outputBytes(&output, aBuffer, aLength);
+		error = close_stream(&output);
 	}
 
-	return false;
+	return error;
 }
 
 //==============================================================================
 
-IOReturn FileNVRAM::dispatchCommand(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3)
+IOReturn FileNVRAM::open_stream(NVRAMOutput* aOutput, const char* aPath, off_t aOffset, bool aTruncate, vfs_context_t aCtx)
 {
-	FileNVRAM* self = OSDynamicCast(FileNVRAM, owner);
+	IOReturn error = 0;
 
-	if (!self)
+	int flags = (aTruncate ? O_TRUNC : 0) | O_CREAT | FWRITE;
+
+	bzero(aOutput, sizeof(NVRAMOutput));
+
+	if (!aCtx)
 	{
-		return kIOReturnBadArgument;
+		printf("FileNVRAM.kext: aCtx == NULL!\n");
+
+		return 0xFFFF; // EINVAL;
 	}
-	
-	size_t command = (size_t) arg0;
 
-	switch (command)
+	if (!mChunk)
 	{
-		case kNVRAMSyncCommand:
-			self->doSync();
-			break;
+		return ENOMEM;
+	}
 
-		default:
-			break;
+	if ((error = fileOpen(aPath, flags, &aOutput->vp, NULL, aCtx)))
+	{
+		return error;
 	}
 
-	return kIOReturnSuccess;
+	aOutput->ctx	= aCtx;
+	aOutput->buffer	= mChunk;
+	aOutput->size	= NVRAM_CHUNK_SIZE;
+	aOutput->start	= aOffset;
+	aOutput->offset	= aOffset;
+
+	return 0;
 }
 
 //==============================================================================
+// Writes out what is left in the chunk buffer and closes the file, returns the first error.
 
-void FileNVRAM::timeoutOccurred(OSObject *target, IOTimerEventSource* timer)
+IOReturn FileNVRAM::close_stream(NVRAMOutput* aOutput)
 {
-	static int retryCount;
+	int closeError;
 
-	if (target)
+	if (aOutput->used)
 	{
-		FileNVRAM* self = OSDynamicCast(FileNVRAM, target);
-
-		if (self)
-		{
-			uint64_t timeout = 20000; // 20ms
-			// Check to see if BSD has been published, if so sync();
+		outputFlush(aOutput, aOutput->buffer, aOutput->used);
+		aOutput->used = 0;
+	}
 
-			OSDictionary *  dict = 0;
-			IOService *     match = 0;
-			boolean_t		found = false;
+	// Callers count a write as done once this returns, so it has to be on disk.
+	if (!aOutput->error)
+	{
+		aOutput->error = fileSync(aOutput->vp, aOutput->ctx);
+	}
 
-			do
-			{
-				dict = IOService::resourceMatching("IOBSD");
+	if (aOutput->error)
+	{
+		printf("FileNVRAM.kext: Error, vn_rdwr() failed with error %d!\n", aOutput->error);
+	}
 
-				if (dict)
-				{
-					if (IOService::waitForMatchingService(dict, timeout))
-					{
-						found = true;
-					}
-				}
-			} while (false);
+	closeError = fileClose(aOutput->vp, true, aOutput->ctx);
 
-			OSSafeReleaseNULL(dict);
-			OSSafeReleaseNULL(match);
+	if (!aOutput->error)
+	{
+		statsCount(mStats, kNVRAMStatWritten, aOutput->offset - aOutput->start);
+	}
 
-			if (found)
-			{
-				UInt8 mLoggingLevel = self->mLoggingLevel;
-				LOG(NOTICE, "BSD found, syncing\n");
+	// Don't let a successful close hide a failed write.
+	return aOutput->error ? aOutput->error : closeError;
+}
 
-				// TODO: Read /Extra/NVRAM/nvram.plist and populate the device tree.
-				char* buffer;
-				uint64_t len;
+//==============================================================================
 
-				if (self->read_buffer(&buffer, &len, self->mCtx))
-				{
-					retryCount++;
-					LOG(ERROR, "Unable to read in nvram data at %s\n", self->mFilePath->getCStringNoCopy());
-					// TODO: Check if / is mounted, and if not, try again until it is.
-					if (retryCount < 100)
-					{
-						timer->setTimeoutMS(100);
-					}
-					else
-					{
-						self->mSafeToSync = true;
-						self->registerNVRAM();
-					}
-				}
-				else
-				{
-					self->mSafeToSync = false;
+IOReturn FileNVRAM::load_file(const char* aPath, vfs_context_t aCtx)
+{
+	IOReturn error = 0;
 
-					timer->cancelTimeout();
-					self->getWorkLoop()->removeEventSource(timer);
-					timer->release();
-					self->mTimer = NULL;
+	NVRAMInput input;
+	off_t size = 0;
 
-					if (len > strlen(NVRAM_FILE_HEADER) + strlen(NVRAM_FILE_FOOTER) + 1)
-					{
-						char* xml = buffer + strlen(NVRAM_FILE_HEADER);
-						size_t xmllen = (size_t)len - strlen(NVRAM_FILE_HEADER) - strlen(NVRAM_FILE_FOOTER);
-						xml[xmllen-1] = 0;
-						OSString *errmsg = 0;
-						OSObject* nvram = OSUnserializeXML(xml, &errmsg);
+	bzero(&input, sizeof(input));
 
-						if (nvram)
-						{
-							OSDictionary* data = OSDynamicCast(OSDictionary, nvram);
-							//if(data) self->setPropertyTable(data);
+	if (!aCtx)
+	{
+		printf("FileNVRAM.kext: aCtx == NULL!\n");
 
-							if (data)
-							{
-								self->copyUnserialzedData(NULL, data);
-							}
+		return 0xFFFF; // EINVAL;
+	}
 
-							nvram->release();
-						}
-					}
+	if (!mChunk)
+	{
+		return ENOMEM;
+	}
 
-					IOFree(buffer, (size_t)len);
+	if ((error = fileOpen(aPath, O_RDONLY | FREAD, &input.vp, &size, aCtx)))
+	{
+		return error;
+	}
 
+	if (size == 0)
+	{
+		error = ENOENT;
+	}
+	else
+	{
+		input.ctx		= aCtx;
+		input.buffer	= mChunk;
+		input.size		= NVRAM_CHUNK_SIZE;
+		input.length	= size;
 
-					self->mSafeToSync = true;
-					self->registerNVRAM();
-					//self->sync();
-				}
-			}
-			else
-			{
-				timer->setTimeoutMS(50);
-			}
+		// A binary plist needs random access, leave it to load_buffer().
+		if (!inputFill(&input))
+		{
+			error = input.error ? input.error : EIO;
+		}
+		else if (input.end >= BPLIST_MAGIC_LENGTH && strncmp(input.buffer, BPLIST_MAGIC, BPLIST_MAGIC_LENGTH) == 0)
+		{
+			error = EFTYPE;
 		}
 		else
 		{
-			//printf("Self is not of type FileNVRAM.\n");
+			error = loadPlist(&input, this, NULL);
 		}
 	}
+
+	fileClose(input.vp, false, aCtx);
+
+	return error;
 }
 
 //==============================================================================
+// Reads the whole file and parses it in one go. Only read errors are returned,
+// a file we can't parse is logged and treated as empty.
 
-IOReturn FileNVRAM::setPowerState ( unsigned long whichState, IOService * whatDevice )
+IOReturn FileNVRAM::load_buffer(const char* aPath, vfs_context_t aCtx)
 {
-	LOG(NOTICE, "setPowerState() state %lu\n",whichState);
+	char* buffer;
+	uint64_t size;
+	IOReturn error = read_buffer(aPath, &buffer, &size, aCtx);
 
-	switch (whichState)
+	if (error)
 	{
-		case POWER_STATE_OFF:
-			LOG(NOTICE, "Entering sleep\n");
-			mSafeToSync = false;
-			// Going to sleep. Perform state-saving tasks here.
-			break;
-
-		default:
-		case POWER_STATE_ON:
-			LOG(NOTICE, "Wakeing\n");
-			// Waking up. Perform device initialization here.
-			mSafeToSync = true;
-			break;
+		return error;
 	}
 
-	return kIOPMAckImplied;
-}
-
-//==============================================================================
-
-OSObject* FileNVRAM::cast(const OSSymbol* key, OSObject* obj)
-{
-	const char* legacy[] = {
-		"boot-args",
-		"boot-script",
-	};
-
-	OSString* str = OSDynamicCast(OSString, key);
+	// The slot record isn't part of the plist.
+	uint64_t len = slotLength(buffer, size);
 
-	if (str)
+	if (isBinaryPlist(buffer, len))
 	{
-		for (int i = 0; i < sizeof(legacy)/sizeof(char*); i++)
-		{
-			if (str->isEqualTo(legacy[i]))
-			{
-				LOG(NOTICE, "Found legacy key %s\n", str->getCStringNoCopy());
+		OSDictionary* data = unserializeBinaryPlist(buffer, len);
 
-				// add null char, convert to OSString
-				OSData* data = OSDynamicCast(OSData, obj);
+		if (data)
+		{
+			copyUnserialzedData(NULL, data);
+			data->release();
+		}
+		else
+		{
+			LOG(ERROR, "Unable to parse binary plist %s\n", aPath);
+		}
+	}
+	else if (len > strlen(NVRAM_FILE_HEADER) + strlen(NVRAM_FILE_FOOTER) + 1)
+	{
+		char* xml = buffer + strlen(NVRAM_FILE_HEADER);
+		size_t xmllen = (size_t)len - strlen(NVRAM_FILE_HEADER) - strlen(NVRAM_FILE_FOOTER);
+		xml[xmllen-1] = 0;
+		OSString *errmsg = 0;
+		OSObject* nvram = OSUnserializeXML(xml, &errmsg);
 
-				if (data)
-				{
-					data->appendByte(0x00, 1);
+		if (nvram)
+		{
+			OSDictionary* data = OSDynamicCast(OSDictionary, nvram);
 
-					return OSString::withCString((const char*)data->getBytesNoCopy());
-				}
+			if (data)
+			{
+				copyUnserialzedData(NULL, data);
 			}
+
+			nvram->release();
+		}
+		else
+		{
+			LOG(ERROR, "Unable to parse %s\n", aPath);
 		}
 	}
 
-	return obj;
+	fileFree(buffer, (size_t)size);
+
+	return 0;
 }
 
 //==============================================================================
+// Lazy loading: keeps the whole file and only indexes where each value is in it.
+// Returns EFTYPE, with nothing stored, for files the streaming loader doesn't handle.
 
-IOReturn FileNVRAM::write_buffer(char* aBuffer, vfs_context_t aCtx)
+IOReturn FileNVRAM::load_image(const char* aPath, vfs_context_t aCtx)
 {
-	IOReturn error = 0;
+	NVRAMInput input;
+	char* buffer;
+	uint64_t len;
+	IOReturn error = read_buffer(aPath, &buffer, &len, aCtx);
 
-	int length = (int)strlen(aBuffer);
-	
-	struct vnode * vp;
-	
-	if (aCtx)
+	if (error)
 	{
-		if ((error = vnode_open(FILE_NVRAM_PATH, (O_TRUNC | O_CREAT | FWRITE | O_NOFOLLOW), S_IRUSR | S_IWUSR, VNODE_LOOKUP_NOFOLLOW, &vp, aCtx)))
-		{
-			printf("FileNVRAM.kext: Error, vnode_open(%s) failed with error %d!\n", FILE_NVRAM_PATH, error);
-			
-			return error;
-		}
-		else
-		{
-			if ((error = vnode_isreg(vp)) == VREG)
-			{
-				if ((error = vn_rdwr(UIO_WRITE, vp, aBuffer, length, 0, UIO_SYSSPACE, IO_NOCACHE|IO_NODELOCKED|IO_UNIT, vfs_context_ucred(aCtx), (int *) 0, vfs_context_proc(aCtx))))
-				{
-					printf("FileNVRAM.kext: Error, vn_rdwr(%s) failed with error %d!\n", FILE_NVRAM_PATH, error);
-				}
-				
-				if ((error = vnode_close(vp, FWASWRITTEN, aCtx)))
-				{
-					printf("FileNVRAM.kext: Error, vnode_close(%s) failed with error %d!\n", FILE_NVRAM_PATH, error);
-				}
-			}
-			else
-			{
-				printf("FileNVRAM.kext: Error, vnode_isreg(%s) failed with error %d!\n", FILE_NVRAM_PATH, error);
-			}
-		}
+		return error;
 	}
-	else
+
+	if (isBinaryPlist(buffer, len) || len > UINT32_MAX)
 	{
-		printf("FileNVRAM.kext: aCtx == NULL!\n");
-		error = 0xFFFF; // EINVAL;
+		fileFree(buffer, (size_t)len);
+		return EFTYPE;
 	}
-	
+
+	bzero(&input, sizeof(input));
+	input.buffer	= buffer;
+	input.size		= (size_t)len;
+	input.end		= (size_t)len;
+
+	lockStoreWrite();
+
+	if (mStore->image)
+	{
+		// A load only ever happens once.
+		unlockStoreWrite();
+		fileFree(buffer, (size_t)len);
+		return EBUSY;
+	}
+
+	mStore->image = buffer;
+	mStore->imageSize = (size_t)len;
+
+	if ((error = loadPlist(&input, this, mStore)))
+	{
+		storeDropLazy(mStore);
+	}
+
+	if (mStore->lazy <= 0)
+	{
+		fileFree(mStore->image, mStore->imageSize);
+		mStore->image = NULL;
+		mStore->imageSize = 0;
+	}
+
+	unlockStoreWrite();
+
 	return error;
 }
 
 //==============================================================================
 
-IOReturn FileNVRAM::read_buffer(char** aBuffer, uint64_t* aLength, vfs_context_t aCtx)
+IOReturn FileNVRAM::read_buffer(const char* aPath, char** aBuffer, uint64_t* aLength, vfs_context_t aCtx)
 {
 	IOReturn error = 0;
 
-	struct vnode * vp;
-	struct vnode_attr va;
+	vnode_t vp;
+	off_t size = 0;
 
-	if (aCtx)
+	if (!aCtx)
 	{
-		if ((error = vnode_open(FILE_NVRAM_PATH, (O_RDONLY | FREAD | O_NOFOLLOW), S_IRUSR, VNODE_LOOKUP_NOFOLLOW, &vp, aCtx)))
-		{
-			printf("failed opening vnode at path %s, errno %d\n", FILE_NVRAM_PATH, error);
-			
-			return error;
-		}
-		else
-		{
-			if ((error = vnode_isreg(vp)) == VREG)
-			{
-				VATTR_INIT(&va);
-				VATTR_WANTED(&va, va_data_size);	/* size in bytes of the fork managed by current vnode */
+		printf("FileNVRAM.kext: aCtx == NULL!\n");
 
-				// Determine size of vnode
-				if ((error = vnode_getattr(vp, &va, aCtx)))
-				{
-					printf("FileNVRAM.kext: Error, failed to determine file size of %s, errno %d.\n", FILE_NVRAM_PATH, error);
-				}
-				else
-				{
-					if (aLength)
-					{
-						*aLength = va.va_data_size;
-					}
-					
-					*aBuffer = (char *)IOMalloc((size_t)va.va_data_size);
-					int len = (int)va.va_data_size;
-					
-					if ((error = vn_rdwr(UIO_READ, vp, *aBuffer, len, 0, UIO_SYSSPACE, IO_NOCACHE|IO_NODELOCKED|IO_UNIT, vfs_context_ucred(aCtx), (int *) 0, vfs_context_proc(aCtx))))
-					{
-						printf("FileNVRAM.kext: Error, writing to vnode(%s) failed with error %d!\n", FILE_NVRAM_PATH, error);
-					}
-				}
-				
-				if ((error = vnode_close(vp, 0, aCtx)))
-				{
-					printf("FileNVRAM.kext: Error, vnode_close(%s) failed with error %d!\n", FILE_NVRAM_PATH, error);
-				}
-			}
-			else
-			{
-				printf("FileNVRAM.kext: Error, vnode_isreg(%s) failed with error %d!\n", FILE_NVRAM_PATH, error);
-			}
-		}
+		return 0xFFFF; // EINVAL;
 	}
-	else
+
+	if ((error = fileOpen(aPath, O_RDONLY | FREAD, &vp, &size, aCtx)))
 	{
-		printf("FileNVRAM.kext: aCtx == NULL!\n");
-		error = 0xFFFF; // EINVAL;
+		return error;
 	}
-	
+
+	if (size == 0)
+	{
+		// Nothing to read, and a zero sized buffer isn't something we want to hand out.
+		error = ENOENT;
+	}
+	else if ((uint64_t)size != (size_t)size)
+	{
+		error = EFBIG;
+	}
+	else if (!(*aBuffer = fileAlloc((size_t)size)))
+	{
+		error = ENOMEM;
+	}
+	else if ((error = fileRead(vp, aCtx, *aBuffer, (size_t)size, 0)))
+	{
+		printf("FileNVRAM.kext: Error, reading from vnode(%s) failed with error %d!\n", aPath, error);
+		fileFree(*aBuffer, (size_t)size);
+	}
+	else if (aLength)
+	{
+		*aLength = size;
+	}
+
+	fileClose(vp, false, aCtx);
+
 	return error;
 }
-
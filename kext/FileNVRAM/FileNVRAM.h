@@ -25,10 +25,14 @@
 #include <sys/proc.h>
 #include <sys/kernel.h>
 #include <sys/vnode.h>
+#include <sys/vnode_if.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/fcntl.h>
+#include <sys/kauth.h>
 #include <libkern/libkern.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
@@ -43,9 +47,17 @@
 #define INFO		2
 #define NOTICE		3
 
+/* Levels above LOG_LEVEL_MAX are compiled out, build with -DLOG_LEVEL_MAX=ERROR to keep only errors. */
+#ifndef LOG_LEVEL_MAX
+	#define LOG_LEVEL_MAX	NOTICE
+#endif
+
+/* Guard any work done only to produce log output with this. */
+#define LOG_ENABLED(__level__)	((__level__) <= LOG_LEVEL_MAX && mLoggingLevel >= (__level__))
+
 #define LOG(__level__, x...)																\
 do {																						\
-	if (mLoggingLevel >= __level__)															\
+	if (LOG_ENABLED(__level__))																\
 	{																						\
 		char pname[256];																	\
 		proc_name(proc_pid(vfs_context_proc(vfs_context_current())), pname, sizeof(pname));	\
@@ -74,9 +86,49 @@ do {																						\
 #include <IOKit/IOTimerEventSource.h>
 
 #define FILE_NVRAM_GUID			"D8F0CCF5-580E-4334-87B6-9FBBB831271D"
+#define APPLE_NVRAM_GUID		"7C436110-AB2A-4BBB-A880-FE41995C9F82"	// boot-args, csr-active-config and the like.
+#define APPLE_SYSTEM_NVRAM_GUID	"40A0DDD2-77F8-4392-B4A3-1E7304206516"	// The system namespace, macOS 11 and later.
+#define EFI_GLOBAL_GUID			"8BE4DF61-93CA-11D2-AA0D-00E098032B8C"
 #define FILE_NVRAM_PATH			"/Extra/NVRAM/nvram.plist"
+#define FILE_NVRAM_SLOT_PATH	"/Extra/NVRAM/nvram.1.plist"	// Written first, then copied to nvram.plist, see Slot.cpp.
+#define FILE_NVRAM_JOURNAL_PATH	"/Extra/NVRAM/nvram.journal"
+#define FILE_NVRAM_SHARD_FORMAT	"/Extra/NVRAM/nvram.%s.%d.plist"	// GUID, slot.
+#define FILE_NVRAM_BLOB_FORMAT	"/Extra/NVRAM/nvram.blob.%s"		// SHA-1 of the contents.
 
 #define NVRAM_ENABLE_LOG		"EnableLogging"
+#define NVRAM_SYNC_DELAY		"SyncDelay"
+#define NVRAM_SYNC_DEADLINE		"SyncDeadline"
+#define NVRAM_SLEEP_BUDGET		"SleepBudget"
+#define NVRAM_IMMEDIATE_KEYS	"ImmediateKeys"
+#define NVRAM_VOLATILE_KEYS		"VolatileKeys"
+
+#define NVRAM_JOURNAL_MODE		"JournalMode"
+#define NVRAM_JOURNAL_LIMIT		"JournalLimit"
+#define NVRAM_JOURNAL_GENERATION	"JournalGeneration"
+
+#define NVRAM_SHARD_MODE		"ShardMode"
+#define NVRAM_SHARDS			"Shards"
+#define NVRAM_BLOB_THRESHOLD	"BlobThreshold"
+#define NVRAM_BLOB_KEY			"FileNVRAMBlob"	// The only key of a blob reference dict.
+
+#define NVRAM_FILE_FORMAT		"FileFormat"
+#define NVRAM_TRACE				"Trace"
+#define NVRAM_STATS				"Stats"
+
+#define NVRAM_SYNC_DELAY_MS		250		// Quiet window before a pending change is written out.
+#define NVRAM_SYNC_DEADLINE_MS	2000	// Upper bound on how long a change can stay pending.
+#define NVRAM_SLEEP_BUDGET_MS	1000	// Longest setPowerState() waits for the flush before sleep.
+#define NVRAM_RETRY_MIN_MS		100		// First retry after a failed sync, doubled after every further failure
+#define NVRAM_RETRY_MAX_MS		30000	// up to this.
+#define NVRAM_ROOT_RETRY_MS		1000	// How often to look for / when no file operation listener can be installed.
+#define NVRAM_JOURNAL_LIMIT_BYTES	(64 * 1024)	// Journal size that triggers a compaction into nvram.plist.
+#define NVRAM_CHUNK_SIZE		PAGE_SIZE	// Serializer output is written to the file in chunks of this size.
+#define NVRAM_IMPORT_DEPTH		8		// Deepest /chosen/nvram nesting that is imported.
+#define NVRAM_SLOTS				2		// Snapshot files written in turn, see Slot.cpp.
+#define NVRAM_SHARD_NAME_MAX	64		// Longest namespace that gets its own shard.
+#define NVRAM_SYMBOL_CACHE		64		// Power of two, symbols kept for keys read from the registry table.
+#define NVRAM_LAZY_BOOT_ARG		"filenvram_lazy"	// filenvram_lazy=1 decodes values on first use.
+#define NVRAM_IMMEDIATE_DEFAULT	"boot-args csr-*"	// ImmediateKeys until it is set.
 
 #define NVRAM_SEPERATOR			":"
 #define NVRAM_FILE_DT_LOCATION	"/chosen/nvram"
@@ -92,6 +144,174 @@ do {																						\
 #define kNVRAMSyncCommand		1
 #define kNVRAMSetProperty		2
 #define kNVRAMGetProperty		4
+#define kNVRAMLoadCommand		8
+
+/* Persistence classes, see Policy.cpp. */
+#define kNVRAMPersistDeferred	0		// Written by the next batched sync.
+#define kNVRAMPersistImmediate	1		// Written before the call that set it returns.
+#define kNVRAMPersistVolatile	2		// Never written.
+
+#define kNVRAMFormatXML			0
+#define kNVRAMFormatBinary		1	// bplist00, detected automatically when loading.
+
+/* Journal records: a header, then op, the NUL terminated key and (for kNVRAMJournalSet) the NUL terminated XML value. */
+#define kNVRAMJournalSet		1
+#define kNVRAMJournalRemove		2
+
+#define NVRAM_JOURNAL_MAGIC		0x4E564A48	// 'NVJH'
+#define NVRAM_RECORD_MAGIC		0x4E564A52	// 'NVJR'
+
+typedef struct
+{
+	UInt32	magic;
+	UInt32	generation;		// Must match JournalGeneration in nvram.plist, or the journal is stale.
+} NVRAMJournalHeader;
+
+typedef struct
+{
+	UInt32	magic;
+	UInt32	length;			// Payload bytes following this header.
+	UInt32	checksum;		// CRC-32 of the payload.
+} NVRAMJournalRecord;
+
+/* Trace events, see Trace.cpp. */
+#define kNVRAMTraceSet			1
+#define kNVRAMTraceRemove		2
+#define kNVRAMTraceSyncBegin	3
+#define kNVRAMTraceSyncEnd		4		// length is the number of bytes written.
+
+typedef struct
+{
+	UInt64	timestamp;		// mach_absolute_time()
+	UInt32	sequence;		// Slot number + 1, 0 while the record is being written.
+	UInt16	event;
+	UInt16	cpu;
+	UInt32	keyHash;		// FNV-1a of the key, 0 if there is none.
+	UInt32	length;			// Value length in bytes.
+	SInt32	pid;
+	UInt32	reserved;
+} NVRAMTraceRecord;
+
+/* Operations with a latency histogram, and plain counters, see Stats.cpp. */
+#define kNVRAMStatGet			0
+#define kNVRAMStatSet			1
+#define kNVRAMStatSync			2
+#define kNVRAMStatLoad			3
+#define kNVRAMStatOps			4
+
+#define kNVRAMStatRejected		0		// Writes refused for lack of privilege or entitlement.
+#define kNVRAMStatSerialized	1		// Bytes produced by the serializers.
+#define kNVRAMStatWritten		2		// Bytes written to disk.
+#define kNVRAMStatUnchanged		3		// Writes of the value a variable already had.
+#define kNVRAMStatSyncSkipped	4		// Snapshots not written because they matched the last one.
+#define kNVRAMStatVolatile		5		// Changes to volatile variables, kept in memory only.
+#define kNVRAMStatCounters		6
+
+#define NVRAM_STATS_BUCKETS		24		// Bucket n counts latencies below 2^n us, the last also anything slower.
+
+/* Boot timeline, when each step first happened. */
+#define kNVRAMBootStart			0
+#define kNVRAMBootBSD			1		// IOBSD published.
+#define kNVRAMBootRoot			2		// / mounted.
+#define kNVRAMBootLoaded		3		// Variables in the store, from the bootloader or nvram.plist.
+#define kNVRAMBootRegistered	4
+#define kNVRAMBootFirstGet		5
+#define kNVRAMBootEvents		6
+
+typedef struct
+{
+	volatile SInt64	count;
+	volatile SInt64	time;			// Microseconds.
+	volatile SInt32	histogram[NVRAM_STATS_BUCKETS];
+} NVRAMOpStats;
+
+typedef struct
+{
+	NVRAMOpStats	ops[kNVRAMStatOps];
+	volatile SInt64	counters[kNVRAMStatCounters];
+	volatile UInt64	boot[kNVRAMBootEvents];		// mach_absolute_time(), 0 until it happens. Not reset.
+} NVRAMStats;
+
+/* Serializer output: appended to data when set, otherwise streamed to vp through buffer.
+   Without either only the length and CRC are kept. */
+typedef struct
+{
+	OSData*			data;
+	vnode_t			vp;
+	vfs_context_t	ctx;
+	char*			buffer;
+	size_t			size;
+	size_t			used;
+	off_t			start;			// File offset the stream was opened at.
+	off_t			offset;			// File offset of buffer[0].
+	int				error;			// First write error, everything after it is dropped.
+	UInt32			crc;			// CRC-32 of everything flushed to vp.
+} NVRAMOutput;
+
+typedef struct
+{
+	const OSSymbol*		name;			// NULL for an empty slot.
+	OSObject*			value;			// NULL until first read when lazily loaded.
+	UInt32				hash;			// nvram_hash() of name.
+	UInt32				offset;			// The encoded value in NVRAMStore.image, while value is NULL.
+	UInt32				length;
+	UInt32				digest;			// storeDigest() of value, 0 until a set compares against it.
+} NVRAMStoreEntry;
+
+typedef struct
+{
+	const OSSymbol*		guid;			// "" for variables without a namespace.
+	UInt32				hash;
+	UInt32				count;
+	UInt32				capacity;		// Power of two.
+	NVRAMStoreEntry*	entries;
+	bool				shared;			// entries belong to a snapshot too, copied before the next change.
+} NVRAMPartition;
+
+#define kNVRAMRetireObject		0		// Released.
+#define kNVRAMRetireMemory		1		// IOFree()d, size bytes.
+#define kNVRAMRetireEntries		2		// storeFreeEntries(), size entries.
+
+typedef struct NVRAMRetired
+{
+	struct NVRAMRetired*	next;
+	UInt8					kind;
+	void*					pointer;
+	size_t					size;
+} NVRAMRetired;
+
+/* Lock free readers, see Epoch.cpp. */
+typedef struct
+{
+	volatile UInt32		epoch;
+	volatile SInt32		readers[2];		// Readers in, by the parity of the epoch they came in under.
+	volatile UInt32		version;		// Odd while a writer changes the store.
+	NVRAMRetired*		retired;		// Unlinked during this epoch.
+	NVRAMRetired*		retiring;		// Unlinked during the one before, freed once its readers are gone.
+} NVRAMEpoch;
+
+typedef struct NVRAMStore
+{
+	UInt32				count;
+	UInt32				capacity;		// Power of two.
+	NVRAMPartition**	partitions;		// NULL for an empty slot, partitions are never removed.
+	char*				image;			// nvram.plist as read, while lazy values still point into it.
+	size_t				imageSize;
+	volatile SInt32		lazy;			// Values not decoded yet.
+	struct NVRAMStore*	snapshot;		// The one taken from this store, the image stays while it is there.
+	NVRAMEpoch*			epoch;			// Set when it is read without the lock, what is unlinked is retired to it.
+} NVRAMStore;
+
+typedef struct
+{
+	const OSSymbol*		key;
+	OSObject*			value;			// Retained, what cast() made of the new value.
+	OSObject*			previous;		// Retained, NULL when the variable didn't exist.
+	const OSSymbol*		guid;			// Partition it went to, from storeInsert().
+	UInt32				digest;			// storeDigest() of value.
+	bool				changed;		// False when the variable already had value.
+	bool				kept;			// Applied to a batch that failed, and couldn't be undone.
+} NVRAMChange;
 
 #define super IODTNVRAM
 
@@ -113,7 +333,23 @@ public:
 	virtual void		copyUnserialzedData(const char* prefix, OSDictionary* dict);
 	virtual void		registerNVRAMController(IONVRAMController *nvram) override;
 	virtual void		sync(void) override;
-	virtual void		doSync(void);
+	virtual bool		doSync(void);
+	virtual bool		flushStore(void);
+	virtual void		syncFailed(void);
+	virtual void		scheduleSync(void);
+	virtual bool		requestFlush(bool aWait, UInt32 aBudget);
+	virtual UInt8		persistenceOf(const OSSymbol *aKey);
+	virtual void		setPersistence(UInt8 aClass, const OSObject *aValue);
+	virtual OSArray		*copyVolatileKeys(void);
+	virtual void		markDirty(const OSSymbol *aGuid);
+	virtual void		journalRecord(UInt8 op, const OSSymbol *aKey, OSObject *anObject);
+	virtual int			replayJournal(void);
+
+	virtual bool		updateFragments(void);
+	virtual bool		writeXMLSnapshot(NVRAMOutput *output);
+	virtual bool		snapshotDigest(UInt32 *aDigest, uint64_t *aLength);
+	virtual OSDictionary *copyBinarySnapshot(void);
+	virtual void		systemWillShutdown(IOOptionBits specifier) override;
 
 	virtual OSObject	*getProperty(const OSSymbol *aKey) const override;
 	virtual OSObject	*copyProperty(const OSSymbol *aKey) const override;
@@ -135,29 +371,125 @@ public:
 	virtual IOByteCount	savePanicInfo(UInt8 *buffer, IOByteCount length) override;
 
 private:
-	static void			timeoutOccurred(OSObject *target, IOTimerEventSource* timer);
+	static bool			bsdPublished(void *target, void *refCon, IOService *newService, IONotifier *notifier);
+	static int			rootFileOp(kauth_cred_t credential, void *idata, kauth_action_t action, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3);
+	static void			loadOccurred(thread_call_param_t owner, thread_call_param_t unused);
+	static void			syncTimeoutOccurred(OSObject *target, IOTimerEventSource* timer);
+	static void			flushOccurred(thread_call_param_t owner, thread_call_param_t unused);
 
 	virtual void		registerNVRAM(void);
-
-	virtual IOReturn	read_buffer(char** aBuffer, uint64_t* aLength, vfs_context_t aCtx);
-	virtual IOReturn	write_buffer(char* aBuffer, vfs_context_t aCtx);
+	virtual bool		waitForFileSystem(void);
+	virtual void		loadFileSystem(void);
+	virtual void		stopListening(void);
+	virtual void		rememberEarlyWrite(const OSSymbol* aKey, OSObject* anObject);
+	virtual bool		mergeEarlyWrites(void);
+
+	virtual IOReturn	read_buffer(const char* aPath, char** aBuffer, uint64_t* aLength, vfs_context_t aCtx);
+	virtual IOReturn	load_file(const char* aPath, vfs_context_t aCtx);
+	virtual IOReturn	load_buffer(const char* aPath, vfs_context_t aCtx);
+	virtual IOReturn	load_image(const char* aPath, vfs_context_t aCtx);
+	virtual IOReturn	loadSlot(const char* aPath);
+	virtual int			selectSlot(void);
+	virtual bool		resetStore(void);
+	virtual bool		writeShards(OSSet* dirty, bool* aComplete);
+	virtual int			writeShard(const OSSymbol* aGuid, OSData* aFragment);
+	virtual bool		loadShards(void);
+	virtual OSArray		*copyShardList(void);
+	virtual OSObject	*copyBlobReference(const OSSymbol* aGuid, const OSObject* aValue, OSSet* aRefs);
+	virtual void		referenceBlobs(OSDictionary* aDict, const OSSymbol* aGuid);
+	virtual void		updateBlobRefs(const OSSymbol* aGuid, OSSet* aRefs);
+	virtual void		removeBlobs(void);
+	virtual OSData		*copyBlob(const OSString* aHash);
+	virtual void		resolveBlobs(void);
+	virtual IOReturn	write_buffer(const char* aPath, const char* aBuffer, size_t aLength, off_t aOffset, bool aTruncate, vfs_context_t aCtx);
+	virtual IOReturn	open_stream(NVRAMOutput* aOutput, const char* aPath, off_t aOffset, bool aTruncate, vfs_context_t aCtx);
+	virtual IOReturn	close_stream(NVRAMOutput* aOutput);
 
 	virtual OSObject	*cast(const OSSymbol* key, OSObject* obj);
 
+	virtual UInt32		copyEntryValues(IORegistryEntry* entry, char* path, size_t size, size_t end);
+	virtual bool		entitledToSet(const OSSymbol* aKey);
+	virtual void		applySetting(const OSSymbol* aKey, OSObject* anObject);
+	virtual void		applyStoredSettings(void);
+	virtual OSObject	*lookupProperty(const char* aKey, bool aRetain) const;
+	virtual bool		storeProperty(const OSSymbol* aKey, OSObject* anObject, const OSSymbol** aGuid);
+	virtual bool		loadProperty(const OSSymbol* aKey, OSObject* anObject);
+	virtual OSObject	*readProperty(const char* aKey, const OSSymbol* aSymbol, bool aRetain) const;
+	virtual const OSSymbol	*copySymbol(const char* aKey) const;
+	virtual void		lockStoreWrite(void);
+	virtual void		unlockStoreWrite(void);
+	virtual NVRAMStore	*copyStoreSnapshot(bool aDecoded);
+	virtual void		releaseStoreSnapshot(NVRAMStore* aSnapshot);
+	virtual bool		updateProperty(const OSSymbol* aKey, OSObject* anObject, const OSSymbol** aGuid, bool* aChanged);
+	virtual bool		unstoreProperty(const OSSymbol* aKey, const OSSymbol** aGuid);
+
 	static IOReturn		dispatchCommand(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3);
 
 	bool				mInitComplete;
 	bool				mSafeToSync;
+	bool				mDirty;
+	bool				mJournalMode;
+	bool				mJournalCompact;	// A boot variable was journaled, the next sync writes nvram.plist. Under mSyncLock.
+	bool				mSnapshotLoaded;	// Came from the bootloader, which only reads slot 0.
+	bool				mLazyLoad;			// NVRAM_LAZY_BOOT_ARG
+	bool				mShardMode;
+	bool				mShardsStale;		// ShardMode was just turned on, every shard has to be written.
+	bool				mPolicyChanged;		// VolatileKeys changed, every namespace has to be serialized again.
+
+	UInt32				mSyncDelay;
+	UInt32				mSyncDeadline;
+	UInt32				mSleepBudget;		// ms, 0 waits for the flush before sleep however long it takes.
+	uint64_t			mDirtySince;
+	UInt32				mSyncRetries;		// Failed syncs in a row, under mSyncLock.
+
+	UInt32				mBlobThreshold;		// Data values this large are kept in blob files, 0 to keep everything inline.
+	UInt32				mJournalLimit;
+	UInt32				mJournalGeneration;
+	off_t				mJournalSize;		// Valid bytes in nvram.journal, 0 when a snapshot is needed first.
 
 	UInt8				mLoggingLevel;
+	UInt8				mFileFormat;
+	UInt32				mSlotGeneration;	// Generation of the newest snapshot on disk.
+	UInt32				mSnapshotCRC;		// snapshotDigest() of the last XML snapshot written,
+	uint64_t			mSnapshotLength;	// and its length, 0 when there is none (or it was binary).
 
     vfs_context_t		mCtx;
 
 	OSDictionary		*mNvramMissDict;
+	OSDictionary		*mFragments;		// Serialized XML per GUID namespace, written as-is until dirty.
+	OSDictionary		*mFragmentCRCs;		// GUID -> CRC-32 of its fragment, set with it, only read for fragments in mFragments.
+	OSSet				*mDirtyNamespaces;
+	OSData				*mJournalPending;	// Records not yet appended to nvram.journal.
+	OSDictionary		*mShardGenerations;	// GUID -> newest generation of its shard on disk.
+	OSSet				*mBlobs;			// Hashes of the blobs known to be on disk.
+	OSDictionary		*mBlobRefs;			// GUID -> hashes its last serialized form refers to,
+	OSDictionary		*mBlobRefsPrevious;	// and the form before, the other slot of a shard may hold it.
+	OSArray				*mImmediateKeys;	// Patterns of the immediate and volatile variables,
+	OSArray				*mVolatileKeys;		// both under mSyncLock.
+	char				*mChunk;			// NVRAM_CHUNK_SIZE bytes, reused by every sync.
+	NVRAMStats			*mStats;
+	const OSSymbol		*mStatsKey;			// FILE_NVRAM_GUID:Stats, made by copyProperty(), never stored.
+	NVRAMStore			*mStore;			// Every variable, the registry table only holds what IOKit sets before start().
+	IORWLock			*mStoreLock;
+	NVRAMEpoch			*mEpoch;			// NULL when every read takes mStoreLock.
+	const OSSymbol		*mSymbols[NVRAM_SYMBOL_CACHE];	// By nvram_hash(), set once and kept until stop(), see copySymbol().
 	IOCommandGate		*mCommandGate;
 	OSString			*mFilePath;
 
-	IOTimerEventSource	*mTimer;
+	bool				mLoadPending;		// Until nvram.plist was read, doSync() doesn't write before.
+	kauth_listener_t	mRootListener;		// Installed while / isn't mounted yet, its first file operation loads nvram.plist.
+	volatile SInt32		mRootCallbacks;		// rootFileOp() calls in flight.
+	volatile UInt32		mRootSeen;
+	thread_call_t		mLoadCall;			// Runs loadFileSystem() for rootFileOp().
+	OSDictionary		*mEarlyWrites;		// Variables set before nvram.plist was loaded, merged over it,
+	OSSet				*mEarlyRemoves;		// and the ones removed. Both under mSyncLock, NULL once loaded.
+	IONotifier			*mBSDNotifier;
+	IOTimerEventSource	*mSyncTimer;
+	IOLock				*mSyncLock;
+	thread_call_t		mFlushCall;			// Runs doSync() for requestFlush(), off the caller's thread.
+	UInt32				mFlushRequested;	// Last flush asked for,
+	UInt32				mFlushCompleted;	// the last one known to be written,
+	UInt32				mFlushFailed;		// and the last one that wasn't, all under mSyncLock.
 };
 
 #endif /* FileNVRAM_FileNVRAM_h */
@@ -0,0 +1,858 @@
+/***
+ * Loader.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Single pass nvram.plist loader. The file is read in chunks and every variable
+ * goes straight into the store, no intermediate dictionary is built. Only our
+ * own layout is understood: a top level dict of plain variables and GUID dicts.
+ * Nested dict and array values are handed to OSUnserializeXML one at a time.
+ * Anything else returns EFTYPE, so the caller can parse the file in one piece.
+ *
+ * With the whole file in memory (lazy loading) values aren't decoded at all,
+ * only where they are in the file is stored, see storeValue().
+ */
+
+#include "FileNVRAM.h"
+
+static bool storeIndex(NVRAMStore* store, const char* key, UInt32 offset, UInt32 length);
+
+#define NVRAM_NAME_MAX		256		// Longest key or integer the loader accepts.
+
+typedef struct
+{
+	vnode_t			vp;
+	vfs_context_t	ctx;
+	char*			buffer;
+	size_t			size;
+	size_t			pos;
+	size_t			end;
+	off_t			offset;			// File offset of the next chunk.
+	off_t			length;
+	int				error;
+} NVRAMInput;
+
+typedef struct
+{
+	char			name[32];
+	bool			closing;		// </name>
+	bool			empty;			// <name/>
+	bool			reference;		// Has an IDREF attribute, those can't be resolved here.
+	UInt32			size;			// size attribute of <integer>.
+} NVRAMTag;
+
+//==============================================================================
+
+static bool inputFill(NVRAMInput* in)
+{
+	size_t count;
+
+	if (in->error || !in->vp || in->offset >= in->length)
+	{
+		return false;
+	}
+
+	count = (size_t)MIN((off_t)in->size, in->length - in->offset);
+
+	if ((in->error = fileRead(in->vp, in->ctx, in->buffer, count, in->offset)))
+	{
+		return false;
+	}
+
+	in->pos = 0;
+	in->end = count;
+	in->offset += count;
+
+	return true;
+}
+
+//==============================================================================
+
+static inline int inputPeek(NVRAMInput* in)
+{
+	if (in->pos == in->end && !inputFill(in))
+	{
+		return -1;
+	}
+
+	return (UInt8)in->buffer[in->pos];
+}
+
+//==============================================================================
+
+static inline int inputNext(NVRAMInput* in)
+{
+	int c = inputPeek(in);
+
+	if (c >= 0)
+	{
+		in->pos++;
+	}
+
+	return c;
+}
+
+//==============================================================================
+
+static inline bool isSpace(int c)
+{
+	return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+}
+
+//==============================================================================
+// Decimal, or hexadecimal with a 0x prefix. A leading '-' gives the two's complement.
+
+static bool parseNumber(const char* str, uint64_t* value)
+{
+	bool negative = (*str == '-');
+	int base = 10;
+
+	str += negative ? 1 : 0;
+	*value = 0;
+
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+	{
+		base = 16;
+		str += 2;
+	}
+
+	if (!*str)
+	{
+		return false;
+	}
+
+	for (; *str; str++)
+	{
+		int digit;
+
+		if (*str >= '0' && *str <= '9')
+		{
+			digit = *str - '0';
+		}
+		else if (base == 16 && *str >= 'a' && *str <= 'f')
+		{
+			digit = *str - 'a' + 10;
+		}
+		else if (base == 16 && *str >= 'A' && *str <= 'F')
+		{
+			digit = *str - 'A' + 10;
+		}
+		else
+		{
+			return false;
+		}
+
+		*value = (*value * base) + digit;
+	}
+
+	if (negative)
+	{
+		*value = ~*value + 1;
+	}
+
+	return true;
+}
+
+//==============================================================================
+// Reads the next tag, skipping whitespace, the XML declaration, DOCTYPE and comments.
+
+static bool readTag(NVRAMInput* in, NVRAMTag* tag)
+{
+	char attributes[NVRAM_NAME_MAX];
+	size_t length = 0;
+	int c;
+
+	while (true)
+	{
+		while (isSpace(c = inputNext(in)));
+
+		if (c != '<')
+		{
+			return false;
+		}
+
+		c = inputPeek(in);
+
+		if (c != '?' && c != '!')
+		{
+			break;
+		}
+
+		int last = 0, previous = 0;
+		bool comment;
+
+		inputNext(in);
+		comment = (c == '!' && inputPeek(in) == '-');
+
+		while ((c = inputNext(in)) != '>' || (comment && (last != '-' || previous != '-')))
+		{
+			if (c < 0)
+			{
+				return false;
+			}
+
+			previous = last;
+			last = c;
+		}
+	}
+
+	if ((tag->closing = (c == '/')))
+	{
+		inputNext(in);
+	}
+
+	while ((c = inputPeek(in)) >= 0 && !isSpace(c) && c != '/' && c != '>')
+	{
+		if (length == sizeof(tag->name) - 1)
+		{
+			return false;
+		}
+
+		tag->name[length++] = c;
+		inputNext(in);
+	}
+
+	tag->name[length] = 0;
+	tag->empty = false;
+	length = 0;
+
+	// Only size and IDREF matter, the rest (ID) is skipped.
+	while ((c = inputNext(in)) >= 0 && c != '>')
+	{
+		if (length < sizeof(attributes) - 1)
+		{
+			attributes[length++] = c;
+		}
+
+		tag->empty = (c == '/');
+	}
+
+	attributes[length] = 0;
+
+	const char* size = strstr(attributes, "size=\"");
+	uint64_t value = 0;
+
+	if (size)
+	{
+		char digits[8];
+		size_t count = 0;
+
+		for (size += 6; count < sizeof(digits) - 1 && *size >= '0' && *size <= '9'; size++)
+		{
+			digits[count++] = *size;
+		}
+
+		digits[count] = 0;
+		parseNumber(digits, &value);
+	}
+
+	tag->size = (UInt32)value;
+	tag->reference = (strstr(attributes, "IDREF") != NULL);
+
+	return (c == '>') && tag->name[0];
+}
+
+//==============================================================================
+// Decodes the next character of element text into out, which takes up to four
+// (UTF-8) bytes. Returns the byte count, 0 at the next tag or -1 on error.
+
+static int readChars(NVRAMInput* in, char* out)
+{
+	char entity[12];
+	size_t length = 0;
+	uint64_t value;
+	int c = inputPeek(in);
+
+	if (c < 0)
+	{
+		return -1;
+	}
+
+	if (c == '<')
+	{
+		return 0;
+	}
+
+	inputNext(in);
+
+	if (c != '&')
+	{
+		out[0] = c;
+		return 1;
+	}
+
+	while ((c = inputNext(in)) != ';')
+	{
+		if (c < 0 || length == sizeof(entity) - 1)
+		{
+			return -1;
+		}
+
+		entity[length++] = c;
+	}
+
+	entity[length] = 0;
+
+	if (strcmp(entity, "amp") == 0)		{ out[0] = '&';		return 1; }
+	if (strcmp(entity, "lt") == 0)		{ out[0] = '<';		return 1; }
+	if (strcmp(entity, "gt") == 0)		{ out[0] = '>';		return 1; }
+	if (strcmp(entity, "quot") == 0)	{ out[0] = '"';		return 1; }
+	if (strcmp(entity, "apos") == 0)	{ out[0] = '\'';	return 1; }
+
+	// Character references, &#NN; or &#xNN; (parseNumber() wants a 0x prefix for the latter).
+	if (entity[0] != '#')
+	{
+		return -1;
+	}
+
+	if (entity[1] == 'x')
+	{
+		entity[0] = '0';
+	}
+
+	if (!parseNumber((entity[1] == 'x') ? entity : &entity[1], &value))
+	{
+		return -1;
+	}
+
+	if (value < 0x80)
+	{
+		out[0] = (char)value;
+		return 1;
+	}
+
+	if (value < 0x800)
+	{
+		out[0] = (char)(0xC0 | (value >> 6));
+		out[1] = (char)(0x80 | (value & 0x3F));
+		return 2;
+	}
+
+	if (value < 0x10000)
+	{
+		out[0] = (char)(0xE0 | (value >> 12));
+		out[1] = (char)(0x80 | ((value >> 6) & 0x3F));
+		out[2] = (char)(0x80 | (value & 0x3F));
+		return 3;
+	}
+
+	if (value > 0x10FFFF)
+	{
+		return -1;
+	}
+
+	out[0] = (char)(0xF0 | (value >> 18));
+	out[1] = (char)(0x80 | ((value >> 12) & 0x3F));
+	out[2] = (char)(0x80 | ((value >> 6) & 0x3F));
+	out[3] = (char)(0x80 | (value & 0x3F));
+
+	return 4;
+}
+
+//==============================================================================
+// Element text into a fixed buffer, for keys and integers.
+
+static bool readText(NVRAMInput* in, char* out, size_t size, size_t* length)
+{
+	char chars[4];
+	size_t used = 0;
+	int count;
+
+	while ((count = readChars(in, chars)) > 0)
+	{
+		if (used + count >= size)
+		{
+			return false;
+		}
+
+		memcpy(out + used, chars, count);
+		used += count;
+	}
+
+	out[used] = 0;
+
+	if (length)
+	{
+		*length = used;
+	}
+
+	return (count == 0);
+}
+
+//==============================================================================
+
+static inline bool expectClose(NVRAMInput* in, const char* name)
+{
+	NVRAMTag tag;
+
+	return readTag(in, &tag) && tag.closing && (strcmp(tag.name, name) == 0);
+}
+
+//==============================================================================
+
+static OSString* readString(NVRAMInput* in)
+{
+	OSData* text = OSData::withCapacity(64);
+	OSString* string = NULL;
+	char buffer[64];
+	char chars[4];
+	size_t used = 0;
+	int count = -1;
+
+	while (text)
+	{
+		// Runs without markup or entities are taken as they are.
+		size_t run = nvram_find(&in->buffer[in->pos], in->end - in->pos, '<', '&', '<');
+
+		if (run)
+		{
+			if (used && !text->appendBytes(buffer, (unsigned int)used))
+			{
+				break;
+			}
+
+			used = 0;
+			text->appendBytes(&in->buffer[in->pos], (unsigned int)run);
+			in->pos += run;
+		}
+
+		if ((count = readChars(in, chars)) <= 0)
+		{
+			break;
+		}
+
+		if (used + count > sizeof(buffer))
+		{
+			text->appendBytes(buffer, (unsigned int)used);
+			used = 0;
+		}
+
+		memcpy(buffer + used, chars, count);
+		used += count;
+	}
+
+	if (count == 0 && text->appendBytes(buffer, (unsigned int)used) && text->appendByte(0x00, 1))
+	{
+		string = OSString::withCString((const char *)text->getBytesNoCopy());
+	}
+
+	OSSafeReleaseNULL(text);
+
+	return string;
+}
+
+//==============================================================================
+// Base64 character values, 0xFF for everything else.
+
+static const UInt8 sBase64Values[256] =
+{
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3E, 0xFF, 0xFF, 0xFF, 0x3F,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+	0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+};
+
+//==============================================================================
+
+static inline int base64Value(int c)
+{
+	return (c < 0 || sBase64Values[c] == 0xFF) ? -1 : sBase64Values[c];
+}
+
+//==============================================================================
+// Decodes base64 as it is read, the text itself is never stored.
+
+static OSData* readData(NVRAMInput* in)
+{
+	OSData* data = OSData::withCapacity(64);
+	UInt8 buffer[48];
+	size_t used = 0;
+	UInt32 group = 0;
+	int count = 0;
+	int c = -1;
+
+	while (data && (c = inputPeek(in)) >= 0 && c != '<')
+	{
+		// Whole groups of four straight from the input buffer, until anything else shows up.
+		if (count == 0)
+		{
+			const UInt8* next = (const UInt8*)&in->buffer[in->pos];
+			const UInt8* end = (const UInt8*)&in->buffer[in->end];
+
+			while (end - next >= 4)
+			{
+				UInt32 a = sBase64Values[next[0]], b = sBase64Values[next[1]];
+				UInt32 d = sBase64Values[next[2]], e = sBase64Values[next[3]];
+
+				if ((a | b | d | e) & 0x80)
+				{
+					break;
+				}
+
+				group = (a << 18) | (b << 12) | (d << 6) | e;
+				buffer[used++] = (UInt8)(group >> 16);
+				buffer[used++] = (UInt8)(group >> 8);
+				buffer[used++] = (UInt8)group;
+				next += 4;
+
+				if (used == sizeof(buffer))
+				{
+					data->appendBytes(buffer, (unsigned int)used);
+					used = 0;
+				}
+			}
+
+			group = 0;
+			in->pos = (const char*)next - in->buffer;
+
+			if ((c = inputPeek(in)) < 0 || c == '<')
+			{
+				break;
+			}
+		}
+
+		int value = base64Value(inputNext(in));
+
+		if (value < 0)
+		{
+			if (isSpace(c) || c == '=')
+			{
+				continue;
+			}
+
+			OSSafeReleaseNULL(data);
+			break;
+		}
+
+		group = (group << 6) | value;
+
+		if (++count == 4)
+		{
+			buffer[used++] = (UInt8)(group >> 16);
+			buffer[used++] = (UInt8)(group >> 8);
+			buffer[used++] = (UInt8)group;
+			group = count = 0;
+
+			if (used == sizeof(buffer))
+			{
+				data->appendBytes(buffer, (unsigned int)used);
+				used = 0;
+			}
+		}
+	}
+
+	// Leftover characters from a padded last group.
+	if (count == 2)
+	{
+		buffer[used++] = (UInt8)(group >> 4);
+	}
+	else if (count == 3)
+	{
+		buffer[used++] = (UInt8)(group >> 10);
+		buffer[used++] = (UInt8)(group >> 2);
+	}
+
+	if (data && (c < 0 || count == 1 || !data->appendBytes(buffer, (unsigned int)used)))
+	{
+		OSSafeReleaseNULL(data);
+	}
+
+	return data;
+}
+
+//==============================================================================
+// Moves past the closing tag of the element opened by tag, copying what it passes
+// over to raw when that is set. Returns false if the element isn't closed.
+
+static bool skipElement(NVRAMInput* in, const NVRAMTag* tag, OSData* raw)
+{
+	int depth = tag->empty ? 0 : 1;
+	int c = 0;
+
+	while (depth && (c = inputNext(in)) >= 0)
+	{
+		char name[sizeof(tag->name)];
+		size_t length = 0;
+		bool closing, empty = false, inName = true;
+		UInt8 byte = c;
+
+		if (raw)
+		{
+			raw->appendBytes(&byte, 1);
+		}
+
+		if (c != '<')
+		{
+			continue;
+		}
+
+		if ((closing = (inputPeek(in) == '/')))
+		{
+			if (raw)
+			{
+				raw->appendByte('/', 1);
+			}
+
+			inputNext(in);
+		}
+
+		while ((c = inputNext(in)) >= 0)
+		{
+			byte = c;
+
+			if (raw)
+			{
+				raw->appendBytes(&byte, 1);
+			}
+
+			if (c == '>')
+			{
+				break;
+			}
+
+			if (inName && !isSpace(c) && c != '/' && length < sizeof(name) - 1)
+			{
+				name[length++] = c;
+			}
+			else
+			{
+				inName = false;
+			}
+
+			empty = (c == '/');
+		}
+
+		name[length] = 0;
+
+		if (length && strcmp(name, tag->name) == 0 && !empty)
+		{
+			depth += closing ? -1 : 1;
+		}
+	}
+
+	return !depth;
+}
+
+//==============================================================================
+// Copies the element verbatim up to its closing tag and parses just that piece.
+
+static OSObject* readRaw(NVRAMInput* in, const NVRAMTag* tag)
+{
+	OSData* raw = OSData::withCapacity(256);
+	OSObject* object = NULL;
+
+	if (!raw || !raw->appendByte('<', 1) || !raw->appendBytes(tag->name, (unsigned int)strlen(tag->name)) || !raw->appendByte('>', 1))
+	{
+		OSSafeReleaseNULL(raw);
+		return NULL;
+	}
+
+	if (skipElement(in, tag, raw) && raw->appendByte(0x00, 1))
+	{
+		object = OSUnserializeXML((const char *)raw->getBytesNoCopy());
+	}
+
+	OSSafeReleaseNULL(raw);
+
+	return object;
+}
+
+//==============================================================================
+// Returns a retained value for the element opened by tag, or NULL.
+
+static OSObject* readValue(NVRAMInput* in, const NVRAMTag* tag)
+{
+	OSObject* value = NULL;
+	const char* name = tag->name;
+
+	if (tag->closing || tag->reference)
+	{
+		return NULL;
+	}
+
+	if (strcmp(name, "string") == 0)
+	{
+		value = tag->empty ? OSString::withCString("") : readString(in);
+	}
+	else if (strcmp(name, "data") == 0)
+	{
+		value = tag->empty ? OSData::withCapacity(0) : readData(in);
+	}
+	else if (strcmp(name, "integer") == 0)
+	{
+		char text[32];
+		uint64_t number;
+
+		if (!tag->empty && readText(in, text, sizeof(text), NULL) && parseNumber(text, &number))
+		{
+			value = OSNumber::withNumber(number, tag->size ? tag->size : 64);
+		}
+	}
+	else if (strcmp(name, "true") == 0 || strcmp(name, "false") == 0)
+	{
+		value = (name[0] == 't') ? kOSBooleanTrue : kOSBooleanFalse;
+		value->retain();
+	}
+	else if (tag->empty && strcmp(name, "dict") == 0)
+	{
+		value = OSDictionary::withCapacity(1);
+	}
+	else if (tag->empty && strcmp(name, "array") == 0)
+	{
+		value = OSArray::withCapacity(1);
+	}
+	else if (!tag->empty)
+	{
+		// Nested collections, and anything else OSUnserializeXML knows about.
+		return readRaw(in, tag);
+	}
+
+	if (value && !tag->empty && !expectClose(in, name))
+	{
+		OSSafeReleaseNULL(value);
+	}
+
+	return value;
+}
+
+//==============================================================================
+
+static inline int loadError(const NVRAMInput* in)
+{
+	return in->error ? in->error : EFTYPE;
+}
+
+//==============================================================================
+// Variables in a GUID dict are stored as GUID:name, the prefix stays in key while
+// we are inside it and every name is read in right after it. When store is set,
+// in holds the whole file and values are only indexed into it (caller locks).
+
+static int loadPlist(NVRAMInput* in, FileNVRAM* entry, NVRAMStore* store)
+{
+	UInt8 mLoggingLevel = entry->mLoggingLevel;
+	char key[2 * NVRAM_NAME_MAX];
+	size_t prefix = 0;
+	size_t length;
+	NVRAMTag tag;
+
+	// Skip <plist>, the top level has to be a dict.
+	do
+	{
+		if (!readTag(in, &tag))
+		{
+			return loadError(in);
+		}
+	} while (!tag.closing && strcmp(tag.name, "plist") == 0);
+
+	if (tag.closing || strcmp(tag.name, "dict") != 0)
+	{
+		return EFTYPE;
+	}
+
+	if (tag.empty)
+	{
+		return 0;
+	}
+
+	while (true)
+	{
+		if (!readTag(in, &tag))
+		{
+			return loadError(in);
+		}
+
+		if (tag.closing && strcmp(tag.name, "dict") == 0)
+		{
+			if (!prefix)
+			{
+				break;
+			}
+
+			prefix = 0;
+			continue;
+		}
+
+		if (tag.closing || tag.empty || strcmp(tag.name, "key") != 0 ||
+			!readText(in, key + prefix, sizeof(key) - prefix - 1, &length) || !expectClose(in, "key"))
+		{
+			return loadError(in);
+		}
+
+		while (isSpace(inputPeek(in)))
+		{
+			inputNext(in);
+		}
+
+		size_t start = in->pos;
+
+		if (!readTag(in, &tag))
+		{
+			return loadError(in);
+		}
+
+		if (!prefix && !tag.closing && strcmp(tag.name, "dict") == 0)
+		{
+			if (tag.reference)
+			{
+				return EFTYPE;
+			}
+
+			if (!tag.empty)
+			{
+				prefix = length;
+				key[prefix++] = NVRAM_SEPERATOR[0];
+			}
+
+			continue;
+		}
+
+		if (store)
+		{
+			if (tag.closing || tag.reference || !skipElement(in, &tag, NULL) ||
+				!storeIndex(store, key, (UInt32)start, (UInt32)(in->pos - start)))
+			{
+				LOG(ERROR, "Unable to index %s\n", key);
+				return loadError(in);
+			}
+
+			continue;
+		}
+
+		OSObject* value = readValue(in, &tag);
+
+		if (!value)
+		{
+			LOG(ERROR, "Unable to load %s\n", key);
+			return loadError(in);
+		}
+
+		const OSSymbol* symbol = OSSymbol::withCString(key);
+
+		if (symbol)
+		{
+			entry->loadProperty(symbol, value);
+			symbol->release();
+		}
+
+		value->release();
+	}
+
+	return 0;
+}
@@ -0,0 +1,128 @@
+/***
+ * Policy.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Every variable has a persistence class. Deferred ones (the default) are written
+ * by the next batched sync, immediate ones before the call that set them returns,
+ * volatile ones only live in memory. FILE_NVRAM_GUID:ImmediateKeys and VolatileKeys
+ * list the keys of the other two classes, separated by spaces or commas. A key
+ * ending in '*' is a prefix, and one without a GUID matches in every namespace.
+ * FILE_NVRAM_GUID is never matched, the settings themselves are always deferred.
+ */
+
+#include "FileNVRAM.h"
+
+//==============================================================================
+// The keys in an ImmediateKeys/VolatileKeys setting, NULL when it isn't text.
+
+static OSArray* policyParse(const OSObject* value)
+{
+	const OSString* string = OSDynamicCast(OSString, value);
+	const OSData* data = OSDynamicCast(OSData, value);
+	const char* bytes = string ? string->getCStringNoCopy() : data ? (const char *)data->getBytesNoCopy() : NULL;
+	size_t length = string ? string->getLength() : data ? data->getLength() : 0;
+	OSArray* patterns = (string || data) ? OSArray::withCapacity(4) : NULL;
+
+	for (size_t i = 0; patterns && i < length; i++)
+	{
+		size_t count = nvram_find(&bytes[i], length - i, ' ', ',', '\0');
+
+		if (count)
+		{
+			// Not on the stack, the setting can be as long as whoever set it liked.
+			char* pattern = (char *)IOMalloc(count + 1);
+			OSString* str = NULL;
+
+			if (pattern)
+			{
+				strlcpy(pattern, &bytes[i], count + 1);
+				str = OSString::withCString(pattern);
+				IOFree(pattern, count + 1);
+			}
+
+			if (!str || !patterns->setObject(str))
+			{
+				OSSafeReleaseNULL(patterns);
+			}
+
+			OSSafeReleaseNULL(str);
+		}
+
+		i += count;
+	}
+
+	return patterns;
+}
+
+//==============================================================================
+// True when one of the patterns covers name in the namespace guid, guid is NULL for
+// plain keys. Patterns with a GUID only match in theirs, the rest in any.
+
+static bool policyMatchName(const OSArray* patterns, const char* guid, size_t guidLength, const char* name)
+{
+	// Or a VolatileKeys of "*" would keep our own configuration from being written.
+	if (guid && guidLength == strlen(FILE_NVRAM_GUID) && strncmp(guid, FILE_NVRAM_GUID, guidLength) == 0)
+	{
+		return false;
+	}
+
+	for (unsigned int i = 0; patterns && i < patterns->getCount(); i++)
+	{
+		const OSString* pattern = (const OSString *)patterns->getObject(i);
+		const char* str = pattern->getCStringNoCopy();
+		const char* separator = strstr(str, NVRAM_SEPERATOR);
+		size_t length = pattern->getLength();
+
+		if (separator)
+		{
+			if (!guid || (size_t)(separator - str) != guidLength || strncmp(str, guid, guidLength) != 0)
+			{
+				continue;
+			}
+
+			length -= separator + strlen(NVRAM_SEPERATOR) - str;
+			str = separator + strlen(NVRAM_SEPERATOR);
+		}
+
+		if ((length && str[length - 1] == '*') ? strncmp(name, str, length - 1) == 0 : strcmp(name, str) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//==============================================================================
+// True when one of the patterns covers key (GUID:name or a plain name).
+
+static bool policyMatch(const OSArray* patterns, const char* key)
+{
+	const char* separator = strstr(key, NVRAM_SEPERATOR);
+
+	if (!separator)
+	{
+		return policyMatchName(patterns, NULL, 0, key);
+	}
+
+	return policyMatchName(patterns, key, separator - key, separator + strlen(NVRAM_SEPERATOR));
+}
+
+//==============================================================================
+// policyMatch() for a store entry, name in the namespace guid ("" for plain keys).
+
+static bool policyMatchEntry(const OSArray* patterns, const OSSymbol* guid, const OSSymbol* name)
+{
+	if (!patterns || !patterns->getCount())
+	{
+		return false;
+	}
+
+	return policyMatchName(patterns, guid->getLength() ? guid->getCStringNoCopy() : NULL, guid->getLength(), name->getCStringNoCopy());
+}
@@ -0,0 +1,230 @@
+/***
+ * Serializer.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Plist (XML) writer for the NVRAM store. Unlike OSSerialize it emits no ID
+ * attributes, so independently serialized fragments can be joined into one file.
+ */
+
+#include "FileNVRAM.h"
+
+//==============================================================================
+
+static const char sBase64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+//==============================================================================
+
+static inline bool appendString(NVRAMOutput* out, const char* str)
+{
+	return outputBytes(out, str, (unsigned int)strlen(str));
+}
+
+//==============================================================================
+
+static inline bool appendIndent(NVRAMOutput* out, int depth)
+{
+	static const char tabs[] = "\t\t\t\t\t\t\t\t";
+
+	while (depth > 0)
+	{
+		int count = MIN(depth, (int)sizeof(tabs) - 1);
+
+		if (!outputBytes(out, tabs, count))
+		{
+			return false;
+		}
+
+		depth -= count;
+	}
+
+	return true;
+}
+
+//==============================================================================
+
+static bool appendEscaped(NVRAMOutput* out, const char* str, size_t length)
+{
+	size_t start = 0;
+	size_t i;
+
+	while ((i = start + nvram_find(&str[start], length - start, '&', '<', '>')) < length)
+	{
+		const char* entity;
+
+		switch (str[i])
+		{
+			case '&':	entity = "&amp;";	break;
+			case '<':	entity = "&lt;";	break;
+			default:	entity = "&gt;";	break;
+		}
+
+		// Copy the run of plain characters, then the entity.
+		if ((i > start && !outputBytes(out, &str[start], (unsigned int)(i - start))) || !appendString(out, entity))
+		{
+			return false;
+		}
+
+		start = i + 1;
+	}
+
+	if (length > start)
+	{
+		return outputBytes(out, &str[start], (unsigned int)(length - start));
+	}
+
+	return true;
+}
+
+//==============================================================================
+
+static bool appendBase64(NVRAMOutput* out, const UInt8* bytes, size_t length)
+{
+	char buffer[256];	// A multiple of 4.
+	size_t used = 0;
+	size_t full = length - (length % 3);
+	size_t i;
+
+	// Whole groups of three bytes, no padding to check for.
+	for (i = 0; i < full; i += 3)
+	{
+		UInt32 group = ((UInt32)bytes[i] << 16) | ((UInt32)bytes[i + 1] << 8) | bytes[i + 2];
+
+		buffer[used]		= sBase64Chars[group >> 18];
+		buffer[used + 1]	= sBase64Chars[(group >> 12) & 0x3F];
+		buffer[used + 2]	= sBase64Chars[(group >> 6) & 0x3F];
+		buffer[used + 3]	= sBase64Chars[group & 0x3F];
+		used += 4;
+
+		if (used == sizeof(buffer))
+		{
+			if (!outputBytes(out, buffer, used))
+			{
+				return false;
+			}
+
+			used = 0;
+		}
+	}
+
+	if (i < length)
+	{
+		UInt32 group = ((UInt32)bytes[i] << 16) | ((i + 1 < length) ? (UInt32)bytes[i + 1] << 8 : 0);
+
+		buffer[used]		= sBase64Chars[group >> 18];
+		buffer[used + 1]	= sBase64Chars[(group >> 12) & 0x3F];
+		buffer[used + 2]	= (i + 1 < length) ? sBase64Chars[(group >> 6) & 0x3F] : '=';
+		buffer[used + 3]	= '=';
+		used += 4;
+	}
+
+	return (used == 0) || outputBytes(out, buffer, used);
+}
+
+//==============================================================================
+
+static inline bool canSerialize(const OSObject* object)
+{
+	return (OSDynamicCast(OSString, object) || OSDynamicCast(OSData, object) ||
+			OSDynamicCast(OSNumber, object) || OSDynamicCast(OSBoolean, object) ||
+			OSDynamicCast(OSDictionary, object) || OSDynamicCast(OSArray, object));
+}
+
+//==============================================================================
+
+static bool serializeEntry(NVRAMOutput* out, const char* name, const OSObject* object, int depth);
+
+static bool serializeObject(NVRAMOutput* out, const OSObject* object, int depth)
+{
+	OSString*		string;
+	OSData*			data;
+	OSNumber*		number;
+	OSBoolean*		boolean;
+	OSDictionary*	dict;
+	OSArray*		array;
+
+	if ((string = OSDynamicCast(OSString, object)))
+	{
+		return appendString(out, "<string>") &&
+			   appendEscaped(out, string->getCStringNoCopy(), string->getLength()) &&
+			   appendString(out, "</string>\n");
+	}
+
+	if ((data = OSDynamicCast(OSData, object)))
+	{
+		return appendString(out, "<data>") &&
+			   appendBase64(out, (const UInt8*)data->getBytesNoCopy(), data->getLength()) &&
+			   appendString(out, "</data>\n");
+	}
+
+	if ((number = OSDynamicCast(OSNumber, object)))
+	{
+		char buffer[64];
+		snprintf(buffer, sizeof(buffer), "<integer size=\"%u\">0x%llx</integer>\n", number->numberOfBits(), number->unsigned64BitValue());
+
+		return appendString(out, buffer);
+	}
+
+	if ((boolean = OSDynamicCast(OSBoolean, object)))
+	{
+		return appendString(out, boolean->isTrue() ? "<true/>\n" : "<false/>\n");
+	}
+
+	if ((dict = OSDynamicCast(OSDictionary, object)))
+	{
+		OSCollectionIterator* iter = OSCollectionIterator::withCollection(dict);
+		const OSSymbol* key;
+		bool result = (iter != NULL) && appendString(out, "<dict>\n");
+
+		while (result && (key = OSDynamicCast(OSSymbol, iter->getNextObject())))
+		{
+			result = serializeEntry(out, key->getCStringNoCopy(), dict->getObject(key), depth + 1);
+		}
+
+		OSSafeReleaseNULL(iter);
+
+		return result && appendIndent(out, depth) && appendString(out, "</dict>\n");
+	}
+
+	if ((array = OSDynamicCast(OSArray, object)))
+	{
+		bool result = appendString(out, "<array>\n");
+
+		for (unsigned int i = 0; result && i < array->getCount(); i++)
+		{
+			OSObject* element = array->getObject(i);
+
+			if (canSerialize(element))
+			{
+				result = appendIndent(out, depth + 1) && serializeObject(out, element, depth + 1);
+			}
+		}
+
+		return result && appendIndent(out, depth) && appendString(out, "</array>\n");
+	}
+
+	return false;
+}
+
+//==============================================================================
+// Unsupported values are skipped (returns true) so one odd entry can't stop a sync.
+
+static bool serializeEntry(NVRAMOutput* out, const char* name, const OSObject* object, int depth)
+{
+	if (!canSerialize(object))
+	{
+		return true;
+	}
+
+	return appendIndent(out, depth) &&
+		   appendString(out, "<key>") &&
+		   appendEscaped(out, name, strlen(name)) &&
+		   appendString(out, "</key>\n") &&
+		   appendIndent(out, depth) &&
+		   serializeObject(out, object, depth);
+}
@@ -0,0 +1,111 @@
+/***
+ * Shard.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * With ShardMode set, every GUID namespace has its own pair of slot files
+ * (nvram.<GUID>.0.plist and nvram.<GUID>.1.plist), so a change only rewrites its
+ * own namespace. nvram.plist keeps the settings, plain keys, the namespaces the
+ * bootloader reads (bootNamespace()) and anything whose name isn't a GUID, plus
+ * the list of shards in FILE_NVRAM_GUID:Shards.
+ * Generation n of a shard is always in slot n % NVRAM_SLOTS.
+ */
+
+#include "FileNVRAM.h"
+
+#define NVRAM_SHARD_PATH_MAX	(sizeof(FILE_NVRAM_SHARD_FORMAT) + NVRAM_SHARD_NAME_MAX + 8)
+
+//==============================================================================
+// Only GUID like names are used in file names.
+
+static bool shardName(const OSString* guid)
+{
+	const char* str = guid->getCStringNoCopy();
+	size_t length = guid->getLength();
+
+	if (!length || length > NVRAM_SHARD_NAME_MAX)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < length; i++)
+	{
+		char c = str[i];
+
+		if (!((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f') || c == '-'))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//==============================================================================
+// Namespaces that get a shard, the rest stays in nvram.plist. The bootloader never
+// reads a shard, and the settings have to be in before the shards are loaded.
+
+static bool shardable(const OSString* guid)
+{
+	return shardName(guid) && !guid->isEqualTo(FILE_NVRAM_GUID) && !bootNamespace(guid->getCStringNoCopy(), guid->getLength());
+}
+
+//==============================================================================
+
+static inline void shardPath(char* path, size_t size, const OSString* guid, UInt32 generation)
+{
+	snprintf(path, size, FILE_NVRAM_SHARD_FORMAT, guid->getCStringNoCopy(), (int)(generation % NVRAM_SLOTS));
+}
+
+//==============================================================================
+// Newest valid generation of a shard on disk, 0 when there is none. Shards are
+// never written without a record, so a file without one doesn't count.
+
+static UInt32 shardCheck(const OSString* guid, char* chunk, vfs_context_t ctx)
+{
+	char path[NVRAM_SHARD_PATH_MAX];
+	UInt32 newest = 0;
+
+	for (int i = 0; i < NVRAM_SLOTS; i++)
+	{
+		UInt32 generation;
+
+		shardPath(path, sizeof(path), guid, i);
+
+		if (slotCheck(path, chunk, ctx, &generation) == 0 && generation > newest && (generation % NVRAM_SLOTS) == (UInt32)i)
+		{
+			newest = generation;
+		}
+	}
+
+	return newest;
+}
+
+//==============================================================================
+// Same namespaces in both lists, in any order.
+
+static bool shardListEqual(const OSArray* a, const OSArray* b)
+{
+	if (!a || !b || a->getCount() != b->getCount())
+	{
+		return false;
+	}
+
+	for (unsigned int i = 0; i < a->getCount(); i++)
+	{
+		bool found = false;
+
+		for (unsigned int j = 0; !found && j < b->getCount(); j++)
+		{
+			found = a->getObject(i)->isEqualTo(b->getObject(j));
+		}
+
+		if (!found)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
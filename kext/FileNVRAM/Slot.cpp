@@ -0,0 +1,288 @@
+/***
+ * Slot.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * The bootloader only reads nvram.plist, so that is always the current snapshot.
+ * A snapshot is written to nvram.1.plist first and, once that is on disk, copied
+ * over nvram.plist, so one of them is complete whenever the other is cut short.
+ * Both end in a fixed size record with the generation, the length of the plist
+ * before it and its CRC-32, the newest one that checks out is loaded. Shards
+ * (Shard.cpp) alternate between their two slots, nothing else reads them.
+ *
+ * That is two writes and two fsyncs a sync, where a rename over nvram.plist would
+ * be one. But there is no rename a kext can call by path, and nvram.plist has to
+ * stay where the bootloader looks for it. Copying in place means a copy cut short
+ * leaves a bad nvram.plist, and nvram.1.plist is only a safe fallback for it once
+ * it is on disk itself, hence the first fsync. The second lets the next sync
+ * overwrite nvram.1.plist.
+ *
+ * The record is an XML comment after </plist>. XML allows comments after the root
+ * element, and the bootloader's parser (XMLParseFile()) returns once it has the
+ * top level dict, it never gets to the record. There is no NUL in it either.
+ */
+
+#include "FileNVRAM.h"
+
+#define NVRAM_SLOT_PREFIX		"<!-- FileNVRAM slot "
+#define NVRAM_SLOT_FORMAT		NVRAM_SLOT_PREFIX "%08x %016llx %08x -->\n"
+#define NVRAM_SLOT_RECORD_SIZE	(sizeof(NVRAM_SLOT_PREFIX) - 1 + 8 + 1 + 16 + 1 + 8 + 5)
+
+static const char* sSlotPaths[NVRAM_SLOTS] = { FILE_NVRAM_PATH, FILE_NVRAM_SLOT_PATH };
+
+//==============================================================================
+
+static bool slotHex(const char* str, int digits, uint64_t* value)
+{
+	*value = 0;
+
+	while (digits--)
+	{
+		char c = *str++;
+
+		if (c >= '0' && c <= '9')
+		{
+			*value = (*value << 4) | (c - '0');
+		}
+		else if (c >= 'a' && c <= 'f')
+		{
+			*value = (*value << 4) | (c - 'a' + 10);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//==============================================================================
+// Parses the NVRAM_SLOT_RECORD_SIZE bytes at record.
+
+static bool slotRecord(const char* record, UInt32* generation, uint64_t* length, UInt32* crc)
+{
+	const char* fields = record + strlen(NVRAM_SLOT_PREFIX);
+	uint64_t values[3];
+
+	if (strncmp(record, NVRAM_SLOT_PREFIX, strlen(NVRAM_SLOT_PREFIX)) != 0 ||
+		!slotHex(fields, 8, &values[0]) || fields[8] != ' ' ||
+		!slotHex(fields + 9, 16, &values[1]) || fields[25] != ' ' ||
+		!slotHex(fields + 26, 8, &values[2]) || strncmp(fields + 34, " -->\n", 5) != 0)
+	{
+		return false;
+	}
+
+	*generation = (UInt32)values[0];
+	*length = values[1];
+	*crc = (UInt32)values[2];
+
+	return true;
+}
+
+//==============================================================================
+// Length of the plist in a slot file read into buffer, without the record.
+
+static uint64_t slotLength(const char* buffer, uint64_t size)
+{
+	UInt32 generation, crc;
+	uint64_t length;
+
+	if (size >= NVRAM_SLOT_RECORD_SIZE &&
+		slotRecord(buffer + size - NVRAM_SLOT_RECORD_SIZE, &generation, &length, &crc) &&
+		length == size - NVRAM_SLOT_RECORD_SIZE)
+	{
+		return length;
+	}
+
+	return size;
+}
+
+//==============================================================================
+// Appends the record for everything written to out so far, and cuts off what is
+// left of the previous, longer, snapshot in the slot.
+
+static bool slotFinish(NVRAMOutput* out, UInt32 generation)
+{
+	char record[NVRAM_SLOT_RECORD_SIZE + 1];
+
+	// Everything before the record has to go through outputFlush(), which keeps the CRC.
+	if (out->used)
+	{
+		outputFlush(out, out->buffer, out->used);
+		out->used = 0;
+	}
+
+	snprintf(record, sizeof(record), NVRAM_SLOT_FORMAT, generation, (unsigned long long)(out->offset - out->start), out->crc);
+
+	if (!outputBytes(out, record, NVRAM_SLOT_RECORD_SIZE) || !outputFlush(out, out->buffer, out->used))
+	{
+		return false;
+	}
+
+	out->used = 0;
+
+	return !(out->error = fileSetSize(out->vp, out->ctx, out->offset));
+}
+
+//==============================================================================
+// Verifies a slot file, chunk (NVRAM_CHUNK_SIZE bytes) is used to read it. EFTYPE
+// when it has no record: it is from before slots, was edited by hand, or was cut
+// short before the record. Only the caller can tell which.
+
+static int slotCheck(const char* path, char* chunk, vfs_context_t ctx, UInt32* generation)
+{
+	char record[NVRAM_SLOT_RECORD_SIZE];
+	uint64_t length = 0;
+	UInt32 crc = 0;
+	off_t size = 0;
+	vnode_t vp;
+	int error;
+
+	if ((error = fileOpen(path, O_RDONLY | FREAD, &vp, &size, ctx)))
+	{
+		return error;
+	}
+
+	*generation = 0;
+
+	if (size == 0)
+	{
+		error = ENOENT;
+	}
+	else if (size < (off_t)sizeof(record))
+	{
+		error = EFTYPE;
+	}
+	else if (!(error = fileRead(vp, ctx, record, sizeof(record), size - sizeof(record))))
+	{
+		if (!slotRecord(record, generation, &length, &crc))
+		{
+			*generation = 0;
+			error = EFTYPE;
+		}
+		else if (length != (uint64_t)(size - sizeof(record)))
+		{
+			error = EBADMSG;
+		}
+		else
+		{
+			UInt32 sum = 0;
+
+			for (uint64_t offset = 0; !error && offset < length; offset += NVRAM_CHUNK_SIZE)
+			{
+				size_t count = (size_t)MIN((uint64_t)NVRAM_CHUNK_SIZE, length - offset);
+
+				if (!(error = fileRead(vp, ctx, chunk, count, offset)))
+				{
+					sum = nvram_crc32(sum, chunk, count);
+				}
+			}
+
+			if (!error && sum != crc)
+			{
+				error = EBADMSG;
+			}
+		}
+	}
+
+	fileClose(vp, false, ctx);
+
+	return error;
+}
+
+//==============================================================================
+// Copies a slot file that checked out (record and all) over another one, through
+// chunk, and returns once the copy is on disk. The copy gets the same generation.
+
+static int slotCopy(const char* from, const char* to, char* chunk, vfs_context_t ctx)
+{
+	off_t size = 0;
+	vnode_t source;
+	vnode_t target;
+	int error;
+
+	if ((error = fileOpen(from, O_RDONLY | FREAD, &source, &size, ctx)))
+	{
+		return error;
+	}
+
+	if ((error = fileOpen(to, O_CREAT | FWRITE, &target, NULL, ctx)))
+	{
+		fileClose(source, false, ctx);
+		return error;
+	}
+
+	for (off_t offset = 0; !error && offset < size; offset += NVRAM_CHUNK_SIZE)
+	{
+		size_t count = (size_t)MIN((off_t)NVRAM_CHUNK_SIZE, size - offset);
+
+		if (!(error = fileRead(source, ctx, chunk, count, offset)))
+		{
+			error = fileWrite(target, ctx, chunk, count, offset);
+		}
+	}
+
+	if (!error)
+	{
+		error = fileSetSize(target, ctx, size);
+	}
+
+	if (!error)
+	{
+		error = fileSync(target, ctx);
+	}
+
+	fileClose(source, false, ctx);
+
+	int closeError = fileClose(target, true, ctx);
+
+	return error ? error : closeError;
+}
+
+//==============================================================================
+// The slot with the newest valid snapshot, nvram.plist when both are the same, or
+// -1 when neither can be used. errors gets what slotCheck() said of each.
+//
+// A nvram.plist whose record doesn't match what is before it was edited by hand
+// (the record is left alone) or cut short while being copied over (the record is
+// that of the snapshot before). A copy's generation is below nvram.1.plist's, an
+// edit's is not, and the edit is what the bootloader saw, so it wins.
+
+static int slotSelect(char* chunk, vfs_context_t ctx, UInt32* generation, int errors[NVRAM_SLOTS])
+{
+	UInt32 generations[NVRAM_SLOTS];
+	int newest = -1;
+
+	for (int i = 0; i < NVRAM_SLOTS; i++)
+	{
+		errors[i] = slotCheck(sSlotPaths[i], chunk, ctx, &generations[i]);
+
+		if (!errors[i] && (newest < 0 || generations[i] > generations[newest]))
+		{
+			newest = i;
+		}
+	}
+
+	if (errors[0] == EBADMSG && (newest < 0 || generations[0] >= generations[newest]))
+	{
+		newest = 0;
+	}
+
+	// A nvram.plist without a record is from before slots, or was edited by hand. A
+	// write cut short looks the same, so it is only trusted when it is all there is.
+	if (newest < 0 && errors[0] == EFTYPE && errors[1] == ENOENT)
+	{
+		newest = 0;
+		generations[0] = 0;
+	}
+
+	*generation = (newest < 0) ? 0 : generations[newest];
+
+	return newest;
+}
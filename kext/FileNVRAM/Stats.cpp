@@ -0,0 +1,188 @@
+/***
+ * Stats.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Operation counters and latency histograms, published as FILE_NVRAM_GUID:Stats.
+ * Updates are atomic adds only, so they can be made from any thread without a lock.
+ */
+
+#include "FileNVRAM.h"
+
+static const char* sStatsNames[kNVRAMStatOps] = { "Get", "Set", "Sync", "Load" };
+static const char* sCounterNames[kNVRAMStatCounters] = { "Rejected", "BytesSerialized", "BytesWritten", "Unchanged", "SyncSkipped", "Volatile" };
+static const char* sBootNames[kNVRAMBootEvents] = { "Start", "BSD", "Root", "Loaded", "Registered", "FirstGet" };
+
+//==============================================================================
+
+static inline uint64_t statsBegin(void)
+{
+	return mach_absolute_time();
+}
+
+//==============================================================================
+// Counts one operation that started at start (from statsBegin).
+
+static void statsEnd(NVRAMStats* stats, int op, uint64_t start)
+{
+	uint64_t elapsed;
+	int bucket = 0;
+
+	if (!stats)
+	{
+		return;
+	}
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &elapsed);
+	elapsed /= NSEC_PER_USEC;
+
+	// Bucket n holds latencies below 2^n us.
+	for (uint64_t us = elapsed; us && bucket < NVRAM_STATS_BUCKETS - 1; us >>= 1)
+	{
+		bucket++;
+	}
+
+	OSIncrementAtomic64(&stats->ops[op].count);
+	OSAddAtomic64(elapsed, &stats->ops[op].time);
+	OSIncrementAtomic(&stats->ops[op].histogram[bucket]);
+}
+
+//==============================================================================
+
+static inline void statsCount(NVRAMStats* stats, int counter, uint64_t value)
+{
+	if (stats)
+	{
+		OSAddAtomic64(value, &stats->counters[counter]);
+	}
+}
+
+//==============================================================================
+
+static inline void statsReset(NVRAMStats* stats)
+{
+	if (stats)
+	{
+		bzero((void *)stats->ops, sizeof(stats->ops));
+		bzero((void *)stats->counters, sizeof(stats->counters));
+	}
+}
+
+//==============================================================================
+// Records when a boot step first happened, later calls are no-ops.
+
+static inline void statsMark(NVRAMStats* stats, int event)
+{
+	if (stats && !stats->boot[event])
+	{
+		OSCompareAndSwap64(0, mach_absolute_time(), &stats->boot[event]);
+	}
+}
+
+//==============================================================================
+// Latency (us) that percent of the operations stayed below, as the upper bound of
+// the histogram bucket it falls in. 0 when none were counted.
+
+static uint64_t statsPercentile(const NVRAMStats* stats, int op, UInt32 percent)
+{
+	uint64_t total = 0, seen = 0;
+
+	for (int i = 0; i < NVRAM_STATS_BUCKETS; i++)
+	{
+		total += (UInt32)stats->ops[op].histogram[i];
+	}
+
+	uint64_t rank = (total * percent + 99) / 100;
+
+	for (int i = 0; total && i < NVRAM_STATS_BUCKETS; i++)
+	{
+		seen += (UInt32)stats->ops[op].histogram[i];
+
+		if (seen >= rank)
+		{
+			return 1ULL << i;
+		}
+	}
+
+	return 0;
+}
+
+//==============================================================================
+
+static inline bool statsSetNumber(OSDictionary* dict, const char* key, uint64_t value)
+{
+	OSNumber* number = OSNumber::withNumber(value, 64);
+	bool result = number && dict->setObject(key, number);
+
+	OSSafeReleaseNULL(number);
+
+	return result;
+}
+
+//==============================================================================
+// { Get = { Count, Time (us), P50, P99 (us), Histogram }, Set, Sync, Load, Rejected, BytesSerialized, BytesWritten, Unchanged, SyncSkipped, Volatile,
+//   Boot = { BSD, Root, Loaded, Registered, FirstGet (us after start()) } }
+
+static OSDictionary* copyStats(const NVRAMStats* stats)
+{
+	OSDictionary* dict = OSDictionary::withCapacity(kNVRAMStatOps + kNVRAMStatCounters);
+	bool result = (dict != NULL);
+
+	for (int op = 0; result && op < kNVRAMStatOps; op++)
+	{
+		OSDictionary* opDict = OSDictionary::withCapacity(5);
+		OSArray* histogram = OSArray::withCapacity(NVRAM_STATS_BUCKETS);
+
+		result = opDict && histogram &&
+				 statsSetNumber(opDict, "Count", stats->ops[op].count) &&
+				 statsSetNumber(opDict, "Time", stats->ops[op].time) &&
+				 statsSetNumber(opDict, "P50", statsPercentile(stats, op, 50)) &&
+				 statsSetNumber(opDict, "P99", statsPercentile(stats, op, 99));
+
+		for (int i = 0; result && i < NVRAM_STATS_BUCKETS; i++)
+		{
+			OSNumber* number = OSNumber::withNumber((UInt32)stats->ops[op].histogram[i], 32);
+
+			result = number && histogram->setObject(number);
+			OSSafeReleaseNULL(number);
+		}
+
+		result = result && opDict->setObject("Histogram", histogram) && dict->setObject(sStatsNames[op], opDict);
+
+		OSSafeReleaseNULL(histogram);
+		OSSafeReleaseNULL(opDict);
+	}
+
+	for (int i = 0; result && i < kNVRAMStatCounters; i++)
+	{
+		result = statsSetNumber(dict, sCounterNames[i], stats->counters[i]);
+	}
+
+	OSDictionary* boot = result ? OSDictionary::withCapacity(kNVRAMBootEvents) : NULL;
+
+	for (int i = kNVRAMBootStart + 1; boot && result && i < kNVRAMBootEvents; i++)
+	{
+		uint64_t elapsed;
+
+		if (stats->boot[i])
+		{
+			absolutetime_to_nanoseconds(stats->boot[i] - stats->boot[kNVRAMBootStart], &elapsed);
+			result = statsSetNumber(boot, sBootNames[i], elapsed / NSEC_PER_USEC);
+		}
+	}
+
+	result = result && boot && dict->setObject("Boot", boot);
+	OSSafeReleaseNULL(boot);
+
+	if (!result)
+	{
+		OSSafeReleaseNULL(dict);
+	}
+
+	return dict;
+}
@@ -0,0 +1,1110 @@
+/***
+ * Store.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Variable store: an open addressing (linear probing) table of GUID partitions,
+ * each an open addressing table of names. Keys are split once, on the way in.
+ * None of these take a lock, the caller holds mStoreLock. Lazily loaded values
+ * are decoded from the file image by the first reader (read lock is enough).
+ */
+
+#include "FileNVRAM.h"
+
+#define NVRAM_STORE_MIN_CAPACITY	8	// Power of two.
+#define NVRAM_DIGEST_MIN			64	// Smaller values are compared without a digest.
+
+//==============================================================================
+// GUID:name, or a plain name (guid length 0, the "" partition).
+
+static inline const char* storeSplit(const char* key, size_t* guidLength)
+{
+	const char* separator = strstr(key, NVRAM_SEPERATOR);
+
+	*guidLength = separator ? (size_t)(separator - key) : 0;
+
+	return separator ? separator + strlen(NVRAM_SEPERATOR) : key;
+}
+
+//==============================================================================
+
+static inline bool storeOverloaded(UInt32 count, UInt32 capacity)
+{
+	return (count + 1) * 4 > capacity * 3;
+}
+
+//==============================================================================
+
+static NVRAMPartition* storeFindPartition(const NVRAMStore* store, const char* guid, size_t length, UInt32 hash)
+{
+	UInt32 mask = store->capacity - 1;
+
+	for (UInt32 i = hash & mask; store->partitions[i]; i = (i + 1) & mask)
+	{
+		NVRAMPartition* partition = store->partitions[i];
+
+		if (partition->hash == hash && partition->guid->getLength() == length &&
+			strncmp(partition->guid->getCStringNoCopy(), guid, length) == 0)
+		{
+			return partition;
+		}
+	}
+
+	return NULL;
+}
+
+//==============================================================================
+
+static NVRAMStoreEntry* storeFindEntry(const NVRAMPartition* partition, const char* name, UInt32 hash)
+{
+	UInt32 mask = partition->capacity - 1;
+
+	for (UInt32 i = hash & mask; partition->entries[i].name; i = (i + 1) & mask)
+	{
+		NVRAMStoreEntry* entry = &partition->entries[i];
+
+		if (entry->hash == hash && strcmp(entry->name->getCStringNoCopy(), name) == 0)
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+//==============================================================================
+
+static bool storeResizeEntries(NVRAMStore* store, NVRAMPartition* partition, UInt32 capacity)
+{
+	NVRAMStoreEntry* entries = (NVRAMStoreEntry*)IOMalloc(capacity * sizeof(NVRAMStoreEntry));
+
+	if (!entries)
+	{
+		return false;
+	}
+
+	bzero(entries, capacity * sizeof(NVRAMStoreEntry));
+
+	for (UInt32 i = 0; i < partition->capacity; i++)
+	{
+		if (partition->entries[i].name)
+		{
+			UInt32 slot = partition->entries[i].hash & (capacity - 1);
+
+			while (entries[slot].name)
+			{
+				slot = (slot + 1) & (capacity - 1);
+			}
+
+			entries[slot] = partition->entries[i];
+
+			// The snapshot keeps its own references.
+			if (partition->shared)
+			{
+				entries[slot].name->retain();
+
+				if (entries[slot].value)
+				{
+					entries[slot].value->retain();
+				}
+			}
+		}
+	}
+
+	NVRAMStoreEntry* previous = partition->entries;
+	UInt32 previousCapacity = partition->capacity;
+
+	// Lock free readers take the capacity first, it must never be larger than entries.
+	partition->entries = entries;
+	OSMemoryBarrier();
+	partition->capacity = capacity;
+
+	if (!partition->shared)
+	{
+		epochRetire(store->epoch, kNVRAMRetireMemory, previous, previousCapacity * sizeof(NVRAMStoreEntry));
+	}
+
+	partition->shared = false;
+
+	return true;
+}
+
+//==============================================================================
+// Called with the write lock held, before a partition is changed: a snapshot
+// keeps the entries it was taken with, the store carries on with a copy.
+
+static inline bool storeUnshare(NVRAMStore* store, NVRAMPartition* partition)
+{
+	return !partition->shared || storeResizeEntries(store, partition, partition->capacity);
+}
+
+//==============================================================================
+// Releases the names and values in an entries array, and the array.
+
+static void storeFreeEntries(NVRAMStoreEntry* entries, UInt32 capacity)
+{
+	for (UInt32 i = 0; i < capacity; i++)
+	{
+		if (entries[i].name)
+		{
+			entries[i].name->release();
+			OSSafeReleaseNULL(entries[i].value);
+		}
+	}
+
+	IOFree(entries, capacity * sizeof(NVRAMStoreEntry));
+}
+
+//==============================================================================
+
+static bool storeGrowPartitions(NVRAMStore* store)
+{
+	UInt32 capacity = store->capacity * 2;
+	NVRAMPartition** partitions = (NVRAMPartition**)IOMalloc(capacity * sizeof(NVRAMPartition*));
+
+	if (!partitions)
+	{
+		return false;
+	}
+
+	bzero(partitions, capacity * sizeof(NVRAMPartition*));
+
+	for (UInt32 i = 0; i < store->capacity; i++)
+	{
+		if (store->partitions[i])
+		{
+			UInt32 slot = store->partitions[i]->hash & (capacity - 1);
+
+			while (partitions[slot])
+			{
+				slot = (slot + 1) & (capacity - 1);
+			}
+
+			partitions[slot] = store->partitions[i];
+		}
+	}
+
+	NVRAMPartition** previous = store->partitions;
+	UInt32 previousCapacity = store->capacity;
+
+	// Same order as in storeResizeEntries().
+	store->partitions = partitions;
+	OSMemoryBarrier();
+	store->capacity = capacity;
+
+	epochRetire(store->epoch, kNVRAMRetireMemory, previous, previousCapacity * sizeof(NVRAMPartition*));
+
+	return true;
+}
+
+//==============================================================================
+// Finds the partition for a GUID, creating it when create is set.
+
+static NVRAMPartition* storePartition(NVRAMStore* store, const char* guid, size_t length, bool create)
+{
+	UInt32 hash = nvram_hash(guid, length);
+	NVRAMPartition* partition = storeFindPartition(store, guid, length, hash);
+
+	if (partition || !create)
+	{
+		return partition;
+	}
+
+	if (storeOverloaded(store->count, store->capacity) && !storeGrowPartitions(store))
+	{
+		return NULL;
+	}
+
+	// Not on the stack, guid can be as long as the caller's key. Partitions are made rarely.
+	char* name = (char*)IOMalloc(length + 1);
+
+	if (!name)
+	{
+		return NULL;
+	}
+
+	strlcpy(name, guid, length + 1);
+	partition = (NVRAMPartition*)IOMalloc(sizeof(NVRAMPartition));
+
+	if (!partition)
+	{
+		IOFree(name, length + 1);
+		return NULL;
+	}
+
+	partition->guid		= OSSymbol::withCString(name);
+	IOFree(name, length + 1);
+	partition->hash		= hash;
+	partition->count	= 0;
+	partition->capacity	= NVRAM_STORE_MIN_CAPACITY;
+	partition->entries	= (NVRAMStoreEntry*)IOMalloc(NVRAM_STORE_MIN_CAPACITY * sizeof(NVRAMStoreEntry));
+	partition->shared	= false;
+
+	if (!partition->guid || !partition->entries)
+	{
+		OSSafeReleaseNULL(partition->guid);
+
+		if (partition->entries)
+		{
+			IOFree(partition->entries, NVRAM_STORE_MIN_CAPACITY * sizeof(NVRAMStoreEntry));
+		}
+
+		IOFree(partition, sizeof(NVRAMPartition));
+
+		return NULL;
+	}
+
+	bzero(partition->entries, NVRAM_STORE_MIN_CAPACITY * sizeof(NVRAMStoreEntry));
+
+	UInt32 slot = hash & (store->capacity - 1);
+
+	while (store->partitions[slot])
+	{
+		slot = (slot + 1) & (store->capacity - 1);
+	}
+
+	// Complete before a lock free reader can find it.
+	OSMemoryBarrier();
+	store->partitions[slot] = partition;
+	store->count++;
+
+	return partition;
+}
+
+//==============================================================================
+
+static NVRAMStore* storeCreate(void)
+{
+	NVRAMStore* store = (NVRAMStore*)IOMalloc(sizeof(NVRAMStore));
+
+	if (!store)
+	{
+		return NULL;
+	}
+
+	bzero(store, sizeof(NVRAMStore));
+	store->capacity	= NVRAM_STORE_MIN_CAPACITY;
+	store->partitions = (NVRAMPartition**)IOMalloc(NVRAM_STORE_MIN_CAPACITY * sizeof(NVRAMPartition*));
+
+	if (!store->partitions)
+	{
+		IOFree(store, sizeof(NVRAMStore));
+		return NULL;
+	}
+
+	bzero(store->partitions, NVRAM_STORE_MIN_CAPACITY * sizeof(NVRAMPartition*));
+
+	return store;
+}
+
+//==============================================================================
+
+static void storeDestroy(NVRAMStore* store)
+{
+	for (UInt32 i = 0; i < store->capacity; i++)
+	{
+		NVRAMPartition* partition = store->partitions[i];
+
+		if (!partition)
+		{
+			continue;
+		}
+
+		storeFreeEntries(partition->entries, partition->capacity);
+		partition->guid->release();
+		IOFree(partition, sizeof(NVRAMPartition));
+	}
+
+	if (store->image)
+	{
+		fileFree(store->image, store->imageSize);
+	}
+
+	IOFree(store->partitions, store->capacity * sizeof(NVRAMPartition*));
+	IOFree(store, sizeof(NVRAMStore));
+}
+
+//==============================================================================
+// Decodes a value that so far was only indexed in the file image. Readers may
+// race for it, the first one to publish wins.
+
+static OSObject* storeValue(const NVRAMStore* store, NVRAMStoreEntry* entry)
+{
+	OSObject* value = entry->value;
+	NVRAMInput input;
+	NVRAMTag tag;
+
+	if (value || !store->image)
+	{
+		return value;
+	}
+
+	bzero(&input, sizeof(input));
+	input.buffer	= store->image + entry->offset;
+	input.size		= entry->length;
+	input.end		= entry->length;
+
+	if (!readTag(&input, &tag) || !(value = readValue(&input, &tag)))
+	{
+		return NULL;
+	}
+
+	if (!OSCompareAndSwapPtr(NULL, value, (void * volatile *)&entry->value))
+	{
+		value->release();
+		return entry->value;
+	}
+
+	OSDecrementAtomic(&((NVRAMStore *)store)->lazy);
+
+	return value;
+}
+
+//==============================================================================
+// Frees the image once no value, here or in a snapshot, can still point into it.
+
+static inline void storeTrimImage(NVRAMStore* store)
+{
+	if (store->image && store->lazy <= 0 && !store->snapshot)
+	{
+		fileFree(store->image, store->imageSize);
+		store->image = NULL;
+		store->imageSize = 0;
+	}
+}
+
+//==============================================================================
+// Called with the write lock held: an entry stops being lazy, drop the image with the last one.
+
+static void storeForget(NVRAMStore* store, NVRAMStoreEntry* entry)
+{
+	if (entry->value)
+	{
+		epochRetire(store->epoch, kNVRAMRetireObject, entry->value, 0);
+	}
+	else
+	{
+		OSDecrementAtomic(&store->lazy);
+	}
+
+	entry->value = NULL;
+
+	storeTrimImage(store);
+}
+
+//==============================================================================
+// The entry of a "GUID:name" or plain key, and optionally its partition, or NULL.
+
+static NVRAMStoreEntry* storeFind(const NVRAMStore* store, const char* key, NVRAMPartition** found)
+{
+	size_t length;
+	const char* name = storeSplit(key, &length);
+	NVRAMPartition* partition = storeFindPartition(store, key, length, nvram_hash(key, length));
+
+	if (found)
+	{
+		*found = partition;
+	}
+
+	return partition ? storeFindEntry(partition, name, nvram_hash(name, strlen(name))) : NULL;
+}
+
+//==============================================================================
+// Returns the value (not retained) or NULL.
+
+static OSObject* storeLookup(const NVRAMStore* store, const char* key)
+{
+	NVRAMStoreEntry* entry = storeFind(store, key, NULL);
+
+	return entry ? storeValue(store, entry) : NULL;
+}
+
+//==============================================================================
+// storeLookup() for readers that don't hold the lock, inside epochEnter()/epochExit()
+// and checked against the version afterwards. Nothing is written, so a value that
+// wasn't decoded yet comes back as NULL with lazy set. Reads the capacities before
+// the arrays, and never probes more slots than there are.
+
+static OSObject* storeRead(const NVRAMStore* store, const char* key, bool* lazy)
+{
+	size_t length;
+	const char* name = storeSplit(key, &length);
+	UInt32 hash = nvram_hash(key, length);
+	UInt32 capacity = store->capacity;
+	NVRAMPartition* partition = NULL;
+
+	*lazy = false;
+	OSMemoryBarrier();
+
+	NVRAMPartition** partitions = store->partitions;
+
+	for (UInt32 i = 0; i < capacity; i++)
+	{
+		NVRAMPartition* candidate = partitions[(hash + i) & (capacity - 1)];
+
+		if (!candidate)
+		{
+			break;
+		}
+
+		if (candidate->hash == hash && candidate->guid->getLength() == length &&
+			strncmp(candidate->guid->getCStringNoCopy(), key, length) == 0)
+		{
+			partition = candidate;
+			break;
+		}
+	}
+
+	if (!partition)
+	{
+		return NULL;
+	}
+
+	hash = nvram_hash(name, strlen(name));
+	capacity = partition->capacity;
+	OSMemoryBarrier();
+
+	NVRAMStoreEntry* entries = partition->entries;
+
+	for (UInt32 i = 0; i < capacity; i++)
+	{
+		NVRAMStoreEntry* entry = &entries[(hash + i) & (capacity - 1)];
+		const OSSymbol* symbol = entry->name;
+
+		if (!symbol)
+		{
+			break;
+		}
+
+		if (entry->hash == hash && strcmp(symbol->getCStringNoCopy(), name) == 0)
+		{
+			OSObject* value = entry->value;
+
+			*lazy = (value == NULL);
+
+			return value;
+		}
+	}
+
+	return NULL;
+}
+
+//==============================================================================
+// Digest for the compare before write, 0 for values that are cheaper to compare directly.
+
+static UInt32 storeDigest(const OSObject* value)
+{
+	const OSData* data = OSDynamicCast(OSData, value);
+
+	if (!data || data->getLength() < NVRAM_DIGEST_MIN)
+	{
+		return 0;
+	}
+
+	UInt32 digest = nvram_crc32(0, data->getBytesNoCopy(), data->getLength());
+
+	return digest ? digest : 1;
+}
+
+//==============================================================================
+// Called with the write lock held: true when entry already holds value. digest is
+// storeDigest(value), a different one settles it without looking at the bytes.
+
+static bool storeSame(const NVRAMStore* store, NVRAMStoreEntry* entry, const OSObject* value, UInt32 digest)
+{
+	OSObject* current = storeValue(store, entry);
+
+	if (!current)
+	{
+		return false;
+	}
+
+	if (digest)
+	{
+		if (!entry->digest)
+		{
+			entry->digest = storeDigest(current);
+		}
+
+		if (entry->digest != digest)
+		{
+			return false;
+		}
+	}
+
+	// Matching digests are compared too, a collision must never lose a write.
+	return current->isEqualTo(value);
+}
+
+//==============================================================================
+// Adds or replaces a variable, and returns its partition's GUID (not retained) in guid.
+
+static bool storeInsert(NVRAMStore* store, const char* key, OSObject* value, const OSSymbol** guid)
+{
+	size_t length;
+	const char* name = storeSplit(key, &length);
+	NVRAMPartition* partition = storePartition(store, key, length, true);
+	UInt32 hash = nvram_hash(name, strlen(name));
+	NVRAMStoreEntry* entry;
+
+	if (!partition || !storeUnshare(store, partition))
+	{
+		return false;
+	}
+
+	if (guid)
+	{
+		*guid = partition->guid;
+	}
+
+	if ((entry = storeFindEntry(partition, name, hash)))
+	{
+		value->retain();
+		storeForget(store, entry);
+		entry->value = value;
+		entry->digest = 0;
+
+		return true;
+	}
+
+	if (storeOverloaded(partition->count, partition->capacity) && !storeResizeEntries(store, partition, partition->capacity * 2))
+	{
+		return false;
+	}
+
+	const OSSymbol* symbol = OSSymbol::withCString(name);
+
+	if (!symbol)
+	{
+		return false;
+	}
+
+	UInt32 slot = hash & (partition->capacity - 1);
+
+	while (partition->entries[slot].name)
+	{
+		slot = (slot + 1) & (partition->capacity - 1);
+	}
+
+	value->retain();
+	partition->entries[slot].name	= symbol;
+	partition->entries[slot].value	= value;
+	partition->entries[slot].hash	= hash;
+	partition->entries[slot].digest	= 0;
+	partition->count++;
+
+	return true;
+}
+
+//==============================================================================
+// storeInsert() that leaves a variable that already holds value alone, and says so
+// in changed. digest is storeDigest(value), worked out before the lock was taken.
+
+static bool storeUpdate(NVRAMStore* store, const char* key, OSObject* value, UInt32 digest, const OSSymbol** guid, bool* changed)
+{
+	NVRAMPartition* partition;
+	NVRAMStoreEntry* entry = storeFind(store, key, &partition);
+
+	if (entry && storeSame(store, entry, value, digest))
+	{
+		if (guid)
+		{
+			*guid = partition->guid;
+		}
+
+		*changed = false;
+
+		return true;
+	}
+
+	*changed = true;
+
+	if (!storeInsert(store, key, value, guid))
+	{
+		return false;
+	}
+
+	// Saves hashing the value again on the next set.
+	if ((entry = storeFind(store, key, NULL)))
+	{
+		entry->digest = digest;
+	}
+
+	return true;
+}
+
+//==============================================================================
+// Called with the write lock held, before a batch is applied: gives key's partition
+// its own entries and room for extra more variables. Replacing and removing there
+// then never allocates, inserting only allocates the name.
+
+static bool storeReserve(NVRAMStore* store, const char* key, UInt32 extra)
+{
+	size_t length;
+	storeSplit(key, &length);
+	NVRAMPartition* partition = storePartition(store, key, length, true);
+	UInt32 capacity;
+
+	if (!partition || !storeUnshare(store, partition))
+	{
+		return false;
+	}
+
+	for (capacity = partition->capacity; storeOverloaded(partition->count + extra, capacity); capacity *= 2);
+
+	return capacity == partition->capacity || storeResizeEntries(store, partition, capacity);
+}
+
+//==============================================================================
+// Removes every variable that is still only indexed, when a lazy load fails halfway.
+
+static void storeDropLazy(NVRAMStore* store)
+{
+	for (UInt32 i = 0; i < store->capacity; i++)
+	{
+		NVRAMPartition* partition = store->partitions[i];
+		bool dropped = false;
+
+		for (UInt32 j = 0; partition && j < partition->capacity; j++)
+		{
+			NVRAMStoreEntry* entry = &partition->entries[j];
+
+			if (entry->name && !entry->value)
+			{
+				epochRetire(store->epoch, kNVRAMRetireObject, (void *)entry->name, 0);
+				entry->name = NULL;
+				partition->count--;
+				store->lazy--;
+				dropped = true;
+			}
+		}
+
+		// Rehash in place, probe runs can't have holes. Failing leaves them, the
+		// entries behind a hole just can't be found anymore until the next resize.
+		if (dropped)
+		{
+			storeResizeEntries(store, partition, partition->capacity);
+		}
+	}
+}
+
+//==============================================================================
+// Adds a variable whose value is still encoded in the file image (the loader's
+// lazy mode). A variable that is already stored keeps its value.
+
+static bool storeIndex(NVRAMStore* store, const char* key, UInt32 offset, UInt32 length)
+{
+	size_t guidLength;
+	const char* name = storeSplit(key, &guidLength);
+	NVRAMPartition* partition = storePartition(store, key, guidLength, true);
+	UInt32 hash = nvram_hash(name, strlen(name));
+
+	if (!partition || !store->image || offset + length > store->imageSize)
+	{
+		return false;
+	}
+
+	if (storeFindEntry(partition, name, hash))
+	{
+		return true;
+	}
+
+	if (storeOverloaded(partition->count, partition->capacity) && !storeResizeEntries(store, partition, partition->capacity * 2))
+	{
+		return false;
+	}
+
+	const OSSymbol* symbol = OSSymbol::withCString(name);
+
+	if (!symbol)
+	{
+		return false;
+	}
+
+	UInt32 slot = hash & (partition->capacity - 1);
+
+	while (partition->entries[slot].name)
+	{
+		slot = (slot + 1) & (partition->capacity - 1);
+	}
+
+	partition->entries[slot].name	= symbol;
+	partition->entries[slot].value	= NULL;
+	partition->entries[slot].hash	= hash;
+	partition->entries[slot].offset	= offset;
+	partition->entries[slot].length	= length;
+	partition->entries[slot].digest	= 0;
+	partition->count++;
+	store->lazy++;
+
+	return true;
+}
+
+//==============================================================================
+// Removes a variable, shifting back later entries of the probe run so no
+// tombstones are needed. Returns false when there was nothing to remove.
+
+static bool storeDelete(NVRAMStore* store, const char* key, const OSSymbol** guid)
+{
+	size_t length;
+	const char* name = storeSplit(key, &length);
+	NVRAMPartition* partition = storePartition(store, key, length, false);
+	NVRAMStoreEntry* entry = partition ? storeFindEntry(partition, name, nvram_hash(name, strlen(name))) : NULL;
+
+	if (!entry)
+	{
+		return false;
+	}
+
+	// Found in the shared entries, so it has to be found again in the copy.
+	if (partition->shared)
+	{
+		if (!storeUnshare(store, partition))
+		{
+			return false;
+		}
+
+		entry = storeFindEntry(partition, name, nvram_hash(name, strlen(name)));
+	}
+
+	if (guid)
+	{
+		*guid = partition->guid;
+	}
+
+	epochRetire(store->epoch, kNVRAMRetireObject, (void *)entry->name, 0);
+	storeForget(store, entry);
+
+	UInt32 mask = partition->capacity - 1;
+	UInt32 hole = (UInt32)(entry - partition->entries);
+
+	for (UInt32 i = (hole + 1) & mask; partition->entries[i].name; i = (i + 1) & mask)
+	{
+		UInt32 home = partition->entries[i].hash & mask;
+
+		// Entries whose home lies cyclically in (hole, i] have to stay where they are.
+		bool stays = (hole < i) ? (home > hole && home <= i) : (home > hole || home <= i);
+
+		if (!stays)
+		{
+			partition->entries[hole] = partition->entries[i];
+			hole = i;
+		}
+	}
+
+	partition->entries[hole].name	= NULL;
+	partition->entries[hole].value	= NULL;
+	partition->count--;
+
+	return true;
+}
+
+//==============================================================================
+// OSDictionary::withObjects() takes the keys as they are, no duplicate checks.
+// Variables that match skip (see Policy.cpp) are left out.
+
+static OSDictionary* storeCopyPartition(const NVRAMStore* store, const NVRAMPartition* partition, const OSArray* skip)
+{
+	UInt32 count = 0;
+	const OSSymbol** keys = (const OSSymbol**)IOMalloc(MAX(partition->count, 1) * sizeof(OSSymbol*));
+	const OSObject** values = (const OSObject**)IOMalloc(MAX(partition->count, 1) * sizeof(OSObject*));
+	OSDictionary* dict = NULL;
+
+	if (keys && values)
+	{
+		for (UInt32 i = 0; i < partition->capacity; i++)
+		{
+			if (partition->entries[i].name && !policyMatchEntry(skip, partition->guid, partition->entries[i].name) &&
+				(values[count] = storeValue(store, &partition->entries[i])))
+			{
+				keys[count++] = partition->entries[i].name;
+			}
+		}
+
+		dict = count ? OSDictionary::withObjects(values, keys, count, count) : OSDictionary::withCapacity(1);
+	}
+
+	if (keys)
+	{
+		IOFree(keys, MAX(partition->count, 1) * sizeof(OSSymbol*));
+	}
+
+	if (values)
+	{
+		IOFree(values, MAX(partition->count, 1) * sizeof(OSObject*));
+	}
+
+	return dict;
+}
+
+//==============================================================================
+// The nvram.plist layout: plain variables at the top level, next to a dict per GUID.
+
+static OSDictionary* storeCopyRoot(const NVRAMStore* store, const OSArray* skip)
+{
+	NVRAMPartition* root = storeFindPartition(store, "", 0, nvram_hash("", 0));
+	UInt32 size = MAX(store->count + (root ? root->count : 0), 1);
+	UInt32 count = 0;
+	UInt32 plain = 0;
+	const OSSymbol** keys = (const OSSymbol**)IOMalloc(size * sizeof(OSSymbol*));
+	const OSObject** values = (const OSObject**)IOMalloc(size * sizeof(OSObject*));
+	OSDictionary* dict = NULL;
+	bool result = (keys && values);
+
+	// Plain variables first, the GUID dicts after them are ours to release.
+	for (UInt32 i = 0; result && root && i < root->capacity; i++)
+	{
+		if (root->entries[i].name && !policyMatchEntry(skip, root->guid, root->entries[i].name) &&
+			(values[count] = storeValue(store, &root->entries[i])))
+		{
+			keys[count++] = root->entries[i].name;
+		}
+	}
+
+	plain = count;
+
+	for (UInt32 i = 0; result && i < store->capacity; i++)
+	{
+		NVRAMPartition* partition = store->partitions[i];
+
+		if (!partition || partition == root || !partition->count)
+		{
+			continue;
+		}
+
+		if ((values[count] = storeCopyPartition(store, partition, skip)))
+		{
+			keys[count++] = partition->guid;
+		}
+		else
+		{
+			result = false;
+		}
+	}
+
+	if (result)
+	{
+		dict = count ? OSDictionary::withObjects(values, keys, count, count) : OSDictionary::withCapacity(1);
+	}
+
+	for (UInt32 i = plain; i < count; i++)
+	{
+		values[i]->release();
+	}
+
+	if (keys)
+	{
+		IOFree(keys, size * sizeof(OSSymbol*));
+	}
+
+	if (values)
+	{
+		IOFree(values, size * sizeof(OSObject*));
+	}
+
+	return dict;
+}
+
+//==============================================================================
+// Every variable under its full GUID:name key, as `nvram -p` and ioreg expect them.
+
+static OSDictionary* storeCopyFlat(const NVRAMStore* store)
+{
+	UInt32 size = 0;
+	UInt32 count = 0;
+
+	for (UInt32 i = 0; i < store->capacity; i++)
+	{
+		size += store->partitions[i] ? store->partitions[i]->count : 0;
+	}
+
+	size = MAX(size, 1);
+
+	const OSSymbol** keys = (const OSSymbol**)IOMalloc(size * sizeof(OSSymbol*));
+	const OSObject** values = (const OSObject**)IOMalloc(size * sizeof(OSObject*));
+	OSDictionary* dict = NULL;
+	bool result = (keys && values);
+
+	for (UInt32 i = 0; result && i < store->capacity; i++)
+	{
+		NVRAMPartition* partition = store->partitions[i];
+
+		for (UInt32 j = 0; result && partition && j < partition->capacity; j++)
+		{
+			NVRAMStoreEntry* entry = &partition->entries[j];
+
+			if (!entry->name || !storeValue(store, entry))
+			{
+				continue;
+			}
+
+			if (!partition->guid->getLength())
+			{
+				entry->name->retain();
+				keys[count] = entry->name;
+			}
+			else
+			{
+				size_t length = partition->guid->getLength() + strlen(NVRAM_SEPERATOR) + entry->name->getLength() + 1;
+				char* key = (char*)IOMalloc(length);
+
+				if (key)
+				{
+					snprintf(key, length, "%s%s%s", partition->guid->getCStringNoCopy(), NVRAM_SEPERATOR, entry->name->getCStringNoCopy());
+					keys[count] = OSSymbol::withCString(key);
+					IOFree(key, length);
+				}
+
+				result = (key && keys[count]);
+			}
+
+			if (result)
+			{
+				values[count++] = entry->value;
+			}
+		}
+	}
+
+	if (result)
+	{
+		dict = count ? OSDictionary::withObjects(values, keys, count, count) : OSDictionary::withCapacity(1);
+	}
+
+	for (UInt32 i = 0; i < count; i++)
+	{
+		keys[i]->release();
+	}
+
+	if (keys)
+	{
+		IOFree(keys, size * sizeof(OSSymbol*));
+	}
+
+	if (values)
+	{
+		IOFree(values, size * sizeof(OSObject*));
+	}
+
+	return dict;
+}
+
+//==============================================================================
+// Decodes every lazily loaded value, so nothing is decoded in a snapshot later.
+// Called with at least the read lock held.
+
+static void storeDecodeAll(NVRAMStore* store)
+{
+	for (UInt32 i = 0; store->lazy > 0 && i < store->capacity; i++)
+	{
+		NVRAMPartition* partition = store->partitions[i];
+
+		for (UInt32 j = 0; partition && j < partition->capacity; j++)
+		{
+			if (partition->entries[j].name)
+			{
+				storeValue(store, &partition->entries[j]);
+			}
+		}
+	}
+}
+
+//==============================================================================
+// Called with the write lock held. Entries the store moved away from go with the
+// snapshot, the ones it still uses are its own again.
+
+static void storeRelease(NVRAMStore* store, NVRAMStore* snapshot)
+{
+	for (UInt32 i = 0; i < snapshot->capacity; i++)
+	{
+		NVRAMPartition* copy = snapshot->partitions[i];
+
+		if (!copy)
+		{
+			continue;
+		}
+
+		NVRAMPartition* partition = storeFindPartition(store, copy->guid->getCStringNoCopy(), copy->guid->getLength(), copy->hash);
+
+		if (partition && partition->entries == copy->entries)
+		{
+			partition->shared = false;
+		}
+		else
+		{
+			epochRetire(store->epoch, kNVRAMRetireEntries, copy->entries, copy->capacity);
+		}
+
+		copy->guid->release();
+		IOFree(copy, sizeof(NVRAMPartition));
+	}
+
+	store->snapshot = NULL;
+	storeTrimImage(store);
+
+	IOFree(snapshot->partitions, snapshot->capacity * sizeof(NVRAMPartition*));
+	IOFree(snapshot, sizeof(NVRAMStore));
+}
+
+//==============================================================================
+// Called with the write lock held. Returns a read only copy of the store, made in
+// O(partitions): the partitions share their entries with the store until it
+// changes one, see storeUnshare(). Lazy values in it are only read from the image,
+// use storeDecodeAll() first for storeValue(). NULL when there is one already.
+
+static NVRAMStore* storeSnapshot(NVRAMStore* store)
+{
+	NVRAMStore* snapshot;
+
+	if (store->snapshot || !(snapshot = (NVRAMStore*)IOMalloc(sizeof(NVRAMStore))))
+	{
+		return NULL;
+	}
+
+	bzero(snapshot, sizeof(NVRAMStore));
+	snapshot->partitions = (NVRAMPartition**)IOMalloc(store->capacity * sizeof(NVRAMPartition*));
+
+	if (!snapshot->partitions)
+	{
+		IOFree(snapshot, sizeof(NVRAMStore));
+		return NULL;
+	}
+
+	bzero(snapshot->partitions, store->capacity * sizeof(NVRAMPartition*));
+	snapshot->capacity	= store->capacity;
+	snapshot->image		= store->image;
+	snapshot->imageSize	= store->imageSize;
+	snapshot->lazy		= store->lazy;
+	store->snapshot		= snapshot;
+
+	// Same slots as in the store, so partitions are found the same way.
+	for (UInt32 i = 0; i < store->capacity; i++)
+	{
+		NVRAMPartition* partition = store->partitions[i];
+		NVRAMPartition* copy;
+
+		if (!partition)
+		{
+			continue;
+		}
+
+		if (!(copy = (NVRAMPartition*)IOMalloc(sizeof(NVRAMPartition))))
+		{
+			storeRelease(store, snapshot);
+			return NULL;
+		}
+
+		*copy = *partition;
+		copy->guid->retain();
+		partition->shared = true;
+
+		snapshot->partitions[i] = copy;
+		snapshot->count++;
+	}
+
+	return snapshot;
+}
@@ -49,6 +49,296 @@ static inline const char * strstr(const char *s, const char *find)
 	return s;
 }
 
+//==============================================================================
+// CRC-32 (IEEE 802.3, reflected 0xEDB88320). Precomputed, it is used from any thread.
+
+static const UInt32 sCRC32Table[256] = {
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+	0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+	0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+	0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+	0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+	0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+	0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+	0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+	0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+	0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+	0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+	0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+	0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+	0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+	0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+	0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+	0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+	0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+	0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+	0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+	0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+	0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+	0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+	0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+	0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+	0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+	0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+	0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+	0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+	0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+	0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+	0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+static inline UInt32 nvram_crc32(UInt32 crc, const void* buffer, size_t length)
+{
+	const UInt8* bytes = (const UInt8*)buffer;
+
+	crc = ~crc;
+
+	while (length--)
+	{
+		crc = sCRC32Table[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+//==============================================================================
+// SWAR (eight bytes in a 64-bit word): non-zero if any byte of x is zero.
+
+#define NVRAM_SWAR_ONES		0x0101010101010101ULL
+#define NVRAM_SWAR_HIGHS	0x8080808080808080ULL
+
+static inline UInt64 swarHasZero(UInt64 x)
+{
+	return (x - NVRAM_SWAR_ONES) & ~x & NVRAM_SWAR_HIGHS;
+}
+
+//==============================================================================
+// Index of the first a, b or c in str, or length when there is none. Whole
+// words without a match are skipped eight bytes at a time.
+
+static inline size_t nvram_find(const char* str, size_t length, char a, char b, char c)
+{
+	UInt64 ma = NVRAM_SWAR_ONES * (UInt8)a;
+	UInt64 mb = NVRAM_SWAR_ONES * (UInt8)b;
+	UInt64 mc = NVRAM_SWAR_ONES * (UInt8)c;
+	size_t i = 0;
+
+	for (; i + sizeof(UInt64) <= length; i += sizeof(UInt64))
+	{
+		UInt64 word;
+
+		memcpy(&word, &str[i], sizeof(word));
+
+		if (swarHasZero(word ^ ma) | swarHasZero(word ^ mb) | swarHasZero(word ^ mc))
+		{
+			break;
+		}
+	}
+
+	while (i < length && str[i] != a && str[i] != b && str[i] != c)
+	{
+		i++;
+	}
+
+	return i;
+}
+
+//==============================================================================
+// 32-bit FNV-1a.
+
+static inline UInt32 nvram_hash(const char* str, size_t length)
+{
+	UInt32 hash = 0x811C9DC5;
+
+	while (length--)
+	{
+		hash = (hash ^ (UInt8)*str++) * 0x01000193;
+	}
+
+	return hash;
+}
+
+//==============================================================================
+
+static inline bool outputFlush(NVRAMOutput* out, const void* bytes, size_t length)
+{
+	if (!out->error && length)
+	{
+		if (out->vp)
+		{
+			out->error = fileWrite(out->vp, out->ctx, bytes, length, out->offset);
+		}
+
+		out->crc = nvram_crc32(out->crc, bytes, length);
+		out->offset += length;
+	}
+
+	return !out->error;
+}
+
+//==============================================================================
+
+static inline bool outputBytes(NVRAMOutput* out, const void* bytes, size_t length)
+{
+	const char* src = (const char*)bytes;
+
+	if (out->data)
+	{
+		return out->data->appendBytes(bytes, (unsigned int)length);
+	}
+
+	// Only counting, nothing to buffer.
+	if (!out->vp)
+	{
+		return outputFlush(out, bytes, length);
+	}
+
+	while (length && !out->error)
+	{
+		// Nothing buffered and at least a chunk to write, skip the copy.
+		if (!out->used && length >= out->size)
+		{
+			return outputFlush(out, src, length);
+		}
+
+		size_t count = MIN(length, out->size - out->used);
+
+		memcpy(out->buffer + out->used, src, count);
+		out->used += count;
+		src += count;
+		length -= count;
+
+		if (out->used == out->size)
+		{
+			outputFlush(out, out->buffer, out->used);
+			out->used = 0;
+		}
+	}
+
+	return !out->error;
+}
+
+//==============================================================================
+// Namespaces the bootloader reads, their variables have to be in nvram.plist
+// itself: plain keys, Apple's, Apple's system namespace and the EFI globals.
+
+static inline bool bootNamespace(const char* guid, size_t length)
+{
+	return !length ||
+		   (length == strlen(APPLE_NVRAM_GUID) && !strncmp(guid, APPLE_NVRAM_GUID, length)) ||
+		   (length == strlen(APPLE_SYSTEM_NVRAM_GUID) && !strncmp(guid, APPLE_SYSTEM_NVRAM_GUID, length)) ||
+		   (length == strlen(EFI_GLOBAL_GUID) && !strncmp(guid, EFI_GLOBAL_GUID, length));
+}
+
+static inline bool bootVariable(const char* key)
+{
+	const char* separator = strstr(key, NVRAM_SEPERATOR);
+
+	return !separator || bootNamespace(key, separator - key);
+}
+
+//==============================================================================
+// Bytes written to the stream so far.
+
+static inline uint64_t outputOffset(const NVRAMOutput* out)
+{
+	return out->data ? out->data->getLength() : (uint64_t)(out->offset - out->start + out->used);
+}
+
+//==============================================================================
+// Settings arrive either as raw data (nvram GUID:key=%fa%00) or as text (nvram GUID:key=250).
+
+static inline bool settingValue(const OSObject* value, UInt32* result)
+{
+	OSNumber* number = OSDynamicCast(OSNumber, value);
+
+	if (number)
+	{
+		*result = number->unsigned32BitValue();
+		return true;
+	}
+
+	const UInt8* bytes = NULL;
+	unsigned int length = 0;
+	OSString* string = OSDynamicCast(OSString, value);
+	OSData* data = OSDynamicCast(OSData, value);
+
+	if (string)
+	{
+		bytes = (const UInt8*)string->getCStringNoCopy();
+		length = string->getLength();
+	}
+	else if (data)
+	{
+		bytes = (const UInt8*)data->getBytesNoCopy();
+		length = data->getLength();
+	}
+
+	if (!bytes || !length)
+	{
+		return false;
+	}
+
+	bool decimal = true;
+
+	for (unsigned int i = 0; i < length; i++)
+	{
+		if ((bytes[i] < '0' || bytes[i] > '9') && !(bytes[i] == 0 && i == length - 1))
+		{
+			decimal = false;
+			break;
+		}
+	}
+
+	*result = 0;
+
+	if (decimal)
+	{
+		for (unsigned int i = 0; i < length && bytes[i]; i++)
+		{
+			*result = (*result * 10) + (bytes[i] - '0');
+		}
+	}
+	else
+	{
+		// Little endian, like the first byte of EnableLogging.
+		for (unsigned int i = 0; i < length && i < sizeof(UInt32); i++)
+		{
+			*result |= ((UInt32)bytes[i] << (i * 8));
+		}
+	}
+
+	return true;
+}
+
+//==============================================================================
+// How long a pending change waits before it is written out, 0 for right away:
+// each change restarts the quiet window (delay), but never past the deadline.
+
+static inline UInt32 syncWait(uint64_t elapsed, UInt32 delay, UInt32 deadline)
+{
+	if (!delay || elapsed >= deadline)
+	{
+		return 0;
+	}
+
+	return (UInt32)MIN((uint64_t)delay, deadline - elapsed);
+}
+
+static void traceEnable(bool enable);	// Trace.cpp
+static inline void statsReset(NVRAMStats* stats);	// Stats.cpp
+
 //==============================================================================
 
 static inline void handleSetting(const OSObject* object, const OSObject* value, FileNVRAM* entry)
@@ -69,6 +359,136 @@ static inline void handleSetting(const OSObject* object, const OSObject* value,
 			LOG(INFO, "Setting logging to level %d.\n", mLoggingLevel);
 		}
 	}
+	else if (key->isEqualTo(NVRAM_JOURNAL_MODE))
+	{
+		UInt32 mode;
+
+		if (settingValue(value, &mode) && (mode != 0) != entry->mJournalMode)
+		{
+			// Either way the next sync has to write a full snapshot.
+			entry->mJournalMode = (mode != 0);
+			entry->mJournalSize = 0;
+
+			LOG(INFO, "Setting journal mode to %d.\n", entry->mJournalMode);
+		}
+	}
+	else if (key->isEqualTo(NVRAM_JOURNAL_LIMIT))
+	{
+		UInt32 limit;
+
+		if (settingValue(value, &limit))
+		{
+			entry->mJournalLimit = limit;
+
+			LOG(INFO, "Setting journal limit to %u bytes.\n", limit);
+		}
+	}
+	else if (key->isEqualTo(NVRAM_JOURNAL_GENERATION))
+	{
+		settingValue(value, &entry->mJournalGeneration);
+	}
+	else if (key->isEqualTo(NVRAM_SHARD_MODE))
+	{
+		UInt32 mode;
+
+		if (settingValue(value, &mode) && (mode != 0) != entry->mShardMode)
+		{
+			entry->mShardMode = (mode != 0);
+			entry->mShardsStale = entry->mShardMode;
+
+			LOG(INFO, "Setting shard mode to %d.\n", entry->mShardMode);
+		}
+	}
+	else if (key->isEqualTo(NVRAM_SHARDS))
+	{
+		// Kept up to date by doSync(), nothing to apply.
+	}
+	else if (key->isEqualTo(NVRAM_BLOB_THRESHOLD))
+	{
+		UInt32 threshold;
+
+		if (settingValue(value, &threshold))
+		{
+			// Namespaces pick it up as they are serialized again.
+			entry->mBlobThreshold = threshold;
+
+			LOG(INFO, "Setting blob threshold to %u bytes.\n", threshold);
+		}
+	}
+	else if (key->isEqualTo(NVRAM_FILE_FORMAT))
+	{
+		UInt32 format;
+
+		if (settingValue(value, &format) && format <= kNVRAMFormatBinary)
+		{
+			entry->mFileFormat = (UInt8)format;
+
+			LOG(INFO, "Setting file format to %s.\n", format ? "binary" : "XML");
+		}
+	}
+	else if (key->isEqualTo(NVRAM_SYNC_DELAY))
+	{
+		UInt32 delay;
+
+		if (settingValue(value, &delay))
+		{
+			entry->mSyncDelay = delay;
+
+			LOG(INFO, "Setting sync delay to %u ms.\n", delay);
+		}
+	}
+	else if (key->isEqualTo(NVRAM_SYNC_DEADLINE))
+	{
+		UInt32 deadline;
+
+		if (settingValue(value, &deadline))
+		{
+			entry->mSyncDeadline = deadline;
+
+			LOG(INFO, "Setting sync deadline to %u ms.\n", deadline);
+		}
+	}
+	else if (key->isEqualTo(NVRAM_SLEEP_BUDGET))
+	{
+		UInt32 budget;
+
+		if (settingValue(value, &budget))
+		{
+			entry->mSleepBudget = budget;
+
+			LOG(INFO, "Setting sleep budget to %u ms.\n", budget);
+		}
+	}
+	else if (key->isEqualTo(NVRAM_IMMEDIATE_KEYS))
+	{
+		entry->setPersistence(kNVRAMPersistImmediate, value);
+
+		LOG(INFO, "Setting immediate keys.\n");
+	}
+	else if (key->isEqualTo(NVRAM_VOLATILE_KEYS))
+	{
+		entry->setPersistence(kNVRAMPersistVolatile, value);
+
+		LOG(INFO, "Setting volatile keys.\n");
+	}
+	else if (key->isEqualTo(NVRAM_STATS))
+	{
+		// Any write resets the counters.
+		statsReset(entry->mStats);
+
+		LOG(INFO, "Statistics reset.\n");
+	}
+	else if (key->isEqualTo(NVRAM_TRACE))
+	{
+		UInt32 trace;
+
+		if (settingValue(value, &trace))
+		{
+			traceEnable(trace != 0);
+
+			LOG(INFO, "Setting tracing to %d.\n", trace != 0);
+		}
+	}
 	else
 	{
 		LOG(NOTICE, "Unknown key\n");
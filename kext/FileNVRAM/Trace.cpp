@@ -0,0 +1,240 @@
+/***
+ * Trace.cpp
+ * FileNVRAM
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Binary event trace. Writers claim a slot in their CPU's ring with one atomic
+ * increment and never block; the oldest records are overwritten when a ring is
+ * full. The rings are drained with: sysctl -b debug.filenvram_trace > trace.bin
+ */
+
+#include "FileNVRAM.h"
+#include <sys/sysctl.h>
+
+#define NVRAM_TRACE_RINGS		8		// Power of two, CPUs beyond this share rings.
+#define NVRAM_TRACE_RECORDS		256		// Power of two.
+
+typedef struct
+{
+	volatile SInt32		head;			// Slots claimed so far.
+	UInt32				tail;			// Slots drained so far, only touched under sTraceLock.
+	NVRAMTraceRecord	records[NVRAM_TRACE_RECORDS];
+} NVRAMTraceRing;
+
+static NVRAMTraceRing*	sTraceRings;	// Allocated the first time tracing is enabled, freed in traceStop().
+static bool				sTraceEnabled;
+static IOLock*			sTraceLock;		// One drainer at a time.
+static volatile SInt32	sTraceUsers;	// Writers and drainers that may still touch sTraceRings.
+
+//==============================================================================
+
+static void traceEvent(UInt16 event, const char* key, UInt32 length)
+{
+	if (!sTraceEnabled)
+	{
+		return;
+	}
+
+	// Counted before sTraceRings is read, traceStop() waits for us before freeing it.
+	OSIncrementAtomic(&sTraceUsers);
+
+	NVRAMTraceRing* ring = sTraceRings;
+
+	if (!sTraceEnabled || !ring)
+	{
+		OSDecrementAtomic(&sTraceUsers);
+		return;
+	}
+
+	ring += cpu_number() & (NVRAM_TRACE_RINGS - 1);
+
+	// We may be preempted or migrate after this, the slot is still ours alone.
+	UInt32 slot = (UInt32)OSIncrementAtomic(&ring->head);
+	NVRAMTraceRecord* record = &ring->records[slot & (NVRAM_TRACE_RECORDS - 1)];
+
+	// A zero sequence tells the reader the record is being rewritten.
+	record->sequence = 0;
+	OSMemoryBarrier();
+
+	record->timestamp	= mach_absolute_time();
+	record->event		= event;
+	record->cpu			= (UInt16)cpu_number();
+	record->keyHash		= key ? nvram_hash(key, strlen(key)) : 0;
+	record->length		= length;
+	record->pid			= proc_selfpid();
+
+	OSMemoryBarrier();
+	record->sequence = slot + 1;
+
+	OSDecrementAtomic(&sTraceUsers);
+}
+
+//==============================================================================
+
+static inline UInt32 traceLength(const OSObject* value)
+{
+	OSData*		data;
+	OSString*	string;
+	OSNumber*	number;
+
+	if ((data = OSDynamicCast(OSData, value)))
+	{
+		return data->getLength();
+	}
+
+	if ((string = OSDynamicCast(OSString, value)))
+	{
+		return string->getLength();
+	}
+
+	if ((number = OSDynamicCast(OSNumber, value)))
+	{
+		return number->numberOfBytes();
+	}
+
+	return 0;
+}
+
+//==============================================================================
+
+static void traceEnable(bool enable)
+{
+	if (enable && !sTraceRings)
+	{
+		NVRAMTraceRing* rings = (NVRAMTraceRing*)IOMalloc(NVRAM_TRACE_RINGS * sizeof(NVRAMTraceRing));
+
+		if (!rings)
+		{
+			return;
+		}
+
+		bzero(rings, NVRAM_TRACE_RINGS * sizeof(NVRAMTraceRing));
+
+		if (!OSCompareAndSwapPtr(NULL, rings, (void * volatile *)&sTraceRings))
+		{
+			IOFree(rings, NVRAM_TRACE_RINGS * sizeof(NVRAMTraceRing));
+		}
+	}
+
+	sTraceEnabled = enable;
+}
+
+//==============================================================================
+// Copies out every complete record not drained before, ring by ring.
+
+static int traceSysctl(struct sysctl_oid* oidp, void* arg1, int arg2, struct sysctl_req* req)
+{
+	OSIncrementAtomic(&sTraceUsers);
+
+	NVRAMTraceRing* rings = sTraceRings;
+	IOLock* lock = sTraceLock;
+	int error = 0;
+
+	if (!rings || !lock)
+	{
+		OSDecrementAtomic(&sTraceUsers);
+		return 0;
+	}
+
+	if (req->oldptr == USER_ADDR_NULL)
+	{
+		// Size query.
+		OSDecrementAtomic(&sTraceUsers);
+		return SYSCTL_OUT(req, NULL, NVRAM_TRACE_RINGS * NVRAM_TRACE_RECORDS * sizeof(NVRAMTraceRecord));
+	}
+
+	IOLockLock(lock);
+
+	for (int i = 0; !error && i < NVRAM_TRACE_RINGS; i++)
+	{
+		NVRAMTraceRing* ring = &rings[i];
+		UInt32 head = (UInt32)ring->head;
+		UInt32 slot = ring->tail;
+
+		// Skip what was overwritten since the last drain.
+		if (head - slot > NVRAM_TRACE_RECORDS)
+		{
+			slot = head - NVRAM_TRACE_RECORDS;
+		}
+
+		for (; !error && slot != head; slot++)
+		{
+			NVRAMTraceRecord* live = &ring->records[slot & (NVRAM_TRACE_RECORDS - 1)];
+			NVRAMTraceRecord record;
+
+			record = *live;
+			OSMemoryBarrier();
+
+			// Still being written, or already reused by a newer event.
+			if (record.sequence != slot + 1 || live->sequence != slot + 1)
+			{
+				continue;
+			}
+
+			error = SYSCTL_OUT(req, &record, sizeof(record));
+		}
+
+		// Stopped early (buffer full): the rest is picked up by the next drain.
+		ring->tail = error ? slot - 1 : slot;
+	}
+
+	IOLockUnlock(lock);
+	OSDecrementAtomic(&sTraceUsers);
+
+	return error;
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, filenvram_trace, CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED, NULL, 0, traceSysctl, "S", "FileNVRAM trace records");
+
+//==============================================================================
+
+static void traceStart(void)
+{
+	sTraceLock = IOLockAlloc();
+
+	if (sTraceLock)
+	{
+		sysctl_register_oid(&sysctl__debug_filenvram_trace);
+	}
+}
+
+//==============================================================================
+// Nothing new can reach the rings once they are unpublished, then we wait for
+// writers and drainers that got hold of them before that.
+
+static void traceStop(void)
+{
+	IOLock* lock = sTraceLock;
+	NVRAMTraceRing* rings = sTraceRings;
+
+	sTraceEnabled = false;
+
+	if (lock)
+	{
+		sysctl_unregister_oid(&sysctl__debug_filenvram_trace);
+	}
+
+	sTraceLock = NULL;
+	sTraceRings = NULL;
+	OSMemoryBarrier();
+
+	while (sTraceUsers)
+	{
+		IOSleep(1);
+	}
+
+	if (lock)
+	{
+		IOLockFree(lock);
+	}
+
+	if (rings)
+	{
+		IOFree(rings, NVRAM_TRACE_RINGS * sizeof(NVRAMTraceRing));
+	}
+}
@@ -0,0 +1,378 @@
+/***
+ * BinaryPlistTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * bplist00 round trips, streamed and in memory, cut short and corrupted input,
+ * and how it compares to XML. Leaves BinaryPlistTests.bplist and .xml behind for
+ * ComparePlists.py, which checks another reader agrees with ours.
+ */
+
+#include "Host.h"
+#include "FileIO.cpp"
+#include "Support.cpp"
+#include "Serializer.cpp"
+#include "BinaryPlist.cpp"
+#include "Loader.cpp"
+#include "Stats.cpp"
+
+//==============================================================================
+
+static bool sameObject(const OSObject* a, const OSObject* b)
+{
+	const OSDictionary* dictionary = OSDynamicCast(OSDictionary, a);
+	const OSArray* array = OSDynamicCast(OSArray, a);
+
+	if (dictionary)
+	{
+		const OSDictionary* other = OSDynamicCast(OSDictionary, b);
+
+		if (!other || other->getCount() != dictionary->getCount())
+		{
+			return false;
+		}
+
+		for (unsigned int i = 0; i < dictionary->getCount(); i++)
+		{
+			const OSSymbol* key = dictionary->keyAt(i);
+
+			if (!sameObject(dictionary->getObject(key), other->getObject(key)))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	if (array)
+	{
+		const OSArray* other = OSDynamicCast(OSArray, b);
+
+		if (!other || other->getCount() != array->getCount())
+		{
+			return false;
+		}
+
+		for (unsigned int i = 0; i < array->getCount(); i++)
+		{
+			if (!sameObject(array->getObject(i), other->getObject(i)))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	return a && b && a->isEqualTo(b);
+}
+
+//==============================================================================
+
+static void set(OSDictionary* dictionary, const char* key, OSObject* value)
+{
+	dictionary->setObject(key, value);
+	value->release();
+}
+
+static void add(OSArray* array, OSObject* value)
+{
+	array->setObject(value);
+	value->release();
+}
+
+static OSDictionary* makeRoot(int variables)
+{
+	OSDictionary* root = OSDictionary::withCapacity(4);
+	OSDictionary* apple = OSDictionary::withCapacity(variables);
+	OSDictionary* empty = OSDictionary::withCapacity(0);
+	OSArray* array = OSArray::withCapacity(3);
+	UInt8 bytes[70000];
+
+	for (size_t i = 0; i < sizeof(bytes); i++)
+	{
+		bytes[i] = (UInt8)(i * 31 + (i >> 8));
+	}
+
+	set(apple, "boot-args", OSString::withCString("-v debug=0x100 <&> \"quoted\""));
+	set(apple, "unicode", OSString::withCString("caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80"));
+	set(apple, "empty-string", OSString::withCString(""));
+	set(apple, "empty-data", OSData::withCapacity(0));
+	set(apple, "small-data", OSData::withBytes(bytes, 3));
+	set(apple, "large-data", OSData::withBytes(bytes, sizeof(bytes)));
+	set(apple, "n8", OSNumber::withNumber(0x7F, 8));
+	set(apple, "n16", OSNumber::withNumber(0x1234, 16));
+	set(apple, "n32", OSNumber::withNumber(0x89ABCDEF, 32));
+	set(apple, "n64", OSNumber::withNumber(0x123456789ABCDEFULL, 64));
+	apple->setObject("yes", kOSBooleanTrue);
+	apple->setObject("no", kOSBooleanFalse);
+
+	add(array, OSNumber::withNumber(5, 32));
+	array->setObject(kOSBooleanTrue);
+	add(array, OSString::withCString("x"));
+	apple->setObject("array", array);
+	array->release();
+
+	for (int i = 0; i < variables; i++)
+	{
+		char key[32];
+		char value[64];
+
+		snprintf(key, sizeof(key), "var%d", i);
+		snprintf(value, sizeof(value), "value of variable %d", i);
+		set(apple, key, (i & 1) ? (OSObject *)OSString::withCString(value) : (OSObject *)OSData::withBytes(value, (unsigned int)strlen(value)));
+	}
+
+	root->setObject("7C436110-AB2A-4BBB-A880-FE41995C9F82", apple);
+	root->setObject("EMPTY-GUID", empty);
+	set(root, "plain", OSString::withCString("top level"));
+	apple->release();
+	empty->release();
+
+	return root;
+}
+
+//==============================================================================
+
+static OSData* serialize(const OSDictionary* root, bool binary)
+{
+	OSData* data = OSData::withCapacity(4096);
+	NVRAMOutput out;
+
+	bzero(&out, sizeof(out));
+	out.data = data;
+
+	CHECK(binary ? serializeBinaryPlist(&out, root) : serializeObject(&out, root, 0));
+
+	return data;
+}
+
+static void writeFile(const char* path, const OSData* data)
+{
+	FILE* file = fopen(path, "wb");
+
+	CHECK(file);
+	CHECK(fwrite(data->getBytesNoCopy(), 1, data->getLength(), file) == data->getLength());
+	fclose(file);
+}
+
+//==============================================================================
+
+static void testRoundTrip(void)
+{
+	OSDictionary* root = makeRoot(100);
+	OSData* data = serialize(root, true);
+	const char* bytes = (const char *)data->getBytesNoCopy();
+
+	CHECK(isBinaryPlist(bytes, data->getLength()));
+
+	OSDictionary* back = unserializeBinaryPlist(bytes, data->getLength());
+
+	CHECK(back);
+	CHECK(sameObject(root, back));
+
+	// Written again it comes out the same.
+	OSData* again = serialize(back, true);
+
+	CHECK(again->isEqualTo(data));
+
+	writeFile("BinaryPlistTests.bplist", data);
+
+	OSData* xml = OSData::withCapacity(4096);
+
+	xml->appendBytes(NVRAM_FILE_HEADER, strlen(NVRAM_FILE_HEADER));
+	OSData* body = serialize(root, false);
+	xml->appendBytes(body);
+	xml->appendBytes(NVRAM_FILE_FOOTER, strlen(NVRAM_FILE_FOOTER));
+	writeFile("BinaryPlistTests.xml", xml);
+
+	again->release();
+	back->release();
+	body->release();
+	xml->release();
+	data->release();
+	root->release();
+}
+
+//==============================================================================
+// Streamed through a buffer smaller than most objects, to a file.
+
+static void testStreamed(void)
+{
+	OSDictionary* root = makeRoot(100);
+	OSData* data = serialize(root, true);
+	size_t sizes[] = { 1, 7, 16, 4096 };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		char buffer[4096];
+		NVRAMOutput out;
+		vnode_t vp;
+
+		hostFiles.clear();
+		CHECK(fileOpen("/stream.bplist", O_CREAT | FWRITE, &vp, NULL, NULL) == 0);
+
+		bzero(&out, sizeof(out));
+		out.vp = vp;
+		out.buffer = buffer;
+		out.size = sizes[i];
+
+		CHECK(serializeBinaryPlist(&out, root));
+		CHECK(!out.used || outputFlush(&out, out.buffer, out.used));
+		CHECK(out.crc == nvram_crc32(0, data->getBytesNoCopy(), data->getLength()));
+		fileClose(vp, true, NULL);
+
+		const std::string& file = hostFiles["/stream.bplist"];
+
+		CHECK(data->isEqualTo(file.data(), (unsigned int)file.size()));
+	}
+
+	data->release();
+	root->release();
+}
+
+//==============================================================================
+// Every truncation, and single byte changes, must fail cleanly (or still parse).
+
+static void testDamaged(void)
+{
+	OSDictionary* root = makeRoot(20);
+	OSData* data = serialize(root, true);
+	std::string bytes((const char *)data->getBytesNoCopy(), data->getLength());
+	unsigned int seed = 1;
+	int rejected = 0;
+
+	for (size_t length = 0; length < bytes.size(); length += (length < 256 || bytes.size() - length < 256) ? 1 : 97)
+	{
+		std::string cut = bytes.substr(0, length);
+		OSDictionary* back = unserializeBinaryPlist(cut.data(), cut.size());
+
+		CHECK(!back);
+	}
+
+	for (int i = 0; i < 20000; i++)
+	{
+		std::string changed = bytes;
+		size_t offset = rand_r(&seed) % changed.size();
+
+		// Mostly the offset table and trailer, where it matters most.
+		if (i & 1)
+		{
+			offset = changed.size() - 1 - (offset % 64);
+		}
+
+		changed[offset] = (char)rand_r(&seed);
+
+		OSDictionary* back = unserializeBinaryPlist(changed.data(), changed.size());
+
+		rejected += !back;
+		OSSafeReleaseNULL(back);
+	}
+
+	printf("  damaged: %d of 20000 rejected\n", rejected);
+
+	data->release();
+	root->release();
+}
+
+//==============================================================================
+// A flat dict read with the loader's primitives, for timing against bplist.
+
+static OSDictionary* readXML(const OSData* xml)
+{
+	OSDictionary* dictionary = OSDictionary::withCapacity(16);
+	NVRAMInput in;
+	NVRAMTag tag;
+
+	bzero(&in, sizeof(in));
+	in.buffer = (char *)xml->getBytesNoCopy();
+	in.size = in.end = xml->getLength();
+
+	CHECK(readTag(&in, &tag) && strcmp(tag.name, "dict") == 0);
+
+	while (readTag(&in, &tag) && !tag.closing)
+	{
+		char key[NVRAM_NAME_MAX];
+
+		CHECK(strcmp(tag.name, "key") == 0 && readText(&in, key, sizeof(key), NULL) && expectClose(&in, "key"));
+		CHECK(readTag(&in, &tag));
+
+		OSObject* value = readValue(&in, &tag);
+
+		CHECK(value);
+		dictionary->setObject(key, value);
+		value->release();
+	}
+
+	return dictionary;
+}
+
+static void testSpeed(void)
+{
+	OSDictionary* root = OSDictionary::withCapacity(1);
+	OSDictionary* flat = makeRoot(2000);
+
+	// Only leaf values, the flat readXML() doesn't do collections.
+	flat = (OSDictionary *)flat->getObject("7C436110-AB2A-4BBB-A880-FE41995C9F82");
+	flat->retain();
+	flat->removeObject("array");
+	root->setObject("GUID", flat);
+
+	const int rounds = 20;
+	uint64_t xmlWrite = 0, xmlRead = 0, binaryWrite = 0, binaryRead = 0;
+	unsigned int xmlSize = 0, binarySize = 0;
+
+	for (int i = 0; i < rounds; i++)
+	{
+		uint64_t start = hostNanoseconds();
+		OSData* xml = serialize(flat, false);
+		uint64_t middle = hostNanoseconds();
+
+		OSDictionary* read = readXML(xml);
+
+		CHECK(sameObject(flat, read));
+		read->release();
+		xmlWrite += middle - start;
+		xmlRead += hostNanoseconds() - middle;
+		xmlSize = xml->getLength();
+		xml->release();
+
+		start = hostNanoseconds();
+		OSData* binary = serialize(root, true);
+		middle = hostNanoseconds();
+		OSDictionary* back = unserializeBinaryPlist((const char *)binary->getBytesNoCopy(), binary->getLength());
+
+		binaryWrite += middle - start;
+		binaryRead += hostNanoseconds() - middle;
+		binarySize = binary->getLength();
+		CHECK(back && sameObject(root, back));
+		back->release();
+		binary->release();
+	}
+
+	printf("  %u variables: xml %u bytes, write %llu us, read %llu us\n", flat->getCount(), xmlSize,
+		   (unsigned long long)(xmlWrite / rounds / 1000), (unsigned long long)(xmlRead / rounds / 1000));
+	printf("  %u variables: bplist %u bytes, write %llu us, read %llu us\n", flat->getCount(), binarySize,
+		   (unsigned long long)(binaryWrite / rounds / 1000), (unsigned long long)(binaryRead / rounds / 1000));
+
+	flat->release();
+	root->release();
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testRoundTrip();
+	testStreamed();
+	testDamaged();
+	testSpeed();
+
+	return 0;
+}
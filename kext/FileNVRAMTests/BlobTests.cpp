@@ -0,0 +1,190 @@
+/***
+ * BlobTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * BlobThreshold: which values get a blob file, that they come back after a
+ * restart, and that blobs nothing refers to any more are removed once the
+ * snapshots without them are on disk.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#define VENDOR_GUID		"4D1FDA02-38C7-4A6A-9CC6-4BCCA8B30102"
+#define VENDOR_KEY		VENDOR_GUID NVRAM_SEPERATOR "large"
+#define APPLE_KEY		APPLE_NVRAM_GUID NVRAM_SEPERATOR "large"
+
+static int blobCount(void)
+{
+	std::string prefix = std::string(FILE_NVRAM_BLOB_FORMAT).substr(0, strlen(FILE_NVRAM_BLOB_FORMAT) - 2);
+	int count = 0;
+
+	for (std::map<std::string, std::string>::iterator i = hostFiles.begin(); i != hostFiles.end(); ++i)
+	{
+		count += (i->first.compare(0, prefix.size(), prefix) == 0);
+	}
+
+	return count;
+}
+
+static bool hasBlob(const std::string& contents)
+{
+	char hash[NVRAM_BLOB_HASH_LENGTH + 1];
+	char path[NVRAM_BLOB_PATH_MAX];
+
+	blobHash(contents.data(), contents.size(), hash);
+	blobPath(path, sizeof(path), hash);
+
+	return hostFiles.count(path) && hostFiles[path] == contents;
+}
+
+static bool hasData(FileNVRAM* nvram, const char* key, const std::string& contents)
+{
+	OSData* data = OSDynamicCast(OSData, nvram->getProperty(key));
+
+	return data && data->getLength() == contents.size() && memcmp(data->getBytesNoCopy(), contents.data(), contents.size()) == 0;
+}
+
+static void setLarge(FileNVRAM* nvram, const char* key, const std::string& contents)
+{
+	setData(nvram, key, contents.data(), (unsigned int)contents.size());
+}
+
+static FileNVRAM* startBlobs(int format)
+{
+	FileNVRAM* nvram = startNVRAM();
+
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_FILE_FORMAT, format);
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_BLOB_THRESHOLD, 64);
+
+	return nvram;
+}
+
+//==============================================================================
+// Only values outside the namespaces the bootloader reads become blobs.
+
+static void testInline(int format)
+{
+	FileNVRAM* nvram = startBlobs(format);
+	std::string vendor(200, 'v'), apple(200, 'a'), plain(200, 'p');
+
+	setLarge(nvram, VENDOR_KEY, vendor);
+	setLarge(nvram, APPLE_KEY, apple);
+	setLarge(nvram, EFI_GLOBAL_GUID NVRAM_SEPERATOR "large", apple);
+	setLarge(nvram, "large", plain);
+	setLarge(nvram, VENDOR_GUID NVRAM_SEPERATOR "small", std::string(10, 's'));
+	nvram->sync();
+
+	CHECK(blobCount() == 1 && hasBlob(vendor));
+	stopNVRAM(nvram);
+
+	nvram = startNVRAM(false);
+	CHECK(hasData(nvram, VENDOR_KEY, vendor));
+	CHECK(hasData(nvram, APPLE_KEY, apple));
+	CHECK(hasData(nvram, EFI_GLOBAL_GUID NVRAM_SEPERATOR "large", apple));
+	CHECK(hasData(nvram, "large", plain));
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// A blob outlives the snapshot that last referred to it by one serialization of
+// its namespace, then it is removed.
+
+static void testRemove(int format)
+{
+	FileNVRAM* nvram = startBlobs(format);
+	std::string first(200, '1'), second(200, '2'), shared(300, 'S');
+
+	setLarge(nvram, VENDOR_KEY, first);
+	setLarge(nvram, VENDOR_GUID NVRAM_SEPERATOR "shared", shared);
+	nvram->sync();
+	CHECK(blobCount() == 2 && hasBlob(first) && hasBlob(shared));
+
+	setLarge(nvram, VENDOR_KEY, second);
+	nvram->sync();
+	CHECK(blobCount() == 3 && hasBlob(first) && hasBlob(second));
+
+	setNumber(nvram, VENDOR_GUID NVRAM_SEPERATOR "counter", 1);
+	nvram->sync();
+	CHECK(blobCount() == 2 && !hasBlob(first) && hasBlob(second) && hasBlob(shared));
+
+	// The same contents under two names is one blob, it stays while either is set.
+	setLarge(nvram, VENDOR_KEY, shared);
+	setNumber(nvram, VENDOR_GUID NVRAM_SEPERATOR "counter", 2);
+	nvram->sync();
+	setNumber(nvram, VENDOR_GUID NVRAM_SEPERATOR "counter", 3);
+	nvram->sync();
+	CHECK(blobCount() == 1 && hasBlob(shared));
+
+	// A namespace that is gone entirely.
+	const char* keys[] = { VENDOR_KEY, VENDOR_GUID NVRAM_SEPERATOR "shared", VENDOR_GUID NVRAM_SEPERATOR "counter" };
+
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+	{
+		const OSSymbol* key = OSSymbol::withCString(keys[i]);
+
+		nvram->removeProperty(key);
+		key->release();
+	}
+
+	nvram->sync();
+	setString(nvram, "boot-args", "-v");
+	nvram->sync();
+	CHECK(blobCount() == 0);
+
+	// Gone after a restart too, and written again when it comes back.
+	stopNVRAM(nvram);
+	nvram = startNVRAM(false);
+	setLarge(nvram, VENDOR_KEY, shared);
+	nvram->sync();
+	CHECK(blobCount() == 1 && hasBlob(shared));
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// Blobs loaded at start are only removed once the first sync wrote a snapshot
+// without them, a sync that fails removes nothing.
+
+static void testLoaded(void)
+{
+	FileNVRAM* nvram = startBlobs(kNVRAMFormatXML);
+	std::string first(200, '1'), second(200, '2');
+
+	setLarge(nvram, VENDOR_KEY, first);
+	nvram->sync();
+	stopNVRAM(nvram);
+
+	nvram = startNVRAM(false);
+	setLarge(nvram, VENDOR_KEY, second);
+
+	hostWriteBudget = 0;
+	nvram->sync();
+	hostWriteBudget = -1;
+	CHECK(hasBlob(first));
+
+	nvram->sync();
+	setNumber(nvram, VENDOR_GUID NVRAM_SEPERATOR "counter", 1);
+	nvram->sync();
+	CHECK(blobCount() == 1 && hasBlob(second));
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testInline(kNVRAMFormatXML);
+	testInline(kNVRAMFormatBinary);
+	testRemove(kNVRAMFormatXML);
+	testRemove(kNVRAMFormatBinary);
+	testLoaded();
+
+	return 0;
+}
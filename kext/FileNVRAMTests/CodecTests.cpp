@@ -0,0 +1,396 @@
+/***
+ * CodecTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * The word-at-a-time and table-driven helpers against plain byte-by-byte
+ * versions of the same thing: nvram_find, CRC-32, XML escaping and base64.
+ */
+
+#include "Host.h"
+#include "FileIO.cpp"
+#include "Support.cpp"
+#include "Serializer.cpp"
+#include "Loader.cpp"
+#include "Stats.cpp"
+
+//==============================================================================
+
+static size_t naiveFind(const char* str, size_t length, char a, char b, char c)
+{
+	size_t i = 0;
+
+	while (i < length && str[i] != a && str[i] != b && str[i] != c)
+	{
+		i++;
+	}
+
+	return i;
+}
+
+static UInt32 bitwiseCRC32(const void* buffer, size_t length)
+{
+	const UInt8* bytes = (const UInt8*)buffer;
+	UInt32 crc = 0xFFFFFFFF;
+
+	while (length--)
+	{
+		crc ^= *bytes++;
+
+		for (int k = 0; k < 8; k++)
+		{
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+		}
+	}
+
+	return ~crc;
+}
+
+static std::string naiveBase64(const std::string& bytes)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string text;
+	UInt32 bits = 0;
+	int count = 0;
+
+	for (size_t i = 0; i < bytes.size(); i++)
+	{
+		bits = (bits << 8) | (UInt8)bytes[i];
+		count += 8;
+
+		while (count >= 6)
+		{
+			count -= 6;
+			text += chars[(bits >> count) & 0x3F];
+		}
+	}
+
+	if (count)
+	{
+		text += chars[(bits << (6 - count)) & 0x3F];
+	}
+
+	while (text.size() % 4)
+	{
+		text += '=';
+	}
+
+	return text;
+}
+
+//==============================================================================
+
+static std::string randomBytes(unsigned int* seed, size_t length, const char* alphabet)
+{
+	std::string bytes(length, 0);
+
+	for (size_t i = 0; i < length; i++)
+	{
+		bytes[i] = alphabet ? alphabet[rand_r(seed) % strlen(alphabet)] : (char)rand_r(seed);
+	}
+
+	return bytes;
+}
+
+static void outputBegin(NVRAMOutput* out)
+{
+	bzero(out, sizeof(*out));
+	out->data = OSData::withCapacity(64);
+}
+
+static std::string outputEnd(NVRAMOutput* out)
+{
+	std::string text((const char *)out->data->getBytesNoCopy(), out->data->getLength());
+
+	out->data->release();
+
+	return text;
+}
+
+static void input(NVRAMInput* in, std::string& text)
+{
+	bzero(in, sizeof(*in));
+	in->buffer = &text[0];
+	in->size = in->end = text.size();
+}
+
+//==============================================================================
+// Every length and alignment, with matches anywhere or nowhere, and bytes that
+// differ from a target only in the high bit (where a sloppy SWAR test goes wrong).
+
+static void testFind(void)
+{
+	unsigned int seed = 1;
+	char buffer[96];
+
+	for (int round = 0; round < 200000; round++)
+	{
+		size_t length = rand_r(&seed) % 64;
+		size_t offset = rand_r(&seed) % 8;
+		std::string bytes = randomBytes(&seed, length, (round & 1) ? "abc<&>\xbc\xa6\x80\x01" : NULL);
+
+		memcpy(&buffer[offset], bytes.data(), length);
+
+		CHECK(nvram_find(&buffer[offset], length, '<', '&', '>') == naiveFind(&buffer[offset], length, '<', '&', '>'));
+		CHECK(nvram_find(&buffer[offset], length, 'a', 'a', 'a') == naiveFind(&buffer[offset], length, 'a', 'a', 'a'));
+		CHECK(nvram_find(&buffer[offset], length, '\0', ' ', ',') == naiveFind(&buffer[offset], length, '\0', ' ', ','));
+	}
+}
+
+//==============================================================================
+
+static void testCRC32(void)
+{
+	unsigned int seed = 2;
+
+	CHECK(nvram_crc32(0, "123456789", 9) == 0xCBF43926);
+	CHECK(nvram_crc32(0, "", 0) == 0);
+
+	for (int round = 0; round < 2000; round++)
+	{
+		std::string bytes = randomBytes(&seed, rand_r(&seed) % 300, NULL);
+		size_t split = bytes.size() ? rand_r(&seed) % bytes.size() : 0;
+
+		// Continued over two calls, as the streamed writers do.
+		CHECK(nvram_crc32(0, bytes.data(), bytes.size()) == bitwiseCRC32(bytes.data(), bytes.size()));
+		CHECK(nvram_crc32(nvram_crc32(0, bytes.data(), split), &bytes[split], bytes.size() - split) == bitwiseCRC32(bytes.data(), bytes.size()));
+	}
+}
+
+//==============================================================================
+
+static void testEscaped(void)
+{
+	unsigned int seed = 3;
+
+	for (int round = 0; round < 20000; round++)
+	{
+		std::string str = randomBytes(&seed, rand_r(&seed) % 200, (round & 1) ? "ab <&>\"'\xc3\xa9" : "abcdefgh&");
+		std::string expected;
+
+		for (size_t i = 0; i < str.size(); i++)
+		{
+			expected += (str[i] == '&') ? "&amp;" : (str[i] == '<') ? "&lt;" : (str[i] == '>') ? "&gt;" : std::string(1, str[i]);
+		}
+
+		NVRAMOutput out;
+
+		outputBegin(&out);
+		CHECK(appendEscaped(&out, str.data(), str.size()));
+
+		std::string text = outputEnd(&out);
+
+		CHECK(text == expected);
+
+		// And back, through the loader.
+		NVRAMInput in;
+
+		text += "</string>";
+		input(&in, text);
+
+		OSString* string = readString(&in);
+
+		CHECK(string && str == string->getCStringNoCopy());
+		CHECK(expectClose(&in, "string"));
+		string->release();
+	}
+}
+
+//==============================================================================
+
+static void testBase64(void)
+{
+	unsigned int seed = 4;
+
+	for (int round = 0; round < 20000; round++)
+	{
+		std::string bytes = randomBytes(&seed, rand_r(&seed) % 400, NULL);
+		NVRAMOutput out;
+
+		outputBegin(&out);
+		CHECK(appendBase64(&out, (const UInt8 *)bytes.data(), bytes.size()));
+
+		std::string text = outputEnd(&out);
+
+		CHECK(text == naiveBase64(bytes));
+
+		// Broken into lines and indented, the way other writers wrap it.
+		if (round & 1)
+		{
+			for (size_t i = rand_r(&seed) % 80; i < text.size(); i += 1 + rand_r(&seed) % 80)
+			{
+				text.insert(i, "\n\t");
+			}
+		}
+
+		NVRAMInput in;
+
+		text += "</data>";
+		input(&in, text);
+
+		OSData* data = readData(&in);
+
+		CHECK(data && data->isEqualTo(bytes.data(), (unsigned int)bytes.size()));
+		CHECK(expectClose(&in, "data"));
+		data->release();
+	}
+
+	// Not base64.
+	std::string bad = "QUJD*</data>";
+	NVRAMInput in;
+
+	input(&in, bad);
+	CHECK(!readData(&in));
+}
+
+//==============================================================================
+// readData() decodes whole groups straight from the input buffer, and falls back
+// to a character at a time for anything else. A space after every character keeps
+// it on the slow path all the way, both have to agree on any input, good or bad.
+
+static OSData* slowData(const std::string& text)
+{
+	std::string spaced;
+	NVRAMInput in;
+
+	for (size_t i = 0; i < text.size() && text[i] != '<'; i++)
+	{
+		spaced += text[i];
+		spaced += ' ';
+	}
+
+	spaced += "</data>";
+	input(&in, spaced);
+
+	return readData(&in);
+}
+
+static void testBase64Paths(void)
+{
+	unsigned int seed = 5;
+	int decoded = 0;
+
+	for (int round = 0; round < 100000; round++)
+	{
+		std::string text;
+
+		if (round & 1)
+		{
+			// Mostly base64, with padding, whitespace and junk anywhere.
+			text = randomBytes(&seed, rand_r(&seed) % 40, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/==  \n*-");
+		}
+		else
+		{
+			std::string bytes = randomBytes(&seed, rand_r(&seed) % 200, NULL);
+
+			text = naiveBase64(bytes);
+			text = text.substr(0, text.size() - rand_r(&seed) % 3);
+		}
+
+		std::string fast = text + "</data>";
+		NVRAMInput in;
+
+		input(&in, fast);
+
+		OSData* data = readData(&in);
+		OSData* slow = slowData(text);
+
+		CHECK(!data == !slow);
+		CHECK(!data || data->isEqualTo(slow));
+
+		decoded += (data != NULL);
+
+		OSSafeReleaseNULL(data);
+		OSSafeReleaseNULL(slow);
+	}
+
+	CHECK(decoded > 10000);
+}
+
+//==============================================================================
+
+static void testSpeed(void)
+{
+	std::string text(1 << 20, 'x');
+	size_t found = 0;
+	uint64_t start, middle;
+
+	text[text.size() - 1] = '<';
+
+	start = hostNanoseconds();
+
+	for (int i = 0; i < 20; i++)
+	{
+		found += nvram_find(text.data(), text.size(), '<', '&', '>');
+	}
+
+	middle = hostNanoseconds();
+
+	for (int i = 0; i < 20; i++)
+	{
+		found += naiveFind(text.data(), text.size(), '<', '&', '>');
+	}
+
+	CHECK(found == 40 * (text.size() - 1));
+
+	printf("  find in 1 MB: %llu us, byte by byte %llu us\n", (unsigned long long)((middle - start) / 20000),
+		   (unsigned long long)((hostNanoseconds() - middle) / 20000));
+
+	// 1 MB of data as one line, wrapped the way other writers do, and a character
+	// at a time (the slow path only).
+	unsigned int seed = 6;
+	std::string bytes = randomBytes(&seed, 1 << 20, NULL);
+	std::string encoded = naiveBase64(bytes);
+	std::string texts[3] = { encoded, "", "" };
+	uint64_t us[3];
+
+	for (size_t i = 0; i < encoded.size(); i++)
+	{
+		texts[1] += encoded[i];
+		texts[2] += encoded[i];
+		texts[1] += (i % 76 == 75) ? "\n\t" : "";
+		texts[2] += ' ';
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		NVRAMInput in;
+
+		texts[i] += "</data>";
+		start = hostNanoseconds();
+
+		for (int round = 0; round < 5; round++)
+		{
+			input(&in, texts[i]);
+
+			OSData* data = readData(&in);
+
+			CHECK(data && data->isEqualTo(bytes.data(), (unsigned int)bytes.size()));
+			data->release();
+		}
+
+		us[i] = (hostNanoseconds() - start) / 5000;
+	}
+
+	printf("  base64 1 MB: %llu us, wrapped %llu us, slow path %llu us\n",
+		   (unsigned long long)us[0], (unsigned long long)us[1], (unsigned long long)us[2]);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testFind();
+	testCRC32();
+	testEscaped();
+	testBase64();
+	testBase64Paths();
+	testSpeed();
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+#!/usr/bin/env python3
+#
+# ComparePlists.py
+# FileNVRAMTests
+#
+# Loads every plist given (XML or bplist00) with plistlib and fails unless they
+# all hold the same values, so a reader other than ours agrees with what we wrote.
+
+import plistlib
+import sys
+
+plists = []
+
+for path in sys.argv[1:]:
+	with open(path, 'rb') as f:
+		plists.append(plistlib.load(f))
+
+for path, plist in zip(sys.argv[2:], plists[1:]):
+	if plist != plists[0]:
+		sys.exit('%s differs from %s' % (path, sys.argv[1]))
+
+print('  %d plists agree' % len(plists))
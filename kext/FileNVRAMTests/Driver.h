@@ -0,0 +1,93 @@
+/***
+ * Driver.h
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * A FileNVRAM started on the host IOKit (see Host/HostIOKit.cpp), for the tests
+ * that build all of FileNVRAM.cpp. Include it after FileNVRAM.cpp.
+ */
+
+#ifndef FileNVRAMTests_Driver_h
+#define FileNVRAMTests_Driver_h
+
+//==============================================================================
+// With fresh set /Extra/NVRAM starts out empty, otherwise the driver loads what
+// the last one left there.
+
+static FileNVRAM* startNVRAM(bool fresh = true)
+{
+	FileNVRAM* nvram = new FileNVRAM;
+
+	if (fresh)
+	{
+		hostFiles.clear();
+	}
+
+	CHECK(nvram->init(NULL, gIODTPlane));
+	CHECK(nvram->start(hostProvider()));
+	CHECK(nvram->mSafeToSync && !nvram->mLoadPending);
+
+	return nvram;
+}
+
+static void stopNVRAM(FileNVRAM* nvram)
+{
+	nvram->stop(hostProvider());
+	nvram->release();
+}
+
+// Syncs made so far, once the flush thread is done.
+static SInt64 syncs(FileNVRAM* nvram)
+{
+	hostIdle();
+
+	return nvram->mStats->ops[kNVRAMStatSync].count;
+}
+
+//==============================================================================
+
+static bool setValue(FileNVRAM* nvram, const char* key, OSObject* value)
+{
+	const OSSymbol* symbol = OSSymbol::withCString(key);
+	bool result = nvram->setProperty(symbol, value);
+
+	value->release();
+	symbol->release();
+
+	return result;
+}
+
+static void setNumber(FileNVRAM* nvram, const char* key, UInt32 value)
+{
+	CHECK(setValue(nvram, key, OSNumber::withNumber(value, 32)));
+}
+
+static void setString(FileNVRAM* nvram, const char* key, const char* value)
+{
+	CHECK(setValue(nvram, key, OSString::withCString(value)));
+}
+
+static void setData(FileNVRAM* nvram, const char* key, const void* bytes, unsigned int length)
+{
+	CHECK(setValue(nvram, key, OSData::withBytes(bytes, length)));
+}
+
+// Whether the string value of key is value, NULL for not set.
+static bool hasString(FileNVRAM* nvram, const char* key, const char* value)
+{
+	OSString* string = OSDynamicCast(OSString, nvram->getProperty(key));
+
+	return value ? (string && string->isEqualTo(value)) : !nvram->getProperty(key);
+}
+
+static bool fileContains(const char* path, const std::string& text)
+{
+	return hostFiles.count(path) && hostFiles[path].find(text) != std::string::npos;
+}
+
+#endif
@@ -0,0 +1,298 @@
+/***
+ * EpochTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Lock free store reads (Epoch.cpp) against a writer that keeps replacing and
+ * removing what they read, then again with a quarter of the retire records
+ * failing to allocate. Values are never really freed until the end, a release
+ * too many or too early marks them dead, so a reader that gets one sees it.
+ * lookup(), lockWrite() and unlockWrite() are FileNVRAM::lookupProperty(),
+ * lockStoreWrite() and unlockStoreWrite() without the kext around them.
+ */
+
+#include "Host.h"
+#include "FileIO.cpp"
+#include "Support.cpp"
+#include "Loader.cpp"
+#include "Stats.cpp"
+#include "Policy.cpp"
+
+static bool			sFailing;
+static unsigned int	sFailSeed = 7;
+static long			sFailed;
+
+// Only Epoch.cpp's allocations fail, only while sFailing is set (by the writer).
+static void* failMalloc(size_t size)
+{
+	if (sFailing && rand_r(&sFailSeed) % 4 == 0)
+	{
+		sFailed++;
+		return NULL;
+	}
+
+	return IOMalloc(size);
+}
+
+#define IOMalloc failMalloc
+#include "Epoch.cpp"
+#undef IOMalloc
+#include "Store.cpp"
+
+#include <pthread.h>
+#include <vector>
+
+#define READERS		6
+#define KEYS		400
+#define WRITES		200000
+
+//==============================================================================
+// Dies instead of being freed, so use after release can be told.
+
+class Canary : public OSObject
+{
+public:
+	Canary(int key) : mKey(key), mAlive(true), mCount(1) { }
+
+	virtual void retain() const { mCount++; }
+	virtual void release() const { if (--mCount == 0) mAlive = false; }
+	virtual int getRetainCount() const { return mCount; }
+
+	int						mKey;
+	mutable volatile bool	mAlive;
+	mutable std::atomic<int> mCount;
+};
+
+static NVRAMStore*		sStore;
+static NVRAMEpoch		sEpoch;
+static IORWLock*		sLock;
+static volatile bool	sStop;
+static volatile long	sReads, sFast, sBad;
+
+//==============================================================================
+
+static void makeKey(char* key, size_t size, int i)
+{
+	if (i % 8)
+	{
+		snprintf(key, size, "GUID-%d" NVRAM_SEPERATOR "n%d", i % 8, i / 8);
+	}
+	else
+	{
+		snprintf(key, size, "n%d", i / 8);
+	}
+}
+
+static OSObject* lookup(const char* key, bool* fast)
+{
+	UInt32 epoch = epochEnter(&sEpoch);
+	OSObject* value = NULL;
+	bool found = false;
+
+	for (int i = 0; !found && i < NVRAM_READ_RETRIES; i++)
+	{
+		UInt32 version = sEpoch.version;
+		bool lazy;
+
+		if (version & 1)
+		{
+			break;
+		}
+
+		OSMemoryBarrier();
+		value = storeRead(sStore, key, &lazy);
+		OSMemoryBarrier();
+
+		if (lazy)
+		{
+			break;
+		}
+
+		found = (sEpoch.version == version);
+	}
+
+	if (found && value)
+	{
+		value->retain();
+	}
+
+	epochExit(&sEpoch, epoch);
+
+	if ((*fast = found))
+	{
+		return value;
+	}
+
+	IORWLockRead(sLock);
+	value = storeLookup(sStore, key);
+
+	if (value)
+	{
+		value->retain();
+	}
+
+	IORWLockUnlock(sLock);
+
+	return value;
+}
+
+static void lockWrite(void)
+{
+	IORWLockWrite(sLock);
+	sEpoch.version++;
+	OSMemoryBarrier();
+}
+
+static void unlockWrite(void)
+{
+	epochReclaim(&sEpoch, false);
+	OSMemoryBarrier();
+	sEpoch.version++;
+	IORWLockUnlock(sLock);
+}
+
+//==============================================================================
+
+static void* reader(void* argument)
+{
+	unsigned int seed = (unsigned int)(intptr_t)argument;
+
+	while (!sStop)
+	{
+		char key[64];
+		int i = rand_r(&seed) % KEYS;
+		bool fast;
+
+		makeKey(key, sizeof(key), i);
+
+		Canary* value = (Canary *)lookup(key, &fast);
+
+		if (value)
+		{
+			if (!value->mAlive || value->mKey != i)
+			{
+				__sync_fetch_and_add(&sBad, 1);
+			}
+
+			value->release();
+		}
+
+		__sync_fetch_and_add(&sReads, 1);
+		__sync_fetch_and_add(&sFast, fast ? 1 : 0);
+	}
+
+	return NULL;
+}
+
+static void testReaders(bool failing)
+{
+	std::vector<Canary*> values;
+	pthread_t threads[READERS];
+	unsigned int seed = 99;
+
+	bzero(&sEpoch, sizeof(sEpoch));
+	sStore = storeCreate();
+	sStore->epoch = &sEpoch;
+	sLock = IORWLockAlloc();
+	sStop = false;
+	sReads = sFast = sBad = sFailed = 0;
+
+	for (int i = 0; i < READERS; i++)
+	{
+		CHECK(pthread_create(&threads[i], NULL, reader, (void *)(intptr_t)i) == 0);
+	}
+
+	// Every failed retire record waits for the readers, that run is shorter.
+	for (int write = 0; write < (failing ? WRITES / 8 : WRITES); write++)
+	{
+		char key[64];
+		int i = rand_r(&seed) % KEYS;
+
+		makeKey(key, sizeof(key), i);
+		lockWrite();
+		sFailing = failing;
+
+		if (rand_r(&seed) % 3)
+		{
+			Canary* value = new Canary(i);
+
+			values.push_back(value);
+			CHECK(storeInsert(sStore, key, value, NULL));
+			value->release();
+		}
+		else
+		{
+			storeDelete(sStore, key, NULL);
+		}
+
+		// A sync's snapshot, released a write later.
+		if (write % 5000 == 0)
+		{
+			NVRAMStore* snapshot = storeSnapshot(sStore);
+
+			sFailing = false;
+			unlockWrite();
+			lockWrite();
+			sFailing = failing;
+
+			if (snapshot)
+			{
+				storeRelease(sStore, snapshot);
+			}
+		}
+
+		sFailing = false;
+		unlockWrite();
+	}
+
+	sStop = true;
+
+	for (int i = 0; i < READERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	CHECK(sBad == 0);
+
+	// Everything retired is freed once the last readers are gone, and nothing else.
+	lockWrite();
+	epochSynchronize(&sEpoch);
+	epochSynchronize(&sEpoch);
+	CHECK(!sEpoch.retired && !sEpoch.retiring);
+
+	size_t live = 0;
+
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		live += values[i]->mAlive ? 1 : 0;
+	}
+
+	unlockWrite();
+	storeDestroy(sStore);
+
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		CHECK(!values[i]->mAlive);
+		delete values[i];
+	}
+
+	IORWLockFree(sLock);
+
+	printf("  %s: %ld reads, %ld%% without the lock, %zu values still stored, %ld retire records failed\n",
+		   failing ? "out of memory" : "normal", sReads, sReads ? sFast * 100 / sReads : 0, live, sFailed);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testReaders(false);
+	testReaders(true);
+
+	return 0;
+}
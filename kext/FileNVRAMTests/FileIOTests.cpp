@@ -0,0 +1,278 @@
+/***
+ * FileIOTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * FileIO.cpp on the in-memory files of Host.cpp: buffers, short and split
+ * transfers, the end of the file, a disk that stops taking writes, and removing
+ * a file. Splitting at NVRAM_IO_MAX (1 GB) is the same loop, it isn't run with
+ * buffers that big. What the NVRAM_CHUNK_SIZE buffer saves is measured last.
+ */
+
+#include "Host.h"
+#include "FileIO.cpp"
+#include "Support.cpp"
+#include "Serializer.cpp"
+#include "Stats.cpp"
+
+#include <vector>
+
+//==============================================================================
+
+static void testBuffers(void)
+{
+	CHECK(fileRound(0) == 0 && fileRound(1) == PAGE_SIZE && fileRound(PAGE_SIZE) == PAGE_SIZE && fileRound(PAGE_SIZE + 1) == 2 * PAGE_SIZE);
+	CHECK(!fileAlloc(0));
+
+	for (size_t length = 1; length < 5 * PAGE_SIZE; length += 777)
+	{
+		char* buffer = fileAlloc(length);
+
+		CHECK(buffer && ((uintptr_t)buffer % PAGE_SIZE) == 0);
+		memset(buffer, 0xA5, fileRound(length));
+		fileFree(buffer, length);
+	}
+
+	fileFree(NULL, 0);
+}
+
+//==============================================================================
+
+static void testOpen(void)
+{
+	vnode_t vp = (vnode_t)1;
+	off_t size = -1;
+
+	hostFiles.clear();
+
+	CHECK(fileOpen("/missing.plist", FREAD, &vp, &size, NULL) == ENOENT);
+	CHECK(size == -1);
+
+	hostFiles["/nvram.plist"] = std::string(12345, 'x');
+
+	CHECK(fileOpen("/nvram.plist", FREAD | FWRITE, &vp, &size, NULL) == 0);
+	CHECK(vp && size == 12345);
+
+	hostSyncs = 0;
+	CHECK(fileSetSize(vp, NULL, 100) == 0 && hostFiles["/nvram.plist"].size() == 100);
+	CHECK(fileSync(vp, NULL) == 0 && hostSyncs == 1);
+	CHECK(fileClose(vp, true, NULL) == 0);
+
+	CHECK(fileOpen("/new.plist", O_CREAT | FWRITE, &vp, NULL, NULL) == 0);
+	fileClose(vp, true, NULL);
+	CHECK(hostFiles.count("/new.plist") && hostFiles["/new.plist"].empty());
+}
+
+//==============================================================================
+// The file system may move less than asked for (hostWriteChunk), the rest has
+// to follow in further calls.
+
+static void testTransfers(void)
+{
+	std::vector<char> bytes(123457);
+	vnode_t vp;
+
+	for (size_t i = 0; i < bytes.size(); i++)
+	{
+		bytes[i] = (char)(i * 7 + (i >> 9));
+	}
+
+	int chunks[] = { 0, 1000, 4096, 99999 };
+
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+	{
+		hostFiles.clear();
+		hostWriteChunk = chunks[c];
+		hostRdwrCalls = 0;
+
+		CHECK(fileOpen("/nvram.plist", O_CREAT | FWRITE | FREAD, &vp, NULL, NULL) == 0);
+		CHECK(fileWrite(vp, NULL, bytes.data(), bytes.size(), 100) == 0);
+
+		int expected = chunks[c] ? (int)((bytes.size() + chunks[c] - 1) / chunks[c]) : 1;
+
+		CHECK(hostRdwrCalls == expected);
+
+		const std::string& file = hostFiles["/nvram.plist"];
+
+		CHECK(file.size() == bytes.size() + 100 && memcmp(file.data() + 100, bytes.data(), bytes.size()) == 0);
+
+		char* buffer = fileAlloc(bytes.size());
+
+		CHECK(fileRead(vp, NULL, buffer, bytes.size(), 100) == 0);
+		CHECK(memcmp(buffer, bytes.data(), bytes.size()) == 0);
+
+		// Running into the end of the file.
+		CHECK(fileRead(vp, NULL, buffer, bytes.size(), 101) == EIO);
+		CHECK(fileRead(vp, NULL, buffer, 1, bytes.size() + 100) == EIO);
+		CHECK(fileRead(vp, NULL, buffer, 0, bytes.size() + 100) == 0);
+
+		fileFree(buffer, bytes.size());
+		fileClose(vp, true, NULL);
+	}
+
+	hostWriteChunk = 0;
+}
+
+//==============================================================================
+// A disk that stops taking writes: an error, not a loop or a silent short file.
+
+static void testFull(void)
+{
+	std::vector<char> bytes(50000, 'z');
+	vnode_t vp;
+
+	for (long budget = 0; budget < 50000; budget += 4999)
+	{
+		hostFiles.clear();
+		hostWriteBudget = budget;
+		hostWriteChunk = 1000;
+
+		CHECK(fileOpen("/nvram.plist", O_CREAT | FWRITE, &vp, NULL, NULL) == 0);
+		CHECK(fileWrite(vp, NULL, bytes.data(), bytes.size(), 0) == EIO);
+		CHECK(hostFiles["/nvram.plist"].size() == (size_t)budget);
+		fileClose(vp, true, NULL);
+	}
+
+	hostWriteBudget = -1;
+	hostWriteChunk = 0;
+}
+
+//==============================================================================
+
+static void testRemove(void)
+{
+	hostFiles.clear();
+	hostFiles["/Extra/NVRAM/nvram.blob.1"] = "one";
+	hostFiles["/Extra/NVRAM/nvram.blob.2"] = "two";
+
+	CHECK(fileRemove("/Extra/NVRAM/nvram.blob.1", NULL) == 0);
+	CHECK(!hostFiles.count("/Extra/NVRAM/nvram.blob.1") && hostFiles.count("/Extra/NVRAM/nvram.blob.2"));
+	CHECK(fileRemove("/Extra/NVRAM/nvram.blob.1", NULL) == ENOENT);
+	CHECK(fileRemove("nvram.blob.2", NULL) == EINVAL);
+	CHECK(fileRemove("/nvram.blob.2", NULL) == EINVAL);
+}
+
+//==============================================================================
+// A snapshot streamed through chunk buffers of several sizes, and built in memory
+// and written at once (the old way). Then nvram.1.plist copied to nvram.plist in
+// chunks, as slotCopy() does. In-memory files here, so the number of vn_rdwr()
+// calls matters more than the time: each one is a trip through the file system.
+
+static void benchChunks(void)
+{
+	OSDictionary* dict = OSDictionary::withCapacity(2000);
+	size_t sizes[] = { 256, 1024, PAGE_SIZE, 16 * 1024, 64 * 1024 };
+	char key[32], text[64];
+	vnode_t vp;
+
+	for (int i = 0; i < 2000; i++)
+	{
+		snprintf(key, sizeof(key), "variable%d", i);
+		snprintf(text, sizeof(text), "some value for variable %d", i);
+
+		OSObject* value = (i & 1) ? (OSObject *)OSString::withCString(text) : (OSObject *)OSData::withBytes(text, (unsigned int)strlen(text));
+
+		dict->setObject(key, value);
+		value->release();
+	}
+
+	hostFiles.clear();
+
+	// Built in memory, one write.
+	NVRAMOutput out;
+	uint64_t start = hostNanoseconds();
+
+	bzero(&out, sizeof(out));
+	out.data = OSData::withCapacity(64);
+	CHECK(serializeObject(&out, dict, 0));
+	hostRdwrCalls = 0;
+	CHECK(fileOpen("/nvram.1.plist", O_CREAT | FWRITE, &vp, NULL, NULL) == 0);
+	CHECK(fileWrite(vp, NULL, out.data->getBytesNoCopy(), out.data->getLength(), 0) == 0);
+	fileClose(vp, true, NULL);
+
+	std::string whole = hostFiles["/nvram.1.plist"];
+
+	printf("  %zu KB snapshot: in memory %d write, %llu us", whole.size() / 1024, hostRdwrCalls,
+		   (unsigned long long)((hostNanoseconds() - start) / NSEC_PER_USEC));
+	out.data->release();
+
+	// Streamed.
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		char* chunk = fileAlloc(sizes[i]);
+
+		hostFiles.clear();
+		hostRdwrCalls = 0;
+		start = hostNanoseconds();
+
+		bzero(&out, sizeof(out));
+		CHECK(fileOpen("/nvram.1.plist", O_CREAT | FWRITE, &out.vp, NULL, NULL) == 0);
+		out.buffer = chunk;
+		out.size = sizes[i];
+		CHECK(serializeObject(&out, dict, 0));
+		CHECK(outputFlush(&out, out.buffer, out.used));
+		fileClose(out.vp, true, NULL);
+
+		CHECK(hostFiles["/nvram.1.plist"] == whole);
+		CHECK(hostRdwrCalls == (int)((whole.size() + sizes[i] - 1) / sizes[i]));
+
+		printf(", %zu B chunks %d writes, %llu us", sizes[i], hostRdwrCalls, (unsigned long long)((hostNanoseconds() - start) / NSEC_PER_USEC));
+		fileFree(chunk, sizes[i]);
+	}
+
+	printf("\n  copy:");
+
+	// Copied.
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		char* chunk = fileAlloc(sizes[i]);
+		vnode_t source;
+		off_t size;
+
+		hostFiles["/nvram.plist"].clear();
+		hostRdwrCalls = 0;
+		start = hostNanoseconds();
+
+		CHECK(fileOpen("/nvram.1.plist", FREAD, &source, &size, NULL) == 0);
+		CHECK(fileOpen("/nvram.plist", O_CREAT | FWRITE, &vp, NULL, NULL) == 0);
+
+		for (off_t offset = 0; offset < size; offset += sizes[i])
+		{
+			size_t count = (size_t)MIN((off_t)sizes[i], size - offset);
+
+			CHECK(fileRead(source, NULL, chunk, count, offset) == 0);
+			CHECK(fileWrite(vp, NULL, chunk, count, offset) == 0);
+		}
+
+		fileClose(source, false, NULL);
+		fileClose(vp, true, NULL);
+
+		CHECK(hostFiles["/nvram.plist"] == whole);
+
+		printf("%s %zu B chunks %d calls, %llu us", i ? "," : "", sizes[i], hostRdwrCalls, (unsigned long long)((hostNanoseconds() - start) / NSEC_PER_USEC));
+		fileFree(chunk, sizes[i]);
+	}
+
+	printf("\n");
+
+	dict->release();
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testBuffers();
+	testOpen();
+	testTransfers();
+	testFull();
+	testRemove();
+	benchChunks();
+
+	return 0;
+}
@@ -0,0 +1,1699 @@
+/***
+ * Host.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * The user space side of Host.h. Locks are pthread ones, atomics the compiler's,
+ * and vnodes name entries in hostFiles. Writes can be cut short (hostWriteBudget),
+ * split up (hostWriteChunk) or slowed down (hostWriteDelay) to see how the callers
+ * cope. IOKit is in HostIOKit.cpp.
+ */
+
+#include "Host.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <typeindex>
+#include <typeinfo>
+
+// Only FileNVRAM's sources use their own.
+#undef strstr
+
+//==============================================================================
+// Memory, logging and locks.
+
+int		hostFailAlloc;
+
+extern "C" void* IOMalloc(size_t size)
+{
+	if (hostFailAlloc > 0 && __sync_sub_and_fetch(&hostFailAlloc, 1) == 0)
+	{
+		return NULL;
+	}
+
+	return malloc(size ? size : 1);
+}
+
+extern "C" void IOFree(void* pointer, size_t size)
+{
+	free(pointer);
+}
+
+extern "C" void* IOMallocAligned(size_t size, size_t alignment)
+{
+	void* pointer;
+
+	return posix_memalign(&pointer, alignment, size ? size : 1) ? NULL : pointer;
+}
+
+extern "C" void IOFreeAligned(void* pointer, size_t size)
+{
+	free(pointer);
+}
+
+extern "C" void IOLog(const char* format, ...)
+{
+	if (getenv("HOST_LOG"))
+	{
+		va_list arguments;
+
+		va_start(arguments, format);
+		vfprintf(stderr, format, arguments);
+		va_end(arguments);
+	}
+}
+
+extern "C" void IOSleep(unsigned milliseconds)
+{
+	usleep(milliseconds * 1000);
+}
+
+extern "C" IOLock* IOLockAlloc(void)
+{
+	pthread_mutex_t* mutex = new pthread_mutex_t;
+
+	pthread_mutex_init(mutex, NULL);
+
+	return (IOLock *)mutex;
+}
+
+extern "C" void IOLockFree(IOLock* lock)
+{
+	pthread_mutex_destroy((pthread_mutex_t *)lock);
+	delete (pthread_mutex_t *)lock;
+}
+
+extern "C" void IOLockLock(IOLock* lock)
+{
+	pthread_mutex_lock((pthread_mutex_t *)lock);
+}
+
+extern "C" void IOLockUnlock(IOLock* lock)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)lock);
+}
+
+// Every event shares one condition, sleepers check what they wait for again anyway.
+static pthread_cond_t* sleepCondition(void)
+{
+	static pthread_cond_t* condition;
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, []() {
+		pthread_condattr_t attributes;
+
+		condition = new pthread_cond_t;
+		pthread_condattr_init(&attributes);
+		pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+		pthread_cond_init(condition, &attributes);
+		pthread_condattr_destroy(&attributes);
+	});
+
+	return condition;
+}
+
+extern "C" wait_result_t IOLockSleep(IOLock* lock, void* event, UInt32 interruptible)
+{
+	pthread_cond_wait(sleepCondition(), (pthread_mutex_t *)lock);
+
+	return THREAD_AWAKENED;
+}
+
+extern "C" wait_result_t IOLockSleepDeadline(IOLock* lock, void* event, AbsoluteTime deadline, UInt32 interruptible)
+{
+	uint64_t now;
+	struct timespec until;
+
+	clock_get_uptime(&now);
+
+	if (deadline <= now)
+	{
+		return THREAD_TIMED_OUT;
+	}
+
+	// Deadlines are in absolute time, the condition waits on the real clock.
+	uint64_t real = hostNanoseconds() + (deadline - now);
+
+	until.tv_sec = real / 1000000000ull;
+	until.tv_nsec = real % 1000000000ull;
+
+	return pthread_cond_timedwait(sleepCondition(), (pthread_mutex_t *)lock, &until) == ETIMEDOUT ? THREAD_TIMED_OUT : THREAD_AWAKENED;
+}
+
+extern "C" void IOLockWakeup(IOLock* lock, void* event, bool oneThread)
+{
+	pthread_cond_broadcast(sleepCondition());
+}
+
+extern "C" IORWLock* IORWLockAlloc(void)
+{
+	pthread_rwlock_t* rwlock = new pthread_rwlock_t;
+
+	pthread_rwlock_init(rwlock, NULL);
+
+	return (IORWLock *)rwlock;
+}
+
+extern "C" void IORWLockFree(IORWLock* lock)
+{
+	pthread_rwlock_destroy((pthread_rwlock_t *)lock);
+	delete (pthread_rwlock_t *)lock;
+}
+
+extern "C" void IORWLockRead(IORWLock* lock)
+{
+	pthread_rwlock_rdlock((pthread_rwlock_t *)lock);
+}
+
+extern "C" void IORWLockWrite(IORWLock* lock)
+{
+	pthread_rwlock_wrlock((pthread_rwlock_t *)lock);
+}
+
+extern "C" void IORWLockUnlock(IORWLock* lock)
+{
+	pthread_rwlock_unlock((pthread_rwlock_t *)lock);
+}
+
+//==============================================================================
+// Time, absolute time is in nanoseconds. hostAdvance() moves it on from the real clock.
+
+std::atomic<uint64_t>	gHostClockOffset;
+
+uint64_t hostNanoseconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+extern "C" uint64_t mach_absolute_time(void)
+{
+	return hostNanoseconds() + gHostClockOffset;
+}
+
+extern "C" void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result)
+{
+	*result = abstime;
+}
+
+extern "C" void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result)
+{
+	*result = nanoseconds;
+}
+
+extern "C" void clock_get_uptime(uint64_t* result)
+{
+	*result = mach_absolute_time();
+}
+
+extern "C" void clock_interval_to_absolutetime_interval(uint32_t interval, uint32_t scale, uint64_t* result)
+{
+	*result = (uint64_t)interval * scale;
+}
+
+extern "C" void clock_interval_to_deadline(uint32_t interval, uint32_t scale, uint64_t* result)
+{
+	*result = mach_absolute_time() + (uint64_t)interval * scale;
+}
+
+//==============================================================================
+// Atomics.
+
+extern "C" SInt32 OSIncrementAtomic(volatile SInt32* address)
+{
+	return __sync_fetch_and_add(address, 1);
+}
+
+extern "C" SInt32 OSDecrementAtomic(volatile SInt32* address)
+{
+	return __sync_fetch_and_sub(address, 1);
+}
+
+extern "C" SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address)
+{
+	return __sync_fetch_and_add(address, amount);
+}
+
+extern "C" SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* address)
+{
+	return __sync_fetch_and_add(address, amount);
+}
+
+extern "C" SInt64 OSIncrementAtomic64(volatile SInt64* address)
+{
+	return __sync_fetch_and_add(address, 1);
+}
+
+extern "C" bool OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32* address)
+{
+	return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+extern "C" bool OSCompareAndSwap64(UInt64 oldValue, UInt64 newValue, volatile UInt64* address)
+{
+	return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+extern "C" bool OSCompareAndSwapPtr(void* oldValue, void* newValue, void* volatile* address)
+{
+	return __sync_bool_compare_and_swap(address, oldValue, newValue);
+}
+
+extern "C" void OSMemoryBarrier(void)
+{
+	__sync_synchronize();
+}
+
+//==============================================================================
+// Processes and the rest.
+
+static __thread int sCPU;
+
+void hostSetCPU(int cpu)
+{
+	sCPU = cpu;
+}
+
+extern "C" int cpu_number(void)
+{
+	return sCPU;
+}
+
+extern "C" task_t current_task(void)
+{
+	return (task_t)1;
+}
+
+extern "C" int proc_selfpid(void)
+{
+	return getpid();
+}
+
+extern "C" int proc_pid(proc_t proc)
+{
+	return 0;
+}
+
+int		hostProcNames;
+
+extern "C" void proc_name(int pid, char* buffer, int size)
+{
+	hostProcNames++;
+	strlcpy(buffer, "host", size);
+}
+
+extern "C" int PE_parse_boot_argn(const char* name, void* value, int size)
+{
+	return 0;
+}
+
+extern "C" size_t strlcpy(char* destination, const char* source, size_t size)
+{
+	size_t length = strlen(source);
+
+	if (size)
+	{
+		size_t count = MIN(length, size - 1);
+
+		memcpy(destination, source, count);
+		destination[count] = '\0';
+	}
+
+	return length;
+}
+
+extern "C" size_t strlcat(char* destination, const char* source, size_t size)
+{
+	size_t length = strnlen(destination, size);
+
+	return length + strlcpy(destination + length, source, size - length);
+}
+
+extern "C" void sysctl_register_oid(struct sysctl_oid* oid)
+{
+}
+
+extern "C" void sysctl_unregister_oid(struct sysctl_oid* oid)
+{
+}
+
+extern "C" int SYSCTL_OUT(struct sysctl_req* request, const void* pointer, size_t length)
+{
+	if (request->oldptr)
+	{
+		if (request->oldidx + length > request->oldlen)
+		{
+			return ENOMEM;
+		}
+
+		memcpy((char *)(uintptr_t)request->oldptr + request->oldidx, pointer, length);
+	}
+
+	request->oldidx += length;
+
+	return 0;
+}
+
+//==============================================================================
+// SHA-1, FIPS 180-4, for Blob.cpp's hashes.
+
+static uint32_t sha1Rotate(uint32_t value, int bits)
+{
+	return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1Block(uint32_t state[5], const uint8_t block[64])
+{
+	uint32_t w[80];
+
+	for (int i = 0; i < 16; i++)
+	{
+		w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) | ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	}
+
+	for (int i = 16; i < 80; i++)
+	{
+		w[i] = sha1Rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+	for (int i = 0; i < 80; i++)
+	{
+		uint32_t f, k;
+
+		if (i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if (i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if (i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		uint32_t t = sha1Rotate(a, 5) + f + e + k + w[i];
+
+		e = d;
+		d = c;
+		c = sha1Rotate(b, 30);
+		b = a;
+		a = t;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+extern "C" void SHA1Init(SHA1_CTX* context)
+{
+	context->state[0] = 0x67452301;
+	context->state[1] = 0xEFCDAB89;
+	context->state[2] = 0x98BADCFE;
+	context->state[3] = 0x10325476;
+	context->state[4] = 0xC3D2E1F0;
+	context->count = 0;
+}
+
+extern "C" void SHA1Update(SHA1_CTX* context, const void* data, size_t length)
+{
+	const uint8_t* bytes = (const uint8_t *)data;
+
+	while (length--)
+	{
+		context->buffer[context->count++ % 64] = *bytes++;
+
+		if (context->count % 64 == 0)
+		{
+			sha1Block(context->state, context->buffer);
+		}
+	}
+}
+
+extern "C" void SHA1Final(void* digest, SHA1_CTX* context)
+{
+	uint64_t bits = context->count * 8;
+	uint8_t pad = 0x80;
+
+	SHA1Update(context, &pad, 1);
+	pad = 0;
+
+	while (context->count % 64 != 56)
+	{
+		SHA1Update(context, &pad, 1);
+	}
+
+	for (int i = 7; i >= 0; i--)
+	{
+		uint8_t byte = (uint8_t)(bits >> (i * 8));
+
+		SHA1Update(context, &byte, 1);
+	}
+
+	for (int i = 0; i < 20; i++)
+	{
+		((uint8_t *)digest)[i] = (uint8_t)(context->state[i / 4] >> (24 - (i % 4) * 8));
+	}
+}
+
+//==============================================================================
+// OSUnserializeXML(), for the plists Serializer.cpp writes: no IDs or references.
+
+static void xmlSkip(const char** text)
+{
+	for (;;)
+	{
+		while (**text == ' ' || **text == '\t' || **text == '\n' || **text == '\r')
+		{
+			(*text)++;
+		}
+
+		// Declarations, comments and the plist element itself.
+		if (strncmp(*text, "<?", 2) == 0 || strncmp(*text, "<!", 2) == 0 || strncmp(*text, "<plist", 6) == 0 || strncmp(*text, "</plist>", 8) == 0)
+		{
+			const char* end = strchr(*text, '>');
+
+			if (!end)
+			{
+				return;
+			}
+
+			*text = end + 1;
+			continue;
+		}
+
+		return;
+	}
+}
+
+// The text up to </tag>, entities decoded. False when there is no end tag.
+static bool xmlText(const char** text, const char* tag, std::string* result)
+{
+	std::string close = std::string("</") + tag + ">";
+	const char* end = strstr(*text, close.c_str());
+
+	if (!end)
+	{
+		return false;
+	}
+
+	result->clear();
+
+	for (const char* p = *text; p < end; p++)
+	{
+		static const struct { const char* entity; char c; } entities[] = { { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' }, { "&apos;", '\'' } };
+		bool decoded = false;
+
+		for (size_t i = 0; *p == '&' && i < sizeof(entities) / sizeof(entities[0]); i++)
+		{
+			size_t length = strlen(entities[i].entity);
+
+			if (strncmp(p, entities[i].entity, length) == 0)
+			{
+				*result += entities[i].c;
+				p += length - 1;
+				decoded = true;
+				break;
+			}
+		}
+
+		if (!decoded)
+		{
+			*result += *p;
+		}
+	}
+
+	*text = end + close.size();
+
+	return true;
+}
+
+static bool xmlBase64(const std::string& text, std::vector<unsigned char>* bytes)
+{
+	UInt32 group = 0;
+	int count = 0;
+
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		char c = text[i];
+		int value;
+
+		if (c >= 'A' && c <= 'Z')		value = c - 'A';
+		else if (c >= 'a' && c <= 'z')	value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')	value = c - '0' + 52;
+		else if (c == '+')				value = 62;
+		else if (c == '/')				value = 63;
+		else if (c == '=' || isspace((unsigned char)c))	continue;
+		else							return false;
+
+		group = (group << 6) | value;
+
+		if (++count == 4)
+		{
+			bytes->push_back(group >> 16);
+			bytes->push_back((group >> 8) & 0xFF);
+			bytes->push_back(group & 0xFF);
+			group = 0;
+			count = 0;
+		}
+	}
+
+	if (count == 3)
+	{
+		bytes->push_back(group >> 10);
+		bytes->push_back((group >> 2) & 0xFF);
+	}
+	else if (count == 2)
+	{
+		bytes->push_back(group >> 4);
+	}
+
+	return count != 1;
+}
+
+static OSObject* xmlValue(const char** text, int depth)
+{
+	std::string content;
+
+	xmlSkip(text);
+
+	if (depth > 32 || **text != '<')
+	{
+		return NULL;
+	}
+
+	const char* p = *text + 1;
+	const char* close = strchr(p, '>');
+
+	if (!close)
+	{
+		return NULL;
+	}
+
+	std::string tag(p, strcspn(p, " />"));
+	bool empty = (close[-1] == '/');
+	const char* attributes = p + tag.size();
+
+	*text = close + 1;
+
+	if (tag == "true" || tag == "false")
+	{
+		OSObject* boolean = (tag == "true") ? kOSBooleanTrue : kOSBooleanFalse;
+
+		if (!empty && strncmp(*text, ("</" + tag + ">").c_str(), tag.size() + 3) == 0)
+		{
+			*text += tag.size() + 3;
+		}
+
+		return boolean;
+	}
+
+	if (tag == "string" || tag == "key")
+	{
+		if (!empty && !xmlText(text, tag.c_str(), &content))
+		{
+			return NULL;
+		}
+
+		return OSString::withCString(content.c_str());
+	}
+
+	if (tag == "data")
+	{
+		std::vector<unsigned char> bytes;
+
+		if ((!empty && !xmlText(text, "data", &content)) || !xmlBase64(content, &bytes))
+		{
+			return NULL;
+		}
+
+		return OSData::withBytes(bytes.data(), (unsigned int)bytes.size());
+	}
+
+	if (tag == "integer")
+	{
+		const char* size = strstr(attributes, "size=\"");
+		unsigned int bits = (size && size < close) ? (unsigned int)strtoul(size + 6, NULL, 10) : 64;
+
+		if (empty || !xmlText(text, "integer", &content))
+		{
+			return NULL;
+		}
+
+		return OSNumber::withNumber(strtoull(content.c_str(), NULL, 0), bits);
+	}
+
+	if (tag == "dict")
+	{
+		OSDictionary* dict = OSDictionary::withCapacity(4);
+
+		while (!empty)
+		{
+			xmlSkip(text);
+
+			if (strncmp(*text, "</dict>", 7) == 0)
+			{
+				*text += 7;
+				break;
+			}
+
+			if (strncmp(*text, "<key>", 5) != 0)
+			{
+				dict->release();
+				return NULL;
+			}
+
+			*text += 5;
+
+			OSObject* value = NULL;
+
+			if (!xmlText(text, "key", &content) || !(value = xmlValue(text, depth + 1)))
+			{
+				dict->release();
+				return NULL;
+			}
+
+			dict->setObject(content.c_str(), value);
+			value->release();
+		}
+
+		return dict;
+	}
+
+	if (tag == "array")
+	{
+		OSArray* array = OSArray::withCapacity(4);
+
+		while (!empty)
+		{
+			xmlSkip(text);
+
+			if (strncmp(*text, "</array>", 8) == 0)
+			{
+				*text += 8;
+				break;
+			}
+
+			OSObject* value = xmlValue(text, depth + 1);
+
+			if (!value)
+			{
+				array->release();
+				return NULL;
+			}
+
+			array->setObject(value);
+			value->release();
+		}
+
+		return array;
+	}
+
+	return NULL;
+}
+
+OSObject* OSUnserializeXML(const char* buffer, OSString** errorString)
+{
+	const char* text = buffer;
+	OSObject* object = xmlValue(&text, 0);
+
+	if (!object && errorString)
+	{
+		*errorString = OSString::withCString("unable to parse");
+	}
+
+	return object;
+}
+
+OSObject* OSUnserializeXML(const char* buffer, size_t bufferSize, OSString** errorString)
+{
+	std::string text(buffer, strnlen(buffer, bufferSize));
+
+	return OSUnserializeXML(text.c_str(), errorString);
+}
+
+//==============================================================================
+// Files. A vnode is an open path, its contents live in hostFiles.
+
+std::map<std::string, std::string>	hostFiles;
+long	hostWriteBudget = -1;
+int		hostWriteChunk;
+int		hostRdwrCalls;
+int		hostSyncs;
+int		hostWriteDelay;
+int		hostRemoves;
+bool	hostRootMounted = true;
+
+struct vnode
+{
+	std::string	path;
+	bool		lookedUp;	// Released by vnode_put(), not vnode_close().
+};
+
+static std::string& hostFile(vnode_t vp)
+{
+	return hostFiles[vp->path];
+}
+
+extern "C" vfs_context_t vfs_context_current(void)
+{
+	// Never looked into, only checked for.
+	return (vfs_context_t)1;
+}
+
+extern "C" proc_t vfs_context_proc(vfs_context_t ctx)
+{
+	return NULL;
+}
+
+extern "C" kauth_cred_t vfs_context_ucred(vfs_context_t ctx)
+{
+	return NULL;
+}
+
+extern "C" int vnode_open(const char* path, int flags, int mode, int lookupFlags, vnode_t* vpp, vfs_context_t ctx)
+{
+	if (!hostFiles.count(path) && !(flags & O_CREAT))
+	{
+		return ENOENT;
+	}
+
+	if (flags & O_TRUNC)
+	{
+		hostFiles[path].clear();
+	}
+
+	*vpp = new vnode;
+	(*vpp)->path = path;
+	(*vpp)->lookedUp = false;
+	hostFiles[path];
+
+	return 0;
+}
+
+extern "C" int vnode_close(vnode_t vp, int flags, vfs_context_t ctx)
+{
+	delete vp;
+
+	return 0;
+}
+
+extern "C" vnode_t vfs_rootvnode(void)
+{
+	static struct vnode root;
+
+	return hostRootMounted ? &root : NULL;
+}
+
+extern "C" int vnode_put(vnode_t vp)
+{
+	if (vp->lookedUp)
+	{
+		delete vp;
+	}
+
+	return 0;
+}
+
+// Files, and directories that have a file in them.
+extern "C" int vnode_lookup(const char* path, int flags, vnode_t* vpp, vfs_context_t ctx)
+{
+	std::map<std::string, std::string>::iterator file = hostFiles.lower_bound(path);
+	std::string directory = std::string(path) + "/";
+
+	if (file == hostFiles.end() || (file->first != path && file->first.compare(0, directory.size(), directory) != 0))
+	{
+		return ENOENT;
+	}
+
+	*vpp = new vnode;
+	(*vpp)->path = path;
+	(*vpp)->lookedUp = true;
+
+	return 0;
+}
+
+extern "C" int VNOP_REMOVE(vnode_t dvp, vnode_t vp, struct componentname* cnp, int flags, vfs_context_t ctx)
+{
+	if (dvp->path + "/" + std::string(cnp->cn_nameptr, cnp->cn_namelen) != vp->path)
+	{
+		return EINVAL;
+	}
+
+	hostRemoves++;
+
+	return hostFiles.erase(vp->path) ? 0 : ENOENT;
+}
+
+extern "C" int vnode_isreg(vnode_t vp)
+{
+	return 1;
+}
+
+extern "C" int vnode_getattr(vnode_t vp, struct vnode_attr* attributes, vfs_context_t ctx)
+{
+	attributes->va_data_size = hostFile(vp).size();
+
+	return 0;
+}
+
+extern "C" int vnode_setsize(vnode_t vp, off_t size, int flags, vfs_context_t ctx)
+{
+	if (hostWriteBudget == 0)
+	{
+		return EIO;
+	}
+
+	hostFile(vp).resize(size);
+
+	return 0;
+}
+
+extern "C" int vn_rdwr(int rw, vnode_t vp, char* base, int length, off_t offset, int segment, int flags, kauth_cred_t cred, int* residual, proc_t proc)
+{
+	std::string& file = hostFile(vp);
+	int count = (hostWriteChunk && length > hostWriteChunk) ? hostWriteChunk : length;
+
+	hostRdwrCalls++;
+
+	if (rw == UIO_WRITE && hostWriteDelay)
+	{
+		usleep(hostWriteDelay * 1000);
+	}
+
+	if (rw == UIO_READ)
+	{
+		count = (offset >= (off_t)file.size()) ? 0 : (int)MIN((off_t)count, (off_t)file.size() - offset);
+		memcpy(base, file.data() + offset, count);
+		*residual = length - count;
+		return 0;
+	}
+
+	if (hostWriteBudget >= 0 && count > hostWriteBudget)
+	{
+		count = (int)hostWriteBudget;
+	}
+
+	if ((size_t)(offset + count) > file.size())
+	{
+		file.resize(offset + count);
+	}
+
+	memcpy(&file[offset], base, count);
+
+	if (hostWriteBudget >= 0)
+	{
+		hostWriteBudget -= count;
+	}
+
+	*residual = length - count;
+
+	// Out of budget is a failing disk, a split write is just a short one.
+	return (hostWriteBudget == 0 && count < length) ? EIO : 0;
+}
+
+extern "C" int VNOP_FSYNC(vnode_t vp, int waitfor, vfs_context_t ctx)
+{
+	hostSyncs++;
+
+	return 0;
+}
+
+//==============================================================================
+// OSObject and friends.
+
+OSObject::OSObject() : mRetainCount(1)
+{
+}
+
+OSObject::~OSObject()
+{
+}
+
+void OSObject::retain() const
+{
+	mRetainCount++;
+}
+
+void OSObject::release() const
+{
+	if (--mRetainCount == 0)
+	{
+		delete this;
+	}
+}
+
+int OSObject::getRetainCount() const
+{
+	return mRetainCount;
+}
+
+bool OSObject::serialize(OSSerialize* s) const
+{
+	return false;
+}
+
+bool OSObject::isEqualTo(const OSObject* object) const
+{
+	return object == this;
+}
+
+const OSMetaClass* OSObject::getMetaClass() const
+{
+	static std::mutex lock;
+	static std::map<std::type_index, OSMetaClass*> classes;
+	std::lock_guard<std::mutex> locked(lock);
+	OSMetaClass*& meta = classes[std::type_index(typeid(*this))];
+
+	if (!meta)
+	{
+		meta = new OSMetaClass(typeid(*this).name());
+	}
+
+	return meta;
+}
+
+void* OSObject::operator new(size_t size)
+{
+	void* pointer = calloc(1, size);
+
+	if (!pointer)
+	{
+		throw std::bad_alloc();
+	}
+
+	return pointer;
+}
+
+void OSObject::operator delete(void* pointer)
+{
+	free(pointer);
+}
+
+OSMetaClass::OSMetaClass(const char* name) : mName(name)
+{
+}
+
+const char* OSMetaClass::getClassName() const
+{
+	return mName.c_str();
+}
+
+//==============================================================================
+
+OSString* OSString::withCString(const char* cString)
+{
+	OSString* string = new OSString;
+
+	string->mString = cString;
+
+	return string;
+}
+
+OSString* OSString::withCStringNoCopy(const char* cString)
+{
+	return withCString(cString);
+}
+
+OSString* OSString::withString(const OSString* string)
+{
+	return withCString(string->getCStringNoCopy());
+}
+
+const char* OSString::getCStringNoCopy() const
+{
+	return mString.c_str();
+}
+
+unsigned int OSString::getLength() const
+{
+	return (unsigned int)mString.size();
+}
+
+char OSString::getChar(unsigned int index) const
+{
+	return index < mString.size() ? mString[index] : '\0';
+}
+
+bool OSString::isEqualTo(const char* cString) const
+{
+	return mString == cString;
+}
+
+bool OSString::isEqualTo(const OSString* string) const
+{
+	return string && mString == string->mString;
+}
+
+bool OSString::isEqualTo(const OSObject* object) const
+{
+	return isEqualTo(dynamic_cast<const OSString *>(object));
+}
+
+bool OSString::serialize(OSSerialize* s) const
+{
+	return s->addString(mString.c_str());
+}
+
+//==============================================================================
+
+// Made on first use, the globals of HostIOKit.cpp are symbols too.
+struct SymbolTable
+{
+	std::mutex							lock;
+	std::map<std::string, OSSymbol*>	symbols;
+};
+
+static SymbolTable& symbolTable(void)
+{
+	static SymbolTable* table = new SymbolTable;
+
+	return *table;
+}
+
+const OSSymbol* OSSymbol::withCString(const char* cString)
+{
+	std::lock_guard<std::mutex> guard(symbolTable().lock);
+	OSSymbol*& symbol = symbolTable().symbols[cString];
+
+	if (!symbol)
+	{
+		symbol = new OSSymbol;
+		symbol->mString = cString;
+	}
+
+	symbol->retain();
+
+	return symbol;
+}
+
+const OSSymbol* OSSymbol::withCStringNoCopy(const char* cString)
+{
+	return withCString(cString);
+}
+
+const OSSymbol* OSSymbol::withString(const OSString* string)
+{
+	return withCString(string->getCStringNoCopy());
+}
+
+const OSSymbol* OSSymbol::existingSymbolForCString(const char* cString)
+{
+	std::lock_guard<std::mutex> guard(symbolTable().lock);
+	std::map<std::string, OSSymbol*>::iterator found = symbolTable().symbols.find(cString);
+
+	if (found == symbolTable().symbols.end())
+	{
+		return NULL;
+	}
+
+	found->second->retain();
+
+	return found->second;
+}
+
+void OSSymbol::release() const
+{
+	// The table keeps the first reference, so a symbol is never deleted.
+	OSObject::release();
+}
+
+//==============================================================================
+
+OSData* OSData::withCapacity(unsigned int capacity)
+{
+	OSData* data = new OSData;
+
+	data->mBytes.reserve(capacity);
+
+	return data;
+}
+
+OSData* OSData::withBytes(const void* bytes, unsigned int length)
+{
+	OSData* data = new OSData;
+
+	data->mBytes.assign((const unsigned char *)bytes, (const unsigned char *)bytes + length);
+
+	return data;
+}
+
+OSData* OSData::withBytesNoCopy(void* bytes, unsigned int length)
+{
+	return withBytes(bytes, length);
+}
+
+OSData* OSData::withData(const OSData* data)
+{
+	return withBytes(data->getBytesNoCopy(), data->getLength());
+}
+
+const void* OSData::getBytesNoCopy() const
+{
+	return mBytes.empty() ? NULL : mBytes.data();
+}
+
+const void* OSData::getBytesNoCopy(unsigned int start, unsigned int length) const
+{
+	return ((size_t)start + length <= mBytes.size()) ? mBytes.data() + start : NULL;
+}
+
+unsigned int OSData::getLength() const
+{
+	return (unsigned int)mBytes.size();
+}
+
+unsigned int OSData::getCapacity() const
+{
+	return (unsigned int)mBytes.capacity();
+}
+
+unsigned int OSData::ensureCapacity(unsigned int capacity)
+{
+	mBytes.reserve(capacity);
+
+	return (unsigned int)mBytes.capacity();
+}
+
+bool OSData::appendBytes(const void* bytes, unsigned int length)
+{
+	// No bytes appends zeroes, as in libkern.
+	if (!bytes)
+	{
+		mBytes.resize(mBytes.size() + length);
+	}
+	else
+	{
+		mBytes.insert(mBytes.end(), (const unsigned char *)bytes, (const unsigned char *)bytes + length);
+	}
+
+	return true;
+}
+
+bool OSData::appendBytes(const OSData* data)
+{
+	return data && appendBytes(data->getBytesNoCopy(), data->getLength());
+}
+
+bool OSData::appendByte(unsigned char byte, unsigned int count)
+{
+	mBytes.insert(mBytes.end(), count, byte);
+
+	return true;
+}
+
+bool OSData::isEqualTo(const void* bytes, unsigned int length) const
+{
+	return length == mBytes.size() && (!length || memcmp(bytes, mBytes.data(), length) == 0);
+}
+
+bool OSData::isEqualTo(const OSObject* object) const
+{
+	const OSData* data = dynamic_cast<const OSData *>(object);
+
+	return data && isEqualTo(data->getBytesNoCopy(), data->getLength());
+}
+
+//==============================================================================
+
+OSNumber* OSNumber::withNumber(unsigned long long value, unsigned int bits)
+{
+	OSNumber* number = new OSNumber;
+
+	number->mBits = bits;
+	number->mValue = (bits < 64) ? (value & ((1ull << bits) - 1)) : value;
+
+	return number;
+}
+
+unsigned long long OSNumber::unsigned64BitValue() const
+{
+	return mValue;
+}
+
+unsigned int OSNumber::unsigned32BitValue() const
+{
+	return (unsigned int)mValue;
+}
+
+unsigned int OSNumber::numberOfBits() const
+{
+	return mBits;
+}
+
+unsigned int OSNumber::numberOfBytes() const
+{
+	return (mBits + 7) / 8;
+}
+
+bool OSNumber::isEqualTo(const OSObject* object) const
+{
+	const OSNumber* number = dynamic_cast<const OSNumber *>(object);
+
+	return number && number->mValue == mValue;
+}
+
+//==============================================================================
+
+OSBoolean::OSBoolean(bool value) : mValue(value)
+{
+}
+
+OSBoolean* const kOSBooleanTrue = new OSBoolean(true);
+OSBoolean* const kOSBooleanFalse = new OSBoolean(false);
+
+OSBoolean* OSBoolean::withBoolean(bool value)
+{
+	return value ? kOSBooleanTrue : kOSBooleanFalse;
+}
+
+bool OSBoolean::isTrue() const
+{
+	return mValue;
+}
+
+bool OSBoolean::isFalse() const
+{
+	return !mValue;
+}
+
+bool OSBoolean::getValue() const
+{
+	return mValue;
+}
+
+void OSBoolean::retain() const
+{
+}
+
+void OSBoolean::release() const
+{
+}
+
+//==============================================================================
+
+OSDictionary::~OSDictionary()
+{
+	flushCollection();
+}
+
+OSDictionary* OSDictionary::withCapacity(unsigned int capacity)
+{
+	OSDictionary* dictionary = new OSDictionary;
+
+	dictionary->mEntries.reserve(capacity);
+
+	return dictionary;
+}
+
+OSDictionary* OSDictionary::withObjects(const OSObject* objects[], const OSSymbol* keys[], unsigned int count, unsigned int capacity)
+{
+	OSDictionary* dictionary = withCapacity(MAX(count, capacity));
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		dictionary->setObject(keys[i], objects[i]);
+	}
+
+	return dictionary;
+}
+
+OSDictionary* OSDictionary::withDictionary(const OSDictionary* dictionary, unsigned int capacity)
+{
+	OSDictionary* copy = withCapacity(MAX(dictionary->getCount(), capacity));
+
+	copy->merge(dictionary);
+
+	return copy;
+}
+
+OSObject* OSDictionary::getObject(const char* key) const
+{
+	for (size_t i = 0; i < mEntries.size(); i++)
+	{
+		if (strcmp(mEntries[i].first->getCStringNoCopy(), key) == 0)
+		{
+			return mEntries[i].second;
+		}
+	}
+
+	return NULL;
+}
+
+OSObject* OSDictionary::getObject(const OSSymbol* key) const
+{
+	// Symbols are unique, as in libkern a pointer compare does.
+	for (size_t i = 0; key && i < mEntries.size(); i++)
+	{
+		if (mEntries[i].first == key)
+		{
+			return mEntries[i].second;
+		}
+	}
+
+	return NULL;
+}
+
+OSObject* OSDictionary::getObject(const OSString* key) const
+{
+	return key ? getObject(key->getCStringNoCopy()) : NULL;
+}
+
+bool OSDictionary::setObject(const OSSymbol* key, const OSObject* object)
+{
+	if (!key || !object)
+	{
+		return false;
+	}
+
+	object->retain();
+
+	for (size_t i = 0; i < mEntries.size(); i++)
+	{
+		if (mEntries[i].first == key)
+		{
+			mEntries[i].second->release();
+			mEntries[i].second = (OSObject *)object;
+			return true;
+		}
+	}
+
+	key->retain();
+	mEntries.push_back(std::make_pair(key, (OSObject *)object));
+
+	return true;
+}
+
+bool OSDictionary::setObject(const char* key, const OSObject* object)
+{
+	const OSSymbol* symbol = key ? OSSymbol::withCString(key) : NULL;
+	bool result = setObject(symbol, object);
+
+	OSSafeRelease(symbol);
+
+	return result;
+}
+
+bool OSDictionary::setObject(const OSString* key, const OSObject* object)
+{
+	return key && setObject(key->getCStringNoCopy(), object);
+}
+
+void OSDictionary::removeObject(const char* key)
+{
+	for (size_t i = 0; i < mEntries.size(); i++)
+	{
+		if (strcmp(mEntries[i].first->getCStringNoCopy(), key) == 0)
+		{
+			mEntries[i].first->release();
+			mEntries[i].second->release();
+			mEntries.erase(mEntries.begin() + i);
+			return;
+		}
+	}
+}
+
+void OSDictionary::removeObject(const OSSymbol* key)
+{
+	removeObject(key->getCStringNoCopy());
+}
+
+void OSDictionary::removeObject(const OSString* key)
+{
+	removeObject(key->getCStringNoCopy());
+}
+
+bool OSDictionary::merge(const OSDictionary* dictionary)
+{
+	for (size_t i = 0; dictionary && i < dictionary->mEntries.size(); i++)
+	{
+		setObject(dictionary->mEntries[i].first, dictionary->mEntries[i].second);
+	}
+
+	return dictionary != NULL;
+}
+
+void OSDictionary::flushCollection()
+{
+	for (size_t i = 0; i < mEntries.size(); i++)
+	{
+		mEntries[i].first->release();
+		mEntries[i].second->release();
+	}
+
+	mEntries.clear();
+}
+
+unsigned int OSDictionary::getCount() const
+{
+	return (unsigned int)mEntries.size();
+}
+
+const OSSymbol* OSDictionary::keyAt(unsigned int index) const
+{
+	return index < mEntries.size() ? mEntries[index].first : NULL;
+}
+
+//==============================================================================
+
+OSArray::~OSArray()
+{
+	for (size_t i = 0; i < mObjects.size(); i++)
+	{
+		mObjects[i]->release();
+	}
+}
+
+OSArray* OSArray::withCapacity(unsigned int capacity)
+{
+	OSArray* array = new OSArray;
+
+	array->mObjects.reserve(capacity);
+
+	return array;
+}
+
+OSObject* OSArray::getObject(unsigned int index) const
+{
+	return index < mObjects.size() ? mObjects[index] : NULL;
+}
+
+bool OSArray::setObject(const OSObject* object)
+{
+	if (!object)
+	{
+		return false;
+	}
+
+	object->retain();
+	mObjects.push_back((OSObject *)object);
+
+	return true;
+}
+
+unsigned int OSArray::getCount() const
+{
+	return (unsigned int)mObjects.size();
+}
+
+//==============================================================================
+
+OSSet::~OSSet()
+{
+	for (size_t i = 0; i < mObjects.size(); i++)
+	{
+		mObjects[i]->release();
+	}
+}
+
+OSSet* OSSet::withCapacity(unsigned int capacity)
+{
+	OSSet* set = new OSSet;
+
+	set->mObjects.reserve(capacity);
+
+	return set;
+}
+
+OSObject* OSSet::getAnyObject() const
+{
+	return mObjects.empty() ? NULL : mObjects[0];
+}
+
+OSObject* OSSet::getObject(unsigned int index) const
+{
+	return index < mObjects.size() ? mObjects[index] : NULL;
+}
+
+bool OSSet::setObject(const OSObject* object)
+{
+	if (!object)
+	{
+		return false;
+	}
+
+	if (!containsObject(object))
+	{
+		object->retain();
+		mObjects.push_back((OSObject *)object);
+	}
+
+	return true;
+}
+
+bool OSSet::merge(const OSSet* set)
+{
+	for (size_t i = 0; i < set->mObjects.size(); i++)
+	{
+		setObject(set->mObjects[i]);
+	}
+
+	return true;
+}
+
+bool OSSet::containsObject(const OSObject* object) const
+{
+	for (size_t i = 0; i < mObjects.size(); i++)
+	{
+		if (mObjects[i] == object || mObjects[i]->isEqualTo(object))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void OSSet::removeObject(const OSObject* object)
+{
+	for (size_t i = 0; i < mObjects.size(); i++)
+	{
+		if (mObjects[i] == object || mObjects[i]->isEqualTo(object))
+		{
+			mObjects[i]->release();
+			mObjects.erase(mObjects.begin() + i);
+			return;
+		}
+	}
+}
+
+unsigned int OSSet::getCount() const
+{
+	return (unsigned int)mObjects.size();
+}
+
+//==============================================================================
+
+OSCollectionIterator::~OSCollectionIterator()
+{
+	OSSafeRelease(mCollection);
+}
+
+OSCollectionIterator* OSCollectionIterator::withCollection(const OSCollection* collection)
+{
+	if (!collection)
+	{
+		return NULL;
+	}
+
+	OSCollectionIterator* iterator = new OSCollectionIterator;
+
+	collection->retain();
+	iterator->mCollection = collection;
+	iterator->mIndex = 0;
+
+	return iterator;
+}
+
+OSObject* OSCollectionIterator::getNextObject()
+{
+	unsigned int index = mIndex++;
+	const OSDictionary* dictionary;
+	const OSArray* array;
+	const OSSet* set;
+
+	// Dictionaries hand out their keys.
+	if ((dictionary = dynamic_cast<const OSDictionary *>(mCollection)))
+	{
+		return (OSObject *)dictionary->keyAt(index);
+	}
+
+	if ((array = dynamic_cast<const OSArray *>(mCollection)))
+	{
+		return array->getObject(index);
+	}
+
+	if ((set = dynamic_cast<const OSSet *>(mCollection)))
+	{
+		return set->getObject(index);
+	}
+
+	return NULL;
+}
+
+void OSCollectionIterator::reset()
+{
+	mIndex = 0;
+}
+
+//==============================================================================
+
+OSSerialize* OSSerialize::withCapacity(unsigned int capacity)
+{
+	OSSerialize* s = new OSSerialize;
+
+	s->mText.reserve(capacity);
+
+	return s;
+}
+
+char* OSSerialize::text() const
+{
+	return (char *)mText.c_str();
+}
+
+bool OSSerialize::addString(const char* string)
+{
+	mText += string;
+
+	return true;
+}
+
+bool OSSerialize::addChar(const char c)
+{
+	mText += c;
+
+	return true;
+}
+
+unsigned int OSSerialize::getLength() const
+{
+	return (unsigned int)mText.size() + 1;
+}
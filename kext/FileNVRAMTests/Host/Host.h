@@ -0,0 +1,745 @@
+/***
+ * Host.h
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Just enough of the kernel, libkern and IOKit to build FileNVRAM as a user
+ * space program, the helpers on their own or FileNVRAM.cpp with all of them. The
+ * headers under Host/ all come here. Collections own real storage and count
+ * references, files live in memory (hostFiles), see Host.cpp. Work loops, timers
+ * and thread calls are in HostIOKit.cpp: timers only fire from hostAdvance().
+ */
+
+#ifndef FileNVRAMTests_Host_h
+#define FileNVRAMTests_Host_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <new>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//==============================================================================
+// Types and constants.
+
+typedef uint8_t		UInt8;
+typedef uint16_t	UInt16;
+typedef uint32_t	UInt32;
+typedef uint64_t	UInt64;
+typedef int8_t		SInt8;
+typedef int16_t		SInt16;
+typedef int32_t		SInt32;
+typedef int64_t		SInt64;
+
+typedef int			kern_return_t;
+typedef kern_return_t	IOReturn;
+typedef uint32_t	IOOptionBits;
+typedef uint64_t	IOByteCount;
+typedef unsigned int	boolean_t;
+typedef uint64_t	AbsoluteTime;
+
+typedef struct vfs_context	*vfs_context_t;
+typedef struct vnode		*vnode_t;
+typedef struct proc			*proc_t;
+typedef struct ucred		*kauth_cred_t;
+typedef struct task			*task_t;
+typedef struct thread_call	*thread_call_t;
+typedef void				*thread_call_param_t;
+typedef void (*thread_call_func_t)(thread_call_param_t, thread_call_param_t);
+typedef struct IOLock		IOLock;
+typedef struct IORWLock		IORWLock;
+typedef int					wait_result_t;
+
+#define kIOReturnSuccess		0
+#define kIOReturnError			((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory		((IOReturn)0xe00002bd)
+#define kIOReturnNotPrivileged	((IOReturn)0xe00002c1)
+#define kIOReturnBadArgument	((IOReturn)0xe00002c2)
+#define kIOReturnNoSpace		((IOReturn)0xe00002c4)
+#define kIOReturnUnsupported	((IOReturn)0xe00002c7)
+#define kIOReturnIOError		((IOReturn)0xe00002ca)
+#define kIOReturnBusy			((IOReturn)0xe00002d5)
+#define kIOReturnTimeout		((IOReturn)0xe00002d6)
+#define kIOReturnNotReady		((IOReturn)0xe00002d8)
+#define kIOReturnNotPermitted	((IOReturn)0xe00002e2)
+#define kIOReturnNotFound		((IOReturn)0xe00002f0)
+#define KERN_SUCCESS			0
+
+#ifndef MIN
+	#define MIN(a, b)	(((a) < (b)) ? (a) : (b))
+	#define MAX(a, b)	(((a) > (b)) ? (a) : (b))
+#endif
+
+#ifndef PAGE_SIZE
+	#define PAGE_SIZE	4096
+#endif
+
+#ifndef EFTYPE
+	#define EFTYPE		79
+#endif
+
+#define THREAD_UNINT		0
+#define THREAD_INTERRUPTIBLE	1
+#define THREAD_AWAKENED		0
+#define THREAD_TIMED_OUT	1
+#define NSEC_PER_USEC		1000ull
+#define NSEC_PER_MSEC		1000000ull
+#define kMicrosecondScale	1000
+#define kMillisecondScale	1000000
+
+// vnode flags the host doesn't have.
+#define FREAD			0x0001
+#define FWRITE			0x0002
+#define FWASWRITTEN		0x10000
+#define VREG			1
+#define VDIR			2
+#define MNT_WAIT		1
+#define IO_UNIT			0x0001
+#define IO_APPEND		0x0002
+#define IO_SYNC			0x0004
+#define IO_NODELOCKED	0x0008
+#define IO_NOCACHE		0x0040
+#define UIO_SYSSPACE	2
+#define VNODE_LOOKUP_NOFOLLOW	1
+#define DELETE			2
+#define ISLASTCN		0x00008000
+
+enum uio_rw { UIO_READ = 0, UIO_WRITE = 1 };
+
+struct componentname
+{
+	uint32_t	cn_nameiop;
+	uint32_t	cn_flags;
+	char*		cn_nameptr;
+	int			cn_namelen;
+};
+
+struct vnode_attr
+{
+	uint64_t	va_data_size;
+	uint64_t	va_mode;
+};
+
+#define VATTR_INIT(v)			do { bzero((v), sizeof(*(v))); } while (0)
+#define VATTR_WANTED(v, a)		do { } while (0)
+#define VATTR_SET(v, a, x)		do { (v)->a = (x); } while (0)
+
+// kauth, only what FileNVRAM.h declares with.
+typedef struct kauth_listener	*kauth_listener_t;
+typedef int						kauth_action_t;
+typedef int (*kauth_scope_callback_t)(kauth_cred_t, void *, kauth_action_t, uintptr_t, uintptr_t, uintptr_t, uintptr_t);
+
+#define KAUTH_SCOPE_FILEOP		"com.apple.kauth.fileop"
+#define KAUTH_RESULT_ALLOW		1
+#define KAUTH_RESULT_DENY		2
+#define KAUTH_RESULT_DEFER		3
+
+// sysctl, a request copies out into oldptr (a plain pointer here).
+struct sysctl_req
+{
+	uint64_t	oldptr;
+	size_t		oldlen;
+	uint64_t	newptr;
+	size_t		oldidx;
+};
+
+struct sysctl_oid		{ int unused; };
+struct sysctl_oid_list	{ int unused; };
+
+#define USER_ADDR_NULL		0
+#define OID_AUTO			0
+#define CTLFLAG_RD			1
+#define CTLFLAG_RW			3
+#define CTLFLAG_LOCKED		4
+#define CTLTYPE_OPAQUE		5
+#define SYSCTL_PROC(parent, nbr, name, access, ptr, arg, handler, fmt, descr)	struct sysctl_oid sysctl_##parent##_##name = { 0 }
+
+// SHA-1, only declared.
+typedef struct { uint32_t state[5]; uint8_t buffer[64]; uint64_t count; } SHA1_CTX;
+#define SHA_DIGEST_LENGTH	20
+
+//==============================================================================
+// Kernel and IOKit functions, see Host.cpp.
+
+extern "C"
+{
+	void	*IOMalloc(size_t size);
+	void	IOFree(void* pointer, size_t size);
+	void	*IOMallocAligned(size_t size, size_t alignment);
+	void	IOFreeAligned(void* pointer, size_t size);
+	void	IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+	void	IOSleep(unsigned milliseconds);
+
+	IOLock	*IOLockAlloc(void);
+	void	IOLockFree(IOLock* lock);
+	void	IOLockLock(IOLock* lock);
+	void	IOLockUnlock(IOLock* lock);
+	wait_result_t	IOLockSleep(IOLock* lock, void* event, UInt32 interruptible);
+	wait_result_t	IOLockSleepDeadline(IOLock* lock, void* event, AbsoluteTime deadline, UInt32 interruptible);
+	void	IOLockWakeup(IOLock* lock, void* event, bool oneThread);
+	IORWLock	*IORWLockAlloc(void);
+	void	IORWLockFree(IORWLock* lock);
+	void	IORWLockRead(IORWLock* lock);
+	void	IORWLockWrite(IORWLock* lock);
+	void	IORWLockUnlock(IORWLock* lock);
+
+	uint64_t	mach_absolute_time(void);
+	void	absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result);
+	void	nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result);
+	void	clock_get_uptime(uint64_t* result);
+	void	clock_interval_to_deadline(uint32_t interval, uint32_t scale, uint64_t* result);
+	void	clock_interval_to_absolutetime_interval(uint32_t interval, uint32_t scale, uint64_t* result);
+
+	SInt32	OSIncrementAtomic(volatile SInt32* address);
+	SInt32	OSDecrementAtomic(volatile SInt32* address);
+	SInt32	OSAddAtomic(SInt32 amount, volatile SInt32* address);
+	SInt64	OSAddAtomic64(SInt64 amount, volatile SInt64* address);
+	SInt64	OSIncrementAtomic64(volatile SInt64* address);
+	bool	OSCompareAndSwap(UInt32 oldValue, UInt32 newValue, volatile UInt32* address);
+	bool	OSCompareAndSwap64(UInt64 oldValue, UInt64 newValue, volatile UInt64* address);
+	bool	OSCompareAndSwapPtr(void* oldValue, void* newValue, void* volatile* address);
+	void	OSMemoryBarrier(void);
+
+	int		cpu_number(void);
+	task_t	current_task(void);
+	int		proc_selfpid(void);
+	int		proc_pid(proc_t proc);
+	void	proc_name(int pid, char* buffer, int size);
+	int		PE_parse_boot_argn(const char* name, void* value, int size);
+
+	thread_call_t	thread_call_allocate(thread_call_func_t function, thread_call_param_t parameter);
+	boolean_t	thread_call_free(thread_call_t call);
+	boolean_t	thread_call_enter(thread_call_t call);
+	boolean_t	thread_call_enter_delayed(thread_call_t call, uint64_t deadline);
+	boolean_t	thread_call_cancel(thread_call_t call);
+	boolean_t	thread_call_cancel_wait(thread_call_t call);
+
+	kauth_listener_t	kauth_listen_scope(const char* identifier, kauth_scope_callback_t callback, void* data);
+	void	kauth_unlisten_scope(kauth_listener_t listener);
+
+	size_t	strlcpy(char* destination, const char* source, size_t size);
+	size_t	strlcat(char* destination, const char* source, size_t size);
+
+	vfs_context_t	vfs_context_current(void);
+	proc_t	vfs_context_proc(vfs_context_t ctx);
+	kauth_cred_t	vfs_context_ucred(vfs_context_t ctx);
+	int		vnode_open(const char* path, int flags, int mode, int lookupFlags, vnode_t* vpp, vfs_context_t ctx);
+	int		vnode_close(vnode_t vp, int flags, vfs_context_t ctx);
+	int		vnode_isreg(vnode_t vp);
+	int		vnode_getattr(vnode_t vp, struct vnode_attr* attributes, vfs_context_t ctx);
+	int		vnode_setsize(vnode_t vp, off_t size, int flags, vfs_context_t ctx);
+	vnode_t	vfs_rootvnode(void);
+	int		vnode_put(vnode_t vp);
+	int		vn_rdwr(int rw, vnode_t vp, char* base, int length, off_t offset, int segment, int flags, kauth_cred_t cred, int* residual, proc_t proc);
+	int		VNOP_FSYNC(vnode_t vp, int waitfor, vfs_context_t ctx);
+	int		vnode_lookup(const char* path, int flags, vnode_t* vpp, vfs_context_t ctx);
+	int		VNOP_REMOVE(vnode_t dvp, vnode_t vp, struct componentname* cnp, int flags, vfs_context_t ctx);
+
+	void	sysctl_register_oid(struct sysctl_oid* oid);
+	void	sysctl_unregister_oid(struct sysctl_oid* oid);
+	int		SYSCTL_OUT(struct sysctl_req* request, const void* pointer, size_t length);
+
+	void	SHA1Init(SHA1_CTX* context);
+	void	SHA1Update(SHA1_CTX* context, const void* data, size_t length);
+	void	SHA1Final(void* digest, SHA1_CTX* context);
+}
+
+//==============================================================================
+// libkern containers. Everything is created with one reference and deleted when
+// the last one is released, except symbols (interned for good) and booleans.
+
+class OSMetaClass
+{
+public:
+	explicit OSMetaClass(const char* name);
+
+	const char *getClassName() const;
+
+private:
+	std::string mName;
+};
+
+class OSSerialize;
+
+class OSObject
+{
+public:
+	OSObject();
+	virtual ~OSObject();
+	virtual void retain() const;
+	virtual void release() const;
+	virtual int getRetainCount() const;
+	virtual bool serialize(OSSerialize* s) const;
+	virtual bool isEqualTo(const OSObject* object) const;
+	const OSMetaClass *getMetaClass() const;
+
+	// Zero filled, like the kernel's, constructors leave members alone.
+	static void *operator new(size_t size);
+	static void operator delete(void* pointer);
+
+private:
+	mutable std::atomic<int> mRetainCount;
+};
+
+#define OSDynamicCast(type, inst)	(dynamic_cast<type *>((OSObject *)(inst)))
+#define OSSafeReleaseNULL(inst)		do { if (inst) (inst)->release(); (inst) = NULL; } while (0)
+#define OSSafeRelease(inst)			do { if (inst) (inst)->release(); } while (0)
+#define OSDeclareDefaultStructors(className)	public: className(); virtual ~className(); private:
+#define OSDefineMetaClassAndStructors(className, superclassName)	className::className() { } className::~className() { }
+
+class OSString : public OSObject
+{
+public:
+	static OSString *withCString(const char* cString);
+	static OSString *withCStringNoCopy(const char* cString);
+	static OSString *withString(const OSString* string);
+
+	const char *getCStringNoCopy() const;
+	unsigned int getLength() const;
+	char getChar(unsigned int index) const;
+	bool isEqualTo(const char* cString) const;
+	bool isEqualTo(const OSString* string) const;
+	virtual bool isEqualTo(const OSObject* object) const;
+	virtual bool serialize(OSSerialize* s) const;
+
+protected:
+	std::string mString;
+};
+
+class OSSymbol : public OSString
+{
+public:
+	static const OSSymbol *withCString(const char* cString);
+	static const OSSymbol *withCStringNoCopy(const char* cString);
+	static const OSSymbol *withString(const OSString* string);
+	static const OSSymbol *existingSymbolForCString(const char* cString);
+
+	virtual void release() const;
+};
+
+class OSData : public OSObject
+{
+public:
+	static OSData *withCapacity(unsigned int capacity);
+	static OSData *withBytes(const void* bytes, unsigned int length);
+	static OSData *withBytesNoCopy(void* bytes, unsigned int length);
+	static OSData *withData(const OSData* data);
+
+	const void *getBytesNoCopy() const;
+	const void *getBytesNoCopy(unsigned int start, unsigned int length) const;
+	unsigned int getLength() const;
+	unsigned int getCapacity() const;
+	unsigned int ensureCapacity(unsigned int capacity);
+	bool appendBytes(const void* bytes, unsigned int length);
+	bool appendBytes(const OSData* data);
+	bool appendByte(unsigned char byte, unsigned int count);
+	bool isEqualTo(const void* bytes, unsigned int length) const;
+	virtual bool isEqualTo(const OSObject* object) const;
+
+private:
+	std::vector<unsigned char> mBytes;
+};
+
+class OSNumber : public OSObject
+{
+public:
+	static OSNumber *withNumber(unsigned long long value, unsigned int bits);
+
+	unsigned long long unsigned64BitValue() const;
+	unsigned int unsigned32BitValue() const;
+	unsigned int numberOfBits() const;
+	unsigned int numberOfBytes() const;
+	virtual bool isEqualTo(const OSObject* object) const;
+
+private:
+	unsigned long long mValue;
+	unsigned int mBits;
+};
+
+class OSBoolean : public OSObject
+{
+public:
+	explicit OSBoolean(bool value);
+	static OSBoolean *withBoolean(bool value);
+
+	bool isTrue() const;
+	bool isFalse() const;
+	bool getValue() const;
+	virtual void retain() const;
+	virtual void release() const;
+
+private:
+	bool mValue;
+};
+
+extern OSBoolean * const kOSBooleanTrue;
+extern OSBoolean * const kOSBooleanFalse;
+
+class OSCollection : public OSObject
+{
+public:
+	virtual unsigned int getCount() const = 0;
+};
+
+class OSDictionary : public OSCollection
+{
+public:
+	virtual ~OSDictionary();
+	static OSDictionary *withCapacity(unsigned int capacity);
+	static OSDictionary *withObjects(const OSObject* objects[], const OSSymbol* keys[], unsigned int count, unsigned int capacity = 0);
+	static OSDictionary *withDictionary(const OSDictionary* dictionary, unsigned int capacity = 0);
+
+	OSObject *getObject(const OSSymbol* key) const;
+	OSObject *getObject(const OSString* key) const;
+	OSObject *getObject(const char* key) const;
+	bool setObject(const OSSymbol* key, const OSObject* object);
+	bool setObject(const OSString* key, const OSObject* object);
+	bool setObject(const char* key, const OSObject* object);
+	void removeObject(const OSSymbol* key);
+	void removeObject(const OSString* key);
+	void removeObject(const char* key);
+	bool merge(const OSDictionary* dictionary);
+	virtual void flushCollection();
+	virtual unsigned int getCount() const;
+
+	const OSSymbol *keyAt(unsigned int index) const;
+
+private:
+	std::vector<std::pair<const OSSymbol*, OSObject*> > mEntries;
+};
+
+class OSArray : public OSCollection
+{
+public:
+	virtual ~OSArray();
+	static OSArray *withCapacity(unsigned int capacity);
+
+	OSObject *getObject(unsigned int index) const;
+	bool setObject(const OSObject* object);
+	virtual unsigned int getCount() const;
+
+private:
+	std::vector<OSObject*> mObjects;
+};
+
+class OSSet : public OSCollection
+{
+public:
+	virtual ~OSSet();
+	static OSSet *withCapacity(unsigned int capacity);
+
+	OSObject *getAnyObject() const;
+	OSObject *getObject(unsigned int index) const;
+	bool setObject(const OSObject* object);
+	bool merge(const OSSet* set);
+	bool containsObject(const OSObject* object) const;
+	void removeObject(const OSObject* object);
+	virtual unsigned int getCount() const;
+
+private:
+	std::vector<OSObject*> mObjects;
+};
+
+class OSIterator : public OSObject
+{
+public:
+	virtual OSObject *getNextObject() = 0;
+	virtual void reset() = 0;
+};
+
+class OSCollectionIterator : public OSIterator
+{
+public:
+	virtual ~OSCollectionIterator();
+	static OSCollectionIterator *withCollection(const OSCollection* collection);
+
+	virtual OSObject *getNextObject();
+	virtual void reset();
+
+private:
+	const OSCollection* mCollection;
+	unsigned int mIndex;
+};
+
+class OSSerialize : public OSObject
+{
+public:
+	static OSSerialize *withCapacity(unsigned int capacity);
+
+	char *text() const;
+	bool addString(const char* string);
+	bool addChar(const char c);
+	unsigned int getLength() const;
+
+private:
+	std::string mText;
+};
+
+OSObject *OSUnserializeXML(const char* buffer, OSString** errorString = NULL);
+OSObject *OSUnserializeXML(const char* buffer, size_t bufferSize, OSString** errorString = NULL);
+
+//==============================================================================
+// IOKit, see HostIOKit.cpp. Registry entries keep their properties, a work loop
+// is a recursive lock (its gate), and power management and matching do nothing
+// but what FileNVRAM looks at.
+
+class IORegistryPlane;
+extern const IORegistryPlane *gIODTPlane;
+extern const IORegistryPlane *gIOServicePlane;
+extern const OSSymbol *gIOPublishNotification;
+extern const OSSymbol *gIOFirstPublishNotification;
+extern const OSSymbol *gIOMatchedNotification;
+extern const OSSymbol *gIOProviderClassKey;
+
+class IOService;
+
+class IONotifier : public OSObject
+{
+public:
+	virtual void remove();
+};
+
+typedef bool (*IOServiceMatchingNotificationHandler)(void* target, void* refCon, IOService* newService, IONotifier* notifier);
+
+class IORegistryEntry : public OSObject
+{
+public:
+	IORegistryEntry();
+	virtual ~IORegistryEntry();
+
+	static IORegistryEntry *fromPath(const char* path, const IORegistryPlane* plane = 0, char* residualPath = 0, int* residualLength = 0, IORegistryEntry* fromEntry = 0);
+
+	virtual bool init(IORegistryEntry* old, const IORegistryPlane* plane);
+	virtual bool init(OSDictionary* dictionary = 0);
+	virtual OSIterator *getChildIterator(const IORegistryPlane* plane) const;
+	virtual const char *getName(const IORegistryPlane* plane = 0) const;
+	virtual void setName(const char* name, const IORegistryPlane* plane = 0);
+	virtual bool attachToParent(IORegistryEntry* parent, const IORegistryPlane* plane);
+	virtual void detachFromParent(IORegistryEntry* parent, const IORegistryPlane* plane);
+	virtual OSDictionary *dictionaryWithProperties() const;
+	virtual bool serializeProperties(OSSerialize* s) const;
+	virtual OSObject *getProperty(const OSSymbol* key) const;
+	virtual OSObject *getProperty(const OSString* key) const;
+	virtual OSObject *getProperty(const char* key) const;
+	virtual OSObject *copyProperty(const OSSymbol* key) const;
+	virtual OSObject *copyProperty(const OSString* key) const;
+	virtual OSObject *copyProperty(const char* key) const;
+	virtual bool setProperty(const OSSymbol* key, OSObject* object);
+	virtual bool setProperty(const OSString* key, OSObject* object);
+	virtual bool setProperty(const char* key, OSObject* object);
+	virtual void removeProperty(const OSSymbol* key);
+	virtual void removeProperty(const char* key);
+	virtual void setPropertyTable(OSDictionary* table);
+	virtual OSDictionary *getPropertyTable() const;
+	virtual IOReturn setProperties(OSObject* properties);
+	virtual IOReturn callPlatformFunction(const OSSymbol* functionName, bool waitForFunction, void* param1, void* param2, void* param3, void* param4);
+
+private:
+	IOLock*				mPropertyLock;
+	OSDictionary*		mProperties;
+	std::string			mName;
+};
+
+class IOWorkLoop;
+
+class IOEventSource : public OSObject
+{
+public:
+	virtual void enable();
+	virtual void disable();
+	virtual void setWorkLoop(IOWorkLoop* workLoop);
+
+protected:
+	OSObject*			owner;
+	IOWorkLoop*			workLoop;
+
+	friend void hostAdvance(UInt32 milliseconds);
+};
+
+class IOWorkLoop : public OSObject
+{
+public:
+	IOWorkLoop();
+	virtual ~IOWorkLoop();
+
+	IOReturn addEventSource(IOEventSource* source);
+	IOReturn removeEventSource(IOEventSource* source);
+	bool inGate() const;
+	void closeGate();
+	void openGate();
+
+private:
+	void*				mGate;		// std::recursive_mutex
+	std::atomic<uint64_t>	mOwner;	// Thread in the gate, 0 for none.
+	int					mDepth;
+};
+
+typedef IOReturn (*IOCommandGateAction)(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3);
+
+class IOCommandGate : public IOEventSource
+{
+public:
+	static IOCommandGate *commandGate(OSObject* owner, IOCommandGateAction action = 0);
+
+	virtual IOReturn runCommand(void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
+	virtual IOReturn runAction(IOCommandGateAction action, void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
+
+private:
+	IOCommandGateAction	mAction;
+};
+
+class IOTimerEventSource : public IOEventSource
+{
+public:
+	typedef void (*Action)(OSObject* owner, IOTimerEventSource* sender);
+
+	virtual ~IOTimerEventSource();
+	static IOTimerEventSource *timerEventSource(OSObject* owner, Action action = 0);
+
+	virtual IOReturn setTimeoutMS(UInt32 milliseconds);
+	virtual IOReturn setTimeoutUS(UInt32 microseconds);
+	virtual void cancelTimeout();
+
+	Action				mAction;
+	uint64_t			mDeadline;	// Absolute time, 0 when not armed.
+};
+
+struct IOPMPowerState
+{
+	unsigned long	version;
+	unsigned long	capabilityFlags;
+	unsigned long	outputPowerCharacter;
+	unsigned long	inputPowerRequirement;
+	unsigned long	staticPower;
+	unsigned long	unbudgetedPower;
+	unsigned long	powerToAttain;
+	unsigned long	timeToAttain;
+	unsigned long	settleUpTime;
+	unsigned long	timeToLower;
+	unsigned long	settleDownTime;
+	unsigned long	powerDomainBudget;
+};
+
+#define kIOPMPowerOff	0
+#define kIOPMPowerOn	2
+#define kIOPMAckImplied	0
+
+class IOService : public IORegistryEntry
+{
+public:
+	virtual ~IOService();
+
+	virtual bool start(IOService* provider);
+	virtual void stop(IOService* provider);
+	virtual bool init(IORegistryEntry* old, const IORegistryPlane* plane);
+	virtual bool init(OSDictionary* dictionary = 0);
+	virtual bool passiveMatch(OSDictionary* matching, bool changesOK = false);
+	virtual IOWorkLoop *getWorkLoop() const;
+	virtual void registerService(IOOptionBits options = 0);
+	virtual void PMinit();
+	virtual void PMstop();
+	virtual IOReturn registerPowerDriver(IOService* driver, IOPMPowerState* states, unsigned long count);
+	virtual void joinPMtree(IOService* driver);
+	virtual IOReturn setPowerState(unsigned long state, IOService* device);
+	virtual IOReturn acknowledgeSetPowerState();
+	virtual void systemWillShutdown(IOOptionBits specifier);
+
+	static OSDictionary *resourceMatching(const char* name, OSDictionary* table = 0);
+	static OSDictionary *serviceMatching(const char* name, OSDictionary* table = 0);
+	static IONotifier *addMatchingNotification(const OSSymbol* type, OSDictionary* matching, IOServiceMatchingNotificationHandler handler, void* target, void* ref = 0, SInt32 priority = 0);
+
+private:
+	mutable IOWorkLoop*	mWorkLoop;
+};
+
+class IONVRAMController : public IOService
+{
+};
+
+class IODTNVRAM : public IOService
+{
+public:
+	virtual bool init(IORegistryEntry* old, const IORegistryPlane* plane);
+	virtual void registerNVRAMController(IONVRAMController* controller);
+	virtual void sync();
+	virtual bool safeToSync();
+	virtual bool serializeProperties(OSSerialize* s) const;
+	virtual OSObject *getProperty(const OSSymbol* key) const;
+	virtual OSObject *getProperty(const char* key) const;
+	virtual OSObject *copyProperty(const OSSymbol* key) const;
+	virtual OSObject *copyProperty(const char* key) const;
+	virtual bool setProperty(const OSSymbol* key, OSObject* object);
+	virtual void removeProperty(const OSSymbol* key);
+	virtual IOReturn setProperties(OSObject* properties);
+	virtual IOReturn syncOFVariables();
+	virtual IOReturn readXPRAM(IOByteCount offset, UInt8* buffer, IOByteCount length);
+	virtual IOReturn writeXPRAM(IOByteCount offset, UInt8* buffer, IOByteCount length);
+	virtual IOReturn readNVRAMProperty(IORegistryEntry* entry, const OSSymbol** name, OSData** value);
+	virtual IOReturn writeNVRAMProperty(IORegistryEntry* entry, const OSSymbol* name, OSData* value);
+	virtual OSDictionary *getNVRAMPartitions();
+	virtual IOReturn readNVRAMPartition(const OSSymbol* partitionID, IOByteCount offset, UInt8* buffer, IOByteCount length);
+	virtual IOReturn writeNVRAMPartition(const OSSymbol* partitionID, IOByteCount offset, UInt8* buffer, IOByteCount length);
+	virtual IOByteCount savePanicInfo(UInt8* buffer, IOByteCount length);
+};
+
+#define kIOClientPrivilegeAdministrator	"root"
+
+class IOUserClient : public IOService
+{
+public:
+	static IOReturn clientHasPrivilege(void* securityToken, const char* privilegeName);
+	static OSObject *copyClientEntitlement(task_t task, const char* entitlement);
+};
+
+//==============================================================================
+// Test side.
+
+extern std::map<std::string, std::string>	hostFiles;		// Path -> contents.
+extern long		hostWriteBudget;	// Bytes writes may still put on disk, -1 for no limit.
+extern int		hostWriteChunk;		// Most bytes a single vn_rdwr() moves, 0 for no limit.
+extern int		hostRdwrCalls;
+extern int		hostSyncs;			// VNOP_FSYNC() calls.
+extern int		hostRemoves;		// VNOP_REMOVE() calls.
+extern int		hostProcNames;		// proc_name() calls, LOG() makes one per message.
+extern int		hostWriteDelay;		// Milliseconds each vn_rdwr() write takes, a slow disk.
+extern int		hostFailAlloc;		// The IOMalloc() call, counting from 1, that fails. 0 for none.
+extern bool		hostPrivileged;		// What clientHasPrivilege() says,
+extern bool		hostEntitled;		// and whether the caller has any entitlement.
+extern bool		hostRootMounted;	// vfs_rootvnode() finds /.
+
+void		hostSetCPU(int cpu);	// What cpu_number() returns on this thread.
+uint64_t	hostNanoseconds(void);	// The real clock, absolute time is this plus what hostAdvance() added.
+void		hostAdvance(UInt32 milliseconds);	// Moves absolute time on, fires the timers that are due.
+void		hostIdle(void);			// Waits until no thread call is queued or running.
+IOService	*hostProvider(void);	// Something to start() a driver on.
+
+#define CHECK(condition)																	\
+do {																						\
+	if (!(condition))																		\
+	{																						\
+		printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);				\
+		exit(1);																			\
+	}																						\
+} while (0)
+
+// Support.cpp has its own strstr().
+#define strstr nvram_strstr
+
+#endif
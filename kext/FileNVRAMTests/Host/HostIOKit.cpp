@@ -0,0 +1,837 @@
+/***
+ * HostIOKit.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * The IOKit side of Host.h, enough to start() FileNVRAM and drive it. Thread
+ * calls run on a thread of their own each, like they do in the kernel, timers
+ * fire on whichever thread calls hostAdvance(). IOBSD is always published and
+ * there is no /chosen/nvram, so start() loads nvram.plist from hostFiles.
+ */
+
+#include "Host.h"
+
+#include <pthread.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+
+extern std::atomic<uint64_t>	gHostClockOffset;		// Host.cpp
+
+const IORegistryPlane	*gIODTPlane = (const IORegistryPlane *)"IODeviceTree";
+const IORegistryPlane	*gIOServicePlane = (const IORegistryPlane *)"IOService";
+const OSSymbol			*gIOPublishNotification = OSSymbol::withCString("IOServicePublish");
+const OSSymbol			*gIOFirstPublishNotification = OSSymbol::withCString("IOServiceFirstPublish");
+const OSSymbol			*gIOMatchedNotification = OSSymbol::withCString("IOServiceMatched");
+const OSSymbol			*gIOProviderClassKey = OSSymbol::withCString("IOProviderClass");
+
+bool	hostPrivileged = true;
+bool	hostEntitled = true;
+
+static uint64_t threadID(void)
+{
+	return (uint64_t)pthread_self();
+}
+
+//==============================================================================
+// Registry entries.
+
+IORegistryEntry::IORegistryEntry() : mPropertyLock(IOLockAlloc()), mProperties(OSDictionary::withCapacity(4))
+{
+}
+
+IORegistryEntry::~IORegistryEntry()
+{
+	OSSafeReleaseNULL(mProperties);
+	IOLockFree(mPropertyLock);
+}
+
+IORegistryEntry* IORegistryEntry::fromPath(const char* path, const IORegistryPlane* plane, char* residualPath, int* residualLength, IORegistryEntry* fromEntry)
+{
+	// Kept for good, callers don't release it.
+	static IORegistryEntry* root = new IORegistryEntry;
+
+	return (strcmp(path, "/") == 0) ? root : NULL;
+}
+
+bool IORegistryEntry::init(IORegistryEntry* old, const IORegistryPlane* plane)
+{
+	return true;
+}
+
+bool IORegistryEntry::init(OSDictionary* dictionary)
+{
+	if (dictionary)
+	{
+		setPropertyTable(dictionary);
+	}
+
+	return true;
+}
+
+OSIterator* IORegistryEntry::getChildIterator(const IORegistryPlane* plane) const
+{
+	return NULL;
+}
+
+const char* IORegistryEntry::getName(const IORegistryPlane* plane) const
+{
+	return mName.c_str();
+}
+
+void IORegistryEntry::setName(const char* name, const IORegistryPlane* plane)
+{
+	mName = name;
+}
+
+bool IORegistryEntry::attachToParent(IORegistryEntry* parent, const IORegistryPlane* plane)
+{
+	return true;
+}
+
+void IORegistryEntry::detachFromParent(IORegistryEntry* parent, const IORegistryPlane* plane)
+{
+}
+
+OSDictionary* IORegistryEntry::dictionaryWithProperties() const
+{
+	IOLockLock(mPropertyLock);
+	OSDictionary* dict = OSDictionary::withDictionary(mProperties);
+	IOLockUnlock(mPropertyLock);
+
+	return dict;
+}
+
+bool IORegistryEntry::serializeProperties(OSSerialize* s) const
+{
+	OSDictionary* dict = dictionaryWithProperties();
+	bool result = dict && dict->serialize(s);
+
+	OSSafeReleaseNULL(dict);
+
+	return result;
+}
+
+OSObject* IORegistryEntry::getProperty(const OSSymbol* key) const
+{
+	IOLockLock(mPropertyLock);
+	OSObject* object = mProperties->getObject(key);
+	IOLockUnlock(mPropertyLock);
+
+	return object;
+}
+
+OSObject* IORegistryEntry::getProperty(const OSString* key) const
+{
+	return getProperty(key->getCStringNoCopy());
+}
+
+OSObject* IORegistryEntry::getProperty(const char* key) const
+{
+	IOLockLock(mPropertyLock);
+	OSObject* object = mProperties->getObject(key);
+	IOLockUnlock(mPropertyLock);
+
+	return object;
+}
+
+OSObject* IORegistryEntry::copyProperty(const OSSymbol* key) const
+{
+	IOLockLock(mPropertyLock);
+	OSObject* object = mProperties->getObject(key);
+
+	if (object)
+	{
+		object->retain();
+	}
+
+	IOLockUnlock(mPropertyLock);
+
+	return object;
+}
+
+OSObject* IORegistryEntry::copyProperty(const OSString* key) const
+{
+	return copyProperty(key->getCStringNoCopy());
+}
+
+OSObject* IORegistryEntry::copyProperty(const char* key) const
+{
+	const OSSymbol* symbol = OSSymbol::withCString(key);
+	OSObject* object = IORegistryEntry::copyProperty(symbol);
+
+	symbol->release();
+
+	return object;
+}
+
+bool IORegistryEntry::setProperty(const OSSymbol* key, OSObject* object)
+{
+	IOLockLock(mPropertyLock);
+	bool result = mProperties->setObject(key, object);
+	IOLockUnlock(mPropertyLock);
+
+	return result;
+}
+
+bool IORegistryEntry::setProperty(const OSString* key, OSObject* object)
+{
+	return setProperty(key->getCStringNoCopy(), object);
+}
+
+bool IORegistryEntry::setProperty(const char* key, OSObject* object)
+{
+	const OSSymbol* symbol = OSSymbol::withCString(key);
+	bool result = setProperty(symbol, object);
+
+	symbol->release();
+
+	return result;
+}
+
+void IORegistryEntry::removeProperty(const OSSymbol* key)
+{
+	IOLockLock(mPropertyLock);
+	mProperties->removeObject(key);
+	IOLockUnlock(mPropertyLock);
+}
+
+void IORegistryEntry::removeProperty(const char* key)
+{
+	const OSSymbol* symbol = OSSymbol::withCString(key);
+
+	removeProperty(symbol);
+	symbol->release();
+}
+
+void IORegistryEntry::setPropertyTable(OSDictionary* table)
+{
+	table->retain();
+
+	IOLockLock(mPropertyLock);
+	OSDictionary* previous = mProperties;
+	mProperties = table;
+	IOLockUnlock(mPropertyLock);
+
+	OSSafeReleaseNULL(previous);
+}
+
+OSDictionary* IORegistryEntry::getPropertyTable() const
+{
+	return mProperties;
+}
+
+IOReturn IORegistryEntry::setProperties(OSObject* properties)
+{
+	return kIOReturnUnsupported;
+}
+
+IOReturn IORegistryEntry::callPlatformFunction(const OSSymbol* functionName, bool waitForFunction, void* param1, void* param2, void* param3, void* param4)
+{
+	return kIOReturnUnsupported;
+}
+
+//==============================================================================
+// Work loops, command gates and timers.
+
+void IOEventSource::enable()
+{
+}
+
+void IOEventSource::disable()
+{
+}
+
+void IOEventSource::setWorkLoop(IOWorkLoop* loop)
+{
+	workLoop = loop;
+}
+
+IOWorkLoop::IOWorkLoop() : mGate(new std::recursive_mutex)
+{
+}
+
+IOWorkLoop::~IOWorkLoop()
+{
+	delete (std::recursive_mutex *)mGate;
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource* source)
+{
+	source->retain();
+	source->setWorkLoop(this);
+
+	return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource* source)
+{
+	source->setWorkLoop(NULL);
+	source->release();
+
+	return kIOReturnSuccess;
+}
+
+bool IOWorkLoop::inGate() const
+{
+	return mOwner == threadID();
+}
+
+void IOWorkLoop::closeGate()
+{
+	((std::recursive_mutex *)mGate)->lock();
+	mOwner = threadID();
+	mDepth++;
+}
+
+void IOWorkLoop::openGate()
+{
+	if (--mDepth == 0)
+	{
+		mOwner = 0;
+	}
+
+	((std::recursive_mutex *)mGate)->unlock();
+}
+
+IOCommandGate* IOCommandGate::commandGate(OSObject* owner, IOCommandGateAction action)
+{
+	IOCommandGate* gate = new IOCommandGate;
+
+	gate->owner = owner;
+	gate->mAction = action;
+
+	return gate;
+}
+
+IOReturn IOCommandGate::runCommand(void* arg0, void* arg1, void* arg2, void* arg3)
+{
+	return runAction(mAction, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::runAction(IOCommandGateAction action, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+	if (!workLoop)
+	{
+		return kIOReturnNotReady;
+	}
+
+	workLoop->closeGate();
+	IOReturn result = action(owner, arg0, arg1, arg2, arg3);
+	workLoop->openGate();
+
+	return result;
+}
+
+static std::mutex						sTimersLock;
+static std::set<IOTimerEventSource*>	*sTimers;
+
+IOTimerEventSource::~IOTimerEventSource()
+{
+	std::lock_guard<std::mutex> locked(sTimersLock);
+
+	sTimers->erase(this);
+}
+
+IOTimerEventSource* IOTimerEventSource::timerEventSource(OSObject* owner, Action action)
+{
+	IOTimerEventSource* timer = new IOTimerEventSource;
+	std::lock_guard<std::mutex> locked(sTimersLock);
+
+	timer->owner = owner;
+	timer->mAction = action;
+
+	if (!sTimers)
+	{
+		sTimers = new std::set<IOTimerEventSource*>;
+	}
+
+	sTimers->insert(timer);
+
+	return timer;
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 milliseconds)
+{
+	std::lock_guard<std::mutex> locked(sTimersLock);
+
+	mDeadline = mach_absolute_time() + milliseconds * NSEC_PER_MSEC;
+
+	return kIOReturnSuccess;
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 microseconds)
+{
+	std::lock_guard<std::mutex> locked(sTimersLock);
+
+	mDeadline = mach_absolute_time() + microseconds * NSEC_PER_USEC;
+
+	return kIOReturnSuccess;
+}
+
+void IOTimerEventSource::cancelTimeout()
+{
+	std::lock_guard<std::mutex> locked(sTimersLock);
+
+	mDeadline = 0;
+}
+
+void hostAdvance(UInt32 milliseconds)
+{
+	gHostClockOffset += milliseconds * NSEC_PER_MSEC;
+
+	// Earliest first, an action may set its timer again.
+	for (;;)
+	{
+		IOTimerEventSource* due = NULL;
+		uint64_t now = mach_absolute_time();
+
+		sTimersLock.lock();
+
+		for (std::set<IOTimerEventSource*>::iterator i = sTimers ? sTimers->begin() : std::set<IOTimerEventSource*>::iterator(); sTimers && i != sTimers->end(); ++i)
+		{
+			if ((*i)->mDeadline && (*i)->mDeadline <= now && (!due || (*i)->mDeadline < due->mDeadline))
+			{
+				due = *i;
+			}
+		}
+
+		if (due)
+		{
+			due->mDeadline = 0;
+			due->retain();
+		}
+
+		sTimersLock.unlock();
+
+		if (!due)
+		{
+			break;
+		}
+
+		IOWorkLoop* loop = due->workLoop;
+
+		if (loop && due->mAction)
+		{
+			loop->closeGate();
+			due->mAction(due->owner, due);
+			loop->openGate();
+		}
+
+		due->release();
+	}
+}
+
+//==============================================================================
+// Thread calls.
+
+struct thread_call
+{
+	thread_call_func_t	function;
+	thread_call_param_t	parameter;
+	bool				pending;
+	bool				running;
+	bool				stop;
+	uint64_t			deadline;	// Delayed entry, 0 for none.
+	std::thread			worker;
+};
+
+// Never destroyed, a failed CHECK() exits while workers still wait on them.
+static std::mutex				&sCallsLock = *new std::mutex;
+static std::condition_variable	&sCallsChanged = *new std::condition_variable;
+static std::set<thread_call_t>	*sCalls;
+
+static void callWorker(thread_call_t call)
+{
+	std::unique_lock<std::mutex> locked(sCallsLock);
+
+	while (!call->stop)
+	{
+		if (call->pending)
+		{
+			call->pending = false;
+			call->running = true;
+			locked.unlock();
+			call->function(call->parameter, NULL);
+			locked.lock();
+			call->running = false;
+			sCallsChanged.notify_all();
+		}
+		else if (call->deadline && call->deadline <= mach_absolute_time())
+		{
+			call->deadline = 0;
+			call->pending = true;
+		}
+		else if (call->deadline)
+		{
+			sCallsChanged.wait_for(locked, std::chrono::milliseconds(1));
+		}
+		else
+		{
+			sCallsChanged.wait(locked);
+		}
+	}
+}
+
+extern "C" thread_call_t thread_call_allocate(thread_call_func_t function, thread_call_param_t parameter)
+{
+	thread_call_t call = new thread_call();
+	std::lock_guard<std::mutex> locked(sCallsLock);
+
+	call->function = function;
+	call->parameter = parameter;
+	call->worker = std::thread(callWorker, call);
+
+	if (!sCalls)
+	{
+		sCalls = new std::set<thread_call_t>;
+	}
+
+	sCalls->insert(call);
+
+	return call;
+}
+
+extern "C" boolean_t thread_call_free(thread_call_t call)
+{
+	{
+		std::lock_guard<std::mutex> locked(sCallsLock);
+
+		call->stop = true;
+		sCalls->erase(call);
+		sCallsChanged.notify_all();
+	}
+
+	call->worker.join();
+	delete call;
+
+	return true;
+}
+
+extern "C" boolean_t thread_call_enter(thread_call_t call)
+{
+	std::lock_guard<std::mutex> locked(sCallsLock);
+	bool queued = call->pending;
+
+	call->pending = true;
+	sCallsChanged.notify_all();
+
+	return queued;
+}
+
+extern "C" boolean_t thread_call_enter_delayed(thread_call_t call, uint64_t deadline)
+{
+	std::lock_guard<std::mutex> locked(sCallsLock);
+	bool queued = call->pending || call->deadline;
+
+	call->deadline = deadline;
+	sCallsChanged.notify_all();
+
+	return queued;
+}
+
+extern "C" boolean_t thread_call_cancel(thread_call_t call)
+{
+	std::lock_guard<std::mutex> locked(sCallsLock);
+	bool queued = call->pending || call->deadline;
+
+	call->pending = false;
+	call->deadline = 0;
+
+	return queued;
+}
+
+extern "C" boolean_t thread_call_cancel_wait(thread_call_t call)
+{
+	std::unique_lock<std::mutex> locked(sCallsLock);
+	bool queued = call->pending || call->deadline;
+
+	call->pending = false;
+	call->deadline = 0;
+
+	while (call->running)
+	{
+		sCallsChanged.wait(locked);
+	}
+
+	return queued;
+}
+
+void hostIdle(void)
+{
+	std::unique_lock<std::mutex> locked(sCallsLock);
+
+	for (;;)
+	{
+		bool busy = false;
+
+		for (std::set<thread_call_t>::iterator i = sCalls ? sCalls->begin() : std::set<thread_call_t>::iterator(); sCalls && i != sCalls->end(); ++i)
+		{
+			busy = busy || (*i)->pending || (*i)->running;
+		}
+
+		if (!busy)
+		{
+			return;
+		}
+
+		sCallsChanged.wait(locked);
+	}
+}
+
+//==============================================================================
+// Services, matching and power management.
+
+IOService::~IOService()
+{
+	OSSafeReleaseNULL(mWorkLoop);
+}
+
+bool IOService::start(IOService* provider)
+{
+	return true;
+}
+
+void IOService::stop(IOService* provider)
+{
+}
+
+bool IOService::init(IORegistryEntry* old, const IORegistryPlane* plane)
+{
+	return IORegistryEntry::init(old, plane);
+}
+
+bool IOService::init(OSDictionary* dictionary)
+{
+	return IORegistryEntry::init(dictionary);
+}
+
+bool IOService::passiveMatch(OSDictionary* matching, bool changesOK)
+{
+	return false;
+}
+
+IOWorkLoop* IOService::getWorkLoop() const
+{
+	// Made by the first caller, start().
+	if (!mWorkLoop)
+	{
+		mWorkLoop = new IOWorkLoop;
+	}
+
+	return mWorkLoop;
+}
+
+void IOService::registerService(IOOptionBits options)
+{
+}
+
+void IOService::PMinit()
+{
+}
+
+void IOService::PMstop()
+{
+}
+
+IOReturn IOService::registerPowerDriver(IOService* driver, IOPMPowerState* states, unsigned long count)
+{
+	return kIOReturnSuccess;
+}
+
+void IOService::joinPMtree(IOService* driver)
+{
+}
+
+IOReturn IOService::setPowerState(unsigned long state, IOService* device)
+{
+	return kIOPMAckImplied;
+}
+
+IOReturn IOService::acknowledgeSetPowerState()
+{
+	return kIOReturnSuccess;
+}
+
+void IOService::systemWillShutdown(IOOptionBits specifier)
+{
+}
+
+OSDictionary* IOService::resourceMatching(const char* name, OSDictionary* table)
+{
+	OSDictionary* matching = table ? table : OSDictionary::withCapacity(1);
+	OSString* resource = OSString::withCString(name);
+
+	matching->setObject("IOResourceMatch", resource);
+	resource->release();
+
+	return matching;
+}
+
+OSDictionary* IOService::serviceMatching(const char* name, OSDictionary* table)
+{
+	OSDictionary* matching = table ? table : OSDictionary::withCapacity(1);
+	OSString* provider = OSString::withCString(name);
+
+	matching->setObject(gIOProviderClassKey, provider);
+	provider->release();
+
+	return matching;
+}
+
+void IONotifier::remove()
+{
+	release();
+}
+
+IONotifier* IOService::addMatchingNotification(const OSSymbol* type, OSDictionary* matching, IOServiceMatchingNotificationHandler handler, void* target, void* ref, SInt32 priority)
+{
+	IONotifier* notifier = new IONotifier;
+
+	// Everything is published already.
+	handler(target, ref, hostProvider(), notifier);
+
+	return notifier;
+}
+
+IOService* hostProvider(void)
+{
+	static IOService* provider = new IOService;
+
+	return provider;
+}
+
+//==============================================================================
+// IODTNVRAM's own, FileNVRAM overrides them.
+
+bool IODTNVRAM::init(IORegistryEntry* old, const IORegistryPlane* plane)
+{
+	return IOService::init(old, plane);
+}
+
+void IODTNVRAM::registerNVRAMController(IONVRAMController* controller)
+{
+}
+
+void IODTNVRAM::sync()
+{
+}
+
+bool IODTNVRAM::safeToSync()
+{
+	return true;
+}
+
+bool IODTNVRAM::serializeProperties(OSSerialize* s) const
+{
+	return IORegistryEntry::serializeProperties(s);
+}
+
+OSObject* IODTNVRAM::getProperty(const OSSymbol* key) const
+{
+	return IORegistryEntry::getProperty(key);
+}
+
+OSObject* IODTNVRAM::getProperty(const char* key) const
+{
+	return IORegistryEntry::getProperty(key);
+}
+
+OSObject* IODTNVRAM::copyProperty(const OSSymbol* key) const
+{
+	return IORegistryEntry::copyProperty(key);
+}
+
+OSObject* IODTNVRAM::copyProperty(const char* key) const
+{
+	return IORegistryEntry::copyProperty(key);
+}
+
+bool IODTNVRAM::setProperty(const OSSymbol* key, OSObject* object)
+{
+	return IORegistryEntry::setProperty(key, object);
+}
+
+void IODTNVRAM::removeProperty(const OSSymbol* key)
+{
+	IORegistryEntry::removeProperty(key);
+}
+
+IOReturn IODTNVRAM::setProperties(OSObject* properties)
+{
+	return kIOReturnUnsupported;
+}
+
+IOReturn IODTNVRAM::syncOFVariables()
+{
+	return kIOReturnSuccess;
+}
+
+IOReturn IODTNVRAM::readXPRAM(IOByteCount offset, UInt8* buffer, IOByteCount length)
+{
+	return kIOReturnUnsupported;
+}
+
+IOReturn IODTNVRAM::writeXPRAM(IOByteCount offset, UInt8* buffer, IOByteCount length)
+{
+	return kIOReturnUnsupported;
+}
+
+IOReturn IODTNVRAM::readNVRAMProperty(IORegistryEntry* entry, const OSSymbol** name, OSData** value)
+{
+	return kIOReturnUnsupported;
+}
+
+IOReturn IODTNVRAM::writeNVRAMProperty(IORegistryEntry* entry, const OSSymbol* name, OSData* value)
+{
+	return kIOReturnUnsupported;
+}
+
+OSDictionary* IODTNVRAM::getNVRAMPartitions()
+{
+	return NULL;
+}
+
+IOReturn IODTNVRAM::readNVRAMPartition(const OSSymbol* partitionID, IOByteCount offset, UInt8* buffer, IOByteCount length)
+{
+	return kIOReturnNotFound;
+}
+
+IOReturn IODTNVRAM::writeNVRAMPartition(const OSSymbol* partitionID, IOByteCount offset, UInt8* buffer, IOByteCount length)
+{
+	return kIOReturnSuccess;
+}
+
+IOByteCount IODTNVRAM::savePanicInfo(UInt8* buffer, IOByteCount length)
+{
+	return 0;
+}
+
+//==============================================================================
+// Privileges, and the file operation listener (never needed, / is mounted).
+
+IOReturn IOUserClient::clientHasPrivilege(void* securityToken, const char* privilegeName)
+{
+	return hostPrivileged ? kIOReturnSuccess : kIOReturnNotPrivileged;
+}
+
+OSObject* IOUserClient::copyClientEntitlement(task_t task, const char* entitlement)
+{
+	return hostEntitled ? kOSBooleanTrue : NULL;
+}
+
+extern "C" kauth_listener_t kauth_listen_scope(const char* identifier, kauth_scope_callback_t callback, void* data)
+{
+	return NULL;
+}
+
+extern "C" void kauth_unlisten_scope(kauth_listener_t listener)
+{
+}
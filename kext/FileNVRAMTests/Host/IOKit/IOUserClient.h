@@ -0,0 +1,2 @@
+/* See Host.h. */
+#include "../Host.h"
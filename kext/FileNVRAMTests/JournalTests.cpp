@@ -0,0 +1,232 @@
+/***
+ * JournalTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * JournalMode: what a restart replays from nvram.journal when its tail was torn
+ * or damaged, and which variables never wait in the journal because the
+ * bootloader only reads nvram.plist.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#define VENDOR_GUID		"4D1FDA02-38C7-4A6A-9CC6-4BCCA8B30102"
+
+//==============================================================================
+// A driver in journal mode that has written its first snapshot, so changes from
+// here on are appended to nvram.journal.
+
+static FileNVRAM* startJournal(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_JOURNAL_MODE, 1);
+	nvram->sync();
+	CHECK(nvram->mJournalSize == sizeof(NVRAMJournalHeader));
+
+	return nvram;
+}
+
+static void setRecords(FileNVRAM* nvram, int count)
+{
+	char key[64], value[32];
+
+	for (int i = 0; i < count; i++)
+	{
+		snprintf(key, sizeof(key), VENDOR_GUID NVRAM_SEPERATOR "var%d", i);
+		snprintf(value, sizeof(value), "value%d", i);
+		setString(nvram, key, value);
+	}
+
+	nvram->sync();
+}
+
+// How many of var0...varN-1 a restart sees, they have to be a prefix.
+static int replayed(int count)
+{
+	FileNVRAM* nvram = startNVRAM(false);
+	char key[64], value[32];
+	int found = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		snprintf(key, sizeof(key), VENDOR_GUID NVRAM_SEPERATOR "var%d", i);
+		snprintf(value, sizeof(value), "value%d", i);
+
+		if (hasString(nvram, key, value))
+		{
+			CHECK(found == i);
+			found++;
+		}
+	}
+
+	stopNVRAM(nvram);
+
+	return found;
+}
+
+// Offset of record n in nvram.journal.
+static size_t recordOffset(const std::string& journal, int n)
+{
+	size_t offset = sizeof(NVRAMJournalHeader);
+
+	for (int i = 0; i < n; i++)
+	{
+		NVRAMJournalRecord record;
+
+		CHECK(offset + sizeof(record) <= journal.size());
+		memcpy(&record, journal.data() + offset, sizeof(record));
+		offset += sizeof(record) + record.length;
+	}
+
+	return offset;
+}
+
+//==============================================================================
+
+static void testReplay(void)
+{
+	FileNVRAM* nvram = startJournal();
+	size_t snapshot = hostFiles[FILE_NVRAM_PATH].size();
+
+	setRecords(nvram, 5);
+	stopNVRAM(nvram);
+
+	// Appended only, nvram.plist is left as it was.
+	CHECK(hostFiles[FILE_NVRAM_PATH].size() == snapshot);
+	CHECK(!fileContains(FILE_NVRAM_PATH, "value0"));
+	CHECK(fileContains(FILE_NVRAM_JOURNAL_PATH, "value4"));
+	CHECK(replayed(5) == 5);
+}
+
+//==============================================================================
+// Cut anywhere, the records before the cut are replayed and nothing after it.
+
+static void testTorn(void)
+{
+	FileNVRAM* nvram = startJournal();
+
+	setRecords(nvram, 5);
+	stopNVRAM(nvram);
+
+	std::string plist = hostFiles[FILE_NVRAM_PATH];
+	std::string slot = hostFiles[FILE_NVRAM_SLOT_PATH];
+	std::string journal = hostFiles[FILE_NVRAM_JOURNAL_PATH];
+
+	for (size_t cut = 0; cut <= journal.size(); cut++)
+	{
+		int whole = 0;
+
+		while (whole < 5 && recordOffset(journal, whole + 1) <= cut)
+		{
+			whole++;
+		}
+
+		hostFiles[FILE_NVRAM_PATH] = plist;
+		hostFiles[FILE_NVRAM_SLOT_PATH] = slot;
+		hostFiles[FILE_NVRAM_JOURNAL_PATH] = journal.substr(0, cut);
+
+		CHECK(replayed(5) == whole);
+	}
+}
+
+//==============================================================================
+// A damaged record stops the replay there: its checksum, its length or its magic.
+
+static void testCorrupt(void)
+{
+	FileNVRAM* nvram = startJournal();
+
+	setRecords(nvram, 5);
+	stopNVRAM(nvram);
+
+	std::string plist = hostFiles[FILE_NVRAM_PATH];
+	std::string slot = hostFiles[FILE_NVRAM_SLOT_PATH];
+	std::string journal = hostFiles[FILE_NVRAM_JOURNAL_PATH];
+
+	for (int n = 0; n < 5; n++)
+	{
+		size_t record = recordOffset(journal, n);
+		size_t end = recordOffset(journal, n + 1);
+
+		for (size_t at = record; at < end; at++)
+		{
+			std::string damaged = journal;
+
+			damaged[at] ^= 0x5A;
+
+			hostFiles[FILE_NVRAM_PATH] = plist;
+			hostFiles[FILE_NVRAM_SLOT_PATH] = slot;
+			hostFiles[FILE_NVRAM_JOURNAL_PATH] = damaged;
+
+			CHECK(replayed(5) == n);
+		}
+	}
+
+	// A journal of another generation is already part of nvram.plist, or never was.
+	std::string stale = journal;
+
+	stale[offsetof(NVRAMJournalHeader, generation)] ^= 1;
+	hostFiles[FILE_NVRAM_PATH] = plist;
+	hostFiles[FILE_NVRAM_SLOT_PATH] = slot;
+	hostFiles[FILE_NVRAM_JOURNAL_PATH] = stale;
+
+	CHECK(replayed(5) == 0);
+}
+
+//==============================================================================
+// Variables the bootloader reads go to nvram.plist with the very next sync.
+
+static void testBootVariables(void)
+{
+	const char* keys[] = {
+		"boot-args",
+		APPLE_NVRAM_GUID NVRAM_SEPERATOR "csr-active-config",
+		EFI_GLOBAL_GUID NVRAM_SEPERATOR "Boot0080",
+		VENDOR_GUID NVRAM_SEPERATOR "immediate",
+	};
+
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+	{
+		FileNVRAM* nvram = startJournal();
+
+		setString(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_IMMEDIATE_KEYS, "boot-args " VENDOR_GUID NVRAM_SEPERATOR "immediate");
+		nvram->sync();
+		setString(nvram, VENDOR_GUID NVRAM_SEPERATOR "deferred", "journaled");
+		setString(nvram, keys[i], "compacted");
+		nvram->sync();
+
+		// Everything pending went with it, and the journal started over.
+		CHECK(fileContains(FILE_NVRAM_PATH, "compacted"));
+		CHECK(fileContains(FILE_NVRAM_PATH, "journaled"));
+		CHECK(hostFiles[FILE_NVRAM_JOURNAL_PATH].size() == sizeof(NVRAMJournalHeader));
+		CHECK(!nvram->mJournalCompact);
+
+		// Nothing else leaves the journal.
+		setString(nvram, VENDOR_GUID NVRAM_SEPERATOR "deferred", "again");
+		nvram->sync();
+		CHECK(!fileContains(FILE_NVRAM_PATH, "again"));
+		CHECK(fileContains(FILE_NVRAM_JOURNAL_PATH, "again"));
+
+		stopNVRAM(nvram);
+	}
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testReplay();
+	testTorn();
+	testCorrupt();
+	testBootVariables();
+
+	return 0;
+}
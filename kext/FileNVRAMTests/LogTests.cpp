@@ -0,0 +1,139 @@
+/***
+ * LogTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * LOG() does nothing, not even evaluate its arguments or look up the process
+ * name, unless its level is enabled, and levels above LOG_LEVEL_MAX never are.
+ * What each level costs a getProperty() is measured on the driver itself.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+//==============================================================================
+
+static int sEvaluated;
+
+static int evaluated(void)
+{
+	return ++sEvaluated;
+}
+
+//==============================================================================
+
+static void testLevels(void)
+{
+	UInt8 mLoggingLevel = DISABLED;
+
+	LOG(ERROR, "disabled %d\n", evaluated());
+	CHECK(sEvaluated == 0 && hostProcNames == 0);
+
+	mLoggingLevel = ERROR;
+
+	LOG(INFO, "info %d\n", evaluated());
+	LOG(NOTICE, "notice %d\n", evaluated());
+	CHECK(sEvaluated == 0 && hostProcNames == 0);
+	CHECK(!LOG_ENABLED(INFO));
+
+	LOG(ERROR, "error %d\n", evaluated());
+	CHECK(sEvaluated == 1 && hostProcNames == 1);
+
+	mLoggingLevel = NOTICE;
+
+	LOG(NOTICE, "notice %d\n", evaluated());
+	CHECK(sEvaluated == 2 && hostProcNames == 2);
+	CHECK(LOG_ENABLED(INFO));
+}
+
+//==============================================================================
+// Per call, for a variable that is set. Enabled levels print to /dev/null here,
+// the kernel log costs more still.
+
+static void benchLevels(void)
+{
+	const int count = 100000;
+	const UInt8 levels[] = { DISABLED, ERROR, INFO, NOTICE };
+	uint64_t ns[4];
+	FileNVRAM* nvram = startNVRAM();
+
+	setString(nvram, "boot-args", "-v keepsyms=1");
+
+	fflush(stdout);
+
+	int out = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+
+	CHECK(out >= 0 && null >= 0 && dup2(null, STDOUT_FILENO) >= 0);
+
+	for (int i = 0; i < 4; i++)
+	{
+		nvram->mLoggingLevel = levels[i];
+
+		uint64_t start = hostNanoseconds();
+
+		for (int n = 0; n < count; n++)
+		{
+			CHECK(nvram->getProperty("boot-args"));
+		}
+
+		ns[i] = (hostNanoseconds() - start) / count;
+	}
+
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	close(null);
+	close(out);
+
+	nvram->mLoggingLevel = ERROR;
+	stopNVRAM(nvram);
+
+	// getProperty() logs nothing at ERROR, the default, INFO serializes the value.
+	CHECK(ns[1] < ns[2]);
+
+	printf("  getProperty(): disabled %llu ns, error %llu ns, info %llu ns, notice %llu ns\n",
+		   (unsigned long long)ns[0], (unsigned long long)ns[1], (unsigned long long)ns[2], (unsigned long long)ns[3]);
+}
+
+//==============================================================================
+// As if built with -DLOG_LEVEL_MAX=ERROR: INFO and NOTICE are constant false.
+
+#undef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX	ERROR
+
+static_assert(!((INFO) <= LOG_LEVEL_MAX), "INFO is compiled out");
+
+static void testCompiledOut(void)
+{
+	UInt8 mLoggingLevel = NOTICE;
+
+	sEvaluated = hostProcNames = 0;
+
+	LOG(INFO, "info %d\n", evaluated());
+	LOG(NOTICE, "notice %d\n", evaluated());
+	CHECK(sEvaluated == 0 && hostProcNames == 0);
+	CHECK(!LOG_ENABLED(INFO));
+
+	LOG(ERROR, "error %d\n", evaluated());
+	CHECK(sEvaluated == 1 && hostProcNames == 1);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testLevels();
+	benchLevels();
+	testCompiledOut();
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+/***
+ * PolicyTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * ImmediateKeys/VolatileKeys patterns: how a setting is split, prefixes, patterns
+ * with and without a GUID, and FILE_NVRAM_GUID, which nothing matches.
+ */
+
+#include "Host.h"
+#include "FileIO.cpp"
+#include "Support.cpp"
+#include "Stats.cpp"
+#include "Policy.cpp"
+
+#define VENDOR_GUID		"4D1FDA02-38C7-4A6A-9CC6-4BCCA8B30102"
+
+static OSArray* parse(const char* setting)
+{
+	OSString* string = OSString::withCString(setting);
+	OSArray* patterns = policyParse(string);
+
+	string->release();
+
+	return patterns;
+}
+
+// policyMatch(), and policyMatchEntry() on the same key has to agree.
+static bool matches(const char* setting, const char* key)
+{
+	OSArray* patterns = parse(setting);
+	const char* separator = strstr(key, NVRAM_SEPERATOR);
+	std::string guid = separator ? std::string(key, separator - key) : "";
+	const OSSymbol* guidSymbol = OSSymbol::withCString(guid.c_str());
+	const OSSymbol* name = OSSymbol::withCString(separator ? separator + strlen(NVRAM_SEPERATOR) : key);
+	bool result = policyMatch(patterns, key);
+
+	CHECK(policyMatchEntry(patterns, guidSymbol, name) == result);
+
+	guidSymbol->release();
+	name->release();
+	patterns->release();
+
+	return result;
+}
+
+//==============================================================================
+
+static void testParse(void)
+{
+	OSArray* patterns = parse(" boot-args,csr*,, " VENDOR_GUID ":x ");
+
+	CHECK(patterns->getCount() == 3);
+	CHECK(((OSString *)patterns->getObject(0))->isEqualTo("boot-args"));
+	CHECK(((OSString *)patterns->getObject(1))->isEqualTo("csr*"));
+	CHECK(((OSString *)patterns->getObject(2))->isEqualTo(VENDOR_GUID ":x"));
+	patterns->release();
+
+	// nvram GUID:ImmediateKeys=a%00b sets data.
+	OSData* data = OSData::withBytes("a\0b", 3);
+
+	patterns = policyParse(data);
+	CHECK(patterns->getCount() == 2);
+	patterns->release();
+	data->release();
+
+	OSNumber* number = OSNumber::withNumber(1, 32);
+
+	CHECK(policyParse(number) == NULL);
+	number->release();
+
+	// A pattern longer than any stack buffer would have been.
+	std::string longer(100000, 'k');
+
+	patterns = parse(("a " + longer + " b").c_str());
+	CHECK(patterns->getCount() == 3 && ((OSString *)patterns->getObject(1))->getLength() == longer.size());
+	patterns->release();
+}
+
+//==============================================================================
+
+static void testMatch(void)
+{
+	// Without a GUID: the name, in every namespace.
+	CHECK(matches("boot-args", "boot-args"));
+	CHECK(matches("boot-args", APPLE_NVRAM_GUID ":boot-args"));
+	CHECK(matches("boot-args", VENDOR_GUID ":boot-args"));
+	CHECK(!matches("boot-args", "boot-args2"));
+	CHECK(!matches("boot-args", APPLE_NVRAM_GUID ":boot"));
+
+	// A '*' at the end is a prefix, of the name.
+	CHECK(matches("csr*", APPLE_NVRAM_GUID ":csr-active-config"));
+	CHECK(matches("csr*", "csr"));
+	CHECK(!matches("csr*", "cs"));
+	CHECK(!matches("7C43*", APPLE_NVRAM_GUID ":csr-active-config"));
+	CHECK(matches("*", "anything"));
+	CHECK(matches("*", VENDOR_GUID ":anything"));
+
+	// With a GUID: only in that namespace, never a plain key.
+	CHECK(matches(APPLE_NVRAM_GUID ":csr*", APPLE_NVRAM_GUID ":csr-active-config"));
+	CHECK(!matches(APPLE_NVRAM_GUID ":csr*", VENDOR_GUID ":csr-active-config"));
+	CHECK(!matches(APPLE_NVRAM_GUID ":csr*", "csr-active-config"));
+	CHECK(matches(APPLE_NVRAM_GUID ":*", APPLE_NVRAM_GUID ":x"));
+	CHECK(!matches(APPLE_NVRAM_GUID ":*", VENDOR_GUID ":x"));
+	CHECK(matches(VENDOR_GUID ":x", VENDOR_GUID ":x"));
+	CHECK(!matches(VENDOR_GUID ":x", VENDOR_GUID ":xy"));
+	CHECK(!matches(VENDOR_GUID ":x", "4D1FDA02:x"));
+
+	// One of several.
+	CHECK(matches("a, b," VENDOR_GUID ":c", VENDOR_GUID ":c"));
+	CHECK(matches("a, b," VENDOR_GUID ":c", "b"));
+
+	// The settings are never matched, whatever the pattern.
+	CHECK(!matches("*", FILE_NVRAM_GUID ":" NVRAM_SHARD_MODE));
+	CHECK(!matches(NVRAM_SHARD_MODE, FILE_NVRAM_GUID ":" NVRAM_SHARD_MODE));
+	CHECK(!matches(FILE_NVRAM_GUID ":*", FILE_NVRAM_GUID ":" NVRAM_SHARD_MODE));
+	CHECK(!matches(FILE_NVRAM_GUID ":" NVRAM_SHARD_MODE, FILE_NVRAM_GUID ":" NVRAM_SHARD_MODE));
+	CHECK(matches(NVRAM_SHARD_MODE, VENDOR_GUID ":" NVRAM_SHARD_MODE));
+
+	CHECK(!policyMatch(NULL, "boot-args"));
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testParse();
+	testMatch();
+
+	return 0;
+}
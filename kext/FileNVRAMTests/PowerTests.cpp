@@ -0,0 +1,110 @@
+/***
+ * PowerTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * setPowerState(): going to sleep flushes what is pending, for no longer than
+ * SleepBudget, and nothing is written while asleep. Waking up catches up. The
+ * budget is measured on a disk slowed down with hostWriteDelay.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#define VENDOR_GUID		"4D1FDA02-38C7-4A6A-9CC6-4BCCA8B30102"
+
+static UInt32 sleepFor(FileNVRAM* nvram)
+{
+	uint64_t start = hostNanoseconds();
+
+	CHECK(nvram->setPowerState(POWER_STATE_OFF, NULL) == kIOPMAckImplied);
+	CHECK(!nvram->mSafeToSync);
+
+	return (UInt32)((hostNanoseconds() - start) / NSEC_PER_MSEC);
+}
+
+//==============================================================================
+
+static void testSleep(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+	SInt64 base = syncs(nvram);
+
+	// Nothing pending, nothing written.
+	sleepFor(nvram);
+	CHECK(syncs(nvram) == base);
+	nvram->setPowerState(POWER_STATE_ON, NULL);
+	CHECK(nvram->mSafeToSync && syncs(nvram) == base);
+
+	// A change still waiting for the timer is on disk before sleep.
+	setString(nvram, VENDOR_GUID NVRAM_SEPERATOR "before", "sleep");
+	CHECK(!fileContains(FILE_NVRAM_PATH, "before"));
+	sleepFor(nvram);
+	CHECK(nvram->mStats->ops[kNVRAMStatSync].count == base + 1);
+	CHECK(fileContains(FILE_NVRAM_PATH, "before") && !nvram->mDirty);
+
+	// Asleep: the timer doesn't write, waking up does.
+	setString(nvram, VENDOR_GUID NVRAM_SEPERATOR "while", "asleep");
+	hostAdvance(NVRAM_SYNC_DEADLINE_MS * 2);
+	CHECK(!fileContains(FILE_NVRAM_PATH, "while") && nvram->mDirty);
+
+	nvram->setPowerState(POWER_STATE_ON, NULL);
+	CHECK(syncs(nvram) > base + 1);
+	CHECK(fileContains(FILE_NVRAM_PATH, "while") && !nvram->mDirty);
+
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// Each write takes 100 ms, a sync makes several. With a budget of 20 ms sleep goes
+// ahead while the flush is still writing, without one it waits for all of it.
+
+static void testBudget(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_SLEEP_BUDGET, 20);
+	nvram->sync();
+
+	hostWriteDelay = 100;
+	setString(nvram, VENDOR_GUID NVRAM_SEPERATOR "slow", "disk");
+
+	UInt32 elapsed = sleepFor(nvram);
+
+	CHECK(elapsed >= 20 && elapsed < 150);
+	hostIdle();
+	CHECK(fileContains(FILE_NVRAM_PATH, "slow"));
+	printf("  sleep with a 20 ms budget: %u ms", elapsed);
+
+	nvram->setPowerState(POWER_STATE_ON, NULL);
+	hostWriteDelay = 0;
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_SLEEP_BUDGET, 0);
+	nvram->sync();
+
+	hostWriteDelay = 100;
+	setString(nvram, VENDOR_GUID NVRAM_SEPERATOR "slower", "disk");
+	elapsed = sleepFor(nvram);
+	CHECK(elapsed >= 200);
+	CHECK(fileContains(FILE_NVRAM_PATH, "slower"));
+	printf(", without one: %u ms\n", elapsed);
+
+	hostWriteDelay = 0;
+	nvram->setPowerState(POWER_STATE_ON, NULL);
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testSleep();
+	testBudget();
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+/***
+ * SetTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * What a setProperty() leaves to be written: nothing when the variable already
+ * had the value, and nothing when the value couldn't be stored. setProperties()
+ * changes all of its variables or, whatever fails, none.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#define VENDOR_GUID		"4D1FDA02-38C7-4A6A-9CC6-4BCCA8B30102"
+#define OTHER_GUID		"36C28AB5-6566-4C50-9EBD-CBB920F83843"
+
+//==============================================================================
+
+static SInt64 counter(FileNVRAM* nvram, int which)
+{
+	return nvram->mStats->counters[which];
+}
+
+// Nothing waits for a sync: not dirty, no namespace to serialize again, no record to journal.
+static bool clean(FileNVRAM* nvram)
+{
+	hostIdle();
+
+	return !nvram->mDirty && (!nvram->mDirtyNamespaces || !nvram->mDirtyNamespaces->getCount()) && !nvram->mJournalPending;
+}
+
+//==============================================================================
+
+static void testUnchanged(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+	const char bytes[] = { 0x01, 0x02, 0x03 };
+
+	setString(nvram, "string", "value");
+	setData(nvram, VENDOR_GUID NVRAM_SEPERATOR "data", bytes, sizeof(bytes));
+	setNumber(nvram, VENDOR_GUID NVRAM_SEPERATOR "number", 7);
+	nvram->sync();
+	CHECK(clean(nvram));
+
+	SInt64 base = syncs(nvram);
+	SInt64 unchanged = counter(nvram, kNVRAMStatUnchanged);
+
+	// The same values again, as new objects: accepted, counted, not written.
+	setString(nvram, "string", "value");
+	setData(nvram, VENDOR_GUID NVRAM_SEPERATOR "data", bytes, sizeof(bytes));
+	setNumber(nvram, VENDOR_GUID NVRAM_SEPERATOR "number", 7);
+	CHECK(clean(nvram));
+	CHECK(counter(nvram, kNVRAMStatUnchanged) == unchanged + 3);
+
+	hostAdvance(NVRAM_SYNC_DEADLINE_MS);
+	CHECK(syncs(nvram) == base);
+
+	// Another value is a change again.
+	setString(nvram, "string", "other");
+	CHECK(!clean(nvram));
+	hostAdvance(NVRAM_SYNC_DELAY_MS);
+	CHECK(syncs(nvram) == base + 1);
+	CHECK(counter(nvram, kNVRAMStatUnchanged) == unchanged + 3);
+
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// A setProperty() that fails to store its value is not journaled or synced.
+
+static void testFailed(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_JOURNAL_MODE, 1);
+	nvram->sync();
+	CHECK(clean(nvram));
+
+	SInt64 base = syncs(nvram);
+	size_t journal = hostFiles[FILE_NVRAM_JOURNAL_PATH].size();
+	int failed = 0;
+
+	// A namespace of its own has to be made, fail each allocation on the way in turn.
+	for (int n = 1; n < 64; n++)
+	{
+		const OSSymbol* key = OSSymbol::withCString(VENDOR_GUID NVRAM_SEPERATOR "new");
+		OSString* value = OSString::withCString("rejected");
+
+		hostFailAlloc = n;
+
+		bool result = nvram->setProperty(key, value);
+
+		hostFailAlloc = 0;
+		key->release();
+		value->release();
+
+		if (result)
+		{
+			break;
+		}
+
+		CHECK(!nvram->getProperty(VENDOR_GUID NVRAM_SEPERATOR "new"));
+		CHECK(clean(nvram));
+		failed++;
+	}
+
+	CHECK(failed > 0);
+	CHECK(hasString(nvram, VENDOR_GUID NVRAM_SEPERATOR "new", "rejected"));
+
+	hostAdvance(NVRAM_SYNC_DEADLINE_MS);
+	CHECK(syncs(nvram) == base + 1);
+
+	// Only the value that made it was journaled.
+	std::string appended = hostFiles[FILE_NVRAM_JOURNAL_PATH].substr(journal);
+	size_t first = appended.find("rejected");
+
+	CHECK(first != std::string::npos && appended.find("rejected", first + 1) == std::string::npos);
+
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// Before the batch: changed and deleted exist, the others don't.
+
+static void checkUntouched(FileNVRAM* nvram)
+{
+	CHECK(hasString(nvram, VENDOR_GUID NVRAM_SEPERATOR "changed", "old"));
+	CHECK(hasString(nvram, "deleted", "old"));
+	CHECK(hasString(nvram, OTHER_GUID NVRAM_SEPERATOR "fresh", NULL));
+	CHECK(hasString(nvram, "plain", NULL));
+	CHECK(clean(nvram));
+}
+
+static OSDictionary* batch(const char* extra)
+{
+	OSDictionary* dict = OSDictionary::withCapacity(5);
+	const char* keys[] = { VENDOR_GUID NVRAM_SEPERATOR "changed", OTHER_GUID NVRAM_SEPERATOR "fresh", "plain", extra };
+
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]) && keys[i]; i++)
+	{
+		OSString* value = OSString::withCString("new");
+
+		dict->setObject(keys[i], value);
+		value->release();
+	}
+
+	OSString* deleted = OSString::withCString("deleted");
+
+	dict->setObject(kIONVRAMDeletePropertyKey, deleted);
+	deleted->release();
+
+	return dict;
+}
+
+static void testRollback(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+
+	setString(nvram, VENDOR_GUID NVRAM_SEPERATOR "changed", "old");
+	setString(nvram, "deleted", "old");
+	nvram->sync();
+	checkUntouched(nvram);
+
+	// Not privileged, or not entitled to one of them: nothing is changed.
+	OSDictionary* dict = batch(NULL);
+
+	hostPrivileged = false;
+	CHECK(nvram->setProperties(dict) == kIOReturnNotPrivileged);
+	hostPrivileged = true;
+	checkUntouched(nvram);
+	dict->release();
+
+	dict = batch("csr-active-config");
+	hostEntitled = false;
+	CHECK(nvram->setProperties(dict) == kIOReturnNotPrivileged);
+	hostEntitled = true;
+	checkUntouched(nvram);
+	dict->release();
+
+	// Out of memory anywhere on the way, each allocation in turn: undone completely.
+	SInt64 base = syncs(nvram);
+	int failed = 0;
+
+	dict = batch(NULL);
+
+	for (int n = 1; n < 256; n++)
+	{
+		hostFailAlloc = n;
+
+		IOReturn result = nvram->setProperties(dict);
+
+		hostFailAlloc = 0;
+
+		if (result == kIOReturnSuccess)
+		{
+			break;
+		}
+
+		CHECK(result == kIOReturnNoMemory);
+		checkUntouched(nvram);
+		failed++;
+	}
+
+	dict->release();
+
+	CHECK(failed > 1);
+	CHECK(hasString(nvram, VENDOR_GUID NVRAM_SEPERATOR "changed", "new"));
+	CHECK(hasString(nvram, OTHER_GUID NVRAM_SEPERATOR "fresh", "new"));
+	CHECK(hasString(nvram, "plain", "new"));
+	CHECK(hasString(nvram, "deleted", NULL));
+
+	// Only the batch that went through is written, once.
+	CHECK(syncs(nvram) == base);
+	hostAdvance(NVRAM_SYNC_DELAY_MS);
+	CHECK(syncs(nvram) == base + 1);
+	CHECK(fileContains(FILE_NVRAM_PATH, "<string>new</string>") && !fileContains(FILE_NVRAM_PATH, "<string>old</string>"));
+
+	printf("  setProperties(): undone after %d allocation failures\n", failed);
+
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testUnchanged();
+	testFailed();
+	testRollback();
+
+	return 0;
+}
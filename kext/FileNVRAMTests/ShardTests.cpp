@@ -0,0 +1,113 @@
+/***
+ * ShardTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * ShardMode: which namespaces get their own files. The bootloader only reads
+ * nvram.plist, so plain keys, Apple's, the system and the EFI global namespaces
+ * stay in it, and one that an older version did shard is moved back.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#define VENDOR_GUID		"4D1FDA02-38C7-4A6A-9CC6-4BCCA8B30102"
+
+static bool hasShard(const char* guid)
+{
+	char path[NVRAM_SHARD_PATH_MAX];
+
+	for (int i = 0; i < NVRAM_SLOTS; i++)
+	{
+		snprintf(path, sizeof(path), FILE_NVRAM_SHARD_FORMAT, guid, i);
+
+		if (hostFiles.count(path))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static FileNVRAM* startShards(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_SHARD_MODE, 1);
+	setString(nvram, "boot-args", "-v");
+	setString(nvram, APPLE_NVRAM_GUID NVRAM_SEPERATOR "prev-lang:kbd", "en:0");
+	setString(nvram, APPLE_SYSTEM_NVRAM_GUID NVRAM_SEPERATOR "system-var", "system");
+	setString(nvram, EFI_GLOBAL_GUID NVRAM_SEPERATOR "Boot0080", "boot");
+	setString(nvram, VENDOR_GUID NVRAM_SEPERATOR "vendor", "vendor");
+	nvram->sync();
+
+	return nvram;
+}
+
+//==============================================================================
+
+static void testBootNamespaces(void)
+{
+	FileNVRAM* nvram = startShards();
+
+	CHECK(hasShard(VENDOR_GUID) && !fileContains(FILE_NVRAM_PATH, "<string>vendor</string>"));
+
+	CHECK(!hasShard(APPLE_NVRAM_GUID) && fileContains(FILE_NVRAM_PATH, "<string>en:0</string>"));
+	CHECK(!hasShard(APPLE_SYSTEM_NVRAM_GUID) && fileContains(FILE_NVRAM_PATH, "<string>system</string>"));
+	CHECK(!hasShard(EFI_GLOBAL_GUID) && fileContains(FILE_NVRAM_PATH, "<string>boot</string>"));
+	CHECK(!hasShard(FILE_NVRAM_GUID) && fileContains(FILE_NVRAM_PATH, "<string>-v</string>"));
+
+	stopNVRAM(nvram);
+
+	// And all of it comes back.
+	nvram = startNVRAM(false);
+	CHECK(hasString(nvram, "boot-args", "-v"));
+	CHECK(hasString(nvram, APPLE_NVRAM_GUID NVRAM_SEPERATOR "prev-lang:kbd", "en:0"));
+	CHECK(hasString(nvram, VENDOR_GUID NVRAM_SEPERATOR "vendor", "vendor"));
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// Apple's namespace in a shard, the way a version that did shard it left it.
+
+static void testMovedBack(void)
+{
+	FileNVRAM* nvram = startShards();
+	const OSSymbol* apple = OSSymbol::withCString(APPLE_NVRAM_GUID);
+	std::string entry = "\t<key>" APPLE_NVRAM_GUID "</key>\n\t<dict>\n\t\t<key>prev-lang:kbd</key>\n\t\t<string>en:0</string>\n\t</dict>\n";
+
+	CHECK(nvram->writeShard(apple, OSDynamicCast(OSData, nvram->mFragments->getObject(apple))) == 0);
+	CHECK(hasShard(APPLE_NVRAM_GUID));
+	apple->release();
+	stopNVRAM(nvram);
+
+	std::string& file = hostFiles[FILE_NVRAM_PATH];
+	size_t at = file.find(entry);
+
+	CHECK(at != std::string::npos);
+	file.erase(at, entry.size());
+	file.insert(file.find("<array>\n") + strlen("<array>\n"), "\t\t\t<string>" APPLE_NVRAM_GUID "</string>\n");
+
+	nvram = startNVRAM(false);
+	CHECK(hasString(nvram, APPLE_NVRAM_GUID NVRAM_SEPERATOR "prev-lang:kbd", "en:0"));
+	CHECK(fileContains(FILE_NVRAM_PATH, entry));
+	CHECK(!fileContains(FILE_NVRAM_PATH, "<string>" APPLE_NVRAM_GUID "</string>"));
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testBootNamespaces();
+	testMovedBack();
+
+	return 0;
+}
@@ -0,0 +1,235 @@
+/***
+ * SlotTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Slot files: the record, which slot is loaded (a nvram.plist edited by hand
+ * too), and a sync cut short after every byte it writes (nvram.1.plist, then the
+ * copy over nvram.plist), which must leave the old or the new snapshot whole.
+ * Leaves SlotTests.plist (with a record) and SlotTests.xml (without) behind for
+ * ComparePlists.py.
+ */
+
+#include "Host.h"
+#include "FileIO.cpp"
+#include "Support.cpp"
+#include "Slot.cpp"
+#include "Stats.cpp"
+
+static char sChunk[NVRAM_CHUNK_SIZE];
+
+//==============================================================================
+// The way a sync writes a slot: body, record, flush, sync.
+
+static int writeSlot(const char* path, const std::string& body, UInt32 generation)
+{
+	NVRAMOutput out;
+	vnode_t vp;
+	int error;
+
+	if ((error = fileOpen(path, O_CREAT | FWRITE, &vp, NULL, NULL)))
+	{
+		return error;
+	}
+
+	bzero(&out, sizeof(out));
+	out.vp = vp;
+	out.buffer = sChunk;
+	out.size = sizeof(sChunk);
+
+	bool result = outputBytes(&out, body.data(), body.size()) && slotFinish(&out, generation);
+
+	if (!out.error && out.used)
+	{
+		outputFlush(&out, out.buffer, out.used);
+	}
+
+	if (!out.error)
+	{
+		out.error = fileSync(vp, NULL);
+	}
+
+	fileClose(vp, true, NULL);
+
+	return out.error ? out.error : result ? 0 : EIO;
+}
+
+static std::string plist(char c, size_t length)
+{
+	return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<plist version=\"1.0\">\n<dict>\n\t<key>k</key>\n\t<string>" +
+		   std::string(length, c) + "</string>\n</dict>\n</plist>\n";
+}
+
+static std::string body(const std::string& file)
+{
+	return file.substr(0, slotLength(file.data(), file.size()));
+}
+
+//==============================================================================
+
+static void testRecord(void)
+{
+	std::string text = plist('a', 10000);
+	UInt32 generation;
+
+	hostFiles.clear();
+	hostSyncs = 0;
+
+	CHECK(writeSlot(FILE_NVRAM_SLOT_PATH, text, 7) == 0);
+	CHECK(hostSyncs == 1);
+
+	std::string file = hostFiles[FILE_NVRAM_SLOT_PATH];
+
+	CHECK(file.size() == text.size() + NVRAM_SLOT_RECORD_SIZE && body(file) == text);
+	CHECK(slotCheck(FILE_NVRAM_SLOT_PATH, sChunk, NULL, &generation) == 0 && generation == 7);
+
+	// A shorter snapshot cuts off the rest of the longer one.
+	CHECK(writeSlot(FILE_NVRAM_SLOT_PATH, plist('b', 10), 8) == 0);
+	CHECK(body(hostFiles[FILE_NVRAM_SLOT_PATH]) == plist('b', 10));
+	CHECK(slotCheck(FILE_NVRAM_SLOT_PATH, sChunk, NULL, &generation) == 0 && generation == 8);
+
+	// Damage anywhere in the plist, and a record that doesn't parse.
+	hostFiles[FILE_NVRAM_SLOT_PATH] = file;
+	hostFiles[FILE_NVRAM_SLOT_PATH][5000] ^= 1;
+	CHECK(slotCheck(FILE_NVRAM_SLOT_PATH, sChunk, NULL, &generation) == EBADMSG);
+
+	hostFiles[FILE_NVRAM_SLOT_PATH] = file.substr(0, file.size() - 1);
+	CHECK(slotCheck(FILE_NVRAM_SLOT_PATH, sChunk, NULL, &generation) == EFTYPE);
+
+	hostFiles[FILE_NVRAM_SLOT_PATH] = file.substr(1);
+	CHECK(slotCheck(FILE_NVRAM_SLOT_PATH, sChunk, NULL, &generation) == EBADMSG);
+
+	hostFiles[FILE_NVRAM_SLOT_PATH] = "";
+	CHECK(slotCheck(FILE_NVRAM_SLOT_PATH, sChunk, NULL, &generation) == ENOENT);
+
+	// plistlib (and expat under it) read past the record, it is only a comment.
+	FILE* output = fopen("SlotTests.plist", "wb");
+
+	CHECK(output && fwrite(file.data(), 1, file.size(), output) == file.size());
+	fclose(output);
+
+	output = fopen("SlotTests.xml", "wb");
+	CHECK(output && fwrite(text.data(), 1, text.size(), output) == text.size());
+	fclose(output);
+}
+
+//==============================================================================
+
+static void testSelect(void)
+{
+	std::string legacy = plist('l', 10);
+	UInt32 generation;
+	int errors[NVRAM_SLOTS];
+
+	hostFiles.clear();
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == -1 && generation == 0);
+
+	// nvram.plist from before slots, or edited by hand, is used when it is alone.
+	hostFiles[FILE_NVRAM_PATH] = legacy;
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == 0 && generation == 0);
+	CHECK(errors[0] == EFTYPE && errors[1] == ENOENT);
+
+	// Not when nvram.1.plist is there: then it may just be a copy cut short.
+	CHECK(writeSlot(FILE_NVRAM_SLOT_PATH, plist('b', 10), 4) == 0);
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == 1 && generation == 4);
+
+	hostFiles[FILE_NVRAM_SLOT_PATH] = hostFiles[FILE_NVRAM_SLOT_PATH].substr(0, 50);
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == -1);
+
+	// Newest first, nvram.plist when they are the same.
+	CHECK(writeSlot(FILE_NVRAM_PATH, plist('a', 10), 5) == 0);
+	CHECK(writeSlot(FILE_NVRAM_SLOT_PATH, plist('b', 10), 6) == 0);
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == 1 && generation == 6);
+
+	CHECK(slotCopy(FILE_NVRAM_SLOT_PATH, FILE_NVRAM_PATH, sChunk, NULL) == 0);
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == 0 && generation == 6);
+	CHECK(hostFiles[FILE_NVRAM_PATH] == hostFiles[FILE_NVRAM_SLOT_PATH]);
+
+	// Edited by hand after that, with or without changing its length: still nvram.plist.
+	hostFiles[FILE_NVRAM_PATH][3] = 'e';
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == 0 && generation == 6 && errors[0] == EBADMSG);
+
+	hostFiles[FILE_NVRAM_PATH].insert(3, "edit");
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == 0 && generation == 6 && errors[0] == EBADMSG);
+
+	CHECK(writeSlot(FILE_NVRAM_SLOT_PATH, plist('b', 10), 7) == 0);
+	CHECK(slotSelect(sChunk, NULL, &generation, errors) == 1 && generation == 7);
+}
+
+//==============================================================================
+// Every point a sync can stop at: each byte of nvram.1.plist and of the copy.
+
+static void testCutShort(void)
+{
+	size_t sizes[] = { 100, 5000, 9000 };
+	int runs = 0;
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+		{
+			std::string previous = plist('a', sizes[i]);
+			std::string next = plist('c', sizes[j]);
+
+			hostFiles.clear();
+			CHECK(writeSlot(FILE_NVRAM_SLOT_PATH, previous, 2) == 0);
+			CHECK(slotCopy(FILE_NVRAM_SLOT_PATH, FILE_NVRAM_PATH, sChunk, NULL) == 0);
+
+			std::string files[NVRAM_SLOTS] = { hostFiles[FILE_NVRAM_PATH], hostFiles[FILE_NVRAM_SLOT_PATH] };
+			long total = 2 * (next.size() + NVRAM_SLOT_RECORD_SIZE);
+
+			for (long budget = 0; budget <= total; budget++, runs++)
+			{
+				UInt32 generation;
+				int errors[NVRAM_SLOTS];
+
+				hostFiles[FILE_NVRAM_PATH] = files[0];
+				hostFiles[FILE_NVRAM_SLOT_PATH] = files[1];
+				hostWriteBudget = budget;
+
+				int error = writeSlot(FILE_NVRAM_SLOT_PATH, next, 3);
+
+				if (!error)
+				{
+					error = slotCopy(FILE_NVRAM_SLOT_PATH, FILE_NVRAM_PATH, sChunk, NULL);
+				}
+
+				hostWriteBudget = -1;
+
+				int slot = slotSelect(sChunk, NULL, &generation, errors);
+
+				CHECK(slot >= 0);
+
+				std::string loaded = body(hostFiles[sSlotPaths[slot]]);
+
+				if (error)
+				{
+					CHECK((generation == 2 && loaded == previous) || (generation == 3 && loaded == next));
+				}
+				else
+				{
+					CHECK(slot == 0 && generation == 3 && loaded == next);
+					CHECK(hostFiles[FILE_NVRAM_PATH] == hostFiles[FILE_NVRAM_SLOT_PATH]);
+				}
+			}
+		}
+	}
+
+	printf("  %d syncs cut short\n", runs);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testRecord();
+	testSelect();
+	testCutShort();
+
+	return 0;
+}
@@ -0,0 +1,331 @@
+/***
+ * SnapshotTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * Copy-on-write store snapshots: a snapshot keeps what the store held when it
+ * was taken while the store goes on changing, nothing is leaked or released
+ * twice, and taking one holds the lock for far less than copying the store did.
+ * Last, what getProperty() callers see of a large sync running next to them.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <vector>
+
+typedef std::map<std::string, OSObject*> Reference;
+
+static const char* sGUIDs[] = { "", "A-B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L" };
+
+#define GUIDS	(sizeof(sGUIDs) / sizeof(sGUIDs[0]))
+
+//==============================================================================
+
+static void mutate(NVRAMStore* store, Reference* reference, std::vector<OSObject*>* values, unsigned int* seed, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		char key[64];
+		int guid = rand_r(seed) % GUIDS;
+		int operation = rand_r(seed) % 4;
+
+		if (guid)
+		{
+			snprintf(key, sizeof(key), "%s" NVRAM_SEPERATOR "n%d", sGUIDs[guid], rand_r(seed) % 40);
+		}
+		else
+		{
+			snprintf(key, sizeof(key), "n%d", rand_r(seed) % 40);
+		}
+
+		if (operation < 3)
+		{
+			OSString* value = OSString::withCString(key);
+			bool changed = true;
+
+			values->push_back(value);
+
+			CHECK((operation == 0) ? storeInsert(store, key, value, NULL) : storeUpdate(store, key, value, storeDigest(value), NULL, &changed));
+
+			if (changed)
+			{
+				(*reference)[key] = value;
+			}
+		}
+		else
+		{
+			CHECK(storeDelete(store, key, NULL) == (reference->erase(key) > 0));
+		}
+	}
+}
+
+static void checkStore(const NVRAMStore* store, const Reference& reference)
+{
+	size_t count = 0;
+
+	for (UInt32 i = 0; i < store->capacity; i++)
+	{
+		count += store->partitions[i] ? store->partitions[i]->count : 0;
+	}
+
+	CHECK(count == reference.size());
+
+	for (Reference::const_iterator i = reference.begin(); i != reference.end(); ++i)
+	{
+		CHECK(storeLookup(store, i->first.c_str()) == i->second);
+	}
+}
+
+//==============================================================================
+
+static void testSnapshots(void)
+{
+	NVRAMStore* store = storeCreate();
+	std::vector<OSObject*> values;
+	Reference reference;
+	unsigned int seed = 3;
+
+	for (int round = 0; round < 3000; round++)
+	{
+		mutate(store, &reference, &values, &seed, rand_r(&seed) % 50);
+
+		NVRAMStore* snapshot = storeSnapshot(store);
+
+		CHECK(snapshot);
+		CHECK(!storeSnapshot(store));
+
+		// Taken with the write lock held, then written out while the store changes.
+		Reference taken = reference;
+
+		mutate(store, &reference, &values, &seed, rand_r(&seed) % 80);
+		checkStore(snapshot, taken);
+
+		storeRelease(store, snapshot);
+		checkStore(store, reference);
+
+		for (UInt32 i = 0; i < store->capacity; i++)
+		{
+			CHECK(!store->partitions[i] || !store->partitions[i]->shared);
+		}
+	}
+
+	storeDestroy(store);
+
+	// Only our own reference is left on every value the store ever held.
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		CHECK(values[i]->getRetainCount() == 1);
+		values[i]->release();
+	}
+
+	printf("  3000 snapshots, %zu values\n", values.size());
+}
+
+//==============================================================================
+// A lazily loaded image stays while a snapshot may still decode from it.
+
+static void testLazy(void)
+{
+	const char* plist = "<string>one</string><string>two</string>";
+	NVRAMStore* store = storeCreate();
+
+	store->imageSize = strlen(plist);
+	store->image = fileAlloc(store->imageSize);
+	memcpy(store->image, plist, store->imageSize);
+
+	CHECK(storeIndex(store, "G:one", 0, 20));
+	CHECK(storeIndex(store, "G:two", 20, 20));
+
+	NVRAMStore* snapshot = storeSnapshot(store);
+	OSString* value = OSString::withCString("replaced");
+
+	CHECK(storeInsert(store, "G:one", value, NULL));
+	CHECK(storeDelete(store, "G:two", NULL));
+	CHECK(store->lazy == 0 && store->image);
+
+	OSString* one = OSDynamicCast(OSString, storeLookup(snapshot, "G:one"));
+
+	CHECK(snapshot->image && one && strcmp(one->getCStringNoCopy(), "one") == 0);
+
+	storeRelease(store, snapshot);
+	CHECK(!store->image);
+	CHECK(storeLookup(store, "G:one") == value);
+
+	value->release();
+	storeDestroy(store);
+}
+
+//==============================================================================
+// How long a sync keeps writers waiting: taking a snapshot, and the copy of its
+// namespace the first write after it makes, against the copy of every namespace
+// it used to make under the lock.
+
+static void testSpeed(void)
+{
+	NVRAMStore* store = storeCreate();
+	uint64_t snapshotTime = 0, writeTime = 0, copyTime = 0;
+	const int rounds = 100;
+
+	for (int i = 0; i < 2000; i++)
+	{
+		char key[64];
+		OSString* value = OSString::withCString("value");
+
+		snprintf(key, sizeof(key), "%s" NVRAM_SEPERATOR "n%d", sGUIDs[1 + i % (GUIDS - 1)], i);
+		CHECK(storeInsert(store, key, value, NULL));
+		value->release();
+	}
+
+	for (int round = 0; round < rounds; round++)
+	{
+		OSString* value = OSString::withCString("changed");
+		uint64_t start = hostNanoseconds();
+		NVRAMStore* snapshot = storeSnapshot(store);
+		uint64_t middle = hostNanoseconds();
+
+		CHECK(snapshot && storeInsert(store, "A-B" NVRAM_SEPERATOR "n0", value, NULL));
+
+		uint64_t written = hostNanoseconds();
+		OSDictionary* root = storeCopyRoot(store, NULL);
+
+		copyTime += hostNanoseconds() - written;
+		writeTime += written - middle;
+		snapshotTime += middle - start;
+
+		CHECK(root);
+		root->release();
+		value->release();
+		storeRelease(store, snapshot);
+	}
+
+	printf("  2000 variables, lock held: snapshot %llu ns, first write after it %llu ns, copy %llu ns\n",
+		   (unsigned long long)(snapshotTime / rounds), (unsigned long long)(writeTime / rounds), (unsigned long long)(copyTime / rounds));
+
+	storeDestroy(store);
+}
+
+//==============================================================================
+// getProperty() latencies on this thread until done is set, or count calls when
+// there is nothing to wait for.
+
+static void readProperties(FileNVRAM* nvram, const std::vector<std::string>& keys, volatile bool* done, int count, std::vector<uint64_t>* ns)
+{
+	for (size_t i = 0; done ? !*done : (int)i < count; i++)
+	{
+		const char* key = keys[(i * 7919) % keys.size()].c_str();
+		uint64_t start = hostNanoseconds();
+
+		CHECK(nvram->getProperty(key));
+		ns->push_back(hostNanoseconds() - start);
+	}
+}
+
+static uint64_t percentile(std::vector<uint64_t>* ns, int percent)
+{
+	std::sort(ns->begin(), ns->end());
+
+	return ns->empty() ? 0 : (*ns)[(ns->size() - 1) * percent / 100];
+}
+
+//==============================================================================
+// 20000 variables in 20 namespaces, every one of them changed, then a sync on
+// another thread to a disk that takes 1 ms a write. Readers only wait for the
+// snapshot to be taken, not for it to be serialized or written. Against that, the
+// store copied under the write lock the way a sync did before snapshots: most
+// reads don't take the lock (Epoch.cpp), the ones that do show up in the max.
+
+static void benchReaders(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+	std::vector<std::string> keys;
+	std::vector<uint64_t> idle, syncing, copying;
+	char key[64];
+
+	for (int i = 0; i < 20000; i++)
+	{
+		snprintf(key, sizeof(key), "%08X-0000-4000-8000-000000000000" NVRAM_SEPERATOR "var%d", i % 20, i);
+		keys.push_back(key);
+		setString(nvram, key, "a value of some length");
+	}
+
+	nvram->sync();
+	readProperties(nvram, keys, NULL, 100000, &idle);
+
+	for (int i = 0; i < 20; i++)
+	{
+		setString(nvram, keys[i].c_str(), "changed");
+	}
+
+	volatile bool done = false;
+	uint64_t start = hostNanoseconds();
+	uint64_t syncTime = 0;
+
+	hostWriteDelay = 1;
+
+	std::thread syncer([&]() {
+		nvram->sync();
+		syncTime = hostNanoseconds() - start;
+		done = true;
+	});
+
+	readProperties(nvram, keys, &done, 0, &syncing);
+	syncer.join();
+	hostWriteDelay = 0;
+
+	done = false;
+
+	std::thread copier([&]() {
+		while (!done)
+		{
+			nvram->lockStoreWrite();
+			OSDictionary* root = storeCopyRoot(nvram->mStore, NULL);
+			nvram->unlockStoreWrite();
+
+			OSSafeReleaseNULL(root);
+		}
+	});
+
+	readProperties(nvram, keys, NULL, 100000, &copying);
+	done = true;
+	copier.join();
+
+	std::vector<uint64_t>* runs[] = { &idle, &syncing, &copying };
+	const char* names[] = { "idle", "during a sync", "copying under the lock" };
+
+	printf("  20000 variables, a %llu ms sync, getProperty() p50/p99/max:", (unsigned long long)(syncTime / NSEC_PER_MSEC));
+
+	for (int i = 0; i < 3; i++)
+	{
+		printf("%s %s %llu/%llu/%llu ns", i ? "," : "", names[i], (unsigned long long)percentile(runs[i], 50),
+			   (unsigned long long)percentile(runs[i], 99), (unsigned long long)percentile(runs[i], 100));
+	}
+
+	printf("\n");
+
+	// Waiting for the sync would put its length in the tail.
+	CHECK(syncing.size() > 1000 && percentile(&syncing, 99) < syncTime / 10);
+
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testSnapshots();
+	testLazy();
+	testSpeed();
+	benchReaders();
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+/***
+ * StatsTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * FILE_NVRAM_GUID:Stats is made for each copyProperty() and belongs to the
+ * caller: reading it again, from any thread, never frees one still in use.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#include <thread>
+
+#define STATS_KEY	FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_STATS
+
+//==============================================================================
+
+static uint64_t statsCount(OSDictionary* stats, const char* op)
+{
+	OSDictionary* opDict = OSDynamicCast(OSDictionary, stats->getObject(op));
+	OSNumber* count = opDict ? OSDynamicCast(OSNumber, opDict->getObject("Count")) : NULL;
+
+	CHECK(count);
+
+	return count->unsigned64BitValue();
+}
+
+static OSDictionary* copyStats(FileNVRAM* nvram)
+{
+	OSDictionary* stats = OSDynamicCast(OSDictionary, nvram->copyProperty(STATS_KEY));
+
+	CHECK(stats);
+
+	return stats;
+}
+
+//==============================================================================
+
+static void testCopies(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+	const OSSymbol* key = OSSymbol::withCString(STATS_KEY);
+
+	// Nothing getProperty() could return would stay valid.
+	CHECK(!nvram->getProperty(STATS_KEY));
+	CHECK(!nvram->getProperty(key));
+	CHECK(!nvram->IOService::getProperty(key));
+
+	setString(nvram, "one", "1");
+	setString(nvram, "two", "2");
+
+	OSDictionary* first = copyStats(nvram);
+	uint64_t sets = statsCount(first, "Set");
+
+	CHECK(sets >= 2);
+
+	// A later copy is another dictionary, the first one is left as it was.
+	setString(nvram, "three", "3");
+
+	OSDictionary* second = OSDynamicCast(OSDictionary, nvram->copyProperty(key));
+
+	CHECK(second && second != first);
+	CHECK(statsCount(second, "Set") == sets + 1);
+	CHECK(statsCount(first, "Set") == sets);
+
+	// Writing it resets the counters, and still stores nothing.
+	setString(nvram, STATS_KEY, "reset");
+	CHECK(!nvram->IOService::getProperty(key));
+
+	OSDictionary* reset = copyStats(nvram);
+
+	CHECK(statsCount(reset, "Set") == 0);
+	CHECK(statsCount(first, "Set") == sets);
+
+	reset->release();
+	second->release();
+	first->release();
+	key->release();
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// Readers keep their copy while others read and write.
+
+static void testConcurrent(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+	OSDictionary* held = copyStats(nvram);
+	uint64_t sets = statsCount(held, "Set");
+	std::atomic<bool> done(false);
+	std::vector<std::thread> readers;
+
+	for (int i = 0; i < 4; i++)
+	{
+		readers.push_back(std::thread([&]() {
+			while (!done)
+			{
+				OSDictionary* stats = copyStats(nvram);
+
+				CHECK(statsCount(stats, "Set") >= sets);
+				stats->release();
+			}
+		}));
+	}
+
+	for (int i = 0; i < 2000; i++)
+	{
+		char value[16];
+
+		snprintf(value, sizeof(value), "%d", i);
+		setString(nvram, "busy", value);
+		CHECK(statsCount(held, "Set") == sets);
+	}
+
+	done = true;
+
+	for (size_t i = 0; i < readers.size(); i++)
+	{
+		readers[i].join();
+	}
+
+	held->release();
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testCopies();
+	testConcurrent();
+
+	return 0;
+}
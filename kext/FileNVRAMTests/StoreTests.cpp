@@ -0,0 +1,287 @@
+/***
+ * StoreTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * The variable store against a std::map doing the same inserts, updates and
+ * removals, its copies (flat, by GUID, with keys skipped), lazily indexed values,
+ * and lookups timed against the registry table (an OSDictionary) it replaced.
+ */
+
+#include "Host.h"
+#include "FileIO.cpp"
+#include "Support.cpp"
+#include "Loader.cpp"
+#include "Stats.cpp"
+#include "Policy.cpp"
+#include "Epoch.cpp"
+#include "Store.cpp"
+
+#include <map>
+
+typedef std::map<std::string, OSObject*> Reference;
+
+static const char* sGUIDs[] = { "", "7C436110-AB2A-4BBB-A880-FE41995C9F82", "8BE4DF61-93CA-11D2-AA0D-00E098032B8C", "A", "B", "C", "D", "E", "F", "G" };
+
+#define GUIDS	(sizeof(sGUIDs) / sizeof(sGUIDs[0]))
+
+//==============================================================================
+
+static void makeKey(char* key, size_t size, int guid, int name)
+{
+	if (guid)
+	{
+		snprintf(key, size, "%s" NVRAM_SEPERATOR "n%d", sGUIDs[guid], name);
+	}
+	else
+	{
+		snprintf(key, size, "n%d", name);
+	}
+}
+
+static void checkCopies(const NVRAMStore* store, const Reference& reference)
+{
+	OSDictionary* flat = storeCopyFlat(store);
+
+	CHECK(flat && flat->getCount() == reference.size());
+
+	for (Reference::const_iterator i = reference.begin(); i != reference.end(); ++i)
+	{
+		CHECK(flat->getObject(i->first.c_str()) == i->second);
+	}
+
+	flat->release();
+
+	// By GUID, plain keys at the top, namespaces without variables left out.
+	OSDictionary* root = storeCopyRoot(store, NULL);
+	std::map<std::string, unsigned int> counts;
+
+	CHECK(root);
+
+	for (Reference::const_iterator i = reference.begin(); i != reference.end(); ++i)
+	{
+		const char* separator = strstr(i->first.c_str(), NVRAM_SEPERATOR);
+
+		if (!separator)
+		{
+			CHECK(root->getObject(i->first.c_str()) == i->second);
+			counts[""]++;
+			continue;
+		}
+
+		std::string guid(i->first.c_str(), separator - i->first.c_str());
+		OSDictionary* partition = OSDynamicCast(OSDictionary, root->getObject(guid.c_str()));
+
+		CHECK(partition && partition->getObject(separator + strlen(NVRAM_SEPERATOR)) == i->second);
+		counts[guid]++;
+	}
+
+	for (std::map<std::string, unsigned int>::iterator i = counts.begin(); i != counts.end(); ++i)
+	{
+		OSDictionary* partition = OSDynamicCast(OSDictionary, root->getObject(i->first.c_str()));
+
+		CHECK(i->first.empty() || (partition && partition->getCount() == i->second));
+	}
+
+	CHECK(root->getCount() == counts[""] + counts.size() - 1);
+
+	root->release();
+}
+
+//==============================================================================
+
+static void testReference(void)
+{
+	NVRAMStore* store = storeCreate();
+	Reference reference;
+	unsigned int seed = 1;
+
+	CHECK(store);
+
+	for (int round = 0; round < 200000; round++)
+	{
+		char key[128];
+		int guid = rand_r(&seed) % GUIDS;
+		int operation = rand_r(&seed) % 4;
+		const OSSymbol* partition = NULL;
+
+		makeKey(key, sizeof(key), guid, rand_r(&seed) % 500);
+
+		if (operation < 2)
+		{
+			OSString* value = OSString::withCString(key);
+
+			CHECK(storeInsert(store, key, value, &partition));
+			reference[key] = value;
+			value->release();
+		}
+		else if (operation == 2)
+		{
+			// Setting what is already there changes nothing.
+			Reference::iterator i = reference.find(key);
+			OSObject* value = (i != reference.end() && (round & 1)) ? OSString::withString((OSString *)i->second) : OSString::withCString("other");
+			bool same = (i != reference.end()) && value->isEqualTo(i->second);
+			bool changed;
+
+			CHECK(storeUpdate(store, key, value, storeDigest(value), &partition, &changed));
+			CHECK(changed == !same);
+
+			if (changed)
+			{
+				reference[key] = value;
+			}
+
+			value->release();
+		}
+		else
+		{
+			CHECK(storeDelete(store, key, &partition) == (reference.erase(key) > 0));
+		}
+
+		CHECK(!partition || strcmp(partition->getCStringNoCopy(), sGUIDs[guid]) == 0);
+
+		if (round % 5000 == 0)
+		{
+			for (Reference::iterator i = reference.begin(); i != reference.end(); ++i)
+			{
+				CHECK(storeLookup(store, i->first.c_str()) == i->second);
+			}
+
+			checkCopies(store, reference);
+		}
+	}
+
+	for (int name = 0; name < 500; name++)
+	{
+		char key[128];
+
+		makeKey(key, sizeof(key), 1, name);
+		CHECK((storeLookup(store, key) != NULL) == (reference.count(key) > 0));
+	}
+
+	checkCopies(store, reference);
+
+	// Skipped keys (volatile ones) are left out of the copy.
+	OSString* setting = OSString::withCString("n1 7C436110-AB2A-4BBB-A880-FE41995C9F82:n2*");
+	OSArray* skip = policyParse(setting);
+	OSDictionary* root = storeCopyRoot(store, skip);
+	OSDictionary* apple = OSDynamicCast(OSDictionary, root->getObject(sGUIDs[1]));
+
+	CHECK(!root->getObject("n1") && !root->getObject("n10"));
+	CHECK(apple && !apple->getObject("n2") && !apple->getObject("n20") && !apple->getObject("n299"));
+	CHECK(!reference.count(std::string(sGUIDs[1]) + NVRAM_SEPERATOR "n3") || apple->getObject("n3"));
+
+	root->release();
+	skip->release();
+	setting->release();
+	storeDestroy(store);
+}
+
+//==============================================================================
+// Values only indexed in the image are decoded on first use, then the image goes.
+
+static void testLazy(void)
+{
+	const char* plist = "<string>a &amp; b</string><data>AAEC</data><integer>42</integer>";
+	NVRAMStore* store = storeCreate();
+
+	store->imageSize = strlen(plist);
+	store->image = fileAlloc(store->imageSize);
+	memcpy(store->image, plist, store->imageSize);
+
+	CHECK(storeIndex(store, "GUID:string", 0, 26));
+	CHECK(storeIndex(store, "GUID:data", 26, 17));
+	CHECK(storeIndex(store, "number", 43, 21));
+	CHECK(!storeIndex(store, "past-the-end", 43, 22));
+	CHECK(store->lazy == 3);
+
+	OSString* string = OSDynamicCast(OSString, storeLookup(store, "GUID:string"));
+	OSData* data = OSDynamicCast(OSData, storeLookup(store, "GUID:data"));
+
+	CHECK(string && strcmp(string->getCStringNoCopy(), "a & b") == 0);
+	CHECK(data && data->getLength() == 3 && ((const UInt8 *)data->getBytesNoCopy())[2] == 2);
+	CHECK(store->lazy == 1 && store->image);
+
+	// Replaced before it was ever read.
+	OSString* value = OSString::withCString("replaced");
+
+	CHECK(storeInsert(store, "number", value, NULL));
+	CHECK(store->lazy == 0 && !store->image);
+	CHECK(storeLookup(store, "number") == value);
+
+	value->release();
+	storeDestroy(store);
+}
+
+//==============================================================================
+// Lookups against the registry table's flat dictionary, from a few variables to
+// far more than a real nvram.plist has. Same number of lookups at every size.
+
+static void testSpeed(int count)
+{
+	NVRAMStore* store = storeCreate();
+	OSDictionary* registry = OSDictionary::withCapacity(count);
+	char (*keys)[64] = new char[count][64];
+	int rounds = 20000 / count;
+	uint64_t start, middle;
+	long found = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		OSString* value = OSString::withCString("value");
+
+		makeKey(keys[i], sizeof(keys[i]), i % GUIDS, i);
+		CHECK(storeInsert(store, keys[i], value, NULL));
+		registry->setObject(keys[i], value);
+		value->release();
+	}
+
+	start = hostNanoseconds();
+
+	for (int round = 0; round < rounds; round++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			found += (storeLookup(store, keys[i]) != NULL);
+		}
+	}
+
+	middle = hostNanoseconds();
+
+	for (int round = 0; round < rounds; round++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			found += (registry->getObject(keys[i]) != NULL);
+		}
+	}
+
+	CHECK(found == 2L * rounds * count);
+
+	printf("  %5d variables, lookup: store %llu ns, registry table %llu ns\n", count, (unsigned long long)((middle - start) / (rounds * count)),
+		   (unsigned long long)((hostNanoseconds() - middle) / (rounds * count)));
+
+	delete[] keys;
+	registry->release();
+	storeDestroy(store);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testReference();
+	testLazy();
+	testSpeed(100);
+	testSpeed(1000);
+	testSpeed(2000);
+	testSpeed(5000);
+	testSpeed(10000);
+
+	return 0;
+}
@@ -0,0 +1,236 @@
+/***
+ * SyncTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * When coalesced changes are written out: syncWait() is what scheduleSync()
+ * decides on each change, and a FileNVRAM started on the host IOKit (see
+ * Host/HostIOKit.cpp) shows how many syncs a burst of setProperty() calls
+ * really costs. Its timer only fires when hostAdvance() moves the clock on.
+ * Then a nvram.plist edited by hand between two boots, and what the flush thread
+ * saves setProperty() callers when every change is written through.
+ */
+
+#include "Host.h"
+#include "FileNVRAM.cpp"
+#include "Driver.h"
+
+#include <algorithm>
+#include <vector>
+
+//==============================================================================
+
+static void testWait(void)
+{
+	CHECK(syncWait(0, NVRAM_SYNC_DELAY_MS, NVRAM_SYNC_DEADLINE_MS) == NVRAM_SYNC_DELAY_MS);
+	CHECK(syncWait(1900, NVRAM_SYNC_DELAY_MS, NVRAM_SYNC_DEADLINE_MS) == 100);
+	CHECK(syncWait(NVRAM_SYNC_DEADLINE_MS, NVRAM_SYNC_DELAY_MS, NVRAM_SYNC_DEADLINE_MS) == 0);
+	CHECK(syncWait(1ULL << 40, NVRAM_SYNC_DELAY_MS, NVRAM_SYNC_DEADLINE_MS) == 0);
+
+	// SyncDelay=0 writes every change through.
+	CHECK(syncWait(0, 0, NVRAM_SYNC_DEADLINE_MS) == 0);
+
+	// A deadline shorter than the window cuts it.
+	CHECK(syncWait(0, 5000, 300) == 300);
+}
+
+//==============================================================================
+
+static void testCoalescing(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+	SInt64 base = syncs(nvram);
+	char value[32];
+
+	// One change is written a quiet window later, not before.
+	setString(nvram, "one", "1");
+	hostAdvance(NVRAM_SYNC_DELAY_MS - 1);
+	CHECK(syncs(nvram) == base);
+	hostAdvance(1);
+	CHECK(syncs(nvram) == base + 1 && !nvram->mDirty);
+	CHECK(fileContains(FILE_NVRAM_PATH, "<string>1</string>"));
+
+	// A burst closer together than the window is one sync, after the last change.
+	base = syncs(nvram);
+
+	for (int i = 0; i <= 20; i++)
+	{
+		snprintf(value, sizeof(value), "%d", i);
+		setString(nvram, "burst", value);
+		hostAdvance(50);
+	}
+
+	CHECK(syncs(nvram) == base);
+	hostAdvance(NVRAM_SYNC_DELAY_MS);
+	CHECK(syncs(nvram) == base + 1);
+	CHECK(fileContains(FILE_NVRAM_PATH, "<string>20</string>"));
+
+	// Changes that never stop are still written at least once per deadline.
+	int before = hostSyncs;
+
+	base = syncs(nvram);
+
+	for (int t = 0; t < 60000; t += 10)
+	{
+		snprintf(value, sizeof(value), "%d", t);
+		setString(nvram, "steady", value);
+		hostAdvance(10);
+		hostIdle();
+		CHECK(!nvram->mDirty || (mach_absolute_time() - nvram->mDirtySince) / NSEC_PER_MSEC <= NVRAM_SYNC_DEADLINE_MS);
+	}
+
+	hostAdvance(NVRAM_SYNC_DEADLINE_MS);
+
+	SInt64 steady = syncs(nvram) - base;
+
+	CHECK(steady >= 60000 / NVRAM_SYNC_DEADLINE_MS && steady <= 60000 / NVRAM_SYNC_DEADLINE_MS + 2);
+
+	// Each sync writes nvram.1.plist and copies it to nvram.plist, see Slot.cpp.
+	CHECK(hostSyncs - before == 2 * steady);
+
+	printf("  6000 changes a minute: %lld syncs, %d fsyncs\n", (long long)steady, hostSyncs - before);
+
+	// Write-through: every change is its own sync.
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_SYNC_DELAY, 0);
+	base = syncs(nvram);
+
+	for (int i = 0; i < 100; i++)
+	{
+		snprintf(value, sizeof(value), "%d", i);
+		setString(nvram, "through", value);
+		CHECK(syncs(nvram) == base + i + 1);
+		hostAdvance(10);
+	}
+
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// ImmediateKeys don't wait for the window, setProperty() returns once they are on disk.
+
+static void testImmediate(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+	SInt64 base = syncs(nvram);
+
+	setString(nvram, "boot-args", "-v");
+	CHECK(nvram->mStats->ops[kNVRAMStatSync].count == base + 1);
+	CHECK(fileContains(FILE_NVRAM_PATH, "<string>-v</string>"));
+
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// The edit no longer matches the slot record, but is newer than nvram.1.plist: it
+// is loaded and kept, and the next sync writes it to both.
+
+static void testEdited(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+
+	setString(nvram, "boot-args", "-v");
+	stopNVRAM(nvram);
+
+	std::string& file = hostFiles[FILE_NVRAM_PATH];
+	size_t at = file.find("<string>-v</string>");
+
+	CHECK(at != std::string::npos);
+	file.replace(at, strlen("<string>-v</string>"), "<string>-v debug=0x100</string>");
+	std::string edited = file;
+
+	nvram = startNVRAM(false);
+	CHECK(hasString(nvram, "boot-args", "-v debug=0x100"));
+	CHECK(hostFiles[FILE_NVRAM_PATH] == edited);
+
+	setString(nvram, "csr-active-config", "0");
+	CHECK(fileContains(FILE_NVRAM_PATH, "<string>-v debug=0x100</string>"));
+	CHECK(fileContains(FILE_NVRAM_SLOT_PATH, "<string>-v debug=0x100</string>"));
+	stopNVRAM(nvram);
+
+	// A copy over nvram.plist cut short is different: it still ends in the record of
+	// the snapshot before, which is older than nvram.1.plist.
+	std::string before = hostFiles[FILE_NVRAM_PATH];
+
+	nvram = startNVRAM(false);
+	setString(nvram, "boot-args", "-s");
+	stopNVRAM(nvram);
+
+	hostFiles[FILE_NVRAM_PATH] = hostFiles[FILE_NVRAM_SLOT_PATH].substr(0, 100) + before.substr(100);
+
+	nvram = startNVRAM(false);
+	CHECK(hasString(nvram, "boot-args", "-s"));
+	CHECK(hostFiles[FILE_NVRAM_PATH] == hostFiles[FILE_NVRAM_SLOT_PATH]);
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+// SyncDelay=0 on a disk that takes 1 ms a write, so a sync takes a few ms. Without
+// the flush thread (mFlushCall NULL, as before it) every setProperty() waits for
+// its sync. With it the caller only queues the flush, and changes made while one
+// is writing all go in the next.
+
+static void benchSetProperty(void)
+{
+	FileNVRAM* nvram = startNVRAM();
+	thread_call_t flushCall = nvram->mFlushCall;
+	uint64_t p50[2], p99[2];
+	char value[32];
+
+	setNumber(nvram, FILE_NVRAM_GUID NVRAM_SEPERATOR NVRAM_SYNC_DELAY, 0);
+	hostIdle();
+
+	for (int threaded = 0; threaded < 2; threaded++)
+	{
+		std::vector<uint64_t> ns;
+		SInt64 base = syncs(nvram);
+
+		nvram->mFlushCall = threaded ? flushCall : NULL;
+		hostWriteDelay = 1;
+
+		for (int i = 0; i < 200; i++)
+		{
+			snprintf(value, sizeof(value), "%d-%d", threaded, i);
+
+			uint64_t start = hostNanoseconds();
+
+			setString(nvram, "through", value);
+			ns.push_back(hostNanoseconds() - start);
+		}
+
+		SInt64 count = syncs(nvram) - base;
+
+		hostWriteDelay = 0;
+		CHECK(hasString(nvram, "through", value) && fileContains(FILE_NVRAM_PATH, value));
+		CHECK(threaded ? (count >= 1 && count < 200) : count == 200);
+
+		std::sort(ns.begin(), ns.end());
+		p50[threaded] = ns[ns.size() / 2];
+		p99[threaded] = ns[ns.size() * 99 / 100];
+
+		printf("  %s: setProperty() p50 %llu us, p99 %llu us, %lld syncs\n", threaded ? "flush thread" : "inline",
+			   (unsigned long long)(p50[threaded] / NSEC_PER_USEC), (unsigned long long)(p99[threaded] / NSEC_PER_USEC), (long long)count);
+	}
+
+	CHECK(p99[1] < p50[0]);
+
+	nvram->mFlushCall = flushCall;
+	stopNVRAM(nvram);
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testWait();
+	testCoalescing();
+	testImmediate();
+	testEdited();
+	benchSetProperty();
+
+	return 0;
+}
@@ -0,0 +1,225 @@
+/***
+ * TraceTests.cpp
+ * FileNVRAMTests
+ *
+ * Copyright (c) 2013-2014 xZenue LLC. All rights reserved.
+ *
+ * This work is licensed under the
+ * Creative Commons Attribution-NonCommercial 3.0 Unported License.
+ * To view a copy of this license, visit http://creativecommons.org/licenses/by-nc/3.0/.
+ *
+ * The trace rings: what a drain returns, writers on every CPU racing a drainer,
+ * and traceStop() racing both. The last one mostly earns its keep under
+ * make check CXXFLAGS="-O1 -g -fsanitize=address".
+ */
+
+#include "Host.h"
+#include "FileIO.cpp"
+#include "Support.cpp"
+#include "Trace.cpp"
+#include "Stats.cpp"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define EVENTS		100000		// Per writer.
+#define WRITERS		16			// Two per ring.
+
+static NVRAMTraceRecord	sRecords[NVRAM_TRACE_RINGS * NVRAM_TRACE_RECORDS];
+static volatile bool	sGo;
+static volatile bool	sDone;
+static volatile SInt32	sFinished;		// Writers done.
+
+//==============================================================================
+
+static size_t drain(size_t records)
+{
+	struct sysctl_req request;
+
+	bzero(&request, sizeof(request));
+	request.oldptr = (uintptr_t)sRecords;
+	request.oldlen = records * sizeof(NVRAMTraceRecord);
+
+	int error = traceSysctl(NULL, NULL, 0, &request);
+
+	CHECK(error == 0 || error == ENOMEM);
+
+	return request.oldidx / sizeof(NVRAMTraceRecord);
+}
+
+static void* writer(void* argument)
+{
+	int cpu = (int)(intptr_t)argument;
+
+	hostSetCPU(cpu);
+
+	while (!sGo)
+	{
+	}
+
+	for (UInt32 i = 0; i < EVENTS; i++)
+	{
+		traceEvent(1, "key", cpu * EVENTS + i);
+	}
+
+	OSIncrementAtomic(&sFinished);
+
+	return NULL;
+}
+
+//==============================================================================
+
+static void testDrain(void)
+{
+	traceStart();
+	traceEnable(true);
+	hostSetCPU(3);
+
+	CHECK(drain(NVRAM_TRACE_RINGS * NVRAM_TRACE_RECORDS) == 0);
+
+	for (UInt32 i = 0; i < 100; i++)
+	{
+		traceEvent(2, (i & 1) ? "key" : NULL, i);
+	}
+
+	CHECK(drain(NVRAM_TRACE_RINGS * NVRAM_TRACE_RECORDS) == 100);
+
+	for (UInt32 i = 0; i < 100; i++)
+	{
+		CHECK(sRecords[i].sequence == i + 1 && sRecords[i].length == i && sRecords[i].event == 2 && sRecords[i].cpu == 3);
+		CHECK(sRecords[i].keyHash == ((i & 1) ? nvram_hash("key", 3) : 0));
+	}
+
+	// Drained records don't come back.
+	CHECK(drain(NVRAM_TRACE_RINGS * NVRAM_TRACE_RECORDS) == 0);
+
+	// A full ring keeps the newest, a short buffer leaves the rest for the next drain.
+	for (UInt32 i = 0; i < 1000; i++)
+	{
+		traceEvent(2, "key", i);
+	}
+
+	CHECK(drain(10) == 10);
+	CHECK(sRecords[0].length == 1000 - NVRAM_TRACE_RECORDS && sRecords[9].length == 1000 - NVRAM_TRACE_RECORDS + 9);
+	CHECK(drain(NVRAM_TRACE_RINGS * NVRAM_TRACE_RECORDS) == NVRAM_TRACE_RECORDS - 10);
+	CHECK(sRecords[NVRAM_TRACE_RECORDS - 11].length == 999);
+
+	// Disabled, nothing is recorded.
+	traceEnable(false);
+	traceEvent(2, "key", 0);
+	traceEnable(true);
+	CHECK(drain(NVRAM_TRACE_RINGS * NVRAM_TRACE_RECORDS) == 0);
+
+	traceStop();
+}
+
+//==============================================================================
+// Every record a drain returns while writers are busy is whole, and each ring
+// hands its records out once, oldest first.
+
+static void testStress(void)
+{
+	pthread_t threads[WRITERS];
+	UInt32 last[NVRAM_TRACE_RINGS];
+	size_t drained = 0;
+
+	bzero(last, sizeof(last));
+	traceStart();
+	traceEnable(true);
+	sGo = false;
+	sFinished = 0;
+
+	for (int i = 0; i < WRITERS; i++)
+	{
+		CHECK(pthread_create(&threads[i], NULL, writer, (void *)(intptr_t)i) == 0);
+	}
+
+	sGo = true;
+
+	for (bool finished = false; !finished; )
+	{
+		finished = (sFinished == WRITERS);
+
+		size_t count = drain(37);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			const NVRAMTraceRecord* record = &sRecords[i];
+			int ring = record->cpu & (NVRAM_TRACE_RINGS - 1);
+
+			CHECK(record->cpu < WRITERS && record->event == 1 && record->length / EVENTS == record->cpu);
+			CHECK(record->keyHash == nvram_hash("key", 3) && record->timestamp != 0);
+			CHECK(record->sequence > last[ring]);
+			last[ring] = record->sequence;
+		}
+
+		drained += count;
+	}
+
+	for (int i = 0; i < WRITERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	printf("  %d writers, %zu records drained\n", WRITERS, drained);
+	traceStop();
+}
+
+//==============================================================================
+
+static void* drainer(void* argument)
+{
+	while (!sGo)
+	{
+	}
+
+	while (!sDone)
+	{
+		drain(37);
+	}
+
+	return NULL;
+}
+
+static void testStop(void)
+{
+	for (int round = 0; round < 50; round++)
+	{
+		pthread_t threads[WRITERS + 1];
+
+		traceStart();
+		traceEnable(true);
+		sGo = sDone = false;
+
+		for (int i = 0; i < WRITERS; i++)
+		{
+			CHECK(pthread_create(&threads[i], NULL, writer, (void *)(intptr_t)i) == 0);
+		}
+
+		CHECK(pthread_create(&threads[WRITERS], NULL, drainer, NULL) == 0);
+
+		sGo = true;
+		usleep(200 * (round % 10));
+		traceStop();
+
+		CHECK(sTraceUsers == 0 && !sTraceRings && !sTraceLock);
+
+		sDone = true;
+
+		for (int i = 0; i <= WRITERS; i++)
+		{
+			pthread_join(threads[i], NULL);
+		}
+	}
+}
+
+//==============================================================================
+
+int main(void)
+{
+	testDrain();
+	testStress();
+	testStop();
+
+	return 0;
+}